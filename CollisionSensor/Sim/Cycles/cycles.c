@@ -0,0 +1,351 @@
+/*
+ * File: cycles.c
+ * Purpose: Defines the cycle-count harness. It loads the firmware built for
+ *          the board (Keil .axf or arm-none-eabi-gcc ELF), calls each hot
+ *          function from the table below in the Cortex-M0 emulator and
+ *          prints its instructions and cycles per call. A budget file sets
+ *          the most cycles each case may take; the exit status is 1 if one
+ *          goes over, so the budgets can be enforced on every change.
+ *
+ *          The status flags the firmware spins on (SPI2 TXE/BSY, USART3
+ *          TXE/TC/RXNE) are pinned ready, so the counts are the CPU's own
+ *          work. Time spent waiting for the bus is the simulator's job.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m0.h"
+
+#define CYC_LIMIT 1000000                        // instructions before a call counts as hung
+#define CYC_SCRATCH (M0_RAM_BASE + 0x3000)       // arguments and structs, the stack sits above
+#define CYC_STACK_ROOM (M0_RAM_BASE + M0_RAM_SIZE - CYC_SCRATCH - 0x100)
+#define CYC_MAX_BUDGETS 64
+
+// Registers the firmware polls
+#define CYC_SPI2_SR 0x40003808u
+#define CYC_USART3_ISR 0x4000481Cu
+#define CYC_USART3_RDR 0x40004824u
+#define CYC_I2C1_ISR 0x40005418u
+
+// Scratch layout
+#define CYC_BUF (CYC_SCRATCH + 0x000)      // output buffer
+#define CYC_UNITS (CYC_SCRATCH + 0x080)    // "mm"
+#define CYC_THRESHOLDS (CYC_SCRATCH + 0x0C0) // the thresholds of CONFIG the modules point at
+#define CYC_MOTOR (CYC_SCRATCH + 0x100)    // MOTOR from main.c
+#define CYC_LCD (CYC_SCRATCH + 0x140)      // LCD from main.c
+#define CYC_CONFIG (CYC_SCRATCH + 0x160)   // CONFIG from configStore.h
+#define CYC_SCOPE (CYC_SCRATCH + 0x180)    // SCOPE from main.c
+#define CYC_SESSION (CYC_SCRATCH + 0x190)  // SESSION from main.c
+#define CYC_WATCHDOG (CYC_SCRATCH + 0x1A0) // WATCHDOG from main.c
+#define CYC_CLUTTER (CYC_SCRATCH + 0x1B0)  // CLUTTER from main.c
+#define CYC_HEALTH (CYC_SCRATCH + 0x1C0)   // HEALTH from main.c
+#define CYC_TARGET (CYC_SCRATCH + 0x1D0)   // TARGET from main.c
+#define CYC_ALERT (CYC_SCRATCH + 0x1F0)    // ALERT from main.c
+
+typedef struct {
+  const char *name;        // name in the table and the budget file
+  const char *function;
+  int argc;
+  uint32_t args[4];
+  int (*setup)(M0_Core *m);   // returns -1 if the image lacks something it needs
+} CYC_Case;
+
+typedef struct {
+  char name[64];
+  long cycles;             // -1 if the case has no budget yet
+} CYC_Budget;
+
+static int CYC_SetPointer(M0_Core *m, const char *symbol, uint32_t value) {
+  uint32_t addr = M0_Symbol(symbol);
+  if (addr == 0) return -1;
+  M0_Write(m, addr, value, 4);
+  return 0;
+}
+
+// The warning thresholds in the scratch area, for a module's pointer to them at field
+static void CYC_SetThresholds(M0_Core *m, uint32_t field) {
+  static const uint16_t thresholds[] = { 300, 950, 1900, 3500 };
+  for (int i = 0; i < 4; i++) M0_Write(m, CYC_THRESHOLDS + 2 * i, thresholds[i], 2);
+  M0_Write(m, field, CYC_THRESHOLDS, 4);
+}
+
+/*
+ * The motor main() sets up: PB4, no prescaler, ARR 10000, the warning
+ * thresholds and the haptic curve. Offsets are those of MOTOR in motor.h
+ * under the AAPCS.
+ */
+static int CYC_SetupMotor(M0_Core *m) {
+  static const uint8_t duty[] = { 100, 66, 33, 0 };
+  M0_Write(m, CYC_MOTOR + 0, 4, 1);
+  M0_Write(m, CYC_MOTOR + 2, 0, 2);
+  M0_Write(m, CYC_MOTOR + 4, 10000, 2);
+  CYC_SetThresholds(m, CYC_MOTOR + 8);
+  for (int i = 0; i < 4; i++) M0_Write(m, CYC_MOTOR + 12 + i, duty[i], 1);
+  return CYC_SetPointer(m, "thisMotor", CYC_MOTOR);
+}
+
+/*
+ * The default configuration main() loads when flash holds none: the
+ * warning thresholds, then PWM prescaler 0, ARR 10000 and 100 ms readings
+ */
+static int CYC_SetupConfig(M0_Core *m) {
+  static const uint16_t fields[] = { 300, 950, 1900, 3500, 0, 10000, 100 };
+  for (int i = 0; i < 7; i++) M0_Write(m, CYC_CONFIG + 2 * i, fields[i], 2);
+  M0_Write(m, CYC_CONFIG + 14, 1, 1);
+  return CYC_SetPointer(m, "config", CYC_CONFIG);
+}
+
+// The capture main() sets up: trigger at 300 mm, 32 readings before and 15 after
+static int CYC_SetupScope(M0_Core *m) {
+  M0_Write(m, CYC_SCOPE + 0, 300, 2);
+  M0_Write(m, CYC_SCOPE + 2, 32, 1);
+  M0_Write(m, CYC_SCOPE + 3, 15, 1);
+  return CYC_SetPointer(m, "thisScope", CYC_SCOPE);
+}
+
+// The session statistics main() sets up: the warning thresholds
+static int CYC_SetupSession(M0_Core *m) {
+  CYC_SetThresholds(m, CYC_SESSION);
+  return CYC_SetPointer(m, "thisSession", CYC_SESSION);
+}
+
+// The clutter model main() sets up: the warning thresholds, 100 still readings to learn a range
+static int CYC_SetupClutter(M0_Core *m) {
+  CYC_SetThresholds(m, CYC_CLUTTER);
+  M0_Write(m, CYC_CLUTTER + 4, 100, 1);
+  return CYC_SetPointer(m, "thisClutter", CYC_CLUTTER);
+}
+
+// The health monitor main() sets up: 3 missed periods, 600 stuck readings,
+// 600 out of range, 1000 mm spikes, 4 of them, retries every 5, 3 to recover
+static int CYC_SetupHealth(M0_Core *m) {
+  M0_Write(m, CYC_HEALTH + 0, 3, 1);
+  M0_Write(m, CYC_HEALTH + 2, 600, 2);
+  M0_Write(m, CYC_HEALTH + 4, 600, 2);
+  M0_Write(m, CYC_HEALTH + 6, 1000, 2);
+  M0_Write(m, CYC_HEALTH + 8, 4, 1);
+  M0_Write(m, CYC_HEALTH + 9, 5, 1);
+  M0_Write(m, CYC_HEALTH + 10, 3, 1);
+  return CYC_SetPointer(m, "thisHealth", CYC_HEALTH);
+}
+
+// The supervisor main() sets up: 300 ms for every stage, on the tick it looks at them
+static int CYC_SetupWatchdog(M0_Core *m) {
+  uint32_t ticks = M0_Symbol("watchdogTicks");
+  if (ticks == 0) return -1;
+  for (int i = 0; i < 3; i++) M0_Write(m, CYC_WATCHDOG + 4 * i, 300, 4);
+  M0_Write(m, ticks, 9, 1);
+  return CYC_SetPointer(m, "thisWatchdog", CYC_WATCHDOG);
+}
+
+// The I2C target main() sets up: SCL PB8, SDA PB9, address 0x2A, the warning thresholds
+static int CYC_SetupTarget(M0_Core *m) {
+  M0_Write(m, CYC_TARGET + 0, 8, 1);
+  M0_Write(m, CYC_TARGET + 1, 9, 1);
+  M0_Write(m, CYC_TARGET + 2, 0x2A, 1);
+  CYC_SetThresholds(m, CYC_TARGET + 4);
+  return CYC_SetPointer(m, "thisTarget", CYC_TARGET);
+}
+
+// The alert line main() sets up: PC12, a 1.5 s alarm closing at 200 mm/s or more, the warning
+// thresholds, and a reading at 1300 mm 100 ms before, so the velocity and the time to collision are worked out
+static int CYC_SetupAlert(M0_Core *m) {
+  uint32_t distance = M0_Symbol("alertDistance"), classified = M0_Symbol("alertClassified"), tick = M0_Symbol("uwTick");
+  if (distance == 0 || classified == 0 || tick == 0) return -1;
+  M0_Write(m, CYC_ALERT + 0, 12, 1);
+  M0_Write(m, CYC_ALERT + 2, 1500, 2);
+  M0_Write(m, CYC_ALERT + 4, 200, 2);
+  CYC_SetThresholds(m, CYC_ALERT + 8);
+  M0_Write(m, distance, 1300, 2);
+  M0_Write(m, classified, 1, 1);
+  M0_Write(m, tick, 100, 4);
+  return CYC_SetPointer(m, "thisAlert", CYC_ALERT);
+}
+
+// The host wants the next byte of the map: TXIS and TXE
+static int CYC_SetupI2cTx(M0_Core *m) {
+  M0_Write(m, CYC_I2C1_ISR, 0x3, 4);
+  return 0;
+}
+
+// The LCD main() sets up: SCK PB13, MOSI PB15, SCE PB7, D/C PB5, RST PB6
+static int CYC_SetupLcd(M0_Core *m) {
+  static const uint8_t pins[] = { 13, 15, 7, 5, 6 };
+  for (int i = 0; i < 5; i++) M0_Write(m, CYC_LCD + i, pins[i], 1);
+  M0_Write(m, CYC_UNITS, 'm', 1);
+  M0_Write(m, CYC_UNITS + 1, 'm', 1);
+  return CYC_SetPointer(m, "thisScreen", CYC_LCD);
+}
+
+// First byte of a distance reply waiting in RDR
+static int CYC_SetupUartRx(M0_Core *m) {
+  M0_Write(m, CYC_USART3_RDR, 0x0F, 4);
+  return CYC_SetPointer(m, "rangeMeasurement", 1);
+}
+
+static const CYC_Case cases[] = {
+  { "uintToStr(0)", "uintToStr", 2, { CYC_BUF, 0 }, NULL },
+  { "uintToStr(4500)", "uintToStr", 2, { CYC_BUF, 4500 }, NULL },
+  { "uintToStr(65535)", "uintToStr", 2, { CYC_BUF, 65535 }, NULL },
+  { "setLEDs(150)", "setLEDs", 2, { 150, 1 << 12 }, CYC_SetupConfig },
+  { "setLEDs(2500)", "setLEDs", 2, { 2500, 1 << 28 }, CYC_SetupConfig },
+  { "setLEDs(4000)", "setLEDs", 2, { 4000, 1 << 28 }, CYC_SetupConfig },
+  { "CALIBRATION_Apply(1200)", "CALIBRATION_Apply", 1, { 1200 }, NULL },
+  { "CALIBRATION_Apply(11000)", "CALIBRATION_Apply", 1, { 11000 }, NULL },
+  { "MOTOR_SetVibrationIntensity(150)", "MOTOR_SetVibrationIntensity", 1, { 150 }, CYC_SetupMotor },
+  { "MOTOR_SetVibrationIntensity(1200)", "MOTOR_SetVibrationIntensity", 1, { 1200 }, CYC_SetupMotor },
+  { "MOTOR_SetVibrationIntensity(4000)", "MOTOR_SetVibrationIntensity", 1, { 4000 }, CYC_SetupMotor },
+  { "SCOPE_Update(armed)", "SCOPE_Update", 2, { 2500, 2500 }, CYC_SetupScope },
+  { "SCOPE_Update(trigger)", "SCOPE_Update", 2, { 150, 150 }, CYC_SetupScope },
+  { "SESSION_Update(2500)", "SESSION_Update", 1, { 2500 }, CYC_SetupSession },
+  { "CRASHLOG_Update(2500)", "CRASHLOG_Update", 1, { 2500 }, NULL },
+  { "CLUTTER_Update(600)", "CLUTTER_Update", 1, { 600 }, CYC_SetupClutter },
+  { "HEALTH_Update(1200)", "HEALTH_Update", 3, { 1, 1200, 67 }, CYC_SetupHealth },
+  { "TELEMETRY_Crc(22)", "TELEMETRY_Crc", 2, { CYC_BUF, 22 }, NULL },
+  { "SERIAL_Encode(24)", "SERIAL_Encode", 3, { CYC_BUF + 0x20, CYC_BUF, 24 }, NULL },
+  { "ALERT_Update(1200)", "ALERT_Update", 2, { 1, 1200 }, CYC_SetupAlert },
+  { "TARGET_Update(1200)", "TARGET_Update", 3, { 1, 1200, 1200 }, CYC_SetupTarget },
+  { "WATCHDOG_Tick(look)", "WATCHDOG_Tick", 0, { 0 }, CYC_SetupWatchdog },
+  { "LCD_PrintCharacter('8')", "LCD_PrintCharacter", 1, { '8' }, CYC_SetupLcd },
+  { "LCD_PrintCharacter('M')", "LCD_PrintCharacter", 1, { 'M' }, CYC_SetupLcd },
+  { "LCD_PrintMeasurement(1234)", "LCD_PrintMeasurement", 3, { 1234, CYC_UNITS, 2 }, CYC_SetupLcd },
+  { "LCD_PrintMeasurement(4600)", "LCD_PrintMeasurement", 3, { 4600, CYC_UNITS, 2 }, CYC_SetupLcd },
+  { "USART3_4_IRQHandler", "USART3_4_IRQHandler", 0, { 0 }, CYC_SetupUartRx },
+  { "SysTick_Handler", "SysTick_Handler", 0, { 0 }, NULL },
+  { "I2C1_IRQHandler", "I2C1_IRQHandler", 0, { 0 }, CYC_SetupI2cTx },
+};
+
+static CYC_Budget budgets[CYC_MAX_BUDGETS];
+static int budgetCount;
+
+/*
+ * Budget file: "<case> <cycles>" per line, '-' for a case without a
+ * budget yet, '#' starts a comment
+ */
+static int CYC_LoadBudgets(const char *path) {
+  char line[256];
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char name[64], value[32];
+    char *hash = strchr(line, '#');
+    if (hash != NULL) *hash = '\0';
+    if (sscanf(line, "%63s %31s", name, value) != 2 || budgetCount == CYC_MAX_BUDGETS) continue;
+    snprintf(budgets[budgetCount].name, sizeof(budgets[budgetCount].name), "%s", name);
+    budgets[budgetCount].cycles = strcmp(value, "-") == 0 ? -1 : strtol(value, NULL, 0);
+    budgetCount++;
+  }
+  fclose(f);
+  return 0;
+}
+
+static const CYC_Budget *CYC_FindBudget(const char *name) {
+  for (int i = 0; i < budgetCount; i++) {
+    if (strcmp(budgets[i].name, name) == 0) return &budgets[i];
+  }
+  return NULL;
+}
+
+static void CYC_Usage(const char *prog) {
+  printf("usage: %s image.elf [--wait-states n] [--no-prefetch] [--slow-multiply]\n", prog);
+  printf("       %*s [--budget file] [--write-budget file] [--headroom %%]\n", (int)strlen(prog), "");
+  printf("  --wait-states n     flash latency, 0 at the board's 8 MHz, 1 above 24 MHz\n");
+  printf("  --no-prefetch       every new flash word waits, not just the ones after a branch\n");
+  printf("  --slow-multiply     32 cycle MULS, for cores built with the small multiplier\n");
+  printf("  --budget f          check every case against its budget, exit 1 if one is over\n");
+  printf("  --write-budget f    write the measured cycles plus --headroom (default 10%%) as budgets\n");
+}
+
+int main(int argc, char **argv) {
+  static M0_Core core;
+  const char *image = NULL, *budgetPath = NULL, *writePath = NULL;
+  uint32_t waitStates = 0, mulCycles = 1;
+  int prefetch = 1, over = 0, failed = 0, unset = 0, missing = 0;
+  double headroom = 10;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--wait-states") == 0 && i + 1 < argc) waitStates = strtoul(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "--no-prefetch") == 0) prefetch = 0;
+    else if (strcmp(argv[i], "--slow-multiply") == 0) mulCycles = 32;
+    else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) budgetPath = argv[++i];
+    else if (strcmp(argv[i], "--write-budget") == 0 && i + 1 < argc) writePath = argv[++i];
+    else if (strcmp(argv[i], "--headroom") == 0 && i + 1 < argc) headroom = atof(argv[++i]);
+    else if (argv[i][0] != '-' && image == NULL) image = argv[i];
+    else {
+      CYC_Usage(argv[0]);
+      return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+    }
+  }
+  if (image == NULL) {
+    CYC_Usage(argv[0]);
+    return 2;
+  }
+  if (budgetPath != NULL && CYC_LoadBudgets(budgetPath) != 0) return 2;
+  FILE *out = NULL;
+  if (writePath != NULL) {
+    out = fopen(writePath, "w");
+    if (out == NULL) {
+      perror(writePath);
+      return 2;
+    }
+    fprintf(out, "# Cortex-M0 cycle budgets per call, %u flash wait states%s, written by cycles\n",
+            (unsigned)waitStates, prefetch ? " with prefetch" : "");
+    fprintf(out, "# case cycles ('-' if the case has no budget yet)\n");
+  }
+
+  printf("%-36s %7s %8s %6s %8s %6s %6s %8s\n", "case", "instr", "cycles", "wait", "helpers", "stack", "periph", "budget");
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    const CYC_Case *c = &cases[i];
+    const CYC_Budget *b = CYC_FindBudget(c->name);
+
+    // a fresh image for every case, so no case sees what the one before left behind
+    M0_Reset(&core);
+    if (M0_LoadElf(&core, image) != 0) return 2;
+    core.waitStates = waitStates;
+    core.prefetch = prefetch;
+    core.mulCycles = mulCycles;
+    M0_Pin(&core, CYC_SPI2_SR, 0x82, 0x02);         // TXE set, BSY clear
+    M0_Pin(&core, CYC_USART3_ISR, 0xE0, 0xE0);      // TXE, TC and RXNE set
+
+    uint32_t fn = M0_Symbol(c->function);
+    if (fn == 0 || (c->setup != NULL && c->setup(&core) != 0)) {
+      printf("%-36s not in the image\n", c->name);
+      missing++;
+      if (out != NULL) fprintf(out, "%-36s -\n", c->name);
+      continue;
+    }
+    M0_Status s = M0_Call(&core, fn, c->args, c->argc, CYC_LIMIT);
+    if (s != M0_RETURNED) {
+      uint32_t offset = 0;
+      const char *where = M0_SymbolAt(core.faultAddr, &offset);
+      printf("%-36s %s at 0x%08x (%s+0x%x)\n", c->name, M0_StatusName(s), (unsigned)core.faultAddr, where,
+             (unsigned)offset);
+      failed = 1;
+      continue;
+    }
+
+    const M0_Counters *n = &core.count;
+    char budget[24] = "-";
+    if (b != NULL && b->cycles >= 0) snprintf(budget, sizeof(budget), "%ld", b->cycles);
+    printf("%-36s %7llu %8llu %6llu %8llu %6u %6u %8s", c->name, (unsigned long long)n->instructions,
+           (unsigned long long)n->cycles, (unsigned long long)n->waitCycles,
+           (unsigned long long)n->helperCycles, (unsigned)n->maxStack, (unsigned)n->periphAccesses, budget);
+    if (b != NULL && b->cycles >= 0 && n->cycles > (uint64_t)b->cycles) {
+      printf("  OVER BUDGET");
+      over++;
+    }
+    if (b == NULL || b->cycles < 0) unset++;
+    if (n->maxStack > CYC_STACK_ROOM) printf("  stack reached the scratch area");
+    printf("\n");
+    if (out != NULL) fprintf(out, "%-36s %llu\n", c->name, (unsigned long long)(n->cycles * (1 + headroom / 100) + 0.999));
+  }
+  if (out != NULL) fclose(out);
+
+  if (failed) return 2;
+  if (budgetPath != NULL) printf("%d over budget, %d without a budget, %d not in the image\n", over, unset, missing);
+  return over ? 1 : 0;
+}
@@ -0,0 +1,724 @@
+/*
+ * File: m0.c
+ * Purpose: Defines the Cortex-M0 instruction-set emulator: the ELF loader,
+ *          the memory map and the ARMv6-M Thumb decoder.
+ *
+ *          Cycles follow table 3-1 of the Cortex-M0 TRM: 1 for data
+ *          processing, 2 for loads and stores, 1+N for LDM/STM/PUSH/POP,
+ *          4+N for a POP that loads PC, 3 for a taken branch, BX and BLX,
+ *          4 for BL, MRS, MSR and the barriers. The flash adds its wait
+ *          states to every fetch of a new word (unless the prefetch buffer
+ *          already has it) and to every data read from flash.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m0.h"
+
+// ELF32 as far as the loader needs it
+#define ELF_SHT_SYMTAB 2
+#define ELF_SHT_NOBITS 8
+#define ELF_SHF_ALLOC 0x2
+#define ELF_STT_OBJECT 1
+#define ELF_STT_FUNC 2
+#define ELF_EM_ARM 40
+
+typedef struct {
+  uint32_t addr;
+  uint32_t size;
+  uint8_t func;
+  uint8_t helper;
+  char *name;
+} M0_Sym;
+
+static M0_Sym *symbols;
+static int symbolCount;
+
+static uint16_t M0_Le16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t M0_Le32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Compiler runtime helpers: division, 64 bit shifts and soft float
+ */
+static int M0_IsHelper(const char *name) {
+  return strncmp(name, "__aeabi_", 8) == 0 || strncmp(name, "__ARM_", 6) == 0 ||
+         strncmp(name, "_ll_", 4) == 0 || strncmp(name, "__gnu_", 6) == 0 ||
+         strstr(name, "si3") != NULL || strstr(name, "sf3") != NULL || strstr(name, "sf2") != NULL ||
+         strstr(name, "di3") != NULL || strstr(name, "df3") != NULL;
+}
+
+static int M0_SymCompare(const void *a, const void *b) {
+  const M0_Sym *x = a, *y = b;
+  if (x->addr != y->addr) return x->addr < y->addr ? -1 : 1;
+  return (int)y->func - (int)x->func;
+}
+
+void M0_Reset(M0_Core *m) {
+  memset(m, 0, sizeof(*m));
+  m->mulCycles = 1;
+  m->prefetch = 1;
+  m->lastFetch = 0xFFFFFFFFu;
+}
+
+/*
+ * Load the allocated sections of an ELF image at their run addresses, and
+ * its symbol table. Works for gcc ELF files and Keil .axf files alike.
+ */
+int M0_LoadElf(M0_Core *m, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *elf = malloc(size);
+  if (elf == NULL || fread(elf, 1, size, f) != (size_t)size) {
+    fprintf(stderr, "%s: read error\n", path);
+    fclose(f);
+    free(elf);
+    return -1;
+  }
+  fclose(f);
+
+  if (size < 52 || memcmp(elf, "\177ELF", 4) != 0 || elf[4] != 1 || elf[5] != 1 || M0_Le16(elf + 18) != ELF_EM_ARM) {
+    fprintf(stderr, "%s: not a 32 bit little endian ARM ELF file\n", path);
+    free(elf);
+    return -1;
+  }
+  uint32_t shoff = M0_Le32(elf + 32);
+  uint16_t shentsize = M0_Le16(elf + 46), shnum = M0_Le16(elf + 48);
+  if (shoff + (uint64_t)shnum * shentsize > (uint64_t)size) {
+    fprintf(stderr, "%s: truncated\n", path);
+    free(elf);
+    return -1;
+  }
+
+  for (int i = 0; i < shnum; i++) {
+    const uint8_t *sh = elf + shoff + i * shentsize;
+    uint32_t type = M0_Le32(sh + 4), flags = M0_Le32(sh + 8), addr = M0_Le32(sh + 12);
+    uint32_t offset = M0_Le32(sh + 16), len = M0_Le32(sh + 20);
+    uint8_t *dest = NULL;
+
+    if (type == ELF_SHT_SYMTAB) {
+      const uint8_t *strtab = elf + M0_Le32(elf + shoff + M0_Le32(sh + 24) * shentsize + 16);
+      int count = len / 16;
+      symbols = realloc(symbols, (symbolCount + count) * sizeof(M0_Sym));
+      for (int j = 0; j < count; j++) {
+        const uint8_t *st = elf + offset + j * 16;
+        uint8_t kind = st[12] & 0xF;
+        const char *name = (const char *)strtab + M0_Le32(st);
+        if (M0_Le16(st + 14) == 0 || name[0] == '\0' || name[0] == '$') continue;
+        if (kind != ELF_STT_FUNC && kind != ELF_STT_OBJECT && !M0_IsHelper(name)) continue;
+        M0_Sym *s = &symbols[symbolCount++];
+        s->func = kind != ELF_STT_OBJECT;
+        s->addr = M0_Le32(st + 4) & (s->func ? ~1u : ~0u);
+        s->size = M0_Le32(st + 8);
+        s->helper = s->func && M0_IsHelper(name);
+        s->name = strdup(name);
+      }
+      continue;
+    }
+    if (!(flags & ELF_SHF_ALLOC) || len == 0) continue;
+    if (addr >= M0_FLASH_BASE && addr + len <= M0_FLASH_BASE + M0_FLASH_SIZE) dest = m->flash + (addr - M0_FLASH_BASE);
+    else if (addr >= M0_RAM_BASE && addr + len <= M0_RAM_BASE + M0_RAM_SIZE) dest = m->ram + (addr - M0_RAM_BASE);
+    else {
+      fprintf(stderr, "%s: section at 0x%08x is outside the flash and the RAM, skipped\n", path, (unsigned)addr);
+      continue;
+    }
+    if (type == ELF_SHT_NOBITS) memset(dest, 0, len);
+    else if (offset + (uint64_t)len <= (uint64_t)size) memcpy(dest, elf + offset, len);
+  }
+  free(elf);
+  qsort(symbols, symbolCount, sizeof(M0_Sym), M0_SymCompare);
+  return 0;
+}
+
+/*
+ * Address of a function or variable, 0 if the image does not have it
+ */
+uint32_t M0_Symbol(const char *name) {
+  for (int i = 0; i < symbolCount; i++) {
+    if (strcmp(symbols[i].name, name) == 0) return symbols[i].addr;
+  }
+  return 0;
+}
+
+/*
+ * Function that contains addr, for error messages
+ */
+const char *M0_SymbolAt(uint32_t addr, uint32_t *offset) {
+  const M0_Sym *best = NULL;
+  for (int i = 0; i < symbolCount && symbols[i].addr <= addr; i++) {
+    if (symbols[i].func) best = &symbols[i];
+  }
+  if (best == NULL) return "?";
+  if (offset != NULL) *offset = addr - best->addr;
+  return best->name;
+}
+
+static int M0_HelperAt(uint32_t addr) {
+  for (int i = 0; i < symbolCount && symbols[i].addr <= addr; i++) {
+    if (symbols[i].addr == addr && symbols[i].helper) return 1;
+  }
+  return 0;
+}
+
+/*
+ * Memory map
+ */
+static M0_Reg *M0_FindReg(M0_Core *m, uint32_t addr, int create) {
+  for (int i = 0; i < m->regCount; i++) {
+    if (m->regs[i].addr == addr) return &m->regs[i];
+  }
+  if (!create || m->regCount == M0_MAX_REGS) return NULL;
+  M0_Reg *r = &m->regs[m->regCount++];
+  memset(r, 0, sizeof(*r));
+  r->addr = addr;
+  return r;
+}
+
+/*
+ * Make the given bits of a register always read as value, like the TXE
+ * and BSY flags of a bus that is never busy
+ */
+void M0_Pin(M0_Core *m, uint32_t addr, uint32_t mask, uint32_t value) {
+  M0_Reg *r = M0_FindReg(m, addr & ~3u, 1);
+  if (r == NULL) return;
+  r->pinned |= mask;
+  r->pinValue = (r->pinValue & ~mask) | (value & mask);
+}
+
+static uint8_t *M0_Memory(M0_Core *m, uint32_t addr, int size, int write) {
+  if (addr >= M0_RAM_BASE && addr - M0_RAM_BASE <= M0_RAM_SIZE - size) return m->ram + (addr - M0_RAM_BASE);
+  if (write) return NULL;
+  if (addr >= M0_FLASH_BASE && addr - M0_FLASH_BASE <= M0_FLASH_SIZE - size) return m->flash + (addr - M0_FLASH_BASE);
+  // the boot alias of the flash at address 0
+  if (addr <= M0_FLASH_SIZE - size) return m->flash + addr;
+  return NULL;
+}
+
+static void M0_Fault(M0_Core *m, M0_Status s, uint32_t addr) {
+  if (m->status != M0_OK) return;
+  m->status = s;
+  m->faultAddr = addr;
+}
+
+uint32_t M0_Read(M0_Core *m, uint32_t addr, int size) {
+  if (addr & (size - 1)) {
+    M0_Fault(m, M0_ERR_ACCESS, addr);
+    return 0;
+  }
+  if (addr >= M0_PERIPH_BASE) {
+    M0_Reg *r = M0_FindReg(m, addr & ~3u, 0);
+    uint32_t word = r != NULL ? (r->value & ~r->pinned) | r->pinValue : 0;
+    m->count.periphAccesses++;
+    word >>= 8 * (addr & 3);
+    return size == 4 ? word : word & ((1u << (8 * size)) - 1);
+  }
+  uint8_t *p = M0_Memory(m, addr, size, 0);
+  if (p == NULL) {
+    M0_Fault(m, M0_ERR_ACCESS, addr);
+    return 0;
+  }
+  if (p >= m->flash && p < m->flash + M0_FLASH_SIZE) {
+    m->count.cycles += m->waitStates;
+    m->count.waitCycles += m->waitStates;
+  }
+  return size == 1 ? p[0] : size == 2 ? M0_Le16(p) : M0_Le32(p);
+}
+
+void M0_Write(M0_Core *m, uint32_t addr, uint32_t value, int size) {
+  if (addr & (size - 1)) {
+    M0_Fault(m, M0_ERR_ACCESS, addr);
+    return;
+  }
+  if (addr >= M0_PERIPH_BASE) {
+    M0_Reg *r = M0_FindReg(m, addr & ~3u, 1);
+    uint32_t shift = 8 * (addr & 3);
+    uint32_t mask = size == 4 ? 0xFFFFFFFFu : ((1u << (8 * size)) - 1) << shift;
+    m->count.periphAccesses++;
+    if (r != NULL) r->value = (r->value & ~mask) | ((value << shift) & mask);
+    return;
+  }
+  uint8_t *p = M0_Memory(m, addr, size, 1);
+  if (p == NULL) {
+    M0_Fault(m, M0_ERR_ACCESS, addr);
+    return;
+  }
+  for (int i = 0; i < size; i++) p[i] = value >> (8 * i);
+}
+
+/*
+ * Flag helpers
+ */
+static uint32_t M0_AddWithCarry(M0_Core *m, uint32_t x, uint32_t y, uint32_t carry, int setFlags) {
+  uint64_t u = (uint64_t)x + y + carry;
+  int64_t s = (int64_t)(int32_t)x + (int32_t)y + carry;
+  uint32_t r = (uint32_t)u;
+  if (setFlags) {
+    m->n = r >> 31;
+    m->z = r == 0;
+    m->c = (u >> 32) & 1;
+    m->v = (int64_t)(int32_t)r != s;
+  }
+  return r;
+}
+
+static void M0_SetNZ(M0_Core *m, uint32_t r) {
+  m->n = r >> 31;
+  m->z = r == 0;
+}
+
+static uint32_t M0_Shift(M0_Core *m, int type, uint32_t x, uint32_t n) {
+  uint32_t r = x;
+  if (n == 0) return x;
+  switch (type) {
+    case 0:  // LSL
+      m->c = n <= 32 ? (n == 32 ? x & 1 : (x >> (32 - n)) & 1) : 0;
+      r = n < 32 ? x << n : 0;
+      break;
+    case 1:  // LSR
+      m->c = n <= 32 ? (x >> (n - 1)) & 1 : 0;
+      r = n < 32 ? x >> n : 0;
+      break;
+    case 2:  // ASR
+      if (n >= 32) {
+        m->c = x >> 31;
+        r = m->c ? 0xFFFFFFFFu : 0;
+      }
+      else {
+        m->c = (x >> (n - 1)) & 1;
+        r = (uint32_t)((int32_t)x >> n);
+      }
+      break;
+    default:  // ROR
+      n &= 31;
+      r = n ? (x >> n) | (x << (32 - n)) : x;
+      m->c = r >> 31;
+      break;
+  }
+  return r;
+}
+
+static int M0_Condition(M0_Core *m, int cond) {
+  switch (cond) {
+    case 0x0: return m->z;
+    case 0x1: return !m->z;
+    case 0x2: return m->c;
+    case 0x3: return !m->c;
+    case 0x4: return m->n;
+    case 0x5: return !m->n;
+    case 0x6: return m->v;
+    case 0x7: return !m->v;
+    case 0x8: return m->c && !m->z;
+    case 0x9: return !m->c || m->z;
+    case 0xA: return m->n == m->v;
+    case 0xB: return m->n != m->v;
+    case 0xC: return !m->z && m->n == m->v;
+    case 0xD: return m->z || m->n != m->v;
+    default: return 1;
+  }
+}
+
+static void M0_BranchTo(M0_Core *m, uint32_t addr) {
+  m->r[15] = addr & ~1u;
+  m->count.branchesTaken++;
+}
+
+static uint32_t M0_ReadSpecial(M0_Core *m, int sysm) {
+  switch (sysm) {
+    case 0: case 1: case 2: case 3: case 5: case 6: case 7:
+      return ((uint32_t)m->n << 31) | ((uint32_t)m->z << 30) | ((uint32_t)m->c << 29) | ((uint32_t)m->v << 28);
+    case 8: case 9:
+      return m->r[13];
+    case 16:
+      return m->primask;
+    default:
+      return 0;
+  }
+}
+
+static void M0_WriteSpecial(M0_Core *m, int sysm, uint32_t value) {
+  if (sysm <= 3) {
+    m->n = value >> 31;
+    m->z = (value >> 30) & 1;
+    m->c = (value >> 29) & 1;
+    m->v = (value >> 28) & 1;
+  }
+  else if (sysm == 8 || sysm == 9) m->r[13] = value & ~3u;
+  else if (sysm == 16) m->primask = value & 1;
+}
+
+/*
+ * 32 bit instructions: BL, MRS, MSR and the barriers
+ */
+static uint32_t M0_Step32(M0_Core *m, uint16_t hw1, uint16_t hw2, uint32_t pc) {
+  if ((hw1 & 0xF800) == 0xF000 && (hw2 & 0xD000) == 0xD000) {
+    uint32_t s = (hw1 >> 10) & 1, j1 = (hw2 >> 13) & 1, j2 = (hw2 >> 11) & 1;
+    uint32_t i1 = !(j1 ^ s), i2 = !(j2 ^ s);
+    uint32_t imm = (s << 24) | (i1 << 23) | (i2 << 22) | ((hw1 & 0x3FFu) << 12) | ((hw2 & 0x7FFu) << 1);
+    if (s) imm |= 0xFE000000u;
+    m->r[14] = (pc + 4) | 1;
+    m->linked = 1;
+    M0_BranchTo(m, pc + 4 + imm);
+    return 4;
+  }
+  if (hw1 == 0xF3EF && (hw2 & 0xF000) == 0x8000) {
+    m->r[(hw2 >> 8) & 0xF] = M0_ReadSpecial(m, hw2 & 0xFF);
+    return 4;
+  }
+  if ((hw1 & 0xFFF0) == 0xF380 && (hw2 & 0xFF00) == 0x8800) {
+    M0_WriteSpecial(m, hw2 & 0xFF, m->r[hw1 & 0xF]);
+    return 4;
+  }
+  if (hw1 == 0xF3BF && (hw2 & 0xFFC0) == 0x8F40) return 4;  // DSB, DMB, ISB
+  M0_Fault(m, M0_ERR_UNDEFINED, pc);
+  return 0;
+}
+
+/*
+ * Loads and stores of the register-offset and immediate-offset formats
+ */
+static void M0_LoadStore(M0_Core *m, int op, int rt, uint32_t addr) {
+  switch (op) {
+    case 0: M0_Write(m, addr, m->r[rt], 4); break;
+    case 1: M0_Write(m, addr, m->r[rt], 2); break;
+    case 2: M0_Write(m, addr, m->r[rt], 1); break;
+    case 3: m->r[rt] = (uint32_t)(int8_t)M0_Read(m, addr, 1); break;
+    case 4: m->r[rt] = M0_Read(m, addr, 4); break;
+    case 5: m->r[rt] = M0_Read(m, addr, 2); break;
+    case 6: m->r[rt] = M0_Read(m, addr, 1); break;
+    default: m->r[rt] = (uint32_t)(int16_t)M0_Read(m, addr, 2); break;
+  }
+  if (op < 3) m->count.stores++;
+  else m->count.loads++;
+}
+
+/*
+ * Execute one instruction and return its cycles, without the wait states
+ */
+static uint32_t M0_Execute(M0_Core *m, uint16_t hw, uint32_t pc) {
+  uint32_t *r = m->r;
+  uint32_t pcValue = pc + 4;   // PC as an operand reads two instructions ahead
+
+  switch (hw >> 12) {
+    case 0x0:
+    case 0x1: {
+      int rd = hw & 7, rn = (hw >> 3) & 7;
+      int op = (hw >> 11) & 3;
+      if (op == 3) {
+        uint32_t operand = (hw & 0x400) ? (hw >> 6) & 7u : r[(hw >> 6) & 7];
+        if (hw & 0x200) r[rd] = M0_AddWithCarry(m, r[rn], ~operand, 1, 1);
+        else r[rd] = M0_AddWithCarry(m, r[rn], operand, 0, 1);
+        return 1;
+      }
+      uint32_t imm = (hw >> 6) & 0x1F;
+      if (op != 0 && imm == 0) imm = 32;   // LSR and ASR #0 shift by 32
+      r[rd] = M0_Shift(m, op, r[rn], imm);
+      M0_SetNZ(m, r[rd]);
+      return 1;
+    }
+
+    case 0x2:
+    case 0x3: {
+      int rd = (hw >> 8) & 7;
+      uint32_t imm = hw & 0xFF;
+      switch ((hw >> 11) & 3) {
+        case 0: r[rd] = imm; M0_SetNZ(m, imm); break;
+        case 1: M0_AddWithCarry(m, r[rd], ~imm, 1, 1); break;
+        case 2: r[rd] = M0_AddWithCarry(m, r[rd], imm, 0, 1); break;
+        default: r[rd] = M0_AddWithCarry(m, r[rd], ~imm, 1, 1); break;
+      }
+      return 1;
+    }
+
+    case 0x4:
+      if ((hw & 0xFC00) == 0x4000) {
+        int rdn = hw & 7, rm = (hw >> 3) & 7;
+        uint32_t a = r[rdn], b = r[rm], res;
+        uint32_t cycles = 1;
+        switch ((hw >> 6) & 0xF) {
+          case 0x0: res = r[rdn] = a & b; break;
+          case 0x1: res = r[rdn] = a ^ b; break;
+          case 0x2: res = r[rdn] = M0_Shift(m, 0, a, b & 0xFF); break;
+          case 0x3: res = r[rdn] = M0_Shift(m, 1, a, b & 0xFF); break;
+          case 0x4: res = r[rdn] = M0_Shift(m, 2, a, b & 0xFF); break;
+          case 0x5: r[rdn] = M0_AddWithCarry(m, a, b, m->c, 1); return 1;
+          case 0x6: r[rdn] = M0_AddWithCarry(m, a, ~b, m->c, 1); return 1;
+          case 0x7: res = r[rdn] = M0_Shift(m, 3, a, b & 0xFF); break;
+          case 0x8: res = a & b; break;
+          case 0x9: r[rdn] = M0_AddWithCarry(m, ~b, 0, 1, 1); return 1;
+          case 0xA: M0_AddWithCarry(m, a, ~b, 1, 1); return 1;
+          case 0xB: M0_AddWithCarry(m, a, b, 0, 1); return 1;
+          case 0xC: res = r[rdn] = a | b; break;
+          case 0xD: res = r[rdn] = a * b; cycles = m->mulCycles; break;
+          case 0xE: res = r[rdn] = a & ~b; break;
+          default: res = r[rdn] = ~b; break;
+        }
+        M0_SetNZ(m, res);
+        return cycles;
+      }
+      if ((hw & 0xFC00) == 0x4400) {
+        int rdn = (hw & 7) | ((hw >> 4) & 8), rm = (hw >> 3) & 0xF;
+        uint32_t value = rm == 15 ? pcValue : r[rm];
+        switch ((hw >> 8) & 3) {
+          case 0:
+            if (rdn == 15) {
+              M0_BranchTo(m, pcValue + value);
+              return 3;
+            }
+            r[rdn] = (rdn == 15 ? pcValue : r[rdn]) + value;
+            return 1;
+          case 1:
+            M0_AddWithCarry(m, rdn == 15 ? pcValue : r[rdn], ~value, 1, 1);
+            return 1;
+          case 2:
+            if (rdn == 15) {
+              M0_BranchTo(m, value);
+              return 3;
+            }
+            r[rdn] = value;
+            return 1;
+          default:
+            if (hw & 0x80) {
+              // BLX
+              r[14] = (pc + 2) | 1;
+              m->linked = 1;
+            }
+            M0_BranchTo(m, value);
+            return 3;
+        }
+      }
+      // LDR literal
+      m->r[(hw >> 8) & 7] = M0_Read(m, (pcValue & ~3u) + (hw & 0xFF) * 4, 4);
+      m->count.loads++;
+      return 2;
+
+    case 0x5:
+      M0_LoadStore(m, (hw >> 9) & 7, hw & 7, r[(hw >> 3) & 7] + r[(hw >> 6) & 7]);
+      return 2;
+
+    case 0x6:
+    case 0x7: {
+      uint32_t imm = (hw >> 6) & 0x1F;
+      int byte = (hw >> 12) & 1, load = (hw >> 11) & 1;
+      uint32_t addr = r[(hw >> 3) & 7] + (byte ? imm : imm * 4);
+      M0_LoadStore(m, load ? (byte ? 6 : 4) : (byte ? 2 : 0), hw & 7, addr);
+      return 2;
+    }
+
+    case 0x8:
+      M0_LoadStore(m, (hw & 0x800) ? 5 : 1, hw & 7, r[(hw >> 3) & 7] + ((hw >> 6) & 0x1F) * 2);
+      return 2;
+
+    case 0x9:
+      M0_LoadStore(m, (hw & 0x800) ? 4 : 0, (hw >> 8) & 7, r[13] + (hw & 0xFF) * 4);
+      return 2;
+
+    case 0xA:
+      if (hw & 0x800) r[(hw >> 8) & 7] = r[13] + (hw & 0xFF) * 4;
+      else r[(hw >> 8) & 7] = (pcValue & ~3u) + (hw & 0xFF) * 4;   // ADR
+      return 1;
+
+    case 0xB: {
+      uint32_t rlist = hw & 0xFF;
+      int rd = hw & 7, rm = (hw >> 3) & 7;
+      if ((hw & 0xFF00) == 0xB000) {
+        if (hw & 0x80) r[13] -= (hw & 0x7F) * 4;
+        else r[13] += (hw & 0x7F) * 4;
+        return 1;
+      }
+      if ((hw & 0xFF00) == 0xB200) {
+        switch ((hw >> 6) & 3) {
+          case 0: r[rd] = (uint32_t)(int16_t)r[rm]; break;
+          case 1: r[rd] = (uint32_t)(int8_t)r[rm]; break;
+          case 2: r[rd] = r[rm] & 0xFFFF; break;
+          default: r[rd] = r[rm] & 0xFF; break;
+        }
+        return 1;
+      }
+      if ((hw & 0xFE00) == 0xB400) {
+        int n = __builtin_popcount(rlist) + ((hw >> 8) & 1);
+        uint32_t addr = r[13] - 4 * n;
+        r[13] = addr;
+        for (int i = 0; i < 8; i++) {
+          if (rlist & (1u << i)) {
+            M0_Write(m, addr, r[i], 4);
+            addr += 4;
+          }
+        }
+        if (hw & 0x100) M0_Write(m, addr, r[14], 4);
+        m->count.stores += n;
+        return 1 + n;
+      }
+      if ((hw & 0xFFEF) == 0xB662) {
+        m->primask = (hw >> 4) & 1;
+        return 1;
+      }
+      if ((hw & 0xFF00) == 0xBA00 && ((hw >> 6) & 3) != 2) {
+        uint32_t x = r[rm];
+        switch ((hw >> 6) & 3) {
+          case 0: r[rd] = __builtin_bswap32(x); break;
+          case 1: r[rd] = ((x & 0x00FF00FFu) << 8) | ((x >> 8) & 0x00FF00FFu); break;
+          default: r[rd] = (uint32_t)(int16_t)(((x & 0xFF) << 8) | ((x >> 8) & 0xFF)); break;
+        }
+        return 1;
+      }
+      if ((hw & 0xFE00) == 0xBC00) {
+        int n = __builtin_popcount(rlist) + ((hw >> 8) & 1);
+        uint32_t addr = r[13];
+        for (int i = 0; i < 8; i++) {
+          if (rlist & (1u << i)) {
+            r[i] = M0_Read(m, addr, 4);
+            addr += 4;
+          }
+        }
+        m->count.loads += n;
+        if (hw & 0x100) {
+          uint32_t target = M0_Read(m, addr, 4);
+          r[13] = addr + 4;
+          M0_BranchTo(m, target);
+          return 4 + n;
+        }
+        r[13] = addr;
+        return 1 + n;
+      }
+      if ((hw & 0xFF00) == 0xBE00) {
+        M0_Fault(m, M0_ERR_BREAK, pc);
+        return 0;
+      }
+      if ((hw & 0xFF0F) == 0xBF00) return (hw & 0xF0) == 0x30 ? 2 : 1;   // hints, WFI takes 2
+      break;
+    }
+
+    case 0xC: {
+      int rn = (hw >> 8) & 7;
+      uint32_t rlist = hw & 0xFF, addr = r[rn];
+      int n = __builtin_popcount(rlist);
+      if (n == 0) break;
+      for (int i = 0; i < 8; i++) {
+        if (!(rlist & (1u << i))) continue;
+        if (hw & 0x800) r[i] = M0_Read(m, addr, 4);
+        else M0_Write(m, addr, r[i], 4);
+        addr += 4;
+      }
+      if (hw & 0x800) m->count.loads += n;
+      else m->count.stores += n;
+      if (!(hw & 0x800) || !(rlist & (1u << rn))) r[rn] = addr;
+      return 1 + n;
+    }
+
+    case 0xD: {
+      int cond = (hw >> 8) & 0xF;
+      if (cond >= 0xE) {
+        M0_Fault(m, M0_ERR_BREAK, pc);   // UDF and SVC
+        return 0;
+      }
+      if (!M0_Condition(m, cond)) return 1;
+      M0_BranchTo(m, pcValue + ((uint32_t)(int32_t)(int8_t)(hw & 0xFF) << 1));
+      return 3;
+    }
+
+    case 0xE:
+      if (hw & 0x800) break;
+      M0_BranchTo(m, pcValue + (uint32_t)((int32_t)((uint32_t)hw << 21) >> 20));
+      return 3;
+  }
+  M0_Fault(m, M0_ERR_UNDEFINED, pc);
+  return 0;
+}
+
+/*
+ * Fetch and execute the instruction at PC
+ */
+M0_Status M0_Step(M0_Core *m) {
+  uint32_t pc = m->r[15];
+  uint32_t word = pc & ~3u;
+  uint32_t cycles;
+  int inFlash = pc >= M0_FLASH_BASE && pc < M0_FLASH_BASE + M0_FLASH_SIZE;
+
+  if (pc == M0_RETURN_ADDR) return m->status = M0_RETURNED;
+  if (!inFlash && !(pc >= M0_RAM_BASE && pc < M0_RAM_BASE + M0_RAM_SIZE)) {
+    M0_Fault(m, M0_ERR_FETCH, pc);
+    return m->status;
+  }
+
+  // the core fetches a word, two instructions, at a time
+  if (word != m->lastFetch) {
+    if (inFlash && !(m->prefetch && word == m->lastFetch + 4)) {
+      m->count.cycles += m->waitStates;
+      m->count.waitCycles += m->waitStates;
+      if (m->helperReturn) m->count.helperCycles += m->waitStates;
+    }
+    m->lastFetch = word;
+  }
+
+  uint8_t *p = M0_Memory(m, pc, 2, 0);
+  uint16_t hw = M0_Le16(p);
+  uint64_t before = m->count.cycles;
+  m->r[15] = pc + 2;
+  m->linked = 0;
+  if ((hw & 0xE000) == 0xE000 && (hw & 0x1800) != 0) {
+    uint8_t *p2 = M0_Memory(m, pc + 2, 2, 0);
+    m->r[15] = pc + 4;
+    cycles = p2 != NULL ? M0_Step32(m, hw, M0_Le16(p2), pc) : 0;
+    if (p2 == NULL) M0_Fault(m, M0_ERR_FETCH, pc + 2);
+  }
+  else cycles = M0_Execute(m, hw, pc);
+  if (m->status != M0_OK) return m->status;
+
+  m->count.instructions++;
+  m->count.cycles += cycles;
+  if (m->helperReturn) {
+    m->count.helperCycles += m->count.cycles - before;
+    if (m->r[15] == m->helperReturn) m->helperReturn = 0;
+  }
+  else if (m->linked && M0_HelperAt(m->r[15])) {
+    // a BL or BLX into a runtime helper: count until it returns
+    m->helperReturn = m->r[14] & ~1u;
+    m->count.helperCalls++;
+  }
+  if (m->r[13] < m->callSp && m->callSp - m->r[13] > m->count.maxStack) m->count.maxStack = m->callSp - m->r[13];
+  return M0_OK;
+}
+
+/*
+ * Call fn(args...) like the AAPCS does and run it until it returns, or
+ * until limit instructions have run
+ */
+M0_Status M0_Call(M0_Core *m, uint32_t fn, const uint32_t *args, int argc, uint64_t limit) {
+  memset(&m->count, 0, sizeof(m->count));
+  for (int i = 0; i < 4; i++) m->r[i] = i < argc ? args[i] : 0;
+  m->r[13] = M0_RAM_BASE + M0_RAM_SIZE;
+  m->r[14] = M0_RETURN_ADDR | 1;
+  m->r[15] = fn & ~1u;
+  m->callSp = m->r[13];
+  m->helperReturn = 0;
+  m->lastFetch = 0xFFFFFFFFu;
+  m->status = M0_OK;
+
+  while (m->status == M0_OK) {
+    if (m->count.instructions >= limit) {
+      M0_Fault(m, M0_ERR_LIMIT, m->r[15]);
+      break;
+    }
+    M0_Step(m);
+  }
+  return m->status;
+}
+
+const char *M0_StatusName(M0_Status s) {
+  static const char *names[] = {
+    "ok", "returned", "fetch outside memory", "bad data access", "undefined instruction",
+    "breakpoint or supervisor call", "instruction limit reached",
+  };
+  return s <= M0_ERR_LIMIT ? names[s] : "?";
+}
@@ -0,0 +1,101 @@
+/*
+ * File: m0.h
+ * Purpose: Declares a Cortex-M0 instruction-set emulator. It executes the
+ *          ARMv6-M Thumb instruction set of an ELF image built for the
+ *          board and counts instructions and cycles with the timings of the
+ *          Cortex-M0 TRM, plus the STM32F0 flash wait states. There is no
+ *          hardware divide and no FPU, so division and floating point run
+ *          through the compiler's runtime helpers like they do on the board.
+ *
+ *          Memory is the F072's 128 KB of flash and 16 KB of SRAM.
+ *          Peripheral and core registers are a sparse store that remembers
+ *          writes, with pinned values for the status bits the firmware
+ *          spins on, so a function runs straight through its bus waits.
+ */
+#ifndef __M0_H
+#define __M0_H
+
+#include <stdint.h>
+
+#define M0_FLASH_BASE 0x08000000u
+#define M0_FLASH_SIZE 0x20000u
+#define M0_RAM_BASE 0x20000000u
+#define M0_RAM_SIZE 0x4000u
+#define M0_PERIPH_BASE 0x40000000u   // APB, AHB and the core's private bus are all above this
+
+#define M0_RETURN_ADDR 0xF0000000u   // LR of a harness call, returning here ends the call
+#define M0_MAX_REGS 256              // peripheral registers touched in one image
+
+typedef enum {
+  M0_OK,
+  M0_RETURNED,
+  M0_ERR_FETCH,      // PC left the flash
+  M0_ERR_ACCESS,     // unmapped or unaligned data access
+  M0_ERR_UNDEFINED,  // instruction ARMv6-M does not have
+  M0_ERR_BREAK,      // BKPT, SVC or UDF
+  M0_ERR_LIMIT       // ran out of instructions, usually a spin that never ends
+} M0_Status;
+
+typedef struct {
+  uint32_t addr;
+  uint32_t value;
+  uint32_t pinned;   // bits that always read as in pinValue, whatever is written
+  uint32_t pinValue;
+} M0_Reg;
+
+// Counters of one run, cleared by M0_Call
+typedef struct {
+  uint64_t instructions;
+  uint64_t cycles;
+  uint64_t waitCycles;     // part of cycles spent on flash wait states
+  uint64_t helperCycles;   // part of cycles spent in runtime helpers (__aeabi_*)
+  uint32_t helperCalls;
+  uint32_t loads;
+  uint32_t stores;
+  uint32_t periphAccesses;
+  uint32_t branchesTaken;
+  uint32_t maxStack;       // deepest stack use below the SP the call started with
+} M0_Counters;
+
+typedef struct {
+  uint32_t r[16];          // r13 SP, r14 LR, r15 PC (address of the next instruction)
+  uint8_t n, z, c, v;
+  uint8_t primask;
+
+  uint8_t flash[M0_FLASH_SIZE];
+  uint8_t ram[M0_RAM_SIZE];
+  M0_Reg regs[M0_MAX_REGS];
+  int regCount;
+
+  // cycle model
+  uint32_t waitStates;     // FLASH_ACR LATENCY: 0 up to 24 MHz, 1 above
+  uint8_t prefetch;        // FLASH_ACR PRFTBE: sequential fetches do not wait
+  uint32_t mulCycles;      // 1 for the fast multiplier the F0 has, 32 for the small one
+  uint32_t lastFetch;      // word address of the last instruction fetch
+
+  // runtime helper attribution
+  uint32_t helperReturn;   // return address of the outermost helper call, 0 when not in one
+  uint8_t linked;          // the last instruction was a BL or BLX
+  uint32_t callSp;
+
+  M0_Counters count;
+  M0_Status status;
+  uint32_t faultAddr;
+} M0_Core;
+
+void M0_Reset(M0_Core *m);
+int M0_LoadElf(M0_Core *m, const char *path);
+uint32_t M0_Symbol(const char *name);
+const char *M0_SymbolAt(uint32_t addr, uint32_t *offset);
+
+// Memory as the firmware sees it
+uint32_t M0_Read(M0_Core *m, uint32_t addr, int size);
+void M0_Write(M0_Core *m, uint32_t addr, uint32_t value, int size);
+void M0_Pin(M0_Core *m, uint32_t addr, uint32_t mask, uint32_t value);
+
+// Execution
+M0_Status M0_Step(M0_Core *m);
+M0_Status M0_Call(M0_Core *m, uint32_t fn, const uint32_t *args, int argc, uint64_t limit);
+const char *M0_StatusName(M0_Status s);
+
+#endif /* __M0_H */
@@ -0,0 +1,382 @@
+/*
+ * File: filters.c
+ * Purpose: Defines the Monte-Carlo benchmark of the range filter. Thousands
+ *          of randomised range traces, sampled every 100 ms like TIM2 does,
+ *          are run through the firmware's own rangeFilter.c and zone
+ *          boundaries for every filter configuration in a grid. The traces
+ *          mix an object moving at walking speed with gaussian noise,
+ *          spikes, dropouts and multipath jumps (bursts of readings from a
+ *          longer echo path). For each configuration it reports:
+ *            - detection delay from the object entering a closer zone to
+ *              the filtered output showing it, and the entries it missed
+ *            - false zone changes per minute: the output moving to a zone
+ *              the object was not in at the time or just before
+ *            - the share of samples in the wrong zone
+ *            - with --image, the cycles per FILTER_Update call on the
+ *              Cortex-M0, from the firmware built for the board
+ *          Configurations no other configuration beats on all of delay,
+ *          false changes and wrong zone are marked with '*'.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m0.h"
+#include "rangeFilter.h"
+
+#define FLT_PERIOD_MS 100           // TIM2 period, one reading per period
+#define FLT_MAX_RANGE_MM 4500       // no echo beyond this
+#define FLT_OUT_OF_RANGE 0x2AF8     // what the US-100 sends without an echo
+#define FLT_DROPOUT 0xFFFFFFFFu     // no reading this period
+#define FLT_GRACE 3                 // periods a zone stays plausible after the object left it
+#define FLT_MAX_CONFIGS 256
+#define FLT_CYCLE_TRACES 20         // traces run on the emulator per configuration
+#define FLT_SCRATCH (M0_RAM_BASE + 0x3000)
+
+// Zone boundaries of main.c, closest first
+static const uint16_t zoneLimits[4] = { 300, 950, 1900, 3500 };
+
+typedef struct {
+  uint16_t *truth;     // true distance per sample
+  uint32_t *reading;   // what the sensor sent, FLT_DROPOUT if nothing
+} FLT_Trace;
+
+// Impairment limits, each trace draws its own level up to these
+typedef struct {
+  double noise;        // mm standard deviation
+  double spikes;       // chance per sample of a reading anywhere in range
+  double dropouts;     // chance per sample of no reading
+  double multipath;    // chance per sample of a burst of longer-path readings
+} FLT_Impairments;
+
+typedef struct {
+  FILTER filter;
+  uint64_t entries;        // object moved into a closer zone
+  uint64_t missed;         // ... and the output never followed before it moved again
+  uint64_t delaySum;       // samples
+  uint32_t *delays;        // per detected entry, for the percentile
+  uint64_t delayCount;
+  double delayP95Ms;
+  double delayMaxMs;
+  uint64_t falseChanges;
+  uint64_t wrongSamples;
+  uint64_t samples;
+  double cyclesAvg;        // < 0 without an image
+  uint64_t cyclesMax;
+  uint64_t mismatches;     // emulated output differing from the host build
+  int pareto;
+} FLT_Result;
+
+static uint64_t rng;
+
+/*
+ * xorshift64*, so a seed always gives the same traces
+ */
+static uint64_t FLT_Random(void) {
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double FLT_Uniform(void) {
+  return (FLT_Random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double FLT_Gaussian(void) {
+  double u1 = FLT_Uniform(), u2 = FLT_Uniform();
+  if (u1 < 1e-12) u1 = 1e-12;
+  return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static uint8_t FLT_Zone(uint32_t distance) {
+  uint8_t zone = 0;
+  for (int i = 0; i < 4; i++) zone += distance >= zoneLimits[i];
+  return zone;
+}
+
+/*
+ * One trace: the object walks to a random distance, waits, walks on, while
+ * the sensor adds this trace's share of every impairment
+ */
+static void FLT_MakeTrace(FLT_Trace *t, int samples, const FLT_Impairments *imp) {
+  double noise = FLT_Uniform() * imp->noise;
+  double spikes = FLT_Uniform() * imp->spikes;
+  double dropouts = FLT_Uniform() * imp->dropouts;
+  double multipath = FLT_Uniform() * imp->multipath;
+  double d = 150 + FLT_Uniform() * 4850, target = d, speed = 0;
+  int wait = 0, burst = 0;
+  double extra = 0;
+
+  for (int k = 0; k < samples; k++) {
+    if (wait > 0) wait--;
+    else if (fabs(target - d) < 1) {
+      target = 150 + FLT_Uniform() * 4850;
+      speed = (200 + FLT_Uniform() * 1300) * FLT_PERIOD_MS / 1000.0;   // 0.2 to 1.5 m/s
+      wait = (int)(FLT_Uniform() * 30);
+    }
+    else d += fabs(target - d) < speed ? target - d : (target > d ? speed : -speed);
+    t->truth[k] = (uint16_t)(d + 0.5);
+
+    if (burst == 0 && FLT_Uniform() < multipath) {
+      burst = 2 + (int)(FLT_Uniform() * 5);
+      extra = 300 + FLT_Uniform() * 1200;
+    }
+    double r = d + FLT_Gaussian() * noise;
+    if (burst > 0) {
+      r += extra;
+      burst--;
+    }
+    if (FLT_Uniform() < spikes) r = 20 + FLT_Uniform() * (FLT_MAX_RANGE_MM - 20);
+    if (r > FLT_MAX_RANGE_MM) r = FLT_OUT_OF_RANGE;
+    if (r < 0) r = 0;
+    t->reading[k] = FLT_Uniform() < dropouts ? FLT_DROPOUT : (uint32_t)(r + 0.5);
+  }
+}
+
+/*
+ * Run every trace through one configuration and score it
+ */
+static void FLT_Score(FLT_Result *res, const FLT_Trace *traces, int count, int samples) {
+  for (int n = 0; n < count; n++) {
+    const FLT_Trace *t = &traces[n];
+    uint8_t *out = malloc(samples);
+    uint16_t value = 0;
+    int started = 0;
+
+    FILTER_Setup(&res->filter);
+    for (int k = 0; k < samples; k++) {
+      if (t->reading[k] != FLT_DROPOUT) {
+        value = FILTER_Update((uint16_t)t->reading[k]);
+        started = 1;
+      }
+      // nothing is shown before the first reading
+      out[k] = started ? FLT_Zone(value) : 4;
+    }
+
+    for (int k = 1; k < samples; k++) {
+      uint8_t zone = FLT_Zone(t->truth[k]), before = FLT_Zone(t->truth[k - 1]);
+      res->samples++;
+      res->wrongSamples += out[k] != zone;
+
+      if (out[k] != out[k - 1]) {
+        int plausible = 0;
+        for (int j = k; j >= 0 && j >= k - FLT_GRACE; j--) plausible |= FLT_Zone(t->truth[j]) == out[k];
+        res->falseChanges += !plausible;
+      }
+      if (zone < before) {
+        int j = k;
+        while (j < samples && out[j] > zone && FLT_Zone(t->truth[j]) == zone) j++;
+        if (j == samples) continue;   // the trace ended first, neither detected nor missed
+        res->entries++;
+        if (out[j] <= zone) {
+          res->delays[res->delayCount++] = j - k;
+          res->delaySum += j - k;
+        }
+        else res->missed++;
+      }
+    }
+    free(out);
+  }
+}
+
+/*
+ * Cycles per FILTER_Update on the Cortex-M0, and a check that the firmware
+ * built for the board filters like the host build does
+ */
+static int FLT_Cycles(FLT_Result *res, const M0_Core *image, const FLT_Trace *traces, int count, int samples) {
+  static M0_Core core;
+  uint32_t setup = M0_Symbol("FILTER_Setup"), update = M0_Symbol("FILTER_Update");
+  uint64_t sum = 0, calls = 0;
+
+  if (setup == 0 || update == 0) {
+    fprintf(stderr, "the image has no FILTER_Setup or FILTER_Update\n");
+    return -1;
+  }
+  core = *image;
+  M0_Write(&core, FLT_SCRATCH + 0, res->filter.window, 1);
+  M0_Write(&core, FLT_SCRATCH + 1, res->filter.smoothing, 1);
+  M0_Write(&core, FLT_SCRATCH + 2, res->filter.hysteresis, 2);
+  // the thresholds after the struct, which points at them
+  for (int i = 0; i < 4; i++) M0_Write(&core, FLT_SCRATCH + 8 + 2 * i, res->filter.thresholds[i], 2);
+  M0_Write(&core, FLT_SCRATCH + 4, FLT_SCRATCH + 8, 4);
+
+  for (int n = 0; n < count && n < FLT_CYCLE_TRACES; n++) {
+    uint32_t arg = FLT_SCRATCH;
+    if (M0_Call(&core, setup, &arg, 1, 100000) != M0_RETURNED) return -1;
+    FILTER_Setup(&res->filter);
+    for (int k = 0; k < samples; k++) {
+      if (traces[n].reading[k] == FLT_DROPOUT) continue;
+      arg = traces[n].reading[k];
+      M0_Status s = M0_Call(&core, update, &arg, 1, 100000);
+      if (s != M0_RETURNED) {
+        fprintf(stderr, "FILTER_Update: %s at 0x%08x\n", M0_StatusName(s), (unsigned)core.faultAddr);
+        return -1;
+      }
+      res->mismatches += (core.r[0] & 0xFFFF) != FILTER_Update((uint16_t)arg);
+      sum += core.count.cycles;
+      calls++;
+      if (core.count.cycles > res->cyclesMax) res->cyclesMax = core.count.cycles;
+    }
+  }
+  res->cyclesAvg = calls ? (double)sum / calls : 0;
+  return 0;
+}
+
+static int FLT_DelayOrder(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double FLT_DelayMs(const FLT_Result *r) {
+  return r->delayCount ? (double)r->delaySum / r->delayCount * FLT_PERIOD_MS : 0;
+}
+
+static double FLT_FalsePerMin(const FLT_Result *r) {
+  return r->samples ? r->falseChanges * 60000.0 / (r->samples * (double)FLT_PERIOD_MS) : 0;
+}
+
+static double FLT_WrongPct(const FLT_Result *r) {
+  return r->samples ? 100.0 * r->wrongSamples / r->samples : 0;
+}
+
+/*
+ * Mark the configurations no other one beats on every quality metric
+ */
+static void FLT_Pareto(FLT_Result *results, int count) {
+  for (int i = 0; i < count; i++) {
+    const FLT_Result *a = &results[i];
+    results[i].pareto = 1;
+    for (int j = 0; j < count && results[i].pareto; j++) {
+      const FLT_Result *b = &results[j];
+      int noWorse = FLT_DelayMs(b) <= FLT_DelayMs(a) && FLT_FalsePerMin(b) <= FLT_FalsePerMin(a) &&
+                    FLT_WrongPct(b) <= FLT_WrongPct(a) && b->missed <= a->missed;
+      int better = FLT_DelayMs(b) < FLT_DelayMs(a) || FLT_FalsePerMin(b) < FLT_FalsePerMin(a) ||
+                   FLT_WrongPct(b) < FLT_WrongPct(a) || b->missed < a->missed;
+      if (j != i && noWorse && better) results[i].pareto = 0;
+    }
+  }
+}
+
+static void FLT_Usage(const char *prog) {
+  printf("usage: %s [--traces n] [--samples n] [--seed n] [--config w,s,h]... [--image elf] [--csv file]\n", prog);
+  printf("       %*s [--noise mm] [--spikes %%] [--dropouts %%] [--multipath %%]\n", (int)strlen(prog), "");
+  printf("  --traces n      random traces per configuration (default 2000)\n");
+  printf("  --samples n     readings per trace, one every 100 ms (default 300)\n");
+  printf("  --seed n        seed of the traces (default 1)\n");
+  printf("  --config w,s,h  median window, smoothing shift and hysteresis mm to test, repeatable\n");
+  printf("                  (default: windows 1 3 5 7, smoothing 0-3, hysteresis 0 50 100 200)\n");
+  printf("  --image f       firmware built for the board, to count cycles per FILTER_Update\n");
+  printf("  --csv f         write the results as CSV\n");
+  printf("  --noise mm      largest noise standard deviation of a trace (default 30)\n");
+  printf("  --spikes %%      largest spike rate of a trace (default 2)\n");
+  printf("  --dropouts %%    largest dropout rate of a trace (default 5)\n");
+  printf("  --multipath %%   largest rate of multipath bursts of a trace (default 1)\n");
+}
+
+int main(int argc, char **argv) {
+  static FLT_Result results[FLT_MAX_CONFIGS];
+  static M0_Core image;
+  FLT_Impairments imp = { 30, 2, 5, 1 };
+  const char *imagePath = NULL, *csvPath = NULL;
+  int traceCount = 2000, samples = 300, configs = 0, failed = 0;
+
+  rng = 1;
+  for (int i = 1; i < argc; i++) {
+    unsigned w, s, h;
+    if (strcmp(argv[i], "--traces") == 0 && i + 1 < argc) traceCount = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) samples = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) rng = strtoull(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) imagePath = argv[++i];
+    else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) csvPath = argv[++i];
+    else if (strcmp(argv[i], "--noise") == 0 && i + 1 < argc) imp.noise = atof(argv[++i]);
+    else if (strcmp(argv[i], "--spikes") == 0 && i + 1 < argc) imp.spikes = atof(argv[++i]);
+    else if (strcmp(argv[i], "--dropouts") == 0 && i + 1 < argc) imp.dropouts = atof(argv[++i]);
+    else if (strcmp(argv[i], "--multipath") == 0 && i + 1 < argc) imp.multipath = atof(argv[++i]);
+    else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc && configs < FLT_MAX_CONFIGS &&
+             sscanf(argv[++i], "%u,%u,%u", &w, &s, &h) == 3 && w >= 1 && w <= FILTER_MAX_WINDOW && s < 16) {
+      results[configs++].filter = (FILTER){ w, s, h, zoneLimits };
+    }
+    else {
+      FLT_Usage(argv[0]);
+      return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+    }
+  }
+  if (traceCount < 1 || samples < 2 || rng == 0) {
+    FLT_Usage(argv[0]);
+    return 2;
+  }
+  imp.spikes /= 100;
+  imp.dropouts /= 100;
+  imp.multipath /= 100;
+  if (configs == 0) {
+    static const uint8_t windows[] = { 1, 3, 5, 7 };
+    static const uint16_t hysteresis[] = { 0, 50, 100, 200 };
+    for (int w = 0; w < 4; w++)
+      for (int s = 0; s < 4; s++)
+        for (int h = 0; h < 4; h++) results[configs++].filter = (FILTER){ windows[w], s, hysteresis[h], zoneLimits };
+  }
+  if (imagePath != NULL) {
+    M0_Reset(&image);
+    if (M0_LoadElf(&image, imagePath) != 0) return 2;
+  }
+
+  FLT_Trace *traces = calloc(traceCount, sizeof(FLT_Trace));
+  for (int n = 0; n < traceCount; n++) {
+    traces[n].truth = malloc(samples * sizeof(uint16_t));
+    traces[n].reading = malloc(samples * sizeof(uint32_t));
+    FLT_MakeTrace(&traces[n], samples, &imp);
+  }
+
+  for (int c = 0; c < configs; c++) {
+    FLT_Result *r = &results[c];
+    r->delays = malloc((size_t)traceCount * samples * sizeof(uint32_t));
+    r->cyclesAvg = -1;
+    FLT_Score(r, traces, traceCount, samples);
+    if (r->delayCount) {
+      qsort(r->delays, r->delayCount, sizeof(uint32_t), FLT_DelayOrder);
+      r->delayP95Ms = r->delays[(r->delayCount * 95) / 100] * (double)FLT_PERIOD_MS;
+      r->delayMaxMs = r->delays[r->delayCount - 1] * (double)FLT_PERIOD_MS;
+    }
+    free(r->delays);
+    if (imagePath != NULL && FLT_Cycles(r, &image, traces, traceCount, samples) != 0) return 2;
+    if (r->mismatches) failed = 1;
+  }
+  FLT_Pareto(results, configs);
+
+  FILE *csv = NULL;
+  if (csvPath != NULL) {
+    csv = fopen(csvPath, "w");
+    if (csv == NULL) {
+      perror(csvPath);
+      return 2;
+    }
+    fprintf(csv, "window,smoothing,hysteresis,entries,missed,delay_avg_ms,delay_p95_ms,delay_max_ms,"
+                 "false_changes_per_min,wrong_zone_pct,cycles_avg,cycles_max,pareto\n");
+  }
+  printf("%d traces of %.1f s, noise up to %.0f mm, spikes %.1f%%, dropouts %.1f%%, multipath %.1f%%\n",
+         traceCount, samples * FLT_PERIOD_MS / 1000.0, imp.noise, imp.spikes * 100, imp.dropouts * 100,
+         imp.multipath * 100);
+  printf("  %6s %9s %10s %7s %9s %9s %9s %10s %7s %7s %7s\n", "window", "smoothing", "hysteresis", "missed",
+         "delay ms", "p95 ms", "max ms", "false/min", "wrong%", "cycles", "max");
+  for (int c = 0; c < configs; c++) {
+    FLT_Result *r = &results[c];
+    char cycles[16] = "-", cyclesMax[16] = "-";
+    if (r->cyclesAvg >= 0) {
+      snprintf(cycles, sizeof(cycles), "%.1f", r->cyclesAvg);
+      snprintf(cyclesMax, sizeof(cyclesMax), "%llu", (unsigned long long)r->cyclesMax);
+    }
+    printf("%c %6u %9u %10u %6.2f%% %9.1f %9.0f %9.0f %10.2f %7.2f %7s %7s%s\n", r->pareto ? '*' : ' ',
+           (unsigned)r->filter.window, (unsigned)r->filter.smoothing, (unsigned)r->filter.hysteresis,
+           r->entries ? 100.0 * r->missed / r->entries : 0.0, FLT_DelayMs(r), r->delayP95Ms, r->delayMaxMs, FLT_FalsePerMin(r),
+           FLT_WrongPct(r), cycles, cyclesMax, r->mismatches ? "  differs from the host build" : "");
+    if (csv != NULL)
+      fprintf(csv, "%u,%u,%u,%llu,%llu,%.1f,%.0f,%.0f,%.3f,%.3f,%s,%s,%d\n", (unsigned)r->filter.window,
+              (unsigned)r->filter.smoothing, (unsigned)r->filter.hysteresis, (unsigned long long)r->entries,
+              (unsigned long long)r->missed, FLT_DelayMs(r), r->delayP95Ms, r->delayMaxMs, FLT_FalsePerMin(r), FLT_WrongPct(r),
+              r->cyclesAvg >= 0 ? cycles : "", r->cyclesAvg >= 0 ? cyclesMax : "", r->pareto);
+  }
+  if (csv != NULL) fclose(csv);
+  return failed ? 2 : 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * File: sim_nvic.h
+ * Purpose: CMSIS_NVIC_VIRTUAL header for the host build. Replaces the
+ *          CMSIS NVIC functions with the simulator's NVIC model.
+ */
+#ifndef __SIM_NVIC_H
+#define __SIM_NVIC_H
+
+void SIM_NvicEnableIRQ(IRQn_Type IRQn);
+void SIM_NvicDisableIRQ(IRQn_Type IRQn);
+uint32_t SIM_NvicGetEnableIRQ(IRQn_Type IRQn);
+uint32_t SIM_NvicGetPendingIRQ(IRQn_Type IRQn);
+void SIM_NvicSetPendingIRQ(IRQn_Type IRQn);
+void SIM_NvicClearPendingIRQ(IRQn_Type IRQn);
+void SIM_NvicSetPriority(IRQn_Type IRQn, uint32_t priority);
+uint32_t SIM_NvicGetPriority(IRQn_Type IRQn);
+void SIM_NvicSystemReset(void);
+
+#define NVIC_SetPriorityGrouping(x) ((void)(x))
+#define NVIC_GetPriorityGrouping()  (0U)
+#define NVIC_EnableIRQ              SIM_NvicEnableIRQ
+#define NVIC_GetEnableIRQ           SIM_NvicGetEnableIRQ
+#define NVIC_DisableIRQ             SIM_NvicDisableIRQ
+#define NVIC_GetPendingIRQ          SIM_NvicGetPendingIRQ
+#define NVIC_SetPendingIRQ          SIM_NvicSetPendingIRQ
+#define NVIC_ClearPendingIRQ        SIM_NvicClearPendingIRQ
+#define NVIC_SetPriority            SIM_NvicSetPriority
+#define NVIC_GetPriority            SIM_NvicGetPriority
+#define NVIC_SystemReset            SIM_NvicSystemReset
+
+#endif /* __SIM_NVIC_H */
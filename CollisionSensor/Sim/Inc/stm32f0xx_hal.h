@@ -0,0 +1,94 @@
+/*
+ * File: stm32f0xx_hal.h (simulator)
+ * Purpose: Stands in for the HAL header in the host build. It pulls in the
+ *          real HAL/CMSIS headers for all the register types and bit masks,
+ *          then points each peripheral macro at the simulated register file
+ *          so that "USART3->TDR = 0x55" reaches the USART3 model instead of
+ *          address 0x40004828.
+ */
+#ifndef __SIM_STM32F0XX_HAL_H
+#define __SIM_STM32F0XX_HAL_H
+
+// Route the CMSIS NVIC functions to the simulated NVIC
+#define CMSIS_NVIC_VIRTUAL
+#define CMSIS_NVIC_VIRTUAL_HEADER_FILE "sim_nvic.h"
+
+#include_next "stm32f0xx_hal.h"
+
+#include "../sim.h"
+
+#undef RCC
+#undef GPIOA
+#undef GPIOB
+#undef GPIOC
+#undef TIM2
+#undef TIM3
+#undef USART1
+#undef USART3
+#undef SPI2
+#undef SysTick
+#undef SCB
+#undef CRC
+#undef IWDG
+#undef USB
+#undef USB_PMAADDR
+#undef CRS
+#undef DMA1
+#undef I2C1
+#undef DMA1_Channel1
+#undef DMA1_Channel2
+#undef DMA1_Channel3
+#undef DMA1_Channel4
+#undef DMA1_Channel5
+#undef DMA1_Channel6
+#undef DMA1_Channel7
+
+#define RCC     ((RCC_TypeDef *)SIM_Access(SIM_RCC))
+#define GPIOA   ((GPIO_TypeDef *)SIM_Access(SIM_GPIOA))
+#define GPIOB   ((GPIO_TypeDef *)SIM_Access(SIM_GPIOB))
+#define GPIOC   ((GPIO_TypeDef *)SIM_Access(SIM_GPIOC))
+#define TIM2    ((TIM_TypeDef *)SIM_Access(SIM_TIM2))
+#define TIM3    ((TIM_TypeDef *)SIM_Access(SIM_TIM3))
+#define USART1  ((USART_TypeDef *)SIM_Access(SIM_USART1))
+#define USART3  ((USART_TypeDef *)SIM_Access(SIM_USART3))
+#define SPI2    ((SPI_TypeDef *)SIM_Access(SIM_SPI2))
+#define SysTick ((SysTick_Type *)SIM_Access(SIM_SYSTICK))
+#define SCB     ((SCB_Type *)SIM_Access(SIM_SCB))
+#define CRC     ((CRC_TypeDef *)SIM_Access(SIM_CRC))
+#define IWDG    ((IWDG_TypeDef *)SIM_Access(SIM_IWDG))
+#define USB     ((USB_TypeDef *)SIM_Access(SIM_USB))
+#define USB_PMAADDR ((uintptr_t)SIM_Access(SIM_USBPMA))
+#define CRS     ((CRS_TypeDef *)SIM_Access(SIM_CRS))
+#define DMA1    ((DMA_TypeDef *)SIM_Access(SIM_DMA1))
+#define I2C1    ((I2C_TypeDef *)SIM_Access(SIM_I2C1))
+// the channels sit in DMA1's block at their offsets from DMA1_BASE
+#define SIM_DMA1_CHANNEL(n) ((DMA_Channel_TypeDef *)((uint8_t *)SIM_Access(SIM_DMA1) + 0x08 + 20 * ((n) - 1)))
+#define DMA1_Channel1 SIM_DMA1_CHANNEL(1)
+#define DMA1_Channel2 SIM_DMA1_CHANNEL(2)
+#define DMA1_Channel3 SIM_DMA1_CHANNEL(3)
+#define DMA1_Channel4 SIM_DMA1_CHANNEL(4)
+#define DMA1_Channel5 SIM_DMA1_CHANNEL(5)
+#define DMA1_Channel6 SIM_DMA1_CHANNEL(6)
+#define DMA1_Channel7 SIM_DMA1_CHANNEL(7)
+
+// Core intrinsics that have no meaning on the host
+#undef __disable_irq
+#undef __enable_irq
+#undef __get_PRIMASK
+#undef __set_PRIMASK
+#undef __get_MSP
+#undef __WFI
+#undef __DSB
+#undef __ISB
+#undef __DMB
+#define __disable_irq() SIM_DisableIrq()
+#define __enable_irq() SIM_EnableIrq()
+#define __get_PRIMASK() SIM_GetPrimask()
+#define __set_PRIMASK(x) SIM_SetPrimask(x)
+#define __get_MSP() SIM_GetMsp()
+#define __WFI() SIM_Idle()
+#define __DSB() __asm volatile ("" ::: "memory")
+#define __ISB() __asm volatile ("" ::: "memory")
+#define __DMB() __asm volatile ("" ::: "memory")
+
+#endif /* __SIM_STM32F0XX_HAL_H */
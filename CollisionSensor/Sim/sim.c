@@ -0,0 +1,656 @@
+/*
+ * File: sim.c
+ * Purpose: Defines the host simulator core: the register file, the virtual
+ *          clock and event scheduler, the NVIC model and interrupt dispatch.
+ *
+ *          Register writes are trapped rather than polled. The firmware sees
+ *          the register file through a read-only mapping, so every write
+ *          faults once; the fault handler records the register and opens the
+ *          mapping, and the next peripheral access hands the write to the
+ *          peripheral model and closes it again. Every firmware statement
+ *          that touches a peripheral goes through SIM_Access first, so each
+ *          write is seen individually, even a repeated write of the same value.
+ *
+ *          Loops that spin on RAM (the firmware waiting for an interrupt to
+ *          set a flag) never touch a peripheral, so a periodic signal checks
+ *          whether the firmware has burned host CPU without any access. If it
+ *          has, the clock jumps to the next scheduled event and the handlers
+ *          it raises run from the signal, exactly where the hardware would
+ *          have taken the interrupt.
+ */
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "stm32f0xx_hal.h"
+#include "sim.h"
+
+#define SIM_BLOCK_SIZE 0x400
+#define SIM_REGFILE_SIZE (SIM_BLOCK_SIZE * SIM_PERIPH_COUNT)
+#define SIM_MAX_EVENTS 32
+#define SIM_MAX_LISTENERS 8
+#define SIM_MAX_DIRTY 8
+#define SIM_MAX_NESTING 8
+#define SIM_THREAD_PRIORITY 0x100  // thread mode runs below every exception
+
+#define SIM_IDLE_TICK_NS 50000     // idle detector period
+#define SIM_IDLE_CPU_NS 40000      // CPU the firmware may burn without an access before it is idle
+#define SIM_IDLE_QUIET_TICKS 2     // quiet periods in a row before the clock jumps
+
+// Exception handlers, weak so a handler the firmware does not define reads as NULL
+extern void HardFault_Handler(void) __attribute__((weak));
+extern void SysTick_Handler(void) __attribute__((weak));
+extern void WWDG_IRQHandler(void) __attribute__((weak));
+extern void PVD_VDDIO2_IRQHandler(void) __attribute__((weak));
+extern void RTC_IRQHandler(void) __attribute__((weak));
+extern void FLASH_IRQHandler(void) __attribute__((weak));
+extern void RCC_CRS_IRQHandler(void) __attribute__((weak));
+extern void EXTI0_1_IRQHandler(void) __attribute__((weak));
+extern void EXTI2_3_IRQHandler(void) __attribute__((weak));
+extern void EXTI4_15_IRQHandler(void) __attribute__((weak));
+extern void TSC_IRQHandler(void) __attribute__((weak));
+extern void DMA1_Channel1_IRQHandler(void) __attribute__((weak));
+extern void DMA1_Channel2_3_IRQHandler(void) __attribute__((weak));
+extern void DMA1_Channel4_5_6_7_IRQHandler(void) __attribute__((weak));
+extern void ADC1_COMP_IRQHandler(void) __attribute__((weak));
+extern void TIM1_BRK_UP_TRG_COM_IRQHandler(void) __attribute__((weak));
+extern void TIM1_CC_IRQHandler(void) __attribute__((weak));
+extern void TIM2_IRQHandler(void) __attribute__((weak));
+extern void TIM3_IRQHandler(void) __attribute__((weak));
+extern void TIM6_DAC_IRQHandler(void) __attribute__((weak));
+extern void TIM7_IRQHandler(void) __attribute__((weak));
+extern void TIM14_IRQHandler(void) __attribute__((weak));
+extern void TIM15_IRQHandler(void) __attribute__((weak));
+extern void TIM16_IRQHandler(void) __attribute__((weak));
+extern void TIM17_IRQHandler(void) __attribute__((weak));
+extern void I2C1_IRQHandler(void) __attribute__((weak));
+extern void I2C2_IRQHandler(void) __attribute__((weak));
+extern void SPI1_IRQHandler(void) __attribute__((weak));
+extern void SPI2_IRQHandler(void) __attribute__((weak));
+extern void USART1_IRQHandler(void) __attribute__((weak));
+extern void USART2_IRQHandler(void) __attribute__((weak));
+extern void USART3_4_IRQHandler(void) __attribute__((weak));
+extern void CEC_CAN_IRQHandler(void) __attribute__((weak));
+extern void USB_IRQHandler(void) __attribute__((weak));
+
+typedef struct {
+  const char *name;
+  void (*handler)(void);
+} SIM_Vector;
+
+// Vector table from startup_stm32f072xb.s, indexed by exception number
+static SIM_Vector vectors[SIM_EXC_COUNT] = {
+  [SIM_EXC_HARDFAULT] = { "HardFault_Handler", HardFault_Handler },
+  [SIM_EXC_SYSTICK] = { "SysTick_Handler", SysTick_Handler },
+  [SIM_EXC_IRQ0 + WWDG_IRQn] = { "WWDG_IRQHandler", WWDG_IRQHandler },
+  [SIM_EXC_IRQ0 + PVD_VDDIO2_IRQn] = { "PVD_VDDIO2_IRQHandler", PVD_VDDIO2_IRQHandler },
+  [SIM_EXC_IRQ0 + RTC_IRQn] = { "RTC_IRQHandler", RTC_IRQHandler },
+  [SIM_EXC_IRQ0 + FLASH_IRQn] = { "FLASH_IRQHandler", FLASH_IRQHandler },
+  [SIM_EXC_IRQ0 + RCC_CRS_IRQn] = { "RCC_CRS_IRQHandler", RCC_CRS_IRQHandler },
+  [SIM_EXC_IRQ0 + EXTI0_1_IRQn] = { "EXTI0_1_IRQHandler", EXTI0_1_IRQHandler },
+  [SIM_EXC_IRQ0 + EXTI2_3_IRQn] = { "EXTI2_3_IRQHandler", EXTI2_3_IRQHandler },
+  [SIM_EXC_IRQ0 + EXTI4_15_IRQn] = { "EXTI4_15_IRQHandler", EXTI4_15_IRQHandler },
+  [SIM_EXC_IRQ0 + TSC_IRQn] = { "TSC_IRQHandler", TSC_IRQHandler },
+  [SIM_EXC_IRQ0 + DMA1_Channel1_IRQn] = { "DMA1_Channel1_IRQHandler", DMA1_Channel1_IRQHandler },
+  [SIM_EXC_IRQ0 + DMA1_Channel2_3_IRQn] = { "DMA1_Channel2_3_IRQHandler", DMA1_Channel2_3_IRQHandler },
+  [SIM_EXC_IRQ0 + DMA1_Channel4_5_6_7_IRQn] = { "DMA1_Channel4_5_6_7_IRQHandler", DMA1_Channel4_5_6_7_IRQHandler },
+  [SIM_EXC_IRQ0 + ADC1_COMP_IRQn] = { "ADC1_COMP_IRQHandler", ADC1_COMP_IRQHandler },
+  [SIM_EXC_IRQ0 + TIM1_BRK_UP_TRG_COM_IRQn] = { "TIM1_BRK_UP_TRG_COM_IRQHandler", TIM1_BRK_UP_TRG_COM_IRQHandler },
+  [SIM_EXC_IRQ0 + TIM1_CC_IRQn] = { "TIM1_CC_IRQHandler", TIM1_CC_IRQHandler },
+  [SIM_EXC_IRQ0 + TIM2_IRQn] = { "TIM2_IRQHandler", TIM2_IRQHandler },
+  [SIM_EXC_IRQ0 + TIM3_IRQn] = { "TIM3_IRQHandler", TIM3_IRQHandler },
+  [SIM_EXC_IRQ0 + TIM6_DAC_IRQn] = { "TIM6_DAC_IRQHandler", TIM6_DAC_IRQHandler },
+  [SIM_EXC_IRQ0 + TIM7_IRQn] = { "TIM7_IRQHandler", TIM7_IRQHandler },
+  [SIM_EXC_IRQ0 + TIM14_IRQn] = { "TIM14_IRQHandler", TIM14_IRQHandler },
+  [SIM_EXC_IRQ0 + TIM15_IRQn] = { "TIM15_IRQHandler", TIM15_IRQHandler },
+  [SIM_EXC_IRQ0 + TIM16_IRQn] = { "TIM16_IRQHandler", TIM16_IRQHandler },
+  [SIM_EXC_IRQ0 + TIM17_IRQn] = { "TIM17_IRQHandler", TIM17_IRQHandler },
+  [SIM_EXC_IRQ0 + I2C1_IRQn] = { "I2C1_IRQHandler", I2C1_IRQHandler },
+  [SIM_EXC_IRQ0 + I2C2_IRQn] = { "I2C2_IRQHandler", I2C2_IRQHandler },
+  [SIM_EXC_IRQ0 + SPI1_IRQn] = { "SPI1_IRQHandler", SPI1_IRQHandler },
+  [SIM_EXC_IRQ0 + SPI2_IRQn] = { "SPI2_IRQHandler", SPI2_IRQHandler },
+  [SIM_EXC_IRQ0 + USART1_IRQn] = { "USART1_IRQHandler", USART1_IRQHandler },
+  [SIM_EXC_IRQ0 + USART2_IRQn] = { "USART2_IRQHandler", USART2_IRQHandler },
+  [SIM_EXC_IRQ0 + USART3_4_IRQn] = { "USART3_4_IRQHandler", USART3_4_IRQHandler },
+  [SIM_EXC_IRQ0 + CEC_CAN_IRQn] = { "CEC_CAN_IRQHandler", CEC_CAN_IRQHandler },
+  [SIM_EXC_IRQ0 + USB_IRQn] = { "USB_IRQHandler", USB_IRQHandler },
+};
+
+typedef struct {
+  SIM_Listener fn;
+  void *ctx;
+} SIM_ListenerSlot;
+
+SIM_Stats simStats;
+
+// register file: the firmware reads through regsRO, the models write through regsRW
+static uint8_t *regsRO;
+static uint8_t *regsRW;
+static volatile sig_atomic_t regsOpen;
+static volatile uint32_t dirty[SIM_MAX_DIRTY];
+static volatile sig_atomic_t dirtyCount;
+
+// virtual clock
+static uint64_t now;
+static uint64_t endTime;
+static SIM_Event *events[SIM_MAX_EVENTS];
+static int eventCount;
+
+// NVIC
+static uint32_t nvicEnabled;
+static uint32_t nvicPending;
+static uint8_t excPriority[SIM_EXC_COUNT];
+static uint8_t sysTickPending;
+static uint32_t primask;
+static int activeExc[SIM_MAX_NESTING];
+static int activeDepth;
+static uint8_t hardFaultPending;
+static uint32_t faultFrame[8];   // what the core stacks on the fault, found by __get_MSP
+
+// idle detection
+static volatile sig_atomic_t busy;
+static volatile uint64_t accessCount;
+static uint64_t idleLastAccess;
+static uint64_t idleLastCpu;
+static long idleLastFaults;
+static int idleQuiet;
+static int finishing;
+static int exitStatus;
+
+static SIM_ListenerSlot listeners[SIM_SIGNAL_COUNT][SIM_MAX_LISTENERS];
+
+/*
+ * Host CPU time used by the firmware thread, in nanoseconds
+ */
+static uint64_t SIM_ThreadCpuNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*
+ * Write fault on the read-only register view: remember which register was
+ * written and let the store go through. The write is handed to the
+ * peripheral model at the next access.
+ */
+static void SIM_OnWriteFault(int sig, siginfo_t *info, void *uc) {
+  uint8_t *addr = (uint8_t *)info->si_addr;
+  (void)uc;
+
+  if (addr < regsRO || addr >= regsRO + SIM_REGFILE_SIZE || regsOpen) {
+    // a genuine crash in the firmware or the simulator, let it take the process down
+    signal(sig, SIG_DFL);
+    return;
+  }
+  if (dirtyCount < SIM_MAX_DIRTY) dirty[dirtyCount++] = addr - regsRO;
+  mprotect(regsRO, SIM_REGFILE_SIZE, PROT_READ | PROT_WRITE);
+  regsOpen = 1;
+}
+
+/*
+ * Hand trapped writes to the peripheral models and close the register view
+ */
+static void SIM_FlushWrites(void) {
+  if (!regsOpen) return;
+
+  mprotect(regsRO, SIM_REGFILE_SIZE, PROT_READ);
+  regsOpen = 0;
+
+  for (int i = 0; i < dirtyCount; i++) {
+    uint32_t offset = dirty[i];
+    simStats.writes++;
+    SIM_PeriphWrite((SIM_Periph)(offset / SIM_BLOCK_SIZE), (offset % SIM_BLOCK_SIZE) & ~3u);
+  }
+  dirtyCount = 0;
+}
+
+/*
+ * Page faults taken by the firmware thread. A spin loop never faults, so
+ * CPU time spent faulting in cold code must not count as spinning.
+ */
+static long SIM_ThreadFaults(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_THREAD, &ru);
+  return ru.ru_minflt + ru.ru_majflt;
+}
+
+/*
+ * Idle detector: if the firmware has spun on RAM for a while without touching
+ * a peripheral, nothing can change until the next scheduled event, so jump to it.
+ * It takes two quiet periods in a row, so a single hiccup of the host clock
+ * cannot move simulated time while the firmware is really working.
+ */
+static void SIM_OnIdleTick(int sig) {
+  (void)sig;
+  if (busy || finishing) return;
+
+  uint64_t cpu = SIM_ThreadCpuNs();
+  long faults = SIM_ThreadFaults();
+  // the thread clock can step back slightly on some kernels, treat that as activity
+  if (accessCount != idleLastAccess || faults != idleLastFaults || cpu < idleLastCpu) {
+    idleLastAccess = accessCount;
+    idleLastFaults = faults;
+    idleLastCpu = cpu;
+    idleQuiet = 0;
+    return;
+  }
+  if (cpu - idleLastCpu < SIM_IDLE_CPU_NS) return;
+  idleLastCpu = cpu;
+  if (++idleQuiet < SIM_IDLE_QUIET_TICKS) return;
+
+  idleQuiet = 0;
+  SIM_Idle();
+  idleLastAccess = accessCount;
+}
+
+/*
+ * Map the register file, install the write trap and start the idle detector
+ */
+void SIM_Init(uint64_t runCycles) {
+  int fd = memfd_create("sim-regs", 0);
+  if (fd < 0 || ftruncate(fd, SIM_REGFILE_SIZE) != 0) {
+    perror("sim: register file");
+    exit(2);
+  }
+  regsRW = mmap(NULL, SIM_REGFILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  regsRO = mmap(NULL, SIM_REGFILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (regsRW == MAP_FAILED || regsRO == MAP_FAILED) {
+    perror("sim: register file");
+    exit(2);
+  }
+  close(fd);
+
+  // fault everything in now so cold pages cannot look like a spin later (best effort)
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+
+  endTime = runCycles;
+  // the run's statistics carry on over a reset
+  SIM_Keep(&simStats, sizeof(simStats));
+  for (int i = 0; i < SIM_EXC_COUNT; i++) excPriority[i] = 0;
+  SIM_PeriphReset();
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = SIM_OnWriteFault;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigaction(SIGSEGV, &sa, NULL);
+
+  // handlers run from the idle signal and may spin themselves, so let it nest
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIM_OnIdleTick;
+  sa.sa_flags = SA_RESTART | SA_NODEFER;
+  sigaction(SIGALRM, &sa, NULL);
+
+  timer_t timer;
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_SIGNAL;
+  sev.sigev_signo = SIGALRM;
+  struct itimerspec its = { { 0, SIM_IDLE_TICK_NS }, { 0, SIM_IDLE_TICK_NS } };
+  if (timer_create(CLOCK_MONOTONIC, &sev, &timer) != 0 || timer_settime(timer, 0, &its, NULL) != 0) {
+    perror("sim: idle timer");
+    exit(2);
+  }
+}
+
+/*
+ * Stop the run: notify the listeners and leave with the firmware still "running"
+ */
+void SIM_Finish(void) {
+  if (finishing) return;
+  finishing = 1;
+  busy = 1;
+  SIM_Emit(SIM_ON_FINISH, 0, 0, 0);
+  fflush(NULL);
+  exit(exitStatus);
+}
+
+/*
+ * Exit status of the run, for checks done by the listeners
+ */
+void SIM_SetExitStatus(int status) {
+  exitStatus = status;
+}
+
+uint64_t SIM_Now(void) {
+  return now;
+}
+
+/*
+ * Start the clock where a run before a reset left it, before anything is scheduled
+ */
+void SIM_Resume(uint64_t cycles) {
+  now = cycles;
+}
+
+uint64_t SIM_EndTime(void) {
+  return endTime;
+}
+
+const char *SIM_ExceptionName(int exc) {
+  if (exc < 0 || exc >= SIM_EXC_COUNT || vectors[exc].name == NULL) return "?";
+  return vectors[exc].name;
+}
+
+/*
+ * The sim-side writable view of a peripheral block
+ */
+void *SIM_Regs(SIM_Periph p) {
+  return regsRW + p * SIM_BLOCK_SIZE;
+}
+
+/*
+ * Every peripheral access from the firmware lands here before the load or
+ * store happens. Pending writes are applied, the bus access is charged,
+ * live registers (counters) are refreshed and pending interrupts are taken.
+ */
+void *SIM_Access(SIM_Periph p) {
+  busy++;
+  accessCount++;
+  simStats.accesses++;
+  SIM_FlushWrites();
+  SIM_Emit(SIM_ON_CHARGE, SIM_CHARGE_ACCESS, SIM_ACCESS_CYCLES, 0);
+  SIM_Advance(SIM_ACCESS_CYCLES);
+  SIM_PeriphRefresh(p);
+  busy--;
+  SIM_Dispatch();
+  return regsRO + p * SIM_BLOCK_SIZE;
+}
+
+/*
+ * Charge cycles for firmware work that is not a register access (HAL calls)
+ */
+void SIM_Charge(uint32_t cycles) {
+  busy++;
+  accessCount++;
+  SIM_FlushWrites();
+  SIM_Emit(SIM_ON_CHARGE, SIM_CHARGE_CALL, cycles, 0);
+  SIM_Advance(cycles);
+  busy--;
+  SIM_Dispatch();
+}
+
+/*
+ * Move the clock forward, firing every event that falls inside the window
+ */
+void SIM_Advance(uint64_t cycles) {
+  uint64_t target = now + cycles;
+
+  for (;;) {
+    int next = -1;
+    for (int i = 0; i < eventCount; i++) {
+      if (events[i]->when <= target && (next < 0 || events[i]->when < events[next]->when)) next = i;
+    }
+    if (next < 0) break;
+
+    SIM_Event *e = events[next];
+    events[next] = events[--eventCount];
+    e->armed = 0;
+    if (e->when > now) now = e->when;
+    if (now >= endTime) break;
+    e->fire(e->ctx);
+  }
+
+  if (target > now) now = target;
+  if (now >= endTime) {
+    now = endTime;
+    SIM_Finish();
+  }
+}
+
+/*
+ * Nothing can happen before the next event: skip to it and take its interrupts
+ */
+void SIM_Idle(void) {
+  busy++;
+  SIM_FlushWrites();
+
+  uint64_t next = endTime;
+  for (int i = 0; i < eventCount; i++) {
+    if (events[i]->when < next) next = events[i]->when;
+  }
+  if (next < now) next = now;
+
+  if (activeDepth == 0) simStats.idleCycles += next - now;
+  else simStats.spinCycles += next - now;
+  simStats.idleSkips++;
+  SIM_Emit(SIM_ON_CHARGE, SIM_CHARGE_IDLE, (uint32_t)(next - now), 0);
+
+  SIM_Advance(next - now);
+  busy--;
+  SIM_Dispatch();
+}
+
+/*
+ * Arm (or re-arm) an event at an absolute time
+ */
+void SIM_Schedule(SIM_Event *e, uint64_t when) {
+  if (!e->armed) {
+    if (eventCount >= SIM_MAX_EVENTS) {
+      fprintf(stderr, "sim: event table full\n");
+      exit(2);
+    }
+    events[eventCount++] = e;
+    e->armed = 1;
+  }
+  e->when = when < now ? now : when;
+}
+
+void SIM_Cancel(SIM_Event *e) {
+  if (!e->armed) return;
+  for (int i = 0; i < eventCount; i++) {
+    if (events[i] == e) {
+      events[i] = events[--eventCount];
+      break;
+    }
+  }
+  e->armed = 0;
+}
+
+/*
+ * Priority the CPU is currently running at
+ */
+static uint32_t SIM_CurrentPriority(void) {
+  if (activeDepth == 0) return SIM_THREAD_PRIORITY;
+  return excPriority[activeExc[activeDepth - 1]];
+}
+
+/*
+ * Highest priority exception that is pending and enabled, -1 for none.
+ * Equal priorities resolve to the lowest exception number, as on the M0.
+ */
+static int SIM_NextPending(void) {
+  int best = -1;
+
+  if (sysTickPending) best = SIM_EXC_SYSTICK;
+  for (int irq = 0; irq < 32; irq++) {
+    if (!(nvicEnabled & (1u << irq))) continue;
+    if (!(nvicPending & (1u << irq)) && !SIM_PeriphIrqLine(irq)) continue;
+    int exc = SIM_EXC_IRQ0 + irq;
+    if (best < 0 || excPriority[exc] < excPriority[best]) best = exc;
+  }
+  return best;
+}
+
+/*
+ * Take a raised HardFault. It preempts everything, PRIMASK included, and
+ * the firmware's handler must not return: the startup file's default one
+ * loops forever.
+ */
+static void SIM_TakeHardFault(void) {
+  hardFaultPending = 0;
+  if (vectors[SIM_EXC_HARDFAULT].handler == NULL || activeDepth >= SIM_MAX_NESTING) {
+    fprintf(stderr, "sim: HardFault taken with no handler, firmware would hang\n");
+    SIM_Finish();
+  }
+
+  // the registers are the host's, only the xPSR's exception number means something
+  memset(faultFrame, 0, sizeof(faultFrame));
+  faultFrame[7] = 0x01000000 | (uint32_t)SIM_ActiveException();
+
+  activeExc[activeDepth++] = SIM_EXC_HARDFAULT;
+  SIM_Emit(SIM_ON_IRQ_ENTER, SIM_EXC_HARDFAULT, activeDepth, 0);
+  vectors[SIM_EXC_HARDFAULT].handler();
+  fprintf(stderr, "sim: HardFault_Handler returned, firmware would hang\n");
+  SIM_Finish();
+}
+
+/*
+ * Take every pending interrupt that can preempt the current priority
+ */
+void SIM_Dispatch(void) {
+  if (hardFaultPending && !busy && !finishing) SIM_TakeHardFault();
+  while (!busy && !primask && !finishing) {
+    int exc = SIM_NextPending();
+    if (exc < 0 || excPriority[exc] >= SIM_CurrentPriority()) return;
+    if (activeDepth >= SIM_MAX_NESTING) return;
+
+    if (exc == SIM_EXC_SYSTICK) sysTickPending = 0;
+    else nvicPending &= ~(1u << (exc - SIM_EXC_IRQ0));
+
+    if (vectors[exc].handler == NULL) {
+      // Default_Handler in the startup file loops forever
+      fprintf(stderr, "sim: %s taken with no handler, firmware would hang\n", SIM_ExceptionName(exc));
+      SIM_Finish();
+    }
+
+    uint64_t start = now;
+    activeExc[activeDepth++] = exc;
+    SIM_Emit(SIM_ON_IRQ_ENTER, exc, activeDepth, 0);
+    vectors[exc].handler();
+
+    busy++;
+    SIM_FlushWrites();
+    if (exc >= SIM_EXC_IRQ0) SIM_PeriphIrqReturn(exc - SIM_EXC_IRQ0);
+    busy--;
+
+    uint64_t spent = now - start;
+    simStats.excCount[exc]++;
+    simStats.excCycles[exc] += spent;
+    if (spent > simStats.excMaxCycles[exc]) simStats.excMaxCycles[exc] = spent;
+    SIM_Emit(SIM_ON_IRQ_EXIT, exc, activeDepth, (uint32_t)spent);
+    activeDepth--;
+  }
+}
+
+/*
+ * Exception currently executing, 0 in thread mode
+ */
+int SIM_ActiveException(void) {
+  return activeDepth ? activeExc[activeDepth - 1] : 0;
+}
+
+/*
+ * Fault the instruction running now, taken at the next dispatch
+ */
+void SIM_RaiseHardFault(void) {
+  hardFaultPending = 1;
+}
+
+/*
+ * Main stack pointer, read by the HardFault handler: the frame the fault stacked
+ */
+uintptr_t SIM_GetMsp(void) {
+  return (uintptr_t)faultFrame;
+}
+
+void SIM_SetSysTickPending(void) {
+  sysTickPending = 1;
+}
+
+int SIM_GetSysTickPending(void) {
+  return sysTickPending;
+}
+
+void SIM_DisableIrq(void) {
+  primask = 1;
+}
+
+void SIM_EnableIrq(void) {
+  primask = 0;
+  SIM_Dispatch();
+}
+
+uint32_t SIM_GetPrimask(void) {
+  return primask;
+}
+
+void SIM_SetPrimask(uint32_t mask) {
+  primask = mask & 1;
+  SIM_Dispatch();
+}
+
+/*
+ * CMSIS NVIC functions (see Inc/sim_nvic.h)
+ */
+void SIM_NvicEnableIRQ(IRQn_Type IRQn) {
+  if ((int)IRQn >= 0) nvicEnabled |= 1u << IRQn;
+}
+
+void SIM_NvicDisableIRQ(IRQn_Type IRQn) {
+  if ((int)IRQn >= 0) nvicEnabled &= ~(1u << IRQn);
+}
+
+uint32_t SIM_NvicGetEnableIRQ(IRQn_Type IRQn) {
+  return (int)IRQn >= 0 ? (nvicEnabled >> IRQn) & 1 : 0;
+}
+
+uint32_t SIM_NvicGetPendingIRQ(IRQn_Type IRQn) {
+  if ((int)IRQn < 0) return 0;
+  return ((nvicPending >> IRQn) & 1) | (SIM_PeriphIrqLine(IRQn) ? 1 : 0);
+}
+
+void SIM_NvicSetPendingIRQ(IRQn_Type IRQn) {
+  if ((int)IRQn >= 0) nvicPending |= 1u << IRQn;
+  else if (IRQn == SysTick_IRQn) sysTickPending = 1;
+}
+
+void SIM_NvicClearPendingIRQ(IRQn_Type IRQn) {
+  if ((int)IRQn >= 0) nvicPending &= ~(1u << IRQn);
+  else if (IRQn == SysTick_IRQn) sysTickPending = 0;
+}
+
+void SIM_NvicSetPriority(IRQn_Type IRQn, uint32_t priority) {
+  int exc = SIM_EXC_IRQ0 + (int)IRQn;
+  if (exc < 0 || exc >= SIM_EXC_COUNT) return;
+  // the M0 implements the top two bits of each priority byte
+  excPriority[exc] = (uint8_t)((priority << (8U - __NVIC_PRIO_BITS)) & 0xFF);
+}
+
+uint32_t SIM_NvicGetPriority(IRQn_Type IRQn) {
+  int exc = SIM_EXC_IRQ0 + (int)IRQn;
+  if (exc < 0 || exc >= SIM_EXC_COUNT) return 0;
+  return excPriority[exc] >> (8U - __NVIC_PRIO_BITS);
+}
+
+void SIM_NvicSystemReset(void) {
+  fprintf(stderr, "sim: NVIC_SystemReset at %llu us\n", (unsigned long long)SIM_TO_US(now));
+  SIM_Reboot(RCC_CSR_SFTRSTF);
+}
+
+/*
+ * Observers
+ */
+void SIM_Listen(SIM_Signal sig, SIM_Listener fn, void *ctx) {
+  for (int i = 0; i < SIM_MAX_LISTENERS; i++) {
+    if (listeners[sig][i].fn == NULL) {
+      listeners[sig][i].fn = fn;
+      listeners[sig][i].ctx = ctx;
+      return;
+    }
+  }
+  fprintf(stderr, "sim: too many listeners\n");
+  exit(2);
+}
+
+void SIM_Emit(SIM_Signal sig, uint32_t a, uint32_t b, uint32_t c) {
+  for (int i = 0; i < SIM_MAX_LISTENERS && listeners[sig][i].fn != NULL; i++) {
+    listeners[sig][i].fn(listeners[sig][i].ctx, a, b, c);
+  }
+}
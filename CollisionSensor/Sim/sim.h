@@ -0,0 +1,278 @@
+/*
+ * File: sim.h
+ * Purpose: Declares the host simulator core. The firmware is compiled for
+ *          Linux with Sim/Inc ahead of the CMSIS/HAL include paths, which
+ *          redirects every peripheral struct (USART3, SPI2, TIM2, GPIOC, ...)
+ *          to a simulated register file. Each peripheral access advances a
+ *          virtual 8 MHz clock, runs the device models and dispatches any
+ *          pending interrupt handlers, so main.c, lcd.c, motor.c and
+ *          ultrasonicSensorUart.c run unchanged in simulated time. Flash is
+ *          mapped at its real address for the data the firmware keeps there.
+ */
+#ifndef __SIM_H
+#define __SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SIM_CLOCK_HZ 8000000  // HCLK from SystemClock_Config (HSI, no PLL)
+#define SIM_ACCESS_CYCLES 2   // cycles charged for every peripheral register access
+#define SIM_CALL_CYCLES 12    // cycles charged for a HAL call such as HAL_GetTick
+
+#define SIM_MS(ms) ((uint64_t)(ms) * (SIM_CLOCK_HZ / 1000))
+#define SIM_US(us) ((uint64_t)(us) * (SIM_CLOCK_HZ / 1000000))
+#define SIM_TO_US(cycles) ((cycles) / (SIM_CLOCK_HZ / 1000000))
+
+// Every simulated peripheral owns one 1 KB block of the register file
+typedef enum {
+  SIM_RCC,
+  SIM_GPIOA,
+  SIM_GPIOB,
+  SIM_GPIOC,
+  SIM_TIM2,
+  SIM_TIM3,
+  SIM_USART1,
+  SIM_USART3,
+  SIM_SPI2,
+  SIM_SYSTICK,
+  SIM_SCB,
+  SIM_CRC,
+  SIM_IWDG,
+  SIM_USB,
+  SIM_USBPMA,
+  SIM_CRS,
+  SIM_DMA1,
+  SIM_I2C1,
+  SIM_PERIPH_COUNT
+} SIM_Periph;
+
+// Exception numbers of the core exceptions the simulator dispatches
+#define SIM_EXC_HARDFAULT 3
+#define SIM_EXC_SYSTICK 15
+#define SIM_EXC_IRQ0 16
+#define SIM_EXC_COUNT (SIM_EXC_IRQ0 + 32)
+
+// A one-shot event on the virtual timeline
+typedef struct sim_event {
+  uint64_t when;
+  void (*fire)(void *ctx);
+  void *ctx;
+  uint8_t armed;
+} SIM_Event;
+
+/*
+ * Things that happen in the simulated hardware. Listeners receive three
+ * arguments whose meaning depends on the signal:
+ *   SIM_ON_GPIO      port, old ODR, new ODR
+ *   SIM_ON_PWM       timer | (channel 1-4 << 8), active CCR, ARR + 1
+ *   SIM_ON_UART_TX   uart, byte sent by the MCU, 0
+ *   SIM_ON_UART_RX   uart, byte received by the MCU, 1 if accepted (0 on overrun)
+ *   SIM_ON_SPI_TX    spi, byte shifted out, 0
+ *   SIM_ON_IRQ_ENTER exception number, nesting depth, 0
+ *   SIM_ON_IRQ_EXIT  exception number, nesting depth, cycles spent in the handler
+ *   SIM_ON_CHARGE    SIM_CHARGE_* kind, cycles the clock is about to advance, 0
+ *   SIM_ON_FINISH    0, 0, 0
+ */
+typedef enum {
+  SIM_ON_GPIO,
+  SIM_ON_PWM,
+  SIM_ON_UART_TX,
+  SIM_ON_UART_RX,
+  SIM_ON_SPI_TX,
+  SIM_ON_IRQ_ENTER,
+  SIM_ON_IRQ_EXIT,
+  SIM_ON_CHARGE,
+  SIM_ON_FINISH,
+  SIM_SIGNAL_COUNT
+} SIM_Signal;
+
+// What moved the clock, for SIM_ON_CHARGE
+typedef enum {
+  SIM_CHARGE_ACCESS,   // a peripheral register access
+  SIM_CHARGE_CALL,     // a HAL call
+  SIM_CHARGE_IDLE      // the idle detector skipping to the next event
+} SIM_ChargeKind;
+
+typedef void (*SIM_Listener)(void *ctx, uint32_t a, uint32_t b, uint32_t c);
+
+// Run statistics, printed at the end of every run
+typedef struct {
+  uint64_t accesses;        // peripheral register accesses
+  uint64_t writes;          // trapped register writes
+  uint64_t idleCycles;      // cycles skipped while thread mode spun with nothing to do
+  uint64_t spinCycles;      // cycles skipped while a handler spun waiting for another
+  uint64_t idleSkips;       // number of times the idle detector advanced the clock
+  uint64_t excCount[SIM_EXC_COUNT];
+  uint64_t excCycles[SIM_EXC_COUNT];
+  uint64_t excMaxCycles[SIM_EXC_COUNT];
+} SIM_Stats;
+
+extern SIM_Stats simStats;
+
+// Core setup and run control
+void SIM_Init(uint64_t runCycles);
+void SIM_Finish(void);
+void SIM_SetExitStatus(int status);
+uint64_t SIM_Now(void);
+void SIM_Resume(uint64_t cycles);
+uint64_t SIM_EndTime(void);
+const char *SIM_ExceptionName(int exc);
+
+// Register file
+void *SIM_Access(SIM_Periph p);
+void *SIM_Regs(SIM_Periph p);
+
+// Virtual time
+void SIM_Charge(uint32_t cycles);
+void SIM_Advance(uint64_t cycles);
+void SIM_Idle(void);
+void SIM_Schedule(SIM_Event *e, uint64_t when);
+void SIM_Cancel(SIM_Event *e);
+
+// Interrupts
+void SIM_Dispatch(void);
+int SIM_ActiveException(void);
+void SIM_SetSysTickPending(void);
+int SIM_GetSysTickPending(void);
+void SIM_DisableIrq(void);
+void SIM_EnableIrq(void);
+uint32_t SIM_GetPrimask(void);
+void SIM_SetPrimask(uint32_t primask);
+void SIM_RaiseHardFault(void);
+uintptr_t SIM_GetMsp(void);
+
+// Observers
+void SIM_Listen(SIM_Signal sig, SIM_Listener fn, void *ctx);
+void SIM_Emit(SIM_Signal sig, uint32_t a, uint32_t b, uint32_t c);
+
+// Peripheral models (sim_periph.c)
+void SIM_PeriphReset(void);
+void SIM_PeriphWrite(SIM_Periph p, uint32_t offset);
+void SIM_PeriphRefresh(SIM_Periph p);
+int SIM_PeriphIrqLine(int irq);
+void SIM_PeriphIrqReturn(int irq);
+void SIM_UartInject(SIM_Periph uart, uint8_t byte);
+uint32_t SIM_UartFrameCycles(SIM_Periph uart);
+uint16_t SIM_GpioOutput(SIM_Periph port);
+void SIM_GpioSetInput(SIM_Periph port, uint8_t pin, uint8_t level);
+
+// USB device peripheral and the host at the other end (sim_usb.c)
+void SIM_UsbReset(void);
+void SIM_UsbWrite(uint32_t offset);
+int SIM_UsbIrqLine(void);
+int SIM_UsbAttach(int pty, const char *telemetryPath);
+int SIM_UsbReport(FILE *out);
+
+// Telemetry frames, checked the same for both links (sim_usb.c)
+typedef struct {
+  int lastSequence;         // -1 before the first frame
+  uint32_t frames, missing;
+  FILE *out;                // a line per frame, or NULL
+} SIM_Telemetry;
+
+uint16_t SIM_TelemetryCrc(const uint8_t *p, int length);
+int SIM_TelemetryFrame(SIM_Telemetry *t, const uint8_t *f, int length);
+
+// USART1 telemetry link receiver and command line sender (sim_serial.c)
+int SIM_SerialAttach(const char *telemetryPath);
+int SIM_SerialSend(uint64_t ms, const char *text);
+int SIM_SerialReport(FILE *out);
+
+// I2C1 target peripheral and the host reading the register map (sim_i2c.c)
+void SIM_I2cReset(void);
+void SIM_I2cWrite(uint32_t offset);
+int SIM_I2cIrqLine(void);
+void SIM_I2cIrqReturn(void);
+int SIM_I2cAttach(uint64_t periodMs);
+int SIM_I2cReport(FILE *out);
+
+// Flash memory and the HAL flash calls (sim_flash.c)
+#define SIM_FLASH_BASE 0x08000000
+#define SIM_FLASH_SIZE 0x20000
+
+int SIM_FlashAttach(const char *path);
+void SIM_FlashRestore(const uint8_t *image);
+
+// System reset and fault injection (sim_reset.c)
+#define SIM_MAX_FAULTS 8
+typedef struct {
+  uint32_t resets;          // resets since the run started
+  uint64_t faultAt;         // when the last fault was raised, 0 if the reset had no fault
+  uint64_t resetAt;         // when the last reset happened
+  uint32_t cause;           // RCC_CSR flag of the last reset
+  uint32_t csr;             // reset flags the firmware has not removed, as RCC_CSR shows them
+  uint8_t reason;           // CRASH_RECORD reason the firmware captured before it, 0 if none
+} SIM_ResetStats;
+
+extern SIM_ResetStats simResetStats;
+
+void SIM_ResetArgs(int argc, char **argv);
+void SIM_ResetAddArg(const char *name, const char *value);
+int SIM_ResetResume(int fd);
+void SIM_ResetAttach(const uint64_t *faultsMs, int count);
+void SIM_Keep(void *data, size_t size);
+void SIM_Reboot(uint32_t cause);
+
+// US-100 sensor model (sim_us100.c)
+typedef struct {
+  uint32_t requests;   // 0x55 and 0x50 commands seen
+  uint32_t replies;    // commands answered
+  uint32_t dropouts;   // commands left unanswered on purpose
+  uint32_t queued;     // commands that waited for the previous one to finish
+  uint32_t ignored;    // commands overwritten by a later one while the sensor was busy
+} SIM_Us100Stats;
+
+extern SIM_Us100Stats simUs100Stats;
+
+int SIM_Us100Load(const char *path);
+void SIM_Us100Constant(uint16_t distance, int16_t temperature);
+void SIM_Us100SetSeed(uint64_t seed);
+uint64_t SIM_Us100EndMs(void);
+double SIM_Us100TrueDistance(uint64_t t);
+void SIM_Us100Attach(void);
+
+// PCD8544 LCD model (sim_pcd8544.c)
+typedef struct {
+  uint32_t frames;          // bursts of SPI traffic, one per screen update
+  uint64_t commands;        // command bytes (D/C low)
+  uint64_t data;            // display RAM bytes (D/C high)
+  uint64_t changedPixels;   // visible pixels that changed, summed over frames
+  uint32_t maxFrameBytes;   // largest frame
+  uint32_t ignored;         // bytes sent while the LCD was deselected or in reset
+} SIM_LcdTraffic;
+
+int SIM_LcdAttach(const char *frameDir, const char *logPath);
+int SIM_LcdPixel(int x, int y);
+int SIM_LcdWritePbm(const char *path);
+int SIM_LcdWritePng(const char *path, int scale);
+int SIM_LcdCompare(const char *path);
+void SIM_LcdPrint(FILE *f);
+void SIM_LcdStats(SIM_LcdTraffic *t);
+
+// Record, replay and output digest (sim_record.c)
+void SIM_DigestAttach(void);
+uint64_t SIM_OutputDigest(void);
+int SIM_RecordOpen(const char *path);
+int SIM_CaptureDump(const char *path);
+int SIM_ReplayLoad(const char *path);
+uint64_t SIM_ReplayEnd(void);
+void SIM_ReplayAttach(void);
+
+// Scenario benchmark (sim_bench.c)
+const char *SIM_BenchFork(char **scenarios, int count, const char *jsonPath,
+                          const char *baselinePath, double tolerance, int traced, const char *run);
+void SIM_BenchAttach(uint64_t runCycles);
+
+// Interrupt handler and alert line budgets (sim_wcet.c)
+void SIM_WcetAttach(void);
+int SIM_WcetCheck(FILE *out);
+
+// Virtual-time profiler (sim_profile.c)
+int SIM_ProfileAttach(const char *foldedPath, const char *svgPath);
+
+// Output timing trace and golden comparison (sim_trace.c)
+int SIM_TraceAttach(const char *tracePath, const char *goldenFile, double tolerance);
+int SIM_TraceCheck(FILE *out);
+
+#endif /* __SIM_H */
@@ -0,0 +1,432 @@
+/*
+ * File: sim_bench.c
+ * Purpose: Defines the scenario benchmark. Every scenario runs through the
+ *          full firmware in its own forked simulator, and the run is scored
+ *          against the distance the scenario says is really there:
+ *            - latency from an object crossing a zone boundary to the LEDs
+ *              and the vibration motor showing the new zone
+ *            - crossings the outputs never followed, and false alarms (an
+ *              output more urgent than anything the object did recently)
+ *            - the share of the run the LEDs showed the wrong zone
+ *            - target CPU time per simulated second, from the virtual clock
+ *            - interrupt handlers over their budget in isrProbe.h
+ *            - optionally, LED and motor changes that moved from the
+ *              scenario's golden trace (sim_trace.c)
+ *          The results are written as JSON, one scenario per line, and
+ *          compared with a baseline written by an earlier run. A child that
+ *          resets runs on with --bench-run naming its scenario and the pipe
+ *          for its result, and keeps the outputs it saw before the reset.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sim.h"
+
+#define SIM_BENCH_MAX_CHANGES 4096
+#define SIM_BENCH_STEP_US 100        // resolution of the true zone crossings
+#define SIM_BENCH_GRACE_MS 300       // an output this soon after the object was that close is no false alarm
+#define SIM_BENCH_SLACK_MS 1.0       // latency differences below this are not regressions
+#define SIM_BENCH_SLACK_PCT 0.1      // same for percentages and CPU ms
+
+// Zone boundaries of setLEDs in main.c, closest first
+static const uint16_t zoneLimits[] = { 300, 950, 1900, 3500 };
+
+// LEDs in order of urgency, bit positions in GPIOC ODR
+static const uint8_t zoneLeds[] = { 6, 8, 7, 9 };  // red, orange, blue, green
+
+typedef enum {
+  SIM_BENCH_LED,
+  SIM_BENCH_HAPTIC,
+  SIM_BENCH_CHANNELS
+} SIM_BenchChannel;
+
+typedef struct {
+  uint64_t when;
+  uint8_t level;      // 0 is no warning, higher is more urgent
+} SIM_BenchChange;
+
+typedef struct {
+  SIM_BenchChange truth[SIM_BENCH_MAX_CHANGES];
+  int truthCount;
+  SIM_BenchChange seen[SIM_BENCH_MAX_CHANGES];
+  int seenCount;
+} SIM_BenchTimeline;
+
+typedef struct {
+  char name[64];
+  uint32_t crossings;
+  uint32_t missed;
+  double latencyAvgMs[SIM_BENCH_CHANNELS];
+  double latencyMaxMs[SIM_BENCH_CHANNELS];
+  uint32_t falseAlarms;
+  double falseAlarmsPerMin;
+  double wrongZonePct;
+  double cpuMsPerS;
+  double spinMsPerS;
+  double hostMsPerS;
+  uint32_t wcetOver;
+  int32_t traceDiffs;     // -1 when there is no golden trace to compare with
+} SIM_BenchResult;
+
+static SIM_BenchTimeline timelines[SIM_BENCH_CHANNELS];
+static int resultFd = -1;
+static const char *scenarioName;
+
+/*
+ * LED zone of a distance: 4 red, 3 orange, 2 blue, 1 green, 0 none
+ */
+static uint8_t SIM_BenchZone(double mm) {
+  for (int i = 0; i < 4; i++) {
+    if (mm < zoneLimits[i]) return 4 - i;
+  }
+  return 0;
+}
+
+// The motor runs at 100%, 66% and 33% in the red, orange and blue zones
+static uint8_t SIM_BenchHaptic(uint8_t zone) {
+  return zone > 1 ? zone - 1 : 0;
+}
+
+static void SIM_BenchAdd(SIM_BenchChange *list, int *count, uint8_t level) {
+  uint8_t last = *count ? list[*count - 1].level : 0;
+  if (level == last || *count == SIM_BENCH_MAX_CHANGES) return;
+  list[*count].when = SIM_Now();
+  list[*count].level = level;
+  (*count)++;
+}
+
+static void SIM_BenchOnGpio(void *ctx, uint32_t port, uint32_t old, uint32_t new) {
+  uint8_t zone = 0;
+  (void)ctx;
+  (void)old;
+
+  if (port != SIM_GPIOC) return;
+  // setLEDs turns the new LED on before the old one off, so the most urgent lit LED counts
+  for (int i = 0; i < 4 && zone == 0; i++) {
+    if (new & (1u << zoneLeds[i])) zone = 4 - i;
+  }
+  SIM_BenchAdd(timelines[SIM_BENCH_LED].seen, &timelines[SIM_BENCH_LED].seenCount, zone);
+}
+
+static void SIM_BenchOnPwm(void *ctx, uint32_t channel, uint32_t ccr, uint32_t period) {
+  (void)ctx;
+  (void)channel;
+  SIM_BenchTimeline *t = &timelines[SIM_BENCH_HAPTIC];
+  SIM_BenchAdd(t->seen, &t->seenCount, period ? (uint8_t)lround(3.0 * ccr / period) : 0);
+}
+
+/*
+ * Level a timeline shows at time t
+ */
+static uint8_t SIM_BenchLevelAt(const SIM_BenchChange *list, int count, uint64_t t) {
+  uint8_t level = 0;
+  for (int i = 0; i < count && list[i].when <= t; i++) level = list[i].level;
+  return level;
+}
+
+/*
+ * Score one output against the truth. A crossing is followed when the
+ * output reaches the new level before the truth changes again. A crossing
+ * too close to the end to be followed is not counted.
+ */
+static void SIM_BenchScore(SIM_BenchChannel c, SIM_BenchResult *r, uint64_t end) {
+  const SIM_BenchTimeline *t = &timelines[c];
+  uint64_t latencySum = 0, latencyMax = 0;
+  uint32_t followed = 0;
+
+  for (int i = 0; i < t->truthCount; i++) {
+    uint64_t from = t->truth[i].when;
+    uint64_t until = i + 1 < t->truthCount ? t->truth[i + 1].when : end;
+    uint8_t level = t->truth[i].level;
+    int64_t latency = -1;
+
+    if (SIM_BenchLevelAt(t->seen, t->seenCount, from) == level) latency = 0;
+    for (int j = 0; j < t->seenCount && latency < 0 && t->seen[j].when < until; j++) {
+      if (t->seen[j].when >= from && t->seen[j].level == level) latency = t->seen[j].when - from;
+    }
+    if (latency < 0 && until == end && end - from < SIM_MS(SIM_BENCH_GRACE_MS)) continue;
+    if (c == SIM_BENCH_LED) r->crossings++;
+    if (latency < 0) {
+      if (c == SIM_BENCH_LED) r->missed++;
+      continue;
+    }
+    followed++;
+    latencySum += latency;
+    if ((uint64_t)latency > latencyMax) latencyMax = latency;
+  }
+  r->latencyAvgMs[c] = followed ? SIM_TO_US((double)latencySum / followed) / 1000.0 : 0;
+  r->latencyMaxMs[c] = SIM_TO_US((double)latencyMax) / 1000.0;
+}
+
+/*
+ * False alarms and time in the wrong zone, from the LEDs
+ */
+static void SIM_BenchAccuracy(SIM_BenchResult *r, uint64_t end) {
+  const SIM_BenchTimeline *t = &timelines[SIM_BENCH_LED];
+  uint64_t wrong = 0, at = 0;
+
+  for (int j = 0; j < t->seenCount; j++) {
+    uint64_t when = t->seen[j].when;
+    uint64_t since = when > SIM_MS(SIM_BENCH_GRACE_MS) ? when - SIM_MS(SIM_BENCH_GRACE_MS) : 0;
+    uint8_t closest = SIM_BenchLevelAt(t->truth, t->truthCount, since);
+    for (int i = 0; i < t->truthCount && t->truth[i].when <= when; i++) {
+      if (t->truth[i].when >= since && t->truth[i].level > closest) closest = t->truth[i].level;
+    }
+    if (t->seen[j].level > closest) r->falseAlarms++;
+  }
+
+  // walk both timelines together and add up where they disagree
+  while (at < end) {
+    uint64_t next = end;
+    for (int i = 0; i < t->truthCount; i++) {
+      if (t->truth[i].when > at) {
+        next = t->truth[i].when;
+        break;
+      }
+    }
+    for (int j = 0; j < t->seenCount; j++) {
+      if (t->seen[j].when > at) {
+        if (t->seen[j].when < next) next = t->seen[j].when;
+        break;
+      }
+    }
+    if (next > end) next = end;
+    if (SIM_BenchLevelAt(t->truth, t->truthCount, at) != SIM_BenchLevelAt(t->seen, t->seenCount, at))
+      wrong += next - at;
+    at = next;
+  }
+  r->wrongZonePct = end ? 100.0 * wrong / end : 0;
+  r->falseAlarmsPerMin = end ? r->falseAlarms * 60.0 * SIM_CLOCK_HZ / end : 0;
+}
+
+static void SIM_BenchOnFinish(void *ctx, uint32_t a, uint32_t b, uint32_t c) {
+  SIM_BenchResult r;
+  struct timespec cpu;
+  uint64_t end = SIM_Now();
+  double seconds = (double)end / SIM_CLOCK_HZ;
+  (void)ctx;
+  (void)a;
+  (void)b;
+  (void)c;
+
+  memset(&r, 0, sizeof(r));
+  snprintf(r.name, sizeof(r.name), "%s", scenarioName);
+  SIM_BenchScore(SIM_BENCH_LED, &r, end);
+  SIM_BenchScore(SIM_BENCH_HAPTIC, &r, end);
+  SIM_BenchAccuracy(&r, end);
+  // thread mode only spins in main's empty loop, so the rest is handler time
+  r.cpuMsPerS = seconds > 0 ? (end - simStats.idleCycles) / 8000.0 / seconds : 0;
+  r.spinMsPerS = seconds > 0 ? simStats.spinCycles / 8000.0 / seconds : 0;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  r.hostMsPerS = seconds > 0 ? (cpu.tv_sec * 1e3 + cpu.tv_nsec / 1e6) / seconds : 0;
+  r.wcetOver = SIM_WcetCheck(NULL);
+  r.traceDiffs = SIM_TraceCheck(NULL);
+
+  if (write(resultFd, &r, sizeof(r)) != sizeof(r)) SIM_SetExitStatus(2);
+  close(resultFd);
+}
+
+/*
+ * In a benchmark child: work out where the scenario crosses each zone
+ * boundary and watch the outputs. Called before SIM_Init, the walk takes
+ * long enough for the idle detector to mistake it for a spinning firmware.
+ */
+void SIM_BenchAttach(uint64_t end) {
+  uint8_t zone = 0, haptic = 0;
+
+  for (uint64_t t = 0; t < end; t += SIM_US(SIM_BENCH_STEP_US)) {
+    uint8_t z = SIM_BenchZone(SIM_Us100TrueDistance(t));
+    SIM_BenchTimeline *l = &timelines[SIM_BENCH_LED], *h = &timelines[SIM_BENCH_HAPTIC];
+    if (z != zone && l->truthCount < SIM_BENCH_MAX_CHANGES) l->truth[l->truthCount++] = (SIM_BenchChange){ t, z };
+    if (SIM_BenchHaptic(z) != haptic && h->truthCount < SIM_BENCH_MAX_CHANGES)
+      h->truth[h->truthCount++] = (SIM_BenchChange){ t, SIM_BenchHaptic(z) };
+    zone = z;
+    haptic = SIM_BenchHaptic(z);
+  }
+  SIM_Keep(timelines, sizeof(timelines));
+  SIM_Listen(SIM_ON_GPIO, SIM_BenchOnGpio, NULL);
+  SIM_Listen(SIM_ON_PWM, SIM_BenchOnPwm, NULL);
+  SIM_Listen(SIM_ON_FINISH, SIM_BenchOnFinish, NULL);
+}
+
+static void SIM_BenchWrite(FILE *f, const SIM_BenchResult *r, int last) {
+  fprintf(f, "    { \"name\": \"%s\", \"crossings\": %u, \"missed\": %u, "
+             "\"ledLatencyAvgMs\": %.3f, \"ledLatencyMaxMs\": %.3f, "
+             "\"hapticLatencyAvgMs\": %.3f, \"hapticLatencyMaxMs\": %.3f, "
+             "\"falseAlarms\": %u, \"falseAlarmsPerMin\": %.2f, \"wrongZonePct\": %.2f, "
+             "\"cpuMsPerS\": %.2f, \"spinMsPerS\": %.2f, \"hostMsPerS\": %.1f, \"wcetOver\": %u }%s\n",
+          r->name, (unsigned)r->crossings, (unsigned)r->missed,
+          r->latencyAvgMs[SIM_BENCH_LED], r->latencyMaxMs[SIM_BENCH_LED],
+          r->latencyAvgMs[SIM_BENCH_HAPTIC], r->latencyMaxMs[SIM_BENCH_HAPTIC],
+          (unsigned)r->falseAlarms, r->falseAlarmsPerMin, r->wrongZonePct,
+          r->cpuMsPerS, r->spinMsPerS, r->hostMsPerS, (unsigned)r->wcetOver, last ? "" : ",");
+}
+
+static double SIM_BenchField(const char *line, const char *key) {
+  char quoted[40];
+  snprintf(quoted, sizeof(quoted), "\"%s\": ", key);
+  const char *p = strstr(line, quoted);
+  return p != NULL ? strtod(p + strlen(quoted), NULL) : NAN;
+}
+
+/*
+ * Find a scenario in a baseline written by SIM_BenchWrite, returns 0 if found
+ */
+static int SIM_BenchLoad(const char *path, const char *name, SIM_BenchResult *r) {
+  char line[1024], quoted[80];
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) return -1;
+  snprintf(quoted, sizeof(quoted), "\"name\": \"%s\"", name);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strstr(line, quoted) == NULL) continue;
+    memset(r, 0, sizeof(*r));
+    r->crossings = (uint32_t)SIM_BenchField(line, "crossings");
+    r->missed = (uint32_t)SIM_BenchField(line, "missed");
+    r->latencyAvgMs[SIM_BENCH_LED] = SIM_BenchField(line, "ledLatencyAvgMs");
+    r->latencyMaxMs[SIM_BENCH_LED] = SIM_BenchField(line, "ledLatencyMaxMs");
+    r->latencyAvgMs[SIM_BENCH_HAPTIC] = SIM_BenchField(line, "hapticLatencyAvgMs");
+    r->latencyMaxMs[SIM_BENCH_HAPTIC] = SIM_BenchField(line, "hapticLatencyMaxMs");
+    r->falseAlarms = (uint32_t)SIM_BenchField(line, "falseAlarms");
+    r->wrongZonePct = SIM_BenchField(line, "wrongZonePct");
+    r->cpuMsPerS = SIM_BenchField(line, "cpuMsPerS");
+    r->wcetOver = (uint32_t)SIM_BenchField(line, "wcetOver");
+    fclose(f);
+    return 0;
+  }
+  fclose(f);
+  return -1;
+}
+
+/*
+ * Print one metric against the baseline, returns 1 if it got worse by
+ * more than the tolerance. Lower is better for every metric compared.
+ */
+static int SIM_BenchCompare(const char *metric, double now, double base, double slack, double tolerance) {
+  int worse = now > base * (1.0 + tolerance / 100.0) + slack;
+  int better = now < base * (1.0 - tolerance / 100.0) - slack;
+  printf("  %-20s %10.2f %10.2f%s\n", metric, base, now, worse ? "  REGRESSION" : better ? "  improved" : "");
+  return worse;
+}
+
+/*
+ * Set up a child to run scenarios[index] and write its result to fd
+ */
+static const char *SIM_BenchChild(char **scenarios, int index, int fd) {
+  const char *base = strrchr(scenarios[index], '/');
+
+  // the run's own summary would drown the scores
+  if (freopen("/dev/null", "w", stdout) == NULL) exit(2);
+  resultFd = fd;
+  scenarioName = base != NULL ? base + 1 : scenarios[index];
+  return scenarios[index];
+}
+
+/*
+ * Run every scenario in a child process. Returns the scenario to run in
+ * each child; the parent collects the results, writes them to jsonPath,
+ * compares them with the baseline and exits with 1 on a regression. When
+ * traced, a run that differs from its golden trace counts as one too.
+ * A child executed again by a reset passes its --bench-run as run, and
+ * goes straight back to its scenario.
+ */
+const char *SIM_BenchFork(char **scenarios, int count, const char *jsonPath,
+                          const char *baselinePath, double tolerance, int traced, const char *run) {
+  SIM_BenchResult *results;
+  int failed = 0, regressions = 0, index, fd;
+
+  if (run != NULL) {
+    if (sscanf(run, "%d:%d", &index, &fd) != 2 || index < 0 || index >= count) {
+      fprintf(stderr, "--bench-run %s: no such scenario\n", run);
+      exit(2);
+    }
+    return SIM_BenchChild(scenarios, index, fd);
+  }
+  results = calloc(count, sizeof(SIM_BenchResult));
+  fflush(stdout);
+  for (int i = 0; i < count; i++) {
+    int fds[2], status;
+    if (pipe(fds) != 0) {
+      perror("pipe");
+      exit(2);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      exit(2);
+    }
+    if (pid == 0) {
+      static char runArg[32];
+      close(fds[0]);
+      snprintf(runArg, sizeof(runArg), "%d:%d", i, fds[1]);
+      SIM_ResetAddArg("--bench-run", runArg);
+      return SIM_BenchChild(scenarios, i, fds[1]);
+    }
+    close(fds[1]);
+    ssize_t got = read(fds[0], &results[i], sizeof(SIM_BenchResult));
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+    if (got != sizeof(SIM_BenchResult) || !WIFEXITED(status) || WEXITSTATUS(status) == 2) {
+      fprintf(stderr, "%s: benchmark run failed\n", scenarios[i]);
+      failed = 1;
+    }
+  }
+  if (failed) exit(2);
+
+  FILE *f = fopen(jsonPath, "w");
+  if (f == NULL) {
+    perror(jsonPath);
+    exit(2);
+  }
+  fprintf(f, "{\n  \"scenarios\": [\n");
+  for (int i = 0; i < count; i++) SIM_BenchWrite(f, &results[i], i == count - 1);
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+
+  for (int i = 0; i < count; i++) {
+    const SIM_BenchResult *r = &results[i];
+    SIM_BenchResult base;
+    printf("%s: %u crossings, %u missed, LED latency %.1f ms avg %.1f ms max, "
+           "%u false alarms, wrong zone %.1f%%, CPU %.1f ms/s, %u handlers over budget\n",
+           r->name, (unsigned)r->crossings, (unsigned)r->missed, r->latencyAvgMs[SIM_BENCH_LED],
+           r->latencyMaxMs[SIM_BENCH_LED], (unsigned)r->falseAlarms, r->wrongZonePct, r->cpuMsPerS,
+           (unsigned)r->wcetOver);
+    if (traced) {
+      printf("  %-20s %10s %10d%s\n", "trace differences", "", (int)r->traceDiffs,
+             r->traceDiffs > 0 ? "  REGRESSION" : "");
+      regressions += r->traceDiffs > 0;
+    }
+    if (baselinePath == NULL) continue;
+    if (SIM_BenchLoad(baselinePath, r->name, &base) != 0) {
+      printf("  not in %s\n", baselinePath);
+      continue;
+    }
+    printf("  %-20s %10s %10s\n", "", "baseline", "now");
+    regressions += SIM_BenchCompare("missed", r->missed, base.missed, 0, 0);
+    regressions += SIM_BenchCompare("LED latency avg ms", r->latencyAvgMs[SIM_BENCH_LED],
+                                    base.latencyAvgMs[SIM_BENCH_LED], SIM_BENCH_SLACK_MS, tolerance);
+    regressions += SIM_BenchCompare("LED latency max ms", r->latencyMaxMs[SIM_BENCH_LED],
+                                    base.latencyMaxMs[SIM_BENCH_LED], SIM_BENCH_SLACK_MS, tolerance);
+    regressions += SIM_BenchCompare("motor latency avg ms", r->latencyAvgMs[SIM_BENCH_HAPTIC],
+                                    base.latencyAvgMs[SIM_BENCH_HAPTIC], SIM_BENCH_SLACK_MS, tolerance);
+    regressions += SIM_BenchCompare("motor latency max ms", r->latencyMaxMs[SIM_BENCH_HAPTIC],
+                                    base.latencyMaxMs[SIM_BENCH_HAPTIC], SIM_BENCH_SLACK_MS, tolerance);
+    regressions += SIM_BenchCompare("false alarms", r->falseAlarms, base.falseAlarms, 0, 0);
+    regressions += SIM_BenchCompare("wrong zone %", r->wrongZonePct, base.wrongZonePct,
+                                    SIM_BENCH_SLACK_PCT, tolerance);
+    regressions += SIM_BenchCompare("CPU ms/s", r->cpuMsPerS, base.cpuMsPerS, SIM_BENCH_SLACK_PCT, tolerance);
+    regressions += SIM_BenchCompare("handlers over budget", r->wcetOver, base.wcetOver, 0, 0);
+  }
+  if (baselinePath != NULL) {
+    if (regressions) printf("%d regressions against %s\n", regressions, baselinePath);
+    else printf("no regressions against %s\n", baselinePath);
+  }
+  else if (traced) printf(regressions ? "%d scenarios differ from their golden traces\n"
+                                      : "all scenarios match their golden traces\n", regressions);
+  exit(regressions ? 1 : 0);
+}
@@ -0,0 +1,112 @@
+/*
+ * File: sim_flash.c
+ * Purpose: Defines the flash memory model. The firmware reads the data it
+ *          keeps in flash through plain pointers, so the 128 KB of flash are
+ *          mapped read-only at their real address, 0x08000000. The HAL flash
+ *          calls are replaced like the other HAL functions in sim_hal.c: an
+ *          erase fills a page with 0xFF, a program can only clear bits of an
+ *          erased half-word, and both charge the virtual clock the
+ *          datasheet's longest time. The CPU stalls for that long on the
+ *          board too, since it runs from the flash being written.
+ *
+ *          Backed by a file, the flash keeps what the firmware saved from
+ *          one run to the next.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stm32f0xx_hal.h"
+#include "sim.h"
+
+#define SIM_FLASH_PROGRAM_US 60     // tPROG, 16 bit programming time
+#define SIM_FLASH_ERASE_US 40000    // tERASE, page erase time
+
+static uint8_t *flashRW;
+static uint8_t locked = 1;
+
+/*
+ * Map the flash at its real address, backed by path if not NULL. A new or
+ * short file is filled up with erased pages.
+ */
+int SIM_FlashAttach(const char *path) {
+  int fd = path != NULL ? open(path, O_RDWR | O_CREAT, 0644) : memfd_create("flash", 0);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path != NULL ? path : "flash");
+    return -1;
+  }
+  if (st.st_size < SIM_FLASH_SIZE) {
+    static uint8_t erased[SIM_FLASH_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+    if (pwrite(fd, erased, SIM_FLASH_SIZE - st.st_size, st.st_size) != SIM_FLASH_SIZE - st.st_size) {
+      perror(path != NULL ? path : "flash");
+      close(fd);
+      return -1;
+    }
+  }
+  flashRW = mmap(NULL, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  void *flashRO = mmap((void *)SIM_FLASH_BASE, SIM_FLASH_SIZE, PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+  close(fd);
+  if (flashRW == MAP_FAILED || flashRO != (void *)SIM_FLASH_BASE) {
+    fprintf(stderr, "cannot map the flash at 0x%08x\n", SIM_FLASH_BASE);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Put back what the flash held before a reset, for a flash not backed by a file
+ */
+void SIM_FlashRestore(const uint8_t *image) {
+  memcpy(flashRW, image, SIM_FLASH_SIZE);
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void) {
+  SIM_Charge(SIM_CALL_CYCLES);
+  locked = 0;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void) {
+  SIM_Charge(SIM_CALL_CYCLES);
+  locked = 1;
+  return HAL_OK;
+}
+
+/*
+ * Program 1, 2 or 4 half-words. Like FLASH_SR_PGERR, a half-word that is
+ * not erased can only be programmed with 0.
+ */
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data) {
+  int halfWords = TypeProgram == FLASH_TYPEPROGRAM_HALFWORD ? 1 : TypeProgram == FLASH_TYPEPROGRAM_WORD ? 2 : 4;
+  uint32_t offset = Address - SIM_FLASH_BASE;
+
+  if (locked || (Address & 1) || Address < SIM_FLASH_BASE || offset + 2 * halfWords > SIM_FLASH_SIZE) return HAL_ERROR;
+  for (int i = 0; i < halfWords; i++, Data >>= 16) {
+    uint16_t *cell = (uint16_t *)(flashRW + offset + 2 * i);
+    SIM_Charge(SIM_US(SIM_FLASH_PROGRAM_US));
+    if (*cell != 0xFFFF && (uint16_t)Data != 0) return HAL_ERROR;
+    *cell = (uint16_t)Data;
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError) {
+  uint32_t offset = pEraseInit->PageAddress - SIM_FLASH_BASE;
+
+  *PageError = 0xFFFFFFFF;
+  if (locked || pEraseInit->TypeErase != FLASH_TYPEERASE_PAGES || (offset % FLASH_PAGE_SIZE) ||
+      pEraseInit->PageAddress < SIM_FLASH_BASE || offset + pEraseInit->NbPages * FLASH_PAGE_SIZE > SIM_FLASH_SIZE)
+    return HAL_ERROR;
+  for (uint32_t i = 0; i < pEraseInit->NbPages; i++) {
+    SIM_Charge(SIM_US(SIM_FLASH_ERASE_US));
+    memset(flashRW + offset + i * FLASH_PAGE_SIZE, 0xFF, FLASH_PAGE_SIZE);
+  }
+  return HAL_OK;
+}
@@ -0,0 +1,98 @@
+/*
+ * File: sim_hal.c
+ * Purpose: Host replacements for the few HAL functions the firmware calls.
+ *          The real stm32f0xx_hal.c/_rcc.c talk to the core and clock tree
+ *          directly, so the host build uses these instead. They program the
+ *          simulated SysTick like HAL_InitTick does and charge the virtual
+ *          clock for the time a call takes on the target.
+ */
+#include "stm32f0xx_hal.h"
+#include "sim.h"
+
+__IO uint32_t uwTick;
+uint32_t uwTickPrio = (1UL << __NVIC_PRIO_BITS);
+HAL_TickFreqTypeDef uwTickFreq = HAL_TICK_FREQ_DEFAULT;
+
+/*
+ * Same sequence as the HAL: flash prefetch, 1 ms tick, MSP init
+ */
+HAL_StatusTypeDef HAL_Init(void) {
+  HAL_InitTick(TICK_INT_PRIORITY);
+  HAL_MspInit();
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_InitTick(uint32_t TickPriority) {
+  SysTick->LOAD = (SystemCoreClock / (1000U / uwTickFreq)) - 1;
+  SysTick->VAL = 0;
+  SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+  NVIC_SetPriority(SysTick_IRQn, TickPriority);
+  uwTickPrio = TickPriority;
+  return HAL_OK;
+}
+
+void HAL_IncTick(void) {
+  uwTick += uwTickFreq;
+}
+
+/*
+ * Reading the tick is a function call and a load on the target
+ */
+uint32_t HAL_GetTick(void) {
+  SIM_Charge(SIM_CALL_CYCLES);
+  return uwTick;
+}
+
+uint32_t HAL_GetTickPrio(void) {
+  return uwTickPrio;
+}
+
+void HAL_Delay(uint32_t Delay) {
+  uint32_t tickstart = HAL_GetTick();
+  uint32_t wait = Delay;
+
+  // Add a freq to guarantee minimum wait
+  if (wait < HAL_MAX_DELAY) {
+    wait += (uint32_t)(uwTickFreq);
+  }
+
+  while ((HAL_GetTick() - tickstart) < wait) {
+  }
+}
+
+void HAL_SuspendTick(void) {
+  SysTick->CTRL &= ~SysTick_CTRL_TICKINT_Msk;
+}
+
+void HAL_ResumeTick(void) {
+  SysTick->CTRL |= SysTick_CTRL_TICKINT_Msk;
+}
+
+/*
+ * The simulated clock tree always runs HCLK = PCLK = HSI = 8 MHz, which is
+ * what SystemClock_Config asks for
+ */
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef *RCC_OscInitStruct) {
+  (void)RCC_OscInitStruct;
+  SIM_Charge(SIM_CALL_CYCLES);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef *RCC_ClkInitStruct, uint32_t FLatency) {
+  (void)RCC_ClkInitStruct;
+  (void)FLatency;
+  SIM_Charge(SIM_CALL_CYCLES);
+  return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetSysClockFreq(void) {
+  return SIM_CLOCK_HZ;
+}
+
+uint32_t HAL_RCC_GetHCLKFreq(void) {
+  return SystemCoreClock;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void) {
+  return SystemCoreClock;
+}
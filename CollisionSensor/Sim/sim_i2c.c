@@ -0,0 +1,247 @@
+/*
+ * File: sim_i2c.c
+ * Purpose: Defines the I2C1 peripheral in target mode and the host at the
+ *          other end of the bus, attached with --i2c. The host reads the
+ *          whole register map every period at 400 kHz: the register
+ *          address 0, a repeated start, then every byte of the map, the
+ *          last one not acknowledged. The peripheral stretches the clock
+ *          while ADDR or RXNE is set or TXDR is empty, so the host waits
+ *          for the firmware, as on the board.
+ *
+ *          Every map read is checked like a host would: the id, the CRC and
+ *          a sequence that never goes back. A read during which the
+ *          firmware published a new map is counted, as it is what a torn
+ *          read would come from.
+ */
+#include <stddef.h>
+#include <stdio.h>
+
+#include "stm32f0xx_hal.h"
+#include "i2cTarget.h"
+#include "sim.h"
+
+#define REG(p, type) ((type *)SIM_Regs(p))
+#define SIM_I2C_BIT (SIM_CLOCK_HZ / 400000)   // cycles per SCL period at 400 kHz
+#define SIM_I2C_BYTE (9 * SIM_I2C_BIT)          // 8 bits and the acknowledge
+#define SIM_I2C_ADDRESS 0x2A                    // the board's, as main() sets it
+#define SIM_I2C_MAP ((int)sizeof(TARGET_MAP))
+
+// Where the host is in a read of the map
+typedef enum {
+  SIM_I2C_IDLE,
+  SIM_I2C_ADDRESS_WRITE,  // start and the address to write on the wire
+  SIM_I2C_ADDRESS_HELD,   // ADDR set, the clock held until the firmware clears it
+  SIM_I2C_REGISTER,       // the register address on the wire
+  SIM_I2C_REGISTER_HELD,  // RXNE set, held until the firmware reads RXDR
+  SIM_I2C_ADDRESS_READ,   // repeated start and the address to read on the wire
+  SIM_I2C_READ_HELD,      // ADDR set for the read
+  SIM_I2C_DATA,           // a byte of the map on the wire
+  SIM_I2C_DATA_HELD,      // TXDR empty, held until the firmware writes it
+  SIM_I2C_STOP
+} SIM_I2cState;
+
+static struct {
+  // peripheral
+  uint32_t isr;             // the flags as the model keeps them
+  uint8_t txdr;             // byte waiting in TXDR while TXE is clear
+  uint8_t shift;            // byte on its way to the host
+  // host
+  uint64_t period;          // cycles from one read's start to the next, 0 for back to back
+  SIM_I2cState state;
+  uint64_t start;           // of the read
+  uint8_t holding;          // the clock is held
+  uint64_t held, maxHeld;   // when the clock was last held, and the longest it was
+  uint8_t map[sizeof(TARGET_MAP)];
+  int count;                // bytes of the map read
+  uint32_t published;       // targetStats.published when the read was addressed
+  int64_t lastSequence;     // -1 before the first map
+  uint32_t reads, unanswered, across, bad;
+  SIM_Event step;
+} i2c = { .lastSequence = -1 };
+
+static void SIM_I2cSetIsr(uint32_t set, uint32_t clear) {
+  i2c.isr = (i2c.isr | set) & ~clear;
+  REG(SIM_I2C1, I2C_TypeDef)->ISR = i2c.isr;
+}
+
+void SIM_I2cReset(void) {
+  i2c.isr = 0;
+  SIM_I2cSetIsr(I2C_ISR_TXE, 0);
+}
+
+/*
+ * The clock is held in state until the firmware does what it waits for
+ */
+static void SIM_I2cHold(SIM_I2cState state) {
+  i2c.state = state;
+  i2c.holding = 1;
+  i2c.held = SIM_Now();
+}
+
+/*
+ * The firmware let go of the clock: the host goes on to state, on the wire
+ * for cycles
+ */
+static void SIM_I2cRelease(SIM_I2cState state, uint64_t cycles) {
+  if (i2c.holding && SIM_Now() - i2c.held > i2c.maxHeld) i2c.maxHeld = SIM_Now() - i2c.held;
+  i2c.holding = 0;
+  i2c.state = state;
+  SIM_Schedule(&i2c.step, SIM_Now() + cycles);
+}
+
+/*
+ * TXDR into the shift register, and TXIS to ask for the next byte
+ */
+static void SIM_I2cLoad(void) {
+  i2c.shift = i2c.txdr;
+  SIM_I2cSetIsr(I2C_ISR_TXE | I2C_ISR_TXIS, 0);
+  SIM_I2cRelease(SIM_I2C_DATA, SIM_I2C_BYTE);
+}
+
+/*
+ * A read of the map is over: check it
+ */
+static void SIM_I2cCheck(void) {
+  const TARGET_MAP *map = (const TARGET_MAP *)i2c.map;
+
+  i2c.reads++;
+  if (targetStats.published != i2c.published) i2c.across++;
+  if (map->id != TARGET_ID || map->crc != SIM_TelemetryCrc(i2c.map, offsetof(TARGET_MAP, crc)) ||
+      (int64_t)map->sequence < i2c.lastSequence) {
+    i2c.bad++;
+    printf("%10.3f ms  I2C1 bad map: id %02x sequence %u crc %04x\n", SIM_Now() / 8000.0, map->id,
+           (unsigned)map->sequence, map->crc);
+    return;
+  }
+  i2c.lastSequence = map->sequence;
+}
+
+/*
+ * The bus time of the host's last step is over
+ */
+static void SIM_I2cStep(void *ctx) {
+  I2C_TypeDef *regs = REG(SIM_I2C1, I2C_TypeDef);
+  (void)ctx;
+
+  switch (i2c.state) {
+    case SIM_I2C_IDLE:
+      i2c.start = SIM_Now();
+      i2c.count = 0;
+      i2c.state = SIM_I2C_ADDRESS_WRITE;
+      SIM_Schedule(&i2c.step, SIM_Now() + SIM_I2C_BIT + SIM_I2C_BYTE);
+      break;
+    case SIM_I2C_ADDRESS_WRITE:
+      if (!(regs->CR1 & I2C_CR1_PE) || !(regs->OAR1 & I2C_OAR1_OA1EN) || ((regs->OAR1 >> 1) & 0x7F) != SIM_I2C_ADDRESS) {
+        // not acknowledged: stop and try again next period
+        i2c.unanswered++;
+        i2c.state = SIM_I2C_STOP;
+        SIM_Schedule(&i2c.step, SIM_Now() + SIM_I2C_BIT);
+        break;
+      }
+      SIM_I2cSetIsr(I2C_ISR_ADDR | I2C_ISR_BUSY | (SIM_I2C_ADDRESS << I2C_ISR_ADDCODE_Pos), I2C_ISR_DIR);
+      SIM_I2cHold(SIM_I2C_ADDRESS_HELD);
+      break;
+    case SIM_I2C_REGISTER:
+      regs->RXDR = 0;
+      SIM_I2cSetIsr(I2C_ISR_RXNE, 0);
+      SIM_I2cHold(SIM_I2C_REGISTER_HELD);
+      break;
+    case SIM_I2C_ADDRESS_READ:
+      i2c.published = targetStats.published;
+      SIM_I2cSetIsr(I2C_ISR_ADDR | I2C_ISR_DIR, 0);
+      SIM_I2cHold(SIM_I2C_READ_HELD);
+      break;
+    case SIM_I2C_DATA:
+      i2c.map[i2c.count++] = i2c.shift;
+      if (i2c.count == SIM_I2C_MAP) {
+        // the last byte is not acknowledged, then the stop
+        SIM_I2cSetIsr(I2C_ISR_NACKF, I2C_ISR_TXIS);
+        i2c.state = SIM_I2C_STOP;
+        SIM_Schedule(&i2c.step, SIM_Now() + SIM_I2C_BIT);
+      }
+      else if (!(i2c.isr & I2C_ISR_TXE)) SIM_I2cLoad();
+      else SIM_I2cHold(SIM_I2C_DATA_HELD);
+      break;
+    case SIM_I2C_STOP:
+      if (i2c.count == SIM_I2C_MAP) SIM_I2cCheck();
+      if (i2c.isr & I2C_ISR_BUSY) SIM_I2cSetIsr(I2C_ISR_STOPF, I2C_ISR_BUSY | I2C_ISR_DIR | I2C_ISR_TXIS);
+      i2c.state = SIM_I2C_IDLE;
+      SIM_Schedule(&i2c.step, i2c.start + i2c.period > SIM_Now() ? i2c.start + i2c.period : SIM_Now() + 2 * SIM_I2C_BIT);
+      break;
+    default:
+      break;
+  }
+}
+
+void SIM_I2cWrite(uint32_t offset) {
+  I2C_TypeDef *regs = REG(SIM_I2C1, I2C_TypeDef);
+  uint32_t v;
+
+  switch (offset) {
+    case offsetof(I2C_TypeDef, ISR):
+      // software can only set TXE, which empties TXDR
+      v = regs->ISR;
+      SIM_I2cSetIsr(v & I2C_ISR_TXE, 0);
+      break;
+    case offsetof(I2C_TypeDef, ICR):
+      v = regs->ICR;
+      regs->ICR = 0;
+      SIM_I2cSetIsr(0, v & (I2C_ICR_ADDRCF | I2C_ICR_NACKCF | I2C_ICR_STOPCF | I2C_ICR_BERRCF | I2C_ICR_ARLOCF |
+                            I2C_ICR_OVRCF));
+      if (!(v & I2C_ICR_ADDRCF)) break;
+      if (i2c.state == SIM_I2C_ADDRESS_HELD) SIM_I2cRelease(SIM_I2C_REGISTER, SIM_I2C_BYTE);
+      else if (i2c.state == SIM_I2C_READ_HELD) {
+        // the first byte is wanted at once, or goes if one was left in TXDR
+        if (i2c.isr & I2C_ISR_TXE) {
+          SIM_I2cSetIsr(I2C_ISR_TXIS, 0);
+          i2c.state = SIM_I2C_DATA_HELD;
+        }
+        else SIM_I2cLoad();
+      }
+      break;
+    case offsetof(I2C_TypeDef, TXDR):
+      i2c.txdr = regs->TXDR & 0xFF;
+      SIM_I2cSetIsr(0, I2C_ISR_TXE | I2C_ISR_TXIS);
+      if (i2c.state == SIM_I2C_DATA_HELD) SIM_I2cLoad();
+      break;
+    case offsetof(I2C_TypeDef, CR1):
+      if (!(regs->CR1 & I2C_CR1_PE)) SIM_I2cReset();
+      break;
+  }
+}
+
+int SIM_I2cIrqLine(void) {
+  uint32_t cr1 = REG(SIM_I2C1, I2C_TypeDef)->CR1;
+
+  return ((i2c.isr & I2C_ISR_ADDR) && (cr1 & I2C_CR1_ADDRIE)) || ((i2c.isr & I2C_ISR_RXNE) && (cr1 & I2C_CR1_RXIE)) ||
+         ((i2c.isr & I2C_ISR_TXIS) && (cr1 & I2C_CR1_TXIE)) || ((i2c.isr & I2C_ISR_STOPF) && (cr1 & I2C_CR1_STOPIE)) ||
+         ((i2c.isr & I2C_ISR_NACKF) && (cr1 & I2C_CR1_NACKIE));
+}
+
+/*
+ * The handler returned. The firmware always reads RXDR when RXNE is set,
+ * which is what clears RXNE and lets go of the clock.
+ */
+void SIM_I2cIrqReturn(void) {
+  if (!(i2c.isr & I2C_ISR_RXNE)) return;
+  SIM_I2cSetIsr(0, I2C_ISR_RXNE);
+  if (i2c.state == SIM_I2C_REGISTER_HELD) SIM_I2cRelease(SIM_I2C_ADDRESS_READ, SIM_I2C_BIT + SIM_I2C_BYTE);
+}
+
+int SIM_I2cAttach(uint64_t periodMs) {
+  i2c.period = SIM_MS(periodMs);
+  i2c.step.fire = SIM_I2cStep;
+  SIM_Schedule(&i2c.step, SIM_Now() + (i2c.period ? i2c.period : SIM_I2C_BIT));
+  return 0;
+}
+
+/*
+ * What the host read. Returns 1 if a map was bad or none was read.
+ */
+int SIM_I2cReport(FILE *out) {
+  fprintf(out, "I2C1: %u reads of the %d byte map at 400 kHz, %u while a new map was published, %u bad, "
+               "%u not answered; the clock was held up to %.1f us\n",
+          (unsigned)i2c.reads, SIM_I2C_MAP, (unsigned)i2c.across, (unsigned)i2c.bad, (unsigned)i2c.unanswered,
+          SIM_TO_US((double)i2c.maxHeld));
+  return i2c.bad || i2c.reads == 0;
+}
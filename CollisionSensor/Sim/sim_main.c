@@ -0,0 +1,541 @@
+/*
+ * File: sim_main.c
+ * Purpose: Host entry point of the simulator. The firmware keeps its own
+ *          main(), so the simulator sets itself up from a constructor that
+ *          runs before it: parse the command line, map the register file,
+ *          run SystemInit like the reset handler would, and attach the
+ *          US-100 model (a scenario file or a fixed distance) or a replayed
+ *          recording, and the LCD.
+ *
+ *          The run ends when the virtual clock reaches --time, and a summary
+ *          of the outputs and the interrupt load is printed. With --bench
+ *          the simulator forks one run per scenario and scores them instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stm32f0xx_hal.h"
+#include "eventLog.h"
+#include "scopeCapture.h"
+#include "sampleLog.h"
+#include "sessionStats.h"
+#include "clutterModel.h"
+#include "healthMonitor.h"
+#include "crashLog.h"
+#include "watchdog.h"
+#include "alertLine.h"
+#include "sim.h"
+
+#define SIM_MAX_PRESSES 16
+#define SIM_MAX_SENDS 16       // command lines, as many as sim_serial.c queues
+#define SIM_PRESS_MS 300       // how long the user button is held by default, longer than the time between readings
+
+typedef struct {
+  uint64_t runMs;
+  uint16_t distance;
+  int16_t temperature;
+  const char *scenario;
+  uint64_t seed;
+  int verbose;
+  const char *lcdPng;
+  const char *lcdPbm;
+  const char *lcdFrames;
+  const char *lcdLog;
+  const char *lcdCompare;
+  int lcdShow;
+  const char *record;
+  const char *replay;
+  const char *dumpCapture;
+  const char *bench;
+  const char *baseline;
+  double tolerance;
+  int wcet;
+  int events;
+  int captures;
+  const char *samples;
+  int stats;
+  uint64_t presses[SIM_MAX_PRESSES];   // ms at which the user button is pressed
+  uint64_t holds[SIM_MAX_PRESSES];     // ms it is held for
+  int pressCount;
+  uint64_t faults[SIM_MAX_FAULTS];     // ms at which a HardFault is raised
+  int faultCount;
+  int crashes;
+  int resume;                          // memfd left by a reset, -1 for a run from power-on
+  const char *benchRun;                // a benchmark child executed again by a reset: scenario:pipe
+  const char *profile;
+  const char *flame;
+  const char *flash;
+  const char *trace;
+  const char *golden;
+  double goldenTolerance;
+  int usb;
+  int usbPty;
+  const char *telemetry;
+  int serial;
+  const char *serialTelemetry;
+  const char *sends[SIM_MAX_SENDS];    // command lines for USART1, ms:text
+  int sendCount;
+  int64_t i2c;                         // ms between the I2C host's reads, -1 without one
+} SIM_Options;
+
+typedef struct {
+  SIM_Event event;
+  uint64_t hold;
+  int down;
+} SIM_Press;
+
+static SIM_Options options = { .distance = 1000, .temperature = 25, .tolerance = 5, .goldenTolerance = 1, .resume = -1, .i2c = -1 };
+// Outputs over the whole run, kept over a reset
+static struct {
+  uint32_t pwmCcr, pwmPeriod;
+  uint32_t uartTx, uartRx, uartOverruns, spiBytes;
+} seen;
+static SIM_Press presses[SIM_MAX_PRESSES];
+
+static void SIM_Usage(const char *prog) {
+  printf("usage: %s [--scenario file] [--seed n] [--time ms] [--distance mm] [--temp C] [-v]\n", prog);
+  printf("       %s --bench results.json [--baseline file] [--golden dir] scenario...\n", prog);
+  printf("  --scenario f   script what the US-100 sees (see Sim/scenarios)\n");
+  printf("  --seed n       seed for the sensor noise and dropouts\n");
+  printf("  --time ms      simulated run time (default: the scenario's end, or 10000)\n");
+  printf("  --distance mm  without a scenario, the fixed distance (default 1000)\n");
+  printf("  --temp C       without a scenario, the temperature (default 25)\n");
+  printf("  -v             trace pin, PWM and UART activity\n");
+  printf("  --record f     record the bytes exchanged with the US-100 and the output digest\n");
+  printf("  --replay f     replay a recording instead of the US-100 model, exit 1 if the output differs\n");
+  printf("  --dump-capture f  save the firmware's SENSOR_CAPTURE ring in the recording format\n");
+  printf("  --flash f      keep the flash in f, so what the firmware saves is there the next run\n");
+  printf("  --events       print the firmware's near-miss log at the end of the run\n");
+  printf("  --captures     print the readings the firmware captured around each close call\n");
+  printf("  --samples f    write the readings in the firmware's sample log to f and print its compression\n");
+  printf("  --stats        print the firmware's session, clutter and sensor health statistics at the end of the run\n");
+  printf("  --button ms[:hold]  press the user button (PA0) at this time for hold ms (default %d),\n", SIM_PRESS_MS);
+  printf("                 can be repeated\n");
+  printf("  --fault ms     raise a HardFault at this time and report the recovery, can be repeated\n");
+  printf("  --crashes      print the firmware's crash log at the end of the run\n");
+  printf("  --bench f scn...  run each scenario, score the warnings and write the results to f as JSON\n");
+  printf("  --baseline f   with --bench, compare with earlier results, exit 1 on a regression\n");
+  printf("  --tolerance %%  with --baseline, how much worse a metric may get (default 5)\n");
+  printf("  --wcet         check the interrupt handlers and the alert line's latency against their budgets,\n");
+  printf("                 exit 1 if one is over\n");
+  printf("  --profile f    write the virtual time spent in every firmware call stack as folded stacks\n");
+  printf("  --flame f      write the same profile as a flame graph (SVG)\n");
+  printf("  --trace f      write every LED and motor PWM change with its time\n");
+  printf("  --golden f     compare those changes with a golden trace, exit 1 if they differ;\n");
+  printf("                 with --bench, a directory holding <scenario>.trace for each scenario\n");
+  printf("  --golden-tolerance ms  how far a change may move from the golden one (default 1)\n");
+  printf("  --lcd-png f    save the final screen as a PNG (4x scale)\n");
+  printf("  --lcd-pbm f    save the final screen as a PBM\n");
+  printf("  --lcd-frames d save every screen update as d/frameNNNN.pbm\n");
+  printf("  --lcd-log f    write the bytes sent and pixels changed per update as CSV\n");
+  printf("  --lcd-compare f  compare the final screen with a PBM, exit 1 if it differs\n");
+  printf("  --lcd-show     print the final screen as text\n");
+  printf("  --usb          plug in a USB host that enumerates the board and checks the telemetry frames,\n");
+  printf("                 exit 1 if it does not enumerate or a frame is bad or missing\n");
+  printf("  --usb-pty      with --usb, copy the telemetry stream to a pseudo-terminal\n");
+  printf("  --telemetry f  with --usb, write every telemetry frame decoded to f\n");
+  printf("  --serial       listen to the USART1 telemetry link and check its frames,\n");
+  printf("                 exit 1 if a frame is bad or missing without the firmware dropping it\n");
+  printf("  --serial-telemetry f  with --serial, write every telemetry frame decoded to f\n");
+  printf("  --serial-send ms:line  with --serial, type a command line into USART1 at this time\n");
+  printf("                 (after the one before it), and print the replies\n");
+  printf("  --i2c ms       read the I2C register map every ms (0: back to back) and check every read,\n");
+  printf("                 exit 1 if one is bad or none is read\n");
+}
+
+static void SIM_OnGpio(void *ctx, uint32_t port, uint32_t old, uint32_t new) {
+  (void)ctx;
+  if (options.verbose && port == SIM_GPIOC)
+    printf("%10.3f ms  GPIOC ODR %04x -> %04x\n", SIM_Now() / 8000.0, (unsigned)old, (unsigned)new);
+}
+
+static void SIM_OnPwm(void *ctx, uint32_t channel, uint32_t ccr, uint32_t period) {
+  (void)ctx;
+  seen.pwmCcr = ccr;
+  seen.pwmPeriod = period;
+  if (options.verbose)
+    printf("%10.3f ms  PWM %s CH%u duty %u/%u\n", SIM_Now() / 8000.0,
+           (channel & 0xFF) == SIM_TIM3 ? "TIM3" : "TIM2", (unsigned)(channel >> 8),
+           (unsigned)ccr, (unsigned)period);
+}
+
+static void SIM_OnUartTx(void *ctx, uint32_t uart, uint32_t byte, uint32_t unused) {
+  (void)ctx;
+  (void)unused;
+  if (uart != SIM_USART3) return;
+  seen.uartTx++;
+  if (options.verbose) printf("%10.3f ms  USART3 tx %02x\n", SIM_Now() / 8000.0, (unsigned)byte);
+}
+
+static void SIM_OnUartRx(void *ctx, uint32_t uart, uint32_t byte, uint32_t accepted) {
+  (void)ctx;
+  if (uart != SIM_USART3) return;
+  seen.uartRx++;
+  if (!accepted) seen.uartOverruns++;
+  if (options.verbose)
+    printf("%10.3f ms  USART3 rx %02x%s\n", SIM_Now() / 8000.0, (unsigned)byte, accepted ? "" : " (overrun)");
+}
+
+static void SIM_OnSpiTx(void *ctx, uint32_t spi, uint32_t byte, uint32_t unused) {
+  (void)ctx;
+  (void)spi;
+  (void)byte;
+  (void)unused;
+  seen.spiBytes++;
+}
+
+/*
+ * The near-miss log, read with the firmware's own functions
+ */
+static void SIM_PrintEvents(void) {
+  uint16_t count = EVENTLOG_Count();
+
+  printf("near-miss log: %u events, %u logged and %u dropped this run, %u page erases\n", (unsigned)count,
+         (unsigned)eventLogStats.logged, (unsigned)eventLogStats.dropped, (unsigned)eventLogStats.erases);
+  for (uint16_t i = 0; i < count; i++) {
+    const NEAR_MISS *e = EVENTLOG_Get(i);
+    printf("  session %u at %10.3f s: %s, closest %u mm, closing at %u mm/s, for %u ms\n", (unsigned)e->session,
+           e->timestamp / 1000.0, e->zone == 0 ? "red" : "orange", (unsigned)e->min_distance,
+           (unsigned)e->closing_speed, (unsigned)e->duration);
+  }
+}
+
+/*
+ * The close-call captures, read with the firmware's own functions. The
+ * trigger reading is marked with a '*'.
+ */
+static void SIM_PrintCaptures(void) {
+  uint16_t count = SCOPE_Count();
+
+  printf("captures: %u, %u saved and %u readings skipped this run, %u page erases\n", (unsigned)count,
+         (unsigned)scopeStats.saved, (unsigned)scopeStats.skipped, (unsigned)scopeStats.erases);
+  for (uint16_t i = 0; i < count; i++) {
+    const SCOPE_CAPTURE *c = SCOPE_Get(i);
+    uint16_t samples[SCOPE_SAMPLES];
+    uint8_t n = SCOPE_Samples(c, samples);
+    printf("  session %u at %10.3f s, %u before and %u after:", (unsigned)c->session, c->timestamp / 1000.0,
+           (unsigned)c->pre, (unsigned)c->post);
+    if (n == 0) printf(" does not decode");
+    for (int s = 0; s < n; s++) printf(" %u%s", (unsigned)samples[s], s == c->pre ? "*" : "");
+    printf("\n");
+  }
+}
+
+/*
+ * The sample log's compression this run, and every reading in flash
+ * decoded with the firmware's own functions as "<session> <ms> <mm>"
+ */
+static int SIM_WriteSamples(const char *path) {
+  FILE *f = fopen(path, "w");
+  uint16_t count = SAMPLELOG_Count();
+  uint32_t readings = 0;
+
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  for (uint16_t i = 0; i < count; i++) {
+    const SAMPLE_BLOCK *block = SAMPLELOG_Get(i);
+    SAMPLE_CURSOR cursor;
+    SAMPLE sample;
+    SAMPLELOG_Open(&cursor, block);
+    while (SAMPLELOG_Next(&cursor, &sample)) {
+      fprintf(f, "%u %u %u\n", (unsigned)block->session, (unsigned)sample.timestamp, (unsigned)sample.distance);
+      readings++;
+    }
+  }
+  fclose(f);
+
+  printf("sample log: %u readings coded into %u bytes this run, %.2f:1 against %u bytes per reading\n",
+         (unsigned)sampleLogStats.readings, (unsigned)sampleLogStats.bytes,
+         sampleLogStats.bytes ? (double)sampleLogStats.readings * SAMPLELOG_RAW / sampleLogStats.bytes : 0.0, SAMPLELOG_RAW);
+  printf("  %u blocks programmed, %u readings dropped, %u page erases; %u blocks with %u readings in flash\n",
+         (unsigned)sampleLogStats.blocks, (unsigned)sampleLogStats.dropped, (unsigned)sampleLogStats.erases,
+         (unsigned)count, (unsigned)readings);
+  return 0;
+}
+
+/*
+ * The session statistics as the firmware keeps them, what the clutter model
+ * did with the readings and the sensor's health
+ */
+static void SIM_PrintStats(void) {
+  static const char *zones[SESSION_ZONES] = { "red", "orange", "blue", "green", "none" };
+  static const char *faults[] = { "ok", "no reply", "stuck", "no echo", "erratic" };
+
+  printf("session stats: %u readings in range, %u out of range", (unsigned)sessionStats.count,
+         (unsigned)sessionStats.out_of_range);
+  if (sessionStats.count)
+    printf(", closest %u mm, farthest %u mm, mean %u mm, std dev %u mm", (unsigned)sessionStats.min,
+           (unsigned)sessionStats.max, (unsigned)SESSION_Mean(), (unsigned)SESSION_StdDev());
+  printf("\n  zones:");
+  for (int z = 0; z < SESSION_ZONES; z++)
+    printf(" %s %ux %.1f s%s", zones[z], (unsigned)sessionStats.zone_entries[z], sessionStats.zone_ms[z] / 1000.0,
+           z < SESSION_ZONES - 1 ? "," : "\n");
+  printf("  histogram:");
+  for (int b = 0; b < SESSION_BINS; b++) printf(" %u", (unsigned)sessionStats.histogram[b]);
+  printf(" (per %u mm)\n", SESSION_BIN_MM);
+  printf("clutter: %u readings on background, %u of them coming closer\n", (unsigned)clutterStats.quiet,
+         (unsigned)clutterStats.lifted);
+  printf("sensor health: %u faults, %s at the end\n", (unsigned)healthStatus.faults, faults[healthStatus.fault]);
+  printf("alert line: %u zone changes, %u collision alarms, asserted %u times\n", (unsigned)alertStatus.zone_changes,
+         (unsigned)alertStatus.ttc_alarms, (unsigned)alertStatus.asserted);
+}
+
+/*
+ * The crash log, read with the firmware's own functions
+ */
+static void SIM_PrintCrashes(void) {
+  static const char *const stageNames[WATCHDOG_STAGES] = { "acquire", "warn", "display" };
+  uint16_t count = CRASHLOG_Count();
+
+  printf("crash log: %u crashes\n", (unsigned)count);
+  for (uint16_t i = 0; i < count; i++) {
+    const CRASH_RECORD *c = CRASHLOG_Get(i);
+    if (c->reason == CRASHLOG_WATCHDOG) printf("  session ? at %12s: ", "?");
+    else printf("  session %u at %10.3f s: ", (unsigned)c->session, c->timestamp / 1000.0);
+    if (c->reason >= CRASHLOG_HANG && c->reason < CRASHLOG_HANG + WATCHDOG_STAGES)
+      printf("%s stage hung, ms since check-in: acquire %u warn %u display %u", stageNames[c->reason - CRASHLOG_HANG],
+             (unsigned)c->frame[WATCHDOG_ACQUIRE], (unsigned)c->frame[WATCHDOG_WARN], (unsigned)c->frame[WATCHDOG_DISPLAY]);
+    else if (c->reason == CRASHLOG_WATCHDOG) printf("IWDG reset");
+    else printf("%s in %s, pc %08x lr %08x", c->reason == CRASHLOG_HARDFAULT ? "HardFault" : "Error_Handler",
+                (c->frame[7] & 0x3F) ? SIM_ExceptionName(c->frame[7] & 0x3F) : "thread mode", (unsigned)c->frame[6],
+                (unsigned)c->frame[5]);
+    printf("; warnings back after %.3f ms, readings after %u ms\n", c->restored_us / 1000.0, (unsigned)c->resumed_ms);
+    printf("    last readings:");
+    for (int t = 0; t < c->traced; t++) printf(" %u", (unsigned)c->trace[t]);
+    printf("\n");
+  }
+}
+
+/*
+ * Hold the user button down, then let it go after the press's hold time
+ */
+static void SIM_OnPress(void *ctx) {
+  SIM_Press *press = (SIM_Press *)ctx;
+
+  press->down = !press->down;
+  SIM_GpioSetInput(SIM_GPIOA, 0, press->down);
+  if (press->down) SIM_Schedule(&press->event, SIM_Now() + SIM_MS(press->hold));
+}
+
+/*
+ * End of run summary
+ */
+static void SIM_OnFinish(void *ctx, uint32_t a, uint32_t b, uint32_t c) {
+  uint16_t leds = SIM_GpioOutput(SIM_GPIOC);
+  (void)ctx;
+  (void)a;
+  (void)b;
+  (void)c;
+
+  printf("simulated %.3f ms\n", SIM_Now() / 8000.0);
+  printf("LEDs: red %d blue %d orange %d green %d\n",
+         (leds >> 6) & 1, (leds >> 7) & 1, (leds >> 8) & 1, (leds >> 9) & 1);
+  printf("motor PWM: %u/%u\n", (unsigned)seen.pwmCcr, (unsigned)seen.pwmPeriod);
+  printf("USART3: %u bytes sent, %u received, %u overruns\n",
+         (unsigned)seen.uartTx, (unsigned)seen.uartRx, (unsigned)seen.uartOverruns);
+  printf("US-100: %u requests, %u answered, %u dropped, %u queued and %u lost while busy\n",
+         (unsigned)simUs100Stats.requests, (unsigned)simUs100Stats.replies,
+         (unsigned)simUs100Stats.dropouts, (unsigned)simUs100Stats.queued,
+         (unsigned)simUs100Stats.ignored);
+  printf("SPI2: %u bytes sent\n", (unsigned)seen.spiBytes);
+  SIM_LcdTraffic lcd;
+  SIM_LcdStats(&lcd);
+  printf("LCD: %u updates, %llu command and %llu data bytes, %.1f bytes and %.1f changed pixels per update, largest %u bytes\n",
+         (unsigned)lcd.frames, (unsigned long long)lcd.commands, (unsigned long long)lcd.data,
+         lcd.frames ? (double)(lcd.commands + lcd.data) / lcd.frames : 0.0,
+         lcd.frames ? (double)lcd.changedPixels / lcd.frames : 0.0, (unsigned)lcd.maxFrameBytes);
+  printf("output digest %016llx\n", (unsigned long long)SIM_OutputDigest());
+  printf("register accesses %llu, writes %llu, idle %.1f%%, spinning in handlers %.1f%%\n",
+         (unsigned long long)simStats.accesses, (unsigned long long)simStats.writes,
+         100.0 * simStats.idleCycles / (SIM_Now() ? SIM_Now() : 1),
+         100.0 * simStats.spinCycles / (SIM_Now() ? SIM_Now() : 1));
+  printf("%-24s %10s %12s %12s\n", "exception", "count", "avg us", "max us");
+  for (int i = 0; i < SIM_EXC_COUNT; i++) {
+    if (simStats.excCount[i] == 0) continue;
+    printf("%-24s %10llu %12.1f %12.1f\n", SIM_ExceptionName(i),
+           (unsigned long long)simStats.excCount[i],
+           simStats.excCycles[i] / 8.0 / simStats.excCount[i], simStats.excMaxCycles[i] / 8.0);
+  }
+
+  if (options.wcet) {
+    int over = SIM_WcetCheck(stdout);
+    if (over) {
+      printf("%d handlers over budget\n", over);
+      SIM_SetExitStatus(1);
+    }
+  }
+
+  if (options.usb && SIM_UsbReport(stdout)) SIM_SetExitStatus(1);
+  if (options.serial && SIM_SerialReport(stdout)) SIM_SetExitStatus(1);
+  if (options.i2c >= 0 && SIM_I2cReport(stdout)) SIM_SetExitStatus(1);
+
+  if (options.events) SIM_PrintEvents();
+  if (options.captures) SIM_PrintCaptures();
+  if (options.samples != NULL && SIM_WriteSamples(options.samples) != 0) SIM_SetExitStatus(2);
+  if (options.stats) SIM_PrintStats();
+  if (options.crashes) SIM_PrintCrashes();
+  if (options.dumpCapture != NULL && SIM_CaptureDump(options.dumpCapture) != 0) SIM_SetExitStatus(2);
+  if (options.lcdShow) SIM_LcdPrint(stdout);
+  if (options.lcdPbm != NULL && SIM_LcdWritePbm(options.lcdPbm) != 0) SIM_SetExitStatus(2);
+  if (options.lcdPng != NULL && SIM_LcdWritePng(options.lcdPng, 4) != 0) SIM_SetExitStatus(2);
+  if (options.lcdCompare != NULL) {
+    int diff = SIM_LcdCompare(options.lcdCompare);
+    if (diff < 0) SIM_SetExitStatus(2);
+    else if (diff > 0) {
+      printf("LCD differs from %s in %d pixels\n", options.lcdCompare, diff);
+      SIM_SetExitStatus(1);
+    }
+    else printf("LCD matches %s\n", options.lcdCompare);
+  }
+}
+
+/*
+ * Runs before the firmware's main(): glibc passes the program arguments to
+ * constructors as well
+ */
+__attribute__((constructor)) static void SIM_Main(int argc, char **argv) {
+  char **benchScenarios = calloc(argc, sizeof(char *));
+  int benchCount = 0;
+
+  SIM_ResetArgs(argc, argv);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) options.runMs = strtoull(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) options.scenario = argv[++i];
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) options.seed = strtoull(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "--distance") == 0 && i + 1 < argc) options.distance = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--temp") == 0 && i + 1 < argc) options.temperature = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-v") == 0) options.verbose = 1;
+    else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) options.record = argv[++i];
+    else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) options.replay = argv[++i];
+    else if (strcmp(argv[i], "--dump-capture") == 0 && i + 1 < argc) options.dumpCapture = argv[++i];
+    else if (strcmp(argv[i], "--flash") == 0 && i + 1 < argc) options.flash = argv[++i];
+    else if (strcmp(argv[i], "--wcet") == 0) options.wcet = 1;
+    else if (strcmp(argv[i], "--events") == 0) options.events = 1;
+    else if (strcmp(argv[i], "--captures") == 0) options.captures = 1;
+    else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) options.samples = argv[++i];
+    else if (strcmp(argv[i], "--stats") == 0) options.stats = 1;
+    else if (strcmp(argv[i], "--button") == 0 && i + 1 < argc && options.pressCount < SIM_MAX_PRESSES) {
+      char *hold;
+      options.presses[options.pressCount] = strtoull(argv[++i], &hold, 10);
+      options.holds[options.pressCount++] = *hold == ':' ? strtoull(hold + 1, NULL, 10) : SIM_PRESS_MS;
+    }
+    else if (strcmp(argv[i], "--fault") == 0 && i + 1 < argc && options.faultCount < SIM_MAX_FAULTS)
+      options.faults[options.faultCount++] = strtoull(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--crashes") == 0) options.crashes = 1;
+    else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) options.resume = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--bench-run") == 0 && i + 1 < argc) options.benchRun = argv[++i];
+    else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) options.profile = argv[++i];
+    else if (strcmp(argv[i], "--flame") == 0 && i + 1 < argc) options.flame = argv[++i];
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) options.trace = argv[++i];
+    else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc) options.golden = argv[++i];
+    else if (strcmp(argv[i], "--golden-tolerance") == 0 && i + 1 < argc) options.goldenTolerance = atof(argv[++i]);
+    else if (strcmp(argv[i], "--lcd-png") == 0 && i + 1 < argc) options.lcdPng = argv[++i];
+    else if (strcmp(argv[i], "--lcd-pbm") == 0 && i + 1 < argc) options.lcdPbm = argv[++i];
+    else if (strcmp(argv[i], "--lcd-frames") == 0 && i + 1 < argc) options.lcdFrames = argv[++i];
+    else if (strcmp(argv[i], "--lcd-log") == 0 && i + 1 < argc) options.lcdLog = argv[++i];
+    else if (strcmp(argv[i], "--lcd-compare") == 0 && i + 1 < argc) options.lcdCompare = argv[++i];
+    else if (strcmp(argv[i], "--lcd-show") == 0) options.lcdShow = 1;
+    else if (strcmp(argv[i], "--usb") == 0) options.usb = 1;
+    else if (strcmp(argv[i], "--usb-pty") == 0) options.usb = options.usbPty = 1;
+    else if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc) {
+      options.usb = 1;
+      options.telemetry = argv[++i];
+    }
+    else if (strcmp(argv[i], "--serial") == 0) options.serial = 1;
+    else if (strcmp(argv[i], "--serial-telemetry") == 0 && i + 1 < argc) {
+      options.serial = 1;
+      options.serialTelemetry = argv[++i];
+    }
+    else if (strcmp(argv[i], "--serial-send") == 0 && i + 1 < argc && options.sendCount < SIM_MAX_SENDS &&
+             strchr(argv[i + 1], ':') != NULL) {
+      options.serial = 1;
+      options.sends[options.sendCount++] = argv[++i];
+    }
+    else if (strcmp(argv[i], "--i2c") == 0 && i + 1 < argc) options.i2c = strtoll(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) options.bench = argv[++i];
+    else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) options.baseline = argv[++i];
+    else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) options.tolerance = atof(argv[++i]);
+    else if (argv[i][0] != '-') benchScenarios[benchCount++] = argv[i];
+    else {
+      SIM_Usage(argv[0]);
+      exit(strcmp(argv[i], "--help") == 0 ? 0 : 2);
+    }
+  }
+  if ((benchCount > 0) != (options.bench != NULL)) {
+    SIM_Usage(argv[0]);
+    exit(2);
+  }
+  // the benchmark parent never returns, each child carries on with its scenario
+  if (options.bench != NULL) {
+    options.scenario = SIM_BenchFork(benchScenarios, benchCount, options.bench, options.baseline,
+                                     options.tolerance, options.golden != NULL, options.benchRun);
+    // each scenario's golden trace sits in the directory under the scenario's name
+    if (options.golden != NULL) {
+      static char goldenFile[512];
+      const char *base = strrchr(options.scenario, '/');
+      snprintf(goldenFile, sizeof(goldenFile), "%s/%s", options.golden, base != NULL ? base + 1 : options.scenario);
+      char *dot = strrchr(goldenFile, '.');
+      if (dot != NULL && strcmp(dot, ".scn") == 0) *dot = '\0';
+      strncat(goldenFile, ".trace", sizeof(goldenFile) - strlen(goldenFile) - 1);
+      options.golden = goldenFile;
+    }
+  }
+  setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+  uint64_t runCycles = SIM_MS(options.runMs);
+  if (options.replay != NULL) {
+    if (SIM_ReplayLoad(options.replay) != 0) exit(2);
+    if (runCycles == 0) runCycles = SIM_ReplayEnd();
+  }
+  else if (options.scenario != NULL) {
+    if (SIM_Us100Load(options.scenario) != 0) exit(2);
+  }
+  else SIM_Us100Constant(options.distance, options.temperature);
+  if (options.seed != 0) SIM_Us100SetSeed(options.seed);
+  if (SIM_FlashAttach(options.flash) != 0) exit(2);
+  if (options.resume >= 0 && SIM_ResetResume(options.resume) != 0) exit(2);
+  if (runCycles == 0) runCycles = SIM_MS(SIM_Us100EndMs() ? SIM_Us100EndMs() : 10000);
+
+  if (options.bench != NULL) SIM_BenchAttach(runCycles);
+  if ((options.profile != NULL || options.flame != NULL) && SIM_ProfileAttach(options.profile, options.flame) != 0)
+    exit(2);
+  if ((options.trace != NULL || options.golden != NULL) &&
+      SIM_TraceAttach(options.trace, options.golden, options.goldenTolerance) != 0)
+    exit(2);
+  SIM_Init(runCycles);
+  if (options.replay != NULL) SIM_ReplayAttach();
+  else SIM_Us100Attach();
+  SIM_DigestAttach();
+  SIM_WcetAttach();
+  SIM_Keep(&seen, sizeof(seen));
+  SIM_ResetAttach(options.faults, options.faultCount);
+  if (options.usb && SIM_UsbAttach(options.usbPty, options.telemetry) != 0) exit(2);
+  if (options.serial && SIM_SerialAttach(options.serialTelemetry) != 0) exit(2);
+  if (options.i2c >= 0 && SIM_I2cAttach(options.i2c) != 0) exit(2);
+  for (int s = 0; s < options.sendCount; s++) {
+    char *text;
+    uint64_t ms = strtoull(options.sends[s], &text, 10);
+    if (*text == ':' && SIM_MS(ms) > SIM_Now()) SIM_SerialSend(ms, text + 1);
+  }
+  for (int p = 0; p < options.pressCount; p++) {
+    if (SIM_MS(options.presses[p]) <= SIM_Now()) continue;
+    presses[p].event.fire = SIM_OnPress;
+    presses[p].event.ctx = &presses[p];
+    presses[p].hold = options.holds[p];
+    SIM_Schedule(&presses[p].event, SIM_MS(options.presses[p]));
+  }
+  if (options.record != NULL && SIM_RecordOpen(options.record) != 0) exit(2);
+  if (SIM_LcdAttach(options.lcdFrames, options.lcdLog) != 0) exit(2);
+  SIM_Listen(SIM_ON_GPIO, SIM_OnGpio, NULL);
+  SIM_Listen(SIM_ON_PWM, SIM_OnPwm, NULL);
+  SIM_Listen(SIM_ON_UART_TX, SIM_OnUartTx, NULL);
+  SIM_Listen(SIM_ON_UART_RX, SIM_OnUartRx, NULL);
+  SIM_Listen(SIM_ON_SPI_TX, SIM_OnSpiTx, NULL);
+  SIM_Listen(SIM_ON_FINISH, SIM_OnFinish, NULL);
+
+  // what Reset_Handler does before branching to main
+  SystemInit();
+}
@@ -0,0 +1,402 @@
+/*
+ * File: sim_pcd8544.c
+ * Purpose: Defines a model of the PCD8544 controller in the Nokia 5110 LCD.
+ *          It decodes the SPI2 byte stream together with the D/C, SCE and
+ *          RST pins on GPIOB, runs the basic and extended instruction sets
+ *          (function set, X/Y addressing, display control, Vop, bias and
+ *          temperature coefficient) and keeps the 84x48 display RAM.
+ *
+ *          Traffic is split into frames at every pause in SPI activity, so
+ *          each TIM2 update of the screen is one frame. Every frame records
+ *          how many command and data bytes it took and how many pixels it
+ *          actually changed. Frames can be saved as PBM or PNG images and
+ *          the final screen can be compared with a golden image.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define LCD_WIDTH 84
+#define LCD_HEIGHT 48
+#define LCD_BANKS (LCD_HEIGHT / 8)
+#define LCD_FRAME_GAP_US 2000  // SPI silence that ends a frame
+
+// Nokia 5110 wiring on GPIOB (see README)
+#define LCD_DC_PIN 5
+#define LCD_RST_PIN 6
+#define LCD_SCE_PIN 7
+
+typedef struct {
+  uint8_t ram[LCD_BANKS][LCD_WIDTH];
+  uint8_t shown[LCD_BANKS][LCD_WIDTH];  // visible image at the end of the last frame
+  uint8_t x, y;
+  uint8_t extended;      // H bit of function set
+  uint8_t vertical;      // V bit
+  uint8_t powerDown;     // PD bit
+  uint8_t displayMode;   // D and E bits: 0 blank, 1 all on, 2 normal, 3 inverse
+  uint8_t vop, bias, tempCoef;
+  uint8_t inReset;
+
+  // current frame
+  uint8_t inFrame;
+  uint64_t frameStart;
+  uint32_t frameCommands;
+  uint32_t frameData;
+  SIM_Event frameEnd;
+
+  const char *frameDir;
+  FILE *log;
+  uint32_t frames;
+  uint64_t totalCommands;
+  uint64_t totalData;
+  uint64_t totalChanged;
+  uint32_t maxFrameBytes;
+  uint32_t ignored;      // bytes sent while SCE was high or RST low
+} SIM_Pcd8544;
+
+static SIM_Pcd8544 lcd;
+
+/*
+ * Reset state from the datasheet: powered down, basic instructions,
+ * horizontal addressing, display blank, address 0
+ */
+static void SIM_LcdReset(void) {
+  lcd.x = 0;
+  lcd.y = 0;
+  lcd.extended = 0;
+  lcd.vertical = 0;
+  lcd.powerDown = 1;
+  lcd.displayMode = 0;
+  lcd.vop = 0;
+  lcd.bias = 0;
+  lcd.tempCoef = 0;
+}
+
+/*
+ * Visible pixel, 1 is dark
+ */
+int SIM_LcdPixel(int x, int y) {
+  if (lcd.powerDown) return 0;
+  switch (lcd.displayMode) {
+    case 0: return 0;
+    case 1: return 1;
+    case 2: return (lcd.ram[y / 8][x] >> (y % 8)) & 1;
+    default: return !((lcd.ram[y / 8][x] >> (y % 8)) & 1);
+  }
+}
+
+static void SIM_LcdCommand(uint8_t c) {
+  if ((c & 0xF8) == 0x20) {
+    // function set: 0 0 1 0 0 PD V H
+    lcd.powerDown = (c >> 2) & 1;
+    lcd.vertical = (c >> 1) & 1;
+    lcd.extended = c & 1;
+    return;
+  }
+  if (!lcd.extended) {
+    if (c & 0x80) {
+      if ((c & 0x7F) < LCD_WIDTH) lcd.x = c & 0x7F;
+    }
+    else if ((c & 0xF8) == 0x40) {
+      if ((c & 0x07) < LCD_BANKS) lcd.y = c & 0x07;
+    }
+    else if ((c & 0xFA) == 0x08) {
+      // display control: 0 0 0 0 1 D 0 E
+      lcd.displayMode = ((c >> 1) & 2) | (c & 1);
+    }
+  }
+  else {
+    if (c & 0x80) lcd.vop = c & 0x7F;
+    else if ((c & 0xF8) == 0x10) lcd.bias = c & 0x07;
+    else if ((c & 0xFC) == 0x04) lcd.tempCoef = c & 0x03;
+  }
+}
+
+static void SIM_LcdData(uint8_t d) {
+  lcd.ram[lcd.y][lcd.x] = d;
+  if (lcd.vertical) {
+    if (++lcd.y == LCD_BANKS) {
+      lcd.y = 0;
+      if (++lcd.x == LCD_WIDTH) lcd.x = 0;
+    }
+  }
+  else {
+    if (++lcd.x == LCD_WIDTH) {
+      lcd.x = 0;
+      if (++lcd.y == LCD_BANKS) lcd.y = 0;
+    }
+  }
+}
+
+/*
+ * Writes the visible image as a binary PBM, returns 0 on success
+ */
+int SIM_LcdWritePbm(const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  fprintf(f, "P4\n%d %d\n", LCD_WIDTH, LCD_HEIGHT);
+  for (int y = 0; y < LCD_HEIGHT; y++) {
+    uint8_t row[(LCD_WIDTH + 7) / 8] = { 0 };
+    for (int x = 0; x < LCD_WIDTH; x++) {
+      if (SIM_LcdPixel(x, y)) row[x / 8] |= 0x80 >> (x % 8);
+    }
+    fwrite(row, 1, sizeof(row), f);
+  }
+  fclose(f);
+  return 0;
+}
+
+static uint32_t SIM_Crc32(uint32_t crc, const uint8_t *p, size_t n) {
+  crc = ~crc;
+  while (n--) {
+    crc ^= *p++;
+    for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+  }
+  return ~crc;
+}
+
+static void SIM_PngChunk(FILE *f, const char *type, const uint8_t *data, uint32_t len) {
+  uint8_t be[4] = { len >> 24, len >> 16, len >> 8, len };
+  uint32_t crc = SIM_Crc32(0, (const uint8_t *)type, 4);
+  crc = SIM_Crc32(crc, data, len);
+  fwrite(be, 1, 4, f);
+  fwrite(type, 1, 4, f);
+  fwrite(data, 1, len, f);
+  uint8_t c[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+  fwrite(c, 1, 4, f);
+}
+
+/*
+ * Writes the visible image as an 8 bit greyscale PNG, each LCD pixel a
+ * scale x scale block. The zlib stream uses stored blocks, so no zlib is needed.
+ */
+int SIM_LcdWritePng(const char *path, int scale) {
+  int w = LCD_WIDTH * scale, h = LCD_HEIGHT * scale;
+  size_t rawLen = (size_t)(w + 1) * h;
+  size_t blocks = (rawLen + 65534) / 65535;
+  uint8_t *raw = malloc(rawLen);
+  uint8_t *z = malloc(2 + rawLen + blocks * 5 + 4);
+  FILE *f = fopen(path, "wb");
+
+  if (raw == NULL || z == NULL || f == NULL) {
+    if (f == NULL) perror(path);
+    free(raw);
+    free(z);
+    if (f != NULL) fclose(f);
+    return -1;
+  }
+  for (int y = 0; y < h; y++) {
+    uint8_t *row = raw + (size_t)y * (w + 1);
+    row[0] = 0;  // filter: none
+    for (int x = 0; x < w; x++) row[1 + x] = SIM_LcdPixel(x / scale, y / scale) ? 0x20 : 0xD8;
+  }
+
+  size_t n = 0, done = 0;
+  uint32_t a = 1, b = 0;
+  z[n++] = 0x78;
+  z[n++] = 0x01;
+  while (done < rawLen) {
+    uint32_t len = rawLen - done > 65535 ? 65535 : (uint32_t)(rawLen - done);
+    z[n++] = done + len == rawLen;
+    z[n++] = len & 0xFF;
+    z[n++] = len >> 8;
+    z[n++] = ~len & 0xFF;
+    z[n++] = (~len >> 8) & 0xFF;
+    memcpy(z + n, raw + done, len);
+    n += len;
+    done += len;
+  }
+  for (size_t i = 0; i < rawLen; i++) {
+    a = (a + raw[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  uint32_t adler = (b << 16) | a;
+  z[n++] = adler >> 24;
+  z[n++] = adler >> 16;
+  z[n++] = adler >> 8;
+  z[n++] = adler;
+
+  static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  uint8_t ihdr[13] = { w >> 24, w >> 16, w >> 8, w, h >> 24, h >> 16, h >> 8, h, 8, 0, 0, 0, 0 };
+  fwrite(signature, 1, 8, f);
+  SIM_PngChunk(f, "IHDR", ihdr, sizeof(ihdr));
+  SIM_PngChunk(f, "IDAT", z, (uint32_t)n);
+  SIM_PngChunk(f, "IEND", NULL, 0);
+  fclose(f);
+  free(raw);
+  free(z);
+  return 0;
+}
+
+/*
+ * Compares the visible image with a P4 PBM, returns the number of
+ * differing pixels or -1 if the file cannot be read
+ */
+int SIM_LcdCompare(const char *path) {
+  FILE *f = fopen(path, "rb");
+  int w, h, diff = 0;
+
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  if (fscanf(f, "P4 %d %d", &w, &h) != 2 || w != LCD_WIDTH || h != LCD_HEIGHT || fgetc(f) == EOF) {
+    fprintf(stderr, "%s: not an %dx%d P4 PBM\n", path, LCD_WIDTH, LCD_HEIGHT);
+    fclose(f);
+    return -1;
+  }
+  for (int y = 0; y < LCD_HEIGHT; y++) {
+    uint8_t row[(LCD_WIDTH + 7) / 8];
+    if (fread(row, 1, sizeof(row), f) != sizeof(row)) {
+      fprintf(stderr, "%s: truncated\n", path);
+      fclose(f);
+      return -1;
+    }
+    for (int x = 0; x < LCD_WIDTH; x++) {
+      diff += ((row[x / 8] >> (7 - x % 8)) & 1) != SIM_LcdPixel(x, y);
+    }
+  }
+  fclose(f);
+  return diff;
+}
+
+/*
+ * Prints the screen as text, '#' for a dark pixel
+ */
+void SIM_LcdPrint(FILE *f) {
+  fprintf(f, "+");
+  for (int x = 0; x < LCD_WIDTH; x++) fputc('-', f);
+  fprintf(f, "+\n");
+  for (int y = 0; y < LCD_HEIGHT; y++) {
+    fputc('|', f);
+    for (int x = 0; x < LCD_WIDTH; x++) fputc(SIM_LcdPixel(x, y) ? '#' : ' ', f);
+    fprintf(f, "|\n");
+  }
+  fprintf(f, "+");
+  for (int x = 0; x < LCD_WIDTH; x++) fputc('-', f);
+  fprintf(f, "+\n");
+}
+
+/*
+ * Close the frame: count the pixels it changed and save it
+ */
+static void SIM_LcdEndFrame(void *ctx) {
+  uint32_t changed = 0;
+  (void)ctx;
+
+  if (!lcd.inFrame) return;
+  lcd.inFrame = 0;
+  for (int y = 0; y < LCD_HEIGHT; y++) {
+    for (int x = 0; x < LCD_WIDTH; x++) {
+      uint8_t bit = 1 << (y % 8);
+      uint8_t now = SIM_LcdPixel(x, y) ? bit : 0;
+      if ((lcd.shown[y / 8][x] & bit) != now) {
+        changed++;
+        lcd.shown[y / 8][x] ^= bit;
+      }
+    }
+  }
+  lcd.totalChanged += changed;
+  if (lcd.frameCommands + lcd.frameData > lcd.maxFrameBytes) lcd.maxFrameBytes = lcd.frameCommands + lcd.frameData;
+
+  if (lcd.log != NULL) {
+    fprintf(lcd.log, "%u,%.3f,%.3f,%u,%u,%u\n", (unsigned)lcd.frames,
+            SIM_TO_US(lcd.frameStart) / 1000.0, SIM_TO_US(SIM_Now()) / 1000.0,
+            (unsigned)lcd.frameCommands, (unsigned)lcd.frameData, (unsigned)changed);
+  }
+  if (lcd.frameDir != NULL) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/frame%04u.pbm", lcd.frameDir, (unsigned)lcd.frames);
+    SIM_LcdWritePbm(path);
+  }
+  lcd.frames++;
+}
+
+static void SIM_LcdOnSpi(void *ctx, uint32_t spi, uint32_t byte, uint32_t unused) {
+  uint16_t pins = SIM_GpioOutput(SIM_GPIOB);
+  (void)ctx;
+  (void)unused;
+
+  if (spi != SIM_SPI2) return;
+  if (lcd.inReset || (pins & (1 << LCD_SCE_PIN))) {
+    lcd.ignored++;
+    return;
+  }
+  if (!lcd.inFrame) {
+    lcd.inFrame = 1;
+    lcd.frameStart = SIM_Now();
+    lcd.frameCommands = 0;
+    lcd.frameData = 0;
+  }
+  // D/C is sampled with the last bit of the byte
+  if (pins & (1 << LCD_DC_PIN)) {
+    SIM_LcdData(byte);
+    lcd.frameData++;
+    lcd.totalData++;
+  }
+  else {
+    SIM_LcdCommand(byte);
+    lcd.frameCommands++;
+    lcd.totalCommands++;
+  }
+  SIM_Schedule(&lcd.frameEnd, SIM_Now() + SIM_US(LCD_FRAME_GAP_US));
+}
+
+static void SIM_LcdOnGpio(void *ctx, uint32_t port, uint32_t old, uint32_t new) {
+  (void)ctx;
+  if (port != SIM_GPIOB) return;
+  if (!(new & (1 << LCD_RST_PIN)) && (old & (1 << LCD_RST_PIN))) {
+    SIM_LcdReset();
+    lcd.inReset = 1;
+  }
+  else if ((new & (1 << LCD_RST_PIN)) && !(old & (1 << LCD_RST_PIN))) {
+    lcd.inReset = 0;
+  }
+}
+
+static void SIM_LcdOnFinish(void *ctx, uint32_t a, uint32_t b, uint32_t c) {
+  (void)ctx;
+  (void)a;
+  (void)b;
+  (void)c;
+  SIM_LcdEndFrame(NULL);
+  if (lcd.log != NULL) fclose(lcd.log);
+}
+
+/*
+ * Connect the LCD to SPI2 and GPIOB. frameDir and logPath may be NULL.
+ */
+int SIM_LcdAttach(const char *frameDir, const char *logPath) {
+  SIM_LcdReset();
+  // RST is low until the firmware drives it
+  lcd.inReset = 1;
+  lcd.frameDir = frameDir;
+  lcd.frameEnd.fire = SIM_LcdEndFrame;
+  if (logPath != NULL) {
+    lcd.log = fopen(logPath, "w");
+    if (lcd.log == NULL) {
+      perror(logPath);
+      return -1;
+    }
+    fprintf(lcd.log, "frame,start_ms,end_ms,commands,data,changed_pixels\n");
+  }
+  SIM_Listen(SIM_ON_SPI_TX, SIM_LcdOnSpi, NULL);
+  SIM_Listen(SIM_ON_GPIO, SIM_LcdOnGpio, NULL);
+  // listeners run in order, so this one closes the last frame before the summary
+  SIM_Listen(SIM_ON_FINISH, SIM_LcdOnFinish, NULL);
+  return 0;
+}
+
+void SIM_LcdStats(SIM_LcdTraffic *t) {
+  t->frames = lcd.frames;
+  t->commands = lcd.totalCommands;
+  t->data = lcd.totalData;
+  t->changedPixels = lcd.totalChanged;
+  t->maxFrameBytes = lcd.maxFrameBytes;
+  t->ignored = lcd.ignored;
+}
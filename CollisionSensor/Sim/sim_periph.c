@@ -0,0 +1,731 @@
+/*
+ * File: sim_periph.c
+ * Purpose: Defines the register-level models of the peripherals the firmware
+ *          uses: RCC, GPIOA/B/C, TIM2/TIM3 (time base and PWM), USART1,
+ *          USART3, SPI2, the DMA, SysTick, the SCB interrupt control
+ *          register, the CRC unit and the independent watchdog. I2C1 is
+ *          in sim_i2c.c with the host on its bus. Models only
+ *          see the register file through SIM_Regs, react to trapped writes in
+ *          SIM_PeriphWrite and keep live registers (counters, flags) current
+ *          in SIM_PeriphRefresh.
+ */
+#include <stddef.h>
+#include <stdio.h>
+
+#include "stm32f0xx_hal.h"
+#include "sim.h"
+
+#define REG(p, type) ((type *)SIM_Regs(p))
+#define SIM_LSI_HZ 40000   // typical, the LSI is anywhere from 30 to 50 kHz
+
+typedef struct {
+  SIM_Periph id;
+  int irq;
+  uint32_t counterMask;   // 16 bit timers wrap at 0xFFFF, TIM2 is 32 bit
+  uint8_t running;
+  uint64_t t0;            // time of the last update event (counter = 0)
+  uint32_t psc;           // active prescaler, PSC is only loaded on an update event
+  uint32_t ccr[4];        // active compare values
+  uint32_t sr;            // last status value the model set, for rc_w0 clears
+  SIM_Event update;
+} SIM_Tim;
+
+typedef struct {
+  SIM_Periph id;
+  int irq;
+  uint8_t shifting;
+  uint8_t shiftByte;
+  uint8_t holding;
+  uint8_t holdingByte;
+  SIM_Event frameDone;
+} SIM_Usart;
+
+// A DMA channel's transfer in progress
+typedef struct {
+  uint8_t *memory;        // next byte, CMAR only holds where the transfer started
+  uint16_t left;          // what CNDTR reads
+  uint16_t count;         // CNDTR at the start, for circular mode and the half transfer flag
+  uint8_t enabled;
+} SIM_DmaChannel;
+
+typedef struct {
+  SIM_Periph id;
+  uint8_t fifo[4];
+  uint8_t fifoCount;
+  uint8_t shifting;
+  uint8_t shiftByte;
+  SIM_Event byteDone;
+} SIM_Spi;
+
+static SIM_Tim tim2 = { .id = SIM_TIM2, .irq = TIM2_IRQn, .counterMask = 0xFFFFFFFF };
+static SIM_Tim tim3 = { .id = SIM_TIM3, .irq = TIM3_IRQn, .counterMask = 0xFFFF };
+static SIM_Usart usart1 = { .id = SIM_USART1, .irq = USART1_IRQn };
+static SIM_Usart usart3 = { .id = SIM_USART3, .irq = USART3_4_IRQn };
+static SIM_DmaChannel dmaChannels[7];
+static SIM_Spi spi2 = { .id = SIM_SPI2 };
+static SIM_Event sysTickReload;
+static uint64_t sysTickT0;
+static uint16_t gpioInputs[3];
+static uint32_t crcValue;
+static SIM_Event iwdgTimeout;
+static uint8_t iwdgUnlocked;     // PR and RLR take writes after the 0x5555 key
+static uint32_t iwdgPr, iwdgRlr; // what they hold, a locked write leaves them alone
+
+static void SIM_TimUpdate(void *ctx);
+static void SIM_UsartFrameDone(void *ctx);
+static void SIM_SpiByteDone(void *ctx);
+static void SIM_SysTickReload(void *ctx);
+static void SIM_IwdgTimeout(void *ctx);
+static void SIM_DmaService(void);
+
+static SIM_Tim *SIM_TimOf(SIM_Periph p) {
+  return p == SIM_TIM2 ? &tim2 : p == SIM_TIM3 ? &tim3 : NULL;
+}
+
+/*
+ * Reset values of the registers that matter to the firmware
+ */
+void SIM_PeriphReset(void) {
+  REG(SIM_GPIOA, GPIO_TypeDef)->MODER = 0x28000000;  // PA13/PA14 are SWD
+  REG(SIM_TIM2, TIM_TypeDef)->ARR = 0xFFFFFFFF;
+  REG(SIM_TIM3, TIM_TypeDef)->ARR = 0xFFFF;
+  REG(SIM_USART1, USART_TypeDef)->ISR = USART_ISR_TXE | USART_ISR_TC;
+  REG(SIM_USART3, USART_TypeDef)->ISR = USART_ISR_TXE | USART_ISR_TC;
+  REG(SIM_SPI2, SPI_TypeDef)->SR = SPI_SR_TXE;
+  REG(SIM_SPI2, SPI_TypeDef)->CR2 = 0x0700;   // 8 bit data size
+  REG(SIM_RCC, RCC_TypeDef)->CR = RCC_CR_HSION | RCC_CR_HSIRDY;
+  // after a reset, the flags the firmware left plus the one for that reset
+  REG(SIM_RCC, RCC_TypeDef)->CSR = simResetStats.resets ? simResetStats.csr : RCC_CSR_PORRSTF | RCC_CSR_PINRSTF;
+  REG(SIM_CRC, CRC_TypeDef)->DR = REG(SIM_CRC, CRC_TypeDef)->INIT = crcValue = 0xFFFFFFFF;
+  REG(SIM_CRC, CRC_TypeDef)->POL = 0x04C11DB7;
+  REG(SIM_IWDG, IWDG_TypeDef)->RLR = iwdgRlr = 0xFFF;
+  SIM_UsbReset();
+  SIM_I2cReset();
+
+  tim2.update.fire = SIM_TimUpdate;
+  tim2.update.ctx = &tim2;
+  tim3.update.fire = SIM_TimUpdate;
+  tim3.update.ctx = &tim3;
+  usart1.frameDone.fire = SIM_UsartFrameDone;
+  usart1.frameDone.ctx = &usart1;
+  usart3.frameDone.fire = SIM_UsartFrameDone;
+  usart3.frameDone.ctx = &usart3;
+  spi2.byteDone.fire = SIM_SpiByteDone;
+  spi2.byteDone.ctx = &spi2;
+  sysTickReload.fire = SIM_SysTickReload;
+  iwdgTimeout.fire = SIM_IwdgTimeout;
+}
+
+/*
+ * RCC: RMVF removes the reset flags, HSI48 is ready as soon as it is on
+ */
+static void SIM_RccWrite(uint32_t offset) {
+  RCC_TypeDef *rcc = REG(SIM_RCC, RCC_TypeDef);
+
+  if (offset == offsetof(RCC_TypeDef, CR2)) {
+    if (rcc->CR2 & RCC_CR2_HSI48ON) rcc->CR2 |= RCC_CR2_HSI48RDY;
+    else rcc->CR2 &= ~RCC_CR2_HSI48RDY;
+  }
+
+  if (offset == offsetof(RCC_TypeDef, CSR) && (rcc->CSR & RCC_CSR_RMVF))
+    rcc->CSR &= ~(RCC_CSR_RMVF | RCC_CSR_OBLRSTF | RCC_CSR_PINRSTF | RCC_CSR_PORRSTF | RCC_CSR_SFTRSTF |
+                  RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF | RCC_CSR_LPWRRSTF);
+}
+
+/*
+ * GPIO: apply an output change and tell the listeners
+ */
+static void SIM_GpioSetOdr(SIM_Periph port, uint32_t odr) {
+  GPIO_TypeDef *gpio = REG(port, GPIO_TypeDef);
+  static uint16_t last[3];
+  uint16_t old = last[port - SIM_GPIOA];
+
+  gpio->ODR = odr & 0xFFFF;
+  last[port - SIM_GPIOA] = gpio->ODR;
+  if (old != gpio->ODR) SIM_Emit(SIM_ON_GPIO, port, old, gpio->ODR);
+}
+
+static void SIM_GpioWrite(SIM_Periph port, uint32_t offset) {
+  GPIO_TypeDef *gpio = REG(port, GPIO_TypeDef);
+  uint32_t v;
+
+  switch (offset) {
+    case offsetof(GPIO_TypeDef, BSRR):
+      v = gpio->BSRR;
+      gpio->BSRR = 0;
+      // set wins over reset when both bits are written
+      SIM_GpioSetOdr(port, (gpio->ODR & ~(v >> 16)) | (v & 0xFFFF));
+      break;
+    case offsetof(GPIO_TypeDef, BRR):
+      v = gpio->BRR;
+      gpio->BRR = 0;
+      SIM_GpioSetOdr(port, gpio->ODR & ~(v & 0xFFFF));
+      break;
+    case offsetof(GPIO_TypeDef, ODR):
+      SIM_GpioSetOdr(port, gpio->ODR);
+      break;
+  }
+}
+
+/*
+ * Output pins drive IDR, input pins read the levels set by SIM_GpioSetInput
+ */
+static void SIM_GpioRefresh(SIM_Periph port) {
+  GPIO_TypeDef *gpio = REG(port, GPIO_TypeDef);
+  uint32_t outputs = 0;
+
+  for (int pin = 0; pin < 16; pin++) {
+    if (((gpio->MODER >> (2 * pin)) & 0x3) == 0x1) outputs |= 1u << pin;
+  }
+  gpio->IDR = (gpio->ODR & outputs) | (gpioInputs[port - SIM_GPIOA] & ~outputs);
+}
+
+uint16_t SIM_GpioOutput(SIM_Periph port) {
+  return REG(port, GPIO_TypeDef)->ODR;
+}
+
+void SIM_GpioSetInput(SIM_Periph port, uint8_t pin, uint8_t level) {
+  if (level) gpioInputs[port - SIM_GPIOA] |= 1u << pin;
+  else gpioInputs[port - SIM_GPIOA] &= ~(1u << pin);
+}
+
+/*
+ * Timers: up-counting time base with buffered prescaler and PWM channels
+ */
+static uint64_t SIM_TimPeriod(SIM_Tim *t) {
+  TIM_TypeDef *tim = REG(t->id, TIM_TypeDef);
+  return (uint64_t)((tim->ARR & t->counterMask) + 1) * (t->psc + 1);
+}
+
+static void SIM_TimSetSr(SIM_Tim *t, uint32_t sr) {
+  t->sr = sr;
+  REG(t->id, TIM_TypeDef)->SR = sr;
+}
+
+static void SIM_TimLatchCompare(SIM_Tim *t, int channel, uint32_t value) {
+  TIM_TypeDef *tim = REG(t->id, TIM_TypeDef);
+  if (t->ccr[channel] == value) return;
+  t->ccr[channel] = value;
+  SIM_Emit(SIM_ON_PWM, t->id | ((channel + 1) << 8), value, (tim->ARR & t->counterMask) + 1);
+}
+
+/*
+ * Update event: reload the prescaler and preloaded compares, flag UIF
+ */
+static void SIM_TimUpdate(void *ctx) {
+  SIM_Tim *t = ctx;
+  TIM_TypeDef *tim = REG(t->id, TIM_TypeDef);
+  volatile uint32_t *ccr = &tim->CCR1;
+  uint32_t preload[4] = {
+    tim->CCMR1 & TIM_CCMR1_OC1PE, tim->CCMR1 & TIM_CCMR1_OC2PE,
+    tim->CCMR2 & TIM_CCMR2_OC3PE, tim->CCMR2 & TIM_CCMR2_OC4PE
+  };
+
+  t->t0 = SIM_Now();
+  t->psc = tim->PSC & 0xFFFF;
+  for (int ch = 0; ch < 4; ch++) {
+    if (preload[ch]) SIM_TimLatchCompare(t, ch, ccr[ch]);
+  }
+  if (!(tim->CR1 & TIM_CR1_UDIS)) SIM_TimSetSr(t, t->sr | TIM_SR_UIF);
+  if (t->running) SIM_Schedule(&t->update, t->t0 + SIM_TimPeriod(t));
+}
+
+static void SIM_TimWrite(SIM_Tim *t, uint32_t offset) {
+  TIM_TypeDef *tim = REG(t->id, TIM_TypeDef);
+  volatile uint32_t *ccr = &tim->CCR1;
+  uint32_t count;
+
+  switch (offset) {
+    case offsetof(TIM_TypeDef, CR1):
+      if ((tim->CR1 & TIM_CR1_CEN) && !t->running) {
+        t->running = 1;
+        t->t0 = SIM_Now() - (uint64_t)(tim->CNT & t->counterMask) * (t->psc + 1);
+        SIM_Schedule(&t->update, t->t0 + SIM_TimPeriod(t));
+      }
+      else if (!(tim->CR1 & TIM_CR1_CEN) && t->running) {
+        SIM_PeriphRefresh(t->id);
+        t->running = 0;
+        SIM_Cancel(&t->update);
+      }
+      break;
+    case offsetof(TIM_TypeDef, ARR):
+      // ARR is not preloaded unless ARPE is set
+      if (t->running && !(tim->CR1 & TIM_CR1_ARPE)) {
+        count = (SIM_Now() - t->t0) / (t->psc + 1);
+        if (count > (tim->ARR & t->counterMask)) {
+          // already past the new top: the counter runs on to the wrap
+          SIM_Schedule(&t->update, t->t0 + ((uint64_t)t->counterMask + 1) * (t->psc + 1));
+        }
+        else {
+          SIM_Schedule(&t->update, t->t0 + SIM_TimPeriod(t));
+        }
+      }
+      break;
+    case offsetof(TIM_TypeDef, CNT):
+      t->t0 = SIM_Now() - (uint64_t)(tim->CNT & t->counterMask) * (t->psc + 1);
+      if (t->running) SIM_Schedule(&t->update, t->t0 + SIM_TimPeriod(t));
+      break;
+    case offsetof(TIM_TypeDef, SR):
+      // status flags are rc_w0: writing 1 leaves a flag as it was
+      SIM_TimSetSr(t, t->sr & tim->SR);
+      break;
+    case offsetof(TIM_TypeDef, EGR):
+      if (tim->EGR & TIM_EGR_UG) {
+        tim->EGR = 0;
+        tim->CNT = 0;
+        SIM_Cancel(&t->update);
+        SIM_TimUpdate(t);
+      }
+      break;
+    case offsetof(TIM_TypeDef, CCR1):
+    case offsetof(TIM_TypeDef, CCR2):
+    case offsetof(TIM_TypeDef, CCR3):
+    case offsetof(TIM_TypeDef, CCR4): {
+      int ch = (offset - offsetof(TIM_TypeDef, CCR1)) / 4;
+      uint32_t preload = ch < 2 ? tim->CCMR1 & (TIM_CCMR1_OC1PE << (8 * ch))
+                                : tim->CCMR2 & (TIM_CCMR2_OC3PE << (8 * (ch - 2)));
+      if (!preload) SIM_TimLatchCompare(t, ch, ccr[ch]);
+      break;
+    }
+  }
+}
+
+static void SIM_TimRefresh(SIM_Tim *t) {
+  if (!t->running) return;
+  TIM_TypeDef *tim = REG(t->id, TIM_TypeDef);
+  tim->CNT = ((SIM_Now() - t->t0) / (t->psc + 1)) & t->counterMask;
+  tim->SR = t->sr;
+}
+
+/*
+ * USART: 8N1 frames, one byte of holding register in front of the shifter
+ */
+uint32_t SIM_UartFrameCycles(SIM_Periph uart) {
+  USART_TypeDef *usart = REG(uart, USART_TypeDef);
+  uint32_t brr = usart->BRR & 0xFFFF;
+
+  // 8 times oversampling: BRR[2:0] is USARTDIV[3:1] and a bit is USARTDIV / 2 cycles
+  if (usart->CR1 & USART_CR1_OVER8) {
+    uint32_t usartdiv = (brr & 0xFFF0) | ((brr & 7) << 1);
+    return 5 * (usartdiv ? usartdiv : 2);
+  }
+  return 10 * (brr ? brr : 1);
+}
+
+static SIM_Usart *SIM_UsartOf(SIM_Periph uart) {
+  return uart == SIM_USART1 ? &usart1 : &usart3;
+}
+
+static void SIM_UsartSetIsr(SIM_Usart *u, uint32_t set, uint32_t clear) {
+  USART_TypeDef *usart = REG(u->id, USART_TypeDef);
+  usart->ISR = (usart->ISR | set) & ~clear;
+}
+
+static void SIM_UsartStartFrame(SIM_Usart *u, uint8_t byte) {
+  u->shifting = 1;
+  u->shiftByte = byte;
+  SIM_UsartSetIsr(u, USART_ISR_TXE, USART_ISR_TC);
+  SIM_Schedule(&u->frameDone, SIM_Now() + SIM_UartFrameCycles(u->id));
+  SIM_DmaService();
+}
+
+static void SIM_UsartFrameDone(void *ctx) {
+  SIM_Usart *u = ctx;
+  u->shifting = 0;
+  SIM_Emit(SIM_ON_UART_TX, u->id, u->shiftByte, 0);
+  if (u->holding) {
+    u->holding = 0;
+    SIM_UsartStartFrame(u, u->holdingByte);
+  }
+  else {
+    SIM_UsartSetIsr(u, USART_ISR_TC, 0);
+    SIM_DmaService();
+  }
+}
+
+static void SIM_UsartWrite(SIM_Usart *u, uint32_t offset) {
+  USART_TypeDef *usart = REG(u->id, USART_TypeDef);
+  uint32_t v;
+
+  switch (offset) {
+    case offsetof(USART_TypeDef, TDR):
+      if (!(usart->CR1 & USART_CR1_UE) || !(usart->CR1 & USART_CR1_TE)) break;
+      if (!u->shifting) {
+        SIM_UsartStartFrame(u, usart->TDR & 0xFF);
+      }
+      else {
+        // the byte waits in TDR until the shifter is free
+        u->holding = 1;
+        u->holdingByte = usart->TDR & 0xFF;
+        SIM_UsartSetIsr(u, 0, USART_ISR_TXE);
+      }
+      break;
+    case offsetof(USART_TypeDef, ICR):
+      v = usart->ICR;
+      usart->ICR = 0;
+      SIM_UsartSetIsr(u, 0, v & (USART_ICR_TCCF | USART_ICR_ORECF | USART_ICR_FECF | USART_ICR_NCF | USART_ICR_PECF | USART_ICR_IDLECF));
+      break;
+    case offsetof(USART_TypeDef, RQR):
+      v = usart->RQR;
+      usart->RQR = 0;
+      if (v & USART_RQR_RXFRQ) SIM_UsartSetIsr(u, 0, USART_ISR_RXNE);
+      break;
+    case offsetof(USART_TypeDef, CR3):
+      SIM_DmaService();
+      break;
+  }
+}
+
+/*
+ * A byte arrives on the RX line of a USART, at the current time
+ */
+void SIM_UartInject(SIM_Periph uart, uint8_t byte) {
+  SIM_Usart *u = SIM_UsartOf(uart);
+  USART_TypeDef *usart = REG(u->id, USART_TypeDef);
+
+  if (!(usart->CR1 & USART_CR1_UE) || !(usart->CR1 & USART_CR1_RE)) {
+    SIM_Emit(SIM_ON_UART_RX, u->id, byte, 0);
+    return;
+  }
+  if (usart->ISR & USART_ISR_RXNE) {
+    // the previous byte was never read: overrun, the new byte is lost
+    SIM_UsartSetIsr(u, USART_ISR_ORE, 0);
+    SIM_Emit(SIM_ON_UART_RX, u->id, byte, 0);
+    return;
+  }
+  usart->RDR = byte;
+  SIM_UsartSetIsr(u, USART_ISR_RXNE, 0);
+  SIM_Emit(SIM_ON_UART_RX, u->id, byte, 1);
+  SIM_DmaService();
+}
+
+static int SIM_UsartIrqLine(SIM_Usart *u) {
+  USART_TypeDef *usart = REG(u->id, USART_TypeDef);
+  uint32_t isr = usart->ISR, cr1 = usart->CR1;
+
+  return ((isr & USART_ISR_RXNE) && (cr1 & USART_CR1_RXNEIE)) ||
+         ((isr & USART_ISR_ORE) && (cr1 & USART_CR1_RXNEIE)) ||
+         ((isr & USART_ISR_TXE) && (cr1 & USART_CR1_TXEIE)) ||
+         ((isr & USART_ISR_TC) && (cr1 & USART_CR1_TCIE));
+}
+
+/*
+ * DMA: channel 2 feeds USART1's TDR and channel 3 empties its RDR, the
+ * requests of the F072 without remapping. Bytes only, which is all the
+ * firmware moves.
+ */
+#define SIM_DMA_CHANNEL(ch) ((DMA_Channel_TypeDef *)((uint8_t *)SIM_Regs(SIM_DMA1) + 0x08 + 20 * (ch)))
+
+/*
+ * CMAR holds the low 32 bits of a firmware buffer. The buffers are all in
+ * this program's image, so the high bits are those of any of its variables.
+ */
+static uint8_t *SIM_DmaMemory(uint32_t cmar) {
+  return (uint8_t *)(((uintptr_t)dmaChannels & ~(uintptr_t)0xFFFFFFFF) | cmar);
+}
+
+/*
+ * A byte of channel ch (0 for channel 1) moved: count it and raise the flags
+ */
+static void SIM_DmaDone(int ch) {
+  DMA_TypeDef *dma = REG(SIM_DMA1, DMA_TypeDef);
+  DMA_Channel_TypeDef *c = SIM_DMA_CHANNEL(ch);
+  SIM_DmaChannel *d = &dmaChannels[ch];
+
+  d->left--;
+  if (c->CCR & DMA_CCR_MINC) d->memory++;
+  if (d->left == d->count / 2) dma->ISR |= (DMA_ISR_GIF1 | DMA_ISR_HTIF1) << (4 * ch);
+  if (d->left == 0) {
+    dma->ISR |= (DMA_ISR_GIF1 | DMA_ISR_TCIF1) << (4 * ch);
+    if (c->CCR & DMA_CCR_CIRC) {
+      d->left = d->count;
+      d->memory = SIM_DmaMemory(c->CMAR);
+    }
+  }
+  c->CNDTR = d->left;
+}
+
+/*
+ * Serve the requests: a byte into USART1's TDR for as long as it is empty,
+ * and the byte in its RDR out
+ */
+static void SIM_DmaService(void) {
+  DMA_Channel_TypeDef *c = SIM_DMA_CHANNEL(1), *rx = SIM_DMA_CHANNEL(2);
+  SIM_DmaChannel *d = &dmaChannels[1], *r = &dmaChannels[2];
+  USART_TypeDef *usart = REG(SIM_USART1, USART_TypeDef);
+
+  while (d->enabled && d->left && (c->CCR & DMA_CCR_DIR) && (usart->CR3 & USART_CR3_DMAT) &&
+         (usart->ISR & USART_ISR_TXE) && (usart->CR1 & USART_CR1_UE) && (usart->CR1 & USART_CR1_TE)) {
+    usart->TDR = *d->memory;
+    SIM_DmaDone(1);
+    SIM_UsartWrite(&usart1, offsetof(USART_TypeDef, TDR));
+  }
+  if (r->enabled && r->left && !(rx->CCR & DMA_CCR_DIR) && (usart->CR3 & USART_CR3_DMAR) &&
+      (usart->ISR & USART_ISR_RXNE)) {
+    *r->memory = usart->RDR;
+    SIM_UsartSetIsr(&usart1, 0, USART_ISR_RXNE);
+    SIM_DmaDone(2);
+  }
+}
+
+static void SIM_DmaWrite(uint32_t offset) {
+  DMA_TypeDef *dma = REG(SIM_DMA1, DMA_TypeDef);
+
+  if (offset == offsetof(DMA_TypeDef, IFCR)) {
+    uint32_t clear = dma->IFCR;
+    // a channel's global flag clears all four of its flags
+    for (int ch = 0; ch < 7; ch++) {
+      if (clear & (DMA_IFCR_CGIF1 << (4 * ch))) clear |= 0xF << (4 * ch);
+    }
+    dma->ISR &= ~clear;
+    dma->IFCR = 0;
+    return;
+  }
+  // of a channel's registers only CCR does anything: EN starts the transfer CNDTR and CMAR set up
+  if (offset < 0x08 || (offset - 0x08) % 20 != 0 || (offset - 0x08) / 20 >= 7) return;
+  int ch = (offset - 0x08) / 20;
+  DMA_Channel_TypeDef *c = SIM_DMA_CHANNEL(ch);
+  SIM_DmaChannel *d = &dmaChannels[ch];
+  if ((c->CCR & DMA_CCR_EN) && !d->enabled) {
+    d->memory = SIM_DmaMemory(c->CMAR);
+    d->left = d->count = c->CNDTR & 0xFFFF;
+  }
+  d->enabled = (c->CCR & DMA_CCR_EN) != 0;
+  SIM_DmaService();
+}
+
+static int SIM_DmaIrqLine(int ch) {
+  uint32_t isr = REG(SIM_DMA1, DMA_TypeDef)->ISR >> (4 * ch), ccr = SIM_DMA_CHANNEL(ch)->CCR;
+
+  return ((isr & DMA_ISR_TCIF1) && (ccr & DMA_CCR_TCIE)) || ((isr & DMA_ISR_HTIF1) && (ccr & DMA_CCR_HTIE)) ||
+         ((isr & DMA_ISR_TEIF1) && (ccr & DMA_CCR_TEIE));
+}
+
+/*
+ * SPI: master transmit through the 4 byte TX FIFO
+ */
+static void SIM_SpiUpdateSr(SIM_Spi *s) {
+  SPI_TypeDef *spi = REG(s->id, SPI_TypeDef);
+  uint32_t sr = spi->SR & ~(SPI_SR_TXE | SPI_SR_BSY | SPI_SR_FTLVL);
+
+  if (s->fifoCount <= 2) sr |= SPI_SR_TXE;  // TXE while the FIFO is at most half full
+  if (s->shifting || s->fifoCount) sr |= SPI_SR_BSY;
+  sr |= (uint32_t)(s->fifoCount > 3 ? 3 : s->fifoCount) << SPI_SR_FTLVL_Pos;
+  spi->SR = sr;
+}
+
+static void SIM_SpiStartByte(SIM_Spi *s) {
+  SPI_TypeDef *spi = REG(s->id, SPI_TypeDef);
+  uint32_t br = (spi->CR1 & SPI_CR1_BR_Msk) >> SPI_CR1_BR_Pos;
+
+  s->shifting = 1;
+  s->shiftByte = s->fifo[0];
+  for (int i = 1; i < s->fifoCount; i++) s->fifo[i - 1] = s->fifo[i];
+  s->fifoCount--;
+  // SCK is PCLK / 2^(BR+1)
+  SIM_Schedule(&s->byteDone, SIM_Now() + 8 * (2u << br));
+}
+
+static void SIM_SpiByteDone(void *ctx) {
+  SIM_Spi *s = ctx;
+  s->shifting = 0;
+  SIM_Emit(SIM_ON_SPI_TX, s->id, s->shiftByte, 0);
+  if (s->fifoCount) SIM_SpiStartByte(s);
+  SIM_SpiUpdateSr(s);
+}
+
+static void SIM_SpiWrite(SIM_Spi *s, uint32_t offset) {
+  SPI_TypeDef *spi = REG(s->id, SPI_TypeDef);
+
+  if (offset != offsetof(SPI_TypeDef, DR)) return;
+  if (!(spi->CR1 & SPI_CR1_SPE)) return;
+  if (s->fifoCount < 4) s->fifo[s->fifoCount++] = spi->DR & 0xFF;
+  if (!s->shifting) SIM_SpiStartByte(s);
+  SIM_SpiUpdateSr(s);
+}
+
+/*
+ * SysTick: 24 bit down counter on HCLK
+ */
+static void SIM_SysTickReload(void *ctx) {
+  SysTick_Type *st = REG(SIM_SYSTICK, SysTick_Type);
+  (void)ctx;
+
+  sysTickT0 = SIM_Now();
+  st->CTRL |= SysTick_CTRL_COUNTFLAG_Msk;
+  if (st->CTRL & SysTick_CTRL_TICKINT_Msk) SIM_SetSysTickPending();
+  SIM_Schedule(&sysTickReload, sysTickT0 + (st->LOAD & 0xFFFFFF) + 1);
+}
+
+static void SIM_SysTickWrite(uint32_t offset) {
+  SysTick_Type *st = REG(SIM_SYSTICK, SysTick_Type);
+
+  switch (offset) {
+    case offsetof(SysTick_Type, CTRL):
+    case offsetof(SysTick_Type, VAL):
+      // writing VAL clears the counter, it reloads on the next clock
+      st->VAL = 0;
+      sysTickT0 = SIM_Now();
+      if (st->CTRL & SysTick_CTRL_ENABLE_Msk) SIM_Schedule(&sysTickReload, sysTickT0 + (st->LOAD & 0xFFFFFF) + 1);
+      else SIM_Cancel(&sysTickReload);
+      break;
+  }
+}
+
+static void SIM_SysTickRefresh(void) {
+  SysTick_Type *st = REG(SIM_SYSTICK, SysTick_Type);
+  if (!(st->CTRL & SysTick_CTRL_ENABLE_Msk)) return;
+  uint32_t load = (st->LOAD & 0xFFFFFF) + 1;
+  st->VAL = load - 1 - (uint32_t)((SIM_Now() - sysTickT0) % load);
+}
+
+/*
+ * CRC: one 32 bit word per write to DR, in the reset configuration (CRC-32
+ * polynomial, no bit reversal); the POLYSIZE and REV bits are not modelled
+ */
+static void SIM_CrcWrite(uint32_t offset) {
+  CRC_TypeDef *crc = REG(SIM_CRC, CRC_TypeDef);
+
+  switch (offset) {
+    case offsetof(CRC_TypeDef, DR):
+      crcValue ^= crc->DR;
+      for (int i = 0; i < 32; i++) crcValue = (crcValue << 1) ^ (crcValue & 0x80000000 ? crc->POL : 0);
+      crc->DR = crcValue;
+      break;
+    case offsetof(CRC_TypeDef, CR):
+      if (crc->CR & CRC_CR_RESET) crc->DR = crcValue = crc->INIT;
+      crc->CR &= ~CRC_CR_RESET;
+      break;
+  }
+}
+
+/*
+ * IWDG: a down counter on the LSI that resets the board when it runs out.
+ * The prescaler and reload take effect at once, so SR never shows an update
+ * in progress; the window is not modelled.
+ */
+static void SIM_IwdgTimeout(void *ctx) {
+  (void)ctx;
+  fprintf(stderr, "sim: IWDG reset at %llu us\n", (unsigned long long)SIM_TO_US(SIM_Now()));
+  SIM_Reboot(RCC_CSR_IWDGRSTF);
+}
+
+static void SIM_IwdgWrite(uint32_t offset) {
+  IWDG_TypeDef *iwdg = REG(SIM_IWDG, IWDG_TypeDef);
+  uint32_t key;
+
+  switch (offset) {
+    case offsetof(IWDG_TypeDef, KR):
+      key = iwdg->KR & IWDG_KR_KEY;
+      iwdg->KR = 0;
+      iwdgUnlocked = key == 0x5555;
+      if (key != 0xCCCC && (key != 0xAAAA || !iwdgTimeout.armed)) break;
+      SIM_Schedule(&iwdgTimeout, SIM_Now() + SIM_CLOCK_HZ / SIM_LSI_HZ * (4u << iwdgPr) * (iwdgRlr + 1));
+      break;
+    case offsetof(IWDG_TypeDef, PR):
+      if (iwdgUnlocked) iwdgPr = iwdg->PR & IWDG_PR_PR;
+      iwdg->PR = iwdgPr;
+      break;
+    case offsetof(IWDG_TypeDef, RLR):
+      if (iwdgUnlocked) iwdgRlr = iwdg->RLR & IWDG_RLR_RL;
+      iwdg->RLR = iwdgRlr;
+      break;
+  }
+}
+
+/*
+ * Dispatch a trapped write to its model
+ */
+void SIM_PeriphWrite(SIM_Periph p, uint32_t offset) {
+  switch (p) {
+    case SIM_RCC:
+      SIM_RccWrite(offset); break;
+    case SIM_GPIOA:
+    case SIM_GPIOB:
+    case SIM_GPIOC:
+      SIM_GpioWrite(p, offset); break;
+    case SIM_TIM2:
+    case SIM_TIM3:
+      SIM_TimWrite(SIM_TimOf(p), offset); break;
+    case SIM_USART1:
+    case SIM_USART3:
+      SIM_UsartWrite(SIM_UsartOf(p), offset); break;
+    case SIM_DMA1:
+      SIM_DmaWrite(offset); break;
+    case SIM_SPI2:
+      SIM_SpiWrite(&spi2, offset); break;
+    case SIM_SYSTICK:
+      SIM_SysTickWrite(offset); break;
+    case SIM_CRC:
+      SIM_CrcWrite(offset); break;
+    case SIM_IWDG:
+      SIM_IwdgWrite(offset); break;
+    case SIM_USB:
+      SIM_UsbWrite(offset); break;
+    case SIM_I2C1:
+      SIM_I2cWrite(offset); break;
+    default:
+      break;
+  }
+}
+
+/*
+ * Bring live registers up to date before the firmware reads them
+ */
+void SIM_PeriphRefresh(SIM_Periph p) {
+  switch (p) {
+    case SIM_GPIOA:
+    case SIM_GPIOB:
+    case SIM_GPIOC:
+      SIM_GpioRefresh(p); break;
+    case SIM_TIM2:
+    case SIM_TIM3:
+      SIM_TimRefresh(SIM_TimOf(p)); break;
+    case SIM_SYSTICK:
+      SIM_SysTickRefresh(); break;
+    case SIM_SCB: {
+      SCB_Type *scb = REG(SIM_SCB, SCB_Type);
+      int exc = SIM_ActiveException();
+      scb->ICSR = (uint32_t)exc | (SIM_GetSysTickPending() ? SCB_ICSR_PENDSTSET_Msk : 0);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/*
+ * Level of a peripheral interrupt line
+ */
+int SIM_PeriphIrqLine(int irq) {
+  TIM_TypeDef *tim;
+
+  switch (irq) {
+    case TIM2_IRQn:
+    case TIM3_IRQn:
+      tim = REG(irq == TIM2_IRQn ? SIM_TIM2 : SIM_TIM3, TIM_TypeDef);
+      return (tim->SR & tim->DIER & 0x5F) != 0;
+    case USART1_IRQn:
+      return SIM_UsartIrqLine(&usart1);
+    case USART3_4_IRQn:
+      return SIM_UsartIrqLine(&usart3);
+    case DMA1_Channel2_3_IRQn:
+      return SIM_DmaIrqLine(1) || SIM_DmaIrqLine(2);
+    case USB_IRQn:
+      return SIM_UsbIrqLine();
+    case I2C1_IRQn:
+      return SIM_I2cIrqLine();
+    default:
+      return 0;
+  }
+}
+
+/*
+ * A handler returned. The sensor driver always reads RDR when RXNE is set,
+ * which is what clears RXNE, so a returning USART handler consumes the byte.
+ * The I2C target does the same with RXDR.
+ */
+void SIM_PeriphIrqReturn(int irq) {
+  if (irq == USART3_4_IRQn) SIM_UsartSetIsr(&usart3, 0, USART_ISR_RXNE);
+  if (irq == I2C1_IRQn) SIM_I2cIrqReturn();
+}
@@ -0,0 +1,436 @@
+/*
+ * File: sim_profile.c
+ * Purpose: Defines the virtual-time profiler. Every time the virtual clock
+ *          moves, the firmware's call stack is taken from the host and the
+ *          cycles are added to it, split by what they were spent on:
+ *            [bus]       a peripheral register access
+ *            [bus-wait]  the same access again from the same call site, a
+ *                        loop polling a flag such as SPI2 BSY or USART3 TXE
+ *            [hal]       a HAL call such as HAL_GetTick
+ *            [hal-wait]  the same HAL call again, a loop like HAL_Delay
+ *            [spin]      a handler waiting on RAM for another handler
+ *            [idle]      thread mode with nothing to do
+ *          Stacks are cut at the handler that is running, so a handler's
+ *          time is not added to the code it interrupted. The result is
+ *          written as folded stacks ("main;f;g;[bus] 1234", the input of
+ *          flamegraph.pl) and as a flame graph in SVG.
+ *
+ *          Only the cost of the hardware is on the virtual clock: the
+ *          firmware's own instructions are free here, the cycle-count
+ *          harness (Sim/Cycles) measures those.
+ */
+#include <elf.h>
+#include <execinfo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define SIM_PROFILE_DEPTH 64        // host frames looked at per sample
+#define SIM_PROFILE_FRAMES 16       // firmware frames kept per stack
+#define SIM_PROFILE_STACKS 4096     // distinct stacks, must be a power of 2
+#define SIM_PROFILE_TOP 12          // functions in the printed summary
+
+// Flame graph layout
+#define SIM_FLAME_WIDTH 1200
+#define SIM_FLAME_ROW 16
+#define SIM_FLAME_CHAR 7            // approximate width of a character at font-size 11
+
+typedef enum {
+  SIM_COST_BUS,
+  SIM_COST_BUS_WAIT,
+  SIM_COST_HAL,
+  SIM_COST_HAL_WAIT,
+  SIM_COST_SPIN,
+  SIM_COST_IDLE,
+  SIM_COST_COUNT
+} SIM_Cost;
+
+static const char *const costNames[SIM_COST_COUNT] = {
+  "[bus]", "[bus-wait]", "[hal]", "[hal-wait]", "[spin]", "[idle]"
+};
+static const char *const costColors[SIM_COST_COUNT] = {
+  "#6fa8dc", "#e06666", "#76c7c0", "#f6b26b", "#b4a7d6", "#cccccc"
+};
+
+typedef struct {
+  uintptr_t addr;             // link-time address
+  uintptr_t size;
+  const char *name;
+} SIM_Symbol;
+
+typedef struct {
+  uint8_t depth;
+  uint8_t cost;
+  int32_t frames[SIM_PROFILE_FRAMES];   // symbol indices, outermost first
+  uint64_t cycles;
+} SIM_ProfileStack;
+
+// Flame graph node, children kept sorted by name
+typedef struct {
+  const char *name;
+  const char *color;
+  uint64_t cycles;
+  int child;
+  int next;
+} SIM_FlameNode;
+
+static char *image;               // the executable, symbol names point into it
+static SIM_Symbol *symbols;
+static int symbolCount;
+static uintptr_t loadBias;        // runtime address minus link-time address
+static SIM_ProfileStack stacks[SIM_PROFILE_STACKS];
+static int stackCount;
+static uint64_t lost;             // cycles that did not fit in the table
+static uintptr_t lastSite[SIM_EXC_COUNT];   // call site of the last charge, per exception (0 is thread mode)
+static const char *foldedPath;
+static const char *svgPath;
+
+static int SIM_SymbolOrder(const void *a, const void *b) {
+  const SIM_Symbol *x = a, *y = b;
+  return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/*
+ * Read the function symbols of the running executable
+ */
+static int SIM_ProfileLoadSymbols(void) {
+  FILE *f = fopen("/proc/self/exe", "rb");
+  long len;
+
+  if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) <= 0) {
+    perror("sim: /proc/self/exe");
+    if (f != NULL) fclose(f);
+    return -1;
+  }
+  image = malloc(len);
+  rewind(f);
+  if (image == NULL || fread(image, 1, len, f) != (size_t)len) {
+    fprintf(stderr, "sim: cannot read the executable\n");
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  const Elf64_Ehdr *eh = (const Elf64_Ehdr *)image;
+  if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64) {
+    fprintf(stderr, "sim: the profiler needs a 64-bit ELF host\n");
+    return -1;
+  }
+  const Elf64_Shdr *sh = (const Elf64_Shdr *)(image + eh->e_shoff);
+  for (int i = 0; i < eh->e_shnum; i++) {
+    if (sh[i].sh_type != SHT_SYMTAB) continue;
+    const Elf64_Sym *sym = (const Elf64_Sym *)(image + sh[i].sh_offset);
+    const char *names = image + sh[sh[i].sh_link].sh_offset;
+    int count = sh[i].sh_size / sizeof(Elf64_Sym);
+
+    symbols = calloc(count, sizeof(SIM_Symbol));
+    for (int j = 0; j < count; j++) {
+      if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC || sym[j].st_size == 0) continue;
+      symbols[symbolCount++] = (SIM_Symbol){ sym[j].st_value, sym[j].st_size, names + sym[j].st_name };
+      if (strcmp(names + sym[j].st_name, "SIM_ProfileAttach") == 0)
+        loadBias = (uintptr_t)SIM_ProfileAttach - sym[j].st_value;
+    }
+  }
+  if (symbolCount == 0) {
+    fprintf(stderr, "sim: the executable has no symbol table, do not strip it to profile\n");
+    return -1;
+  }
+  qsort(symbols, symbolCount, sizeof(SIM_Symbol), SIM_SymbolOrder);
+  return 0;
+}
+
+/*
+ * Index of the function containing a runtime address, -1 if none does
+ */
+static int SIM_ProfileSymbol(uintptr_t addr) {
+  int lo = 0, hi = symbolCount - 1;
+
+  addr -= loadBias;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (addr < symbols[mid].addr) hi = mid - 1;
+    else if (addr >= symbols[mid].addr + symbols[mid].size) lo = mid + 1;
+    else return mid;
+  }
+  return -1;
+}
+
+// The simulator's own functions and the C runtime's are not part of the firmware
+static int SIM_ProfileIsFirmware(const char *name) {
+  return strncmp(name, "SIM_", 4) != 0 && name[0] != '_';
+}
+
+static void SIM_ProfileAdd(const SIM_ProfileStack *s, uint64_t cycles) {
+  uint32_t h = 2166136261u ^ s->cost;
+
+  for (int i = 0; i < s->depth; i++) h = (h ^ (uint32_t)s->frames[i]) * 16777619u;
+  for (uint32_t i = 0; i < SIM_PROFILE_STACKS; i++) {
+    SIM_ProfileStack *e = &stacks[(h + i) & (SIM_PROFILE_STACKS - 1)];
+    if (e->cycles == 0) {
+      *e = *s;
+      e->cycles = cycles;
+      stackCount++;
+      return;
+    }
+    if (e->cost == s->cost && e->depth == s->depth &&
+        memcmp(e->frames, s->frames, s->depth * sizeof(s->frames[0])) == 0) {
+      e->cycles += cycles;
+      return;
+    }
+  }
+  lost += cycles;
+}
+
+/*
+ * The clock is about to move: charge the cycles to the firmware stack
+ */
+static void SIM_ProfileOnCharge(void *ctx, uint32_t kind, uint32_t cycles, uint32_t unused) {
+  void *trace[SIM_PROFILE_DEPTH];
+  int inner[SIM_PROFILE_FRAMES], depth = 0, exc = SIM_ActiveException();
+  const char *root = exc ? SIM_ExceptionName(exc) : "main";
+  uintptr_t site = 0;
+  SIM_ProfileStack s;
+  (void)ctx;
+  (void)unused;
+
+  if (cycles == 0) return;
+  int n = backtrace(trace, SIM_PROFILE_DEPTH);
+  for (int i = 0; i < n && depth < SIM_PROFILE_FRAMES; i++) {
+    // return addresses point past the call, which may be the next function
+    int sym = SIM_ProfileSymbol((uintptr_t)trace[i] - 1);
+    if (sym < 0 || !SIM_ProfileIsFirmware(symbols[sym].name)) continue;
+    // the call site is the innermost two frames, so a helper polled from one loop is one site
+    if (depth < 2) site = site * 31 + (uintptr_t)trace[i];
+    inner[depth++] = sym;
+    if (strcmp(symbols[sym].name, root) == 0) break;
+  }
+
+  memset(&s, 0, sizeof(s));
+  s.depth = depth;
+  for (int i = 0; i < depth; i++) s.frames[i] = inner[depth - 1 - i];
+  switch (kind) {
+    case SIM_CHARGE_ACCESS:
+      s.cost = site == lastSite[exc] ? SIM_COST_BUS_WAIT : SIM_COST_BUS;
+      break;
+    case SIM_CHARGE_CALL:
+      s.cost = site == lastSite[exc] ? SIM_COST_HAL_WAIT : SIM_COST_HAL;
+      break;
+    default:
+      s.cost = exc ? SIM_COST_SPIN : SIM_COST_IDLE;
+      site = 0;
+      break;
+  }
+  lastSite[exc] = site;
+  SIM_ProfileAdd(&s, cycles);
+}
+
+static int SIM_ProfileFoldedOrder(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int SIM_ProfileWriteFolded(const char *path) {
+  char **lines = calloc(stackCount, sizeof(char *));
+  int count = 0;
+  FILE *f = fopen(path, "w");
+
+  if (f == NULL || lines == NULL) {
+    if (f == NULL) perror(path);
+    else fclose(f);
+    free(lines);
+    return -1;
+  }
+  for (int i = 0; i < SIM_PROFILE_STACKS; i++) {
+    const SIM_ProfileStack *s = &stacks[i];
+    char line[1024];
+    int len = 0;
+    if (s->cycles == 0) continue;
+    for (int j = 0; j < s->depth; j++)
+      len += snprintf(line + len, sizeof(line) - len, "%s;", symbols[s->frames[j]].name);
+    snprintf(line + len, sizeof(line) - len, "%s %llu", costNames[s->cost], (unsigned long long)s->cycles);
+    lines[count++] = strdup(line);
+  }
+  qsort(lines, count, sizeof(char *), SIM_ProfileFoldedOrder);
+  for (int i = 0; i < count; i++) {
+    fprintf(f, "%s\n", lines[i]);
+    free(lines[i]);
+  }
+  free(lines);
+  fclose(f);
+  return 0;
+}
+
+/*
+ * Child of a flame graph node with this name, added in name order if new
+ */
+static int SIM_FlameChild(SIM_FlameNode *nodes, int *count, int parent, const char *name, const char *color) {
+  int *link = &nodes[parent].child;
+
+  while (*link >= 0 && strcmp(nodes[*link].name, name) < 0) link = &nodes[*link].next;
+  if (*link >= 0 && strcmp(nodes[*link].name, name) == 0) return *link;
+  nodes[*count] = (SIM_FlameNode){ name, color, 0, -1, *link };
+  *link = (*count)++;
+  return *link;
+}
+
+// Warm colours for the firmware's functions, stable per name
+static void SIM_FlameColor(const char *name, char *out, size_t len) {
+  uint32_t h = 2166136261u;
+  for (const char *p = name; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+  snprintf(out, len, "rgb(%u,%u,%u)", 205 + (h & 0x31), 90 + ((h >> 8) % 130), 40 + ((h >> 16) % 50));
+}
+
+static void SIM_FlameEscape(FILE *f, const char *s) {
+  for (; *s; s++) {
+    if (*s == '<') fputs("&lt;", f);
+    else if (*s == '>') fputs("&gt;", f);
+    else if (*s == '&') fputs("&amp;", f);
+    else fputc(*s, f);
+  }
+}
+
+static void SIM_FlameDraw(FILE *f, const SIM_FlameNode *nodes, int node, int level, int height,
+                          double x, double scale, uint64_t total) {
+  const SIM_FlameNode *n = &nodes[node];
+  double w = n->cycles * scale;
+  double y = height - (level + 1) * SIM_FLAME_ROW;
+  char color[32];
+
+  if (w < 0.1) return;
+  if (n->color != NULL) snprintf(color, sizeof(color), "%s", n->color);
+  else SIM_FlameColor(n->name, color, sizeof(color));
+  fprintf(f, "<g><title>");
+  SIM_FlameEscape(f, n->name);
+  fprintf(f, " (%.3f ms, %.2f%%)</title>", n->cycles / 8000.0, 100.0 * n->cycles / total);
+  fprintf(f, "<rect x=\"%.1f\" y=\"%.0f\" width=\"%.1f\" height=\"%d\" fill=\"%s\" rx=\"2\"/>",
+          x, y, w, SIM_FLAME_ROW - 1, color);
+  int fits = (int)((w - 6) / SIM_FLAME_CHAR);
+  if (fits >= 3) {
+    int len = strlen(n->name);
+    fprintf(f, "<text x=\"%.1f\" y=\"%.0f\">", x + 3, y + SIM_FLAME_ROW - 4);
+    if (len <= fits) SIM_FlameEscape(f, n->name);
+    else {
+      char cut[256];
+      snprintf(cut, sizeof(cut), "%.*s..", fits - 2 < 253 ? fits - 2 : 253, n->name);
+      SIM_FlameEscape(f, cut);
+    }
+    fprintf(f, "</text>");
+  }
+  fprintf(f, "</g>\n");
+  for (int c = n->child; c >= 0; c = nodes[c].next) {
+    SIM_FlameDraw(f, nodes, c, level + 1, height, x, scale, total);
+    x += nodes[c].cycles * scale;
+  }
+}
+
+static int SIM_ProfileWriteSvg(const char *path) {
+  SIM_FlameNode *nodes = calloc(1 + stackCount * (SIM_PROFILE_FRAMES + 1), sizeof(SIM_FlameNode));
+  int count = 1, levels = 1;
+  FILE *f = fopen(path, "w");
+
+  if (f == NULL || nodes == NULL) {
+    if (f == NULL) perror(path);
+    else fclose(f);
+    free(nodes);
+    return -1;
+  }
+  nodes[0] = (SIM_FlameNode){ "all", "#eeeeee", 0, -1, -1 };
+  for (int i = 0; i < SIM_PROFILE_STACKS; i++) {
+    const SIM_ProfileStack *s = &stacks[i];
+    int node = 0;
+    if (s->cycles == 0) continue;
+    nodes[0].cycles += s->cycles;
+    for (int j = 0; j < s->depth; j++) {
+      node = SIM_FlameChild(nodes, &count, node, symbols[s->frames[j]].name, NULL);
+      nodes[node].cycles += s->cycles;
+    }
+    node = SIM_FlameChild(nodes, &count, node, costNames[s->cost], costColors[s->cost]);
+    nodes[node].cycles += s->cycles;
+    if (s->depth + 2 > levels) levels = s->depth + 2;
+  }
+
+  int height = (levels + 2) * SIM_FLAME_ROW;
+  fprintf(f, "<?xml version=\"1.0\" standalone=\"no\"?>\n");
+  fprintf(f, "<svg version=\"1.1\" width=\"%d\" height=\"%d\" xmlns=\"http://www.w3.org/2000/svg\" "
+             "font-family=\"monospace\" font-size=\"11\">\n", SIM_FLAME_WIDTH, height);
+  fprintf(f, "<rect width=\"100%%\" height=\"100%%\" fill=\"#ffffff\"/>\n");
+  fprintf(f, "<text x=\"%d\" y=\"%d\" text-anchor=\"middle\" font-size=\"13\">"
+             "Virtual time, %.3f ms simulated</text>\n", SIM_FLAME_WIDTH / 2, SIM_FLAME_ROW, nodes[0].cycles / 8000.0);
+  if (nodes[0].cycles > 0)
+    SIM_FlameDraw(f, nodes, 0, 0, height, 0, (double)SIM_FLAME_WIDTH / nodes[0].cycles, nodes[0].cycles);
+  fprintf(f, "</svg>\n");
+  fclose(f);
+  free(nodes);
+  return 0;
+}
+
+typedef struct {
+  int symbol;
+  uint64_t cycles[SIM_COST_COUNT];
+  uint64_t total;
+} SIM_ProfileSelf;
+
+static int SIM_ProfileSelfOrder(const void *a, const void *b) {
+  const SIM_ProfileSelf *x = a, *y = b;
+  return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+/*
+ * Print the functions the clock spent the most time in, by what it was spent on
+ */
+static void SIM_ProfilePrint(void) {
+  SIM_ProfileSelf *self = calloc(symbolCount, sizeof(SIM_ProfileSelf));
+  uint64_t total = 0;
+
+  for (int i = 0; i < symbolCount; i++) self[i].symbol = i;
+  for (int i = 0; i < SIM_PROFILE_STACKS; i++) {
+    const SIM_ProfileStack *s = &stacks[i];
+    if (s->cycles == 0 || s->depth == 0) continue;
+    SIM_ProfileSelf *e = &self[s->frames[s->depth - 1]];
+    e->cycles[s->cost] += s->cycles;
+    e->total += s->cycles;
+    total += s->cycles;
+  }
+  qsort(self, symbolCount, sizeof(SIM_ProfileSelf), SIM_ProfileSelfOrder);
+
+  printf("%-28s %9s", "profile (self ms)", "total");
+  for (int c = 0; c < SIM_COST_COUNT; c++) printf(" %10s", costNames[c]);
+  printf("\n");
+  for (int i = 0; i < SIM_PROFILE_TOP && i < symbolCount && self[i].total > 0; i++) {
+    printf("%-28s %9.3f", symbols[self[i].symbol].name, self[i].total / 8000.0);
+    for (int c = 0; c < SIM_COST_COUNT; c++) printf(" %10.3f", self[i].cycles[c] / 8000.0);
+    printf("  %5.1f%%\n", total ? 100.0 * self[i].total / total : 0.0);
+  }
+  if (lost) printf("profile: %.3f ms not recorded, more than %d distinct stacks\n", lost / 8000.0, SIM_PROFILE_STACKS);
+  free(self);
+}
+
+static void SIM_ProfileOnFinish(void *ctx, uint32_t a, uint32_t b, uint32_t c) {
+  (void)ctx;
+  (void)a;
+  (void)b;
+  (void)c;
+
+  SIM_ProfilePrint();
+  if (foldedPath != NULL && SIM_ProfileWriteFolded(foldedPath) != 0) SIM_SetExitStatus(2);
+  if (svgPath != NULL && SIM_ProfileWriteSvg(svgPath) != 0) SIM_SetExitStatus(2);
+}
+
+/*
+ * Profile the run into folded stacks and/or a flame graph (either path may
+ * be NULL). Called before SIM_Init: reading the symbols takes long enough
+ * for the idle detector to mistake it for a spinning firmware.
+ */
+int SIM_ProfileAttach(const char *folded, const char *svg) {
+  void *warm[4];
+
+  if (SIM_ProfileLoadSymbols() != 0) return -1;
+  // the first backtrace loads the unwinder, which must not happen inside a signal handler
+  backtrace(warm, 4);
+  foldedPath = folded;
+  svgPath = svg;
+  SIM_Listen(SIM_ON_CHARGE, SIM_ProfileOnCharge, NULL);
+  SIM_Listen(SIM_ON_FINISH, SIM_ProfileOnFinish, NULL);
+  return 0;
+}
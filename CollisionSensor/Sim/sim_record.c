@@ -0,0 +1,341 @@
+/*
+ * File: sim_record.c
+ * Purpose: Defines recording and replay of the byte stream between the
+ *          firmware and the US-100, and the output digest used to check a
+ *          replay against its recording.
+ *
+ *          A recording is a text file with one byte per line,
+ *          "<time us> <tx|rx> <byte hex>", followed by "end <time us>" and
+ *          "digest <hex>". The same format is written from the firmware's
+ *          own capture ring (SENSOR_CAPTURE), so a capture taken on the
+ *          board replays the same way as one taken in the simulator.
+ *
+ *          Replay replaces the US-100 model. Every received byte is paired
+ *          with the command it answers (0x55 gets two bytes, 0x50 one, in the
+ *          order the commands were sent) and is delivered with its recorded
+ *          delay after the firmware sends that command, so a replay stays
+ *          aligned even when a change moves the requests in time.
+ *
+ *          The digest is a hash of everything the user can see: LED and
+ *          other GPIO output changes, PWM changes and LCD bytes, each with
+ *          its cycle time. Equal digests mean bit-identical output.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ultrasonicSensorUart.h"
+#include "sim.h"
+
+#define SIM_REPLAY_QUEUE 64
+
+typedef struct {
+  uint64_t when;   // cycles
+  uint8_t rx;
+  uint8_t byte;
+  int answers;     // for a received byte, the entry of the command it answers, -1 if unknown
+} SIM_Recorded;
+
+typedef struct {
+  SIM_Recorded *entries;
+  int count;
+  int next;
+  uint64_t end;
+  uint64_t digest;
+  int hasDigest;
+
+  // received bytes waiting for their time
+  SIM_Recorded queue[SIM_REPLAY_QUEUE];
+  int queueHead;
+  int queueCount;
+  SIM_Event deliver;
+
+  uint32_t commands;
+  uint32_t skipped;     // recorded commands the firmware did not send
+  uint32_t unanswered;  // firmware commands with no match left in the recording
+} SIM_Replay;
+
+// Firmware capture ring, present when the firmware is built with SENSOR_CAPTURE
+extern volatile SENSOR_Capture sensorCapture __attribute__((weak));
+
+static uint64_t digest = 0xCBF29CE484222325ULL;
+static FILE *record;
+static SIM_Replay replay;
+
+/*
+ * FNV-1a over the event, so the digest depends on the order and time of every output
+ */
+static void SIM_DigestAdd(uint32_t sig, uint32_t a, uint32_t b, uint32_t c) {
+  uint32_t words[6] = { (uint32_t)SIM_Now(), (uint32_t)(SIM_Now() >> 32), sig, a, b, c };
+  const uint8_t *p = (const uint8_t *)words;
+  for (size_t i = 0; i < sizeof(words); i++) {
+    digest ^= p[i];
+    digest *= 0x100000001B3ULL;
+  }
+}
+
+static void SIM_DigestOnGpio(void *ctx, uint32_t port, uint32_t old, uint32_t new) {
+  (void)ctx;
+  (void)old;
+  SIM_DigestAdd(SIM_ON_GPIO, port, new, 0);
+}
+
+static void SIM_DigestOnPwm(void *ctx, uint32_t channel, uint32_t ccr, uint32_t period) {
+  (void)ctx;
+  SIM_DigestAdd(SIM_ON_PWM, channel, ccr, period);
+}
+
+static void SIM_DigestOnSpi(void *ctx, uint32_t spi, uint32_t byte, uint32_t unused) {
+  (void)ctx;
+  (void)unused;
+  SIM_DigestAdd(SIM_ON_SPI_TX, spi, byte, 0);
+}
+
+void SIM_DigestAttach(void) {
+  SIM_Keep(&digest, sizeof(digest));
+  SIM_Listen(SIM_ON_GPIO, SIM_DigestOnGpio, NULL);
+  SIM_Listen(SIM_ON_PWM, SIM_DigestOnPwm, NULL);
+  SIM_Listen(SIM_ON_SPI_TX, SIM_DigestOnSpi, NULL);
+}
+
+uint64_t SIM_OutputDigest(void) {
+  return digest;
+}
+
+/*
+ * Recording
+ */
+static void SIM_RecordLine(uint64_t when, int rx, uint8_t byte) {
+  fprintf(record, "%llu.%03u %s %02x\n", (unsigned long long)SIM_TO_US(when),
+          (unsigned)(when % (SIM_CLOCK_HZ / 1000000)) * 1000 / (SIM_CLOCK_HZ / 1000000),
+          rx ? "rx" : "tx", byte);
+}
+
+static void SIM_RecordOnTx(void *ctx, uint32_t uart, uint32_t byte, uint32_t unused) {
+  (void)ctx;
+  (void)unused;
+  if (uart == SIM_USART3) SIM_RecordLine(SIM_Now(), 0, byte);
+}
+
+static void SIM_RecordOnRx(void *ctx, uint32_t uart, uint32_t byte, uint32_t accepted) {
+  (void)ctx;
+  (void)accepted;
+  if (uart == SIM_USART3) SIM_RecordLine(SIM_Now(), 1, byte);
+}
+
+static void SIM_RecordOnFinish(void *ctx, uint32_t a, uint32_t b, uint32_t c) {
+  (void)ctx;
+  (void)a;
+  (void)b;
+  (void)c;
+  fprintf(record, "end %llu\n", (unsigned long long)SIM_TO_US(SIM_Now()));
+  fprintf(record, "digest %016llx\n", (unsigned long long)digest);
+  fclose(record);
+}
+
+int SIM_RecordOpen(const char *path) {
+  record = fopen(path, "w");
+  if (record == NULL) {
+    perror(path);
+    return -1;
+  }
+  fprintf(record, "# US-100 byte stream: <time us> <tx|rx> <byte hex>\n");
+  SIM_Listen(SIM_ON_UART_TX, SIM_RecordOnTx, NULL);
+  SIM_Listen(SIM_ON_UART_RX, SIM_RecordOnRx, NULL);
+  SIM_Listen(SIM_ON_FINISH, SIM_RecordOnFinish, NULL);
+  return 0;
+}
+
+/*
+ * Write the firmware's capture ring in the recording format, oldest byte first
+ */
+int SIM_CaptureDump(const char *path) {
+  if (&sensorCapture == NULL) {
+    fprintf(stderr, "%s: firmware was built without SENSOR_CAPTURE\n", path);
+    return -1;
+  }
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  uint32_t head = sensorCapture.head;
+  uint32_t first = head > SENSOR_CAPTURE_SIZE ? head - SENSOR_CAPTURE_SIZE : 0;
+  fprintf(f, "# US-100 byte stream from the firmware capture ring, %u bytes\n", (unsigned)(head - first));
+  for (uint32_t i = first; i < head; i++) {
+    volatile SENSOR_CaptureEntry *e = &sensorCapture.entries[i & (SENSOR_CAPTURE_SIZE - 1)];
+    fprintf(f, "%u %s %02x\n", (unsigned)e->time_us, e->dir == SENSOR_CAPTURE_RX ? "rx" : "tx", e->byte);
+  }
+  fclose(f);
+  return 0;
+}
+
+/*
+ * Replay
+ */
+static void SIM_ReplayDeliver(void *ctx) {
+  SIM_Replay *r = (SIM_Replay *)ctx;
+  SIM_Recorded *e = &r->queue[r->queueHead];
+
+  SIM_UartInject(SIM_USART3, e->byte);
+  r->queueHead = (r->queueHead + 1) % SIM_REPLAY_QUEUE;
+  r->queueCount--;
+  if (r->queueCount) SIM_Schedule(&r->deliver, r->queue[r->queueHead].when);
+}
+
+/*
+ * Queue a byte for delivery, keeping the queue in time order
+ */
+static void SIM_ReplayQueue(SIM_Replay *r, uint64_t when, uint8_t byte) {
+  if (r->queueCount == SIM_REPLAY_QUEUE) return;
+  int i = r->queueCount++;
+  while (i > 0 && r->queue[(r->queueHead + i - 1) % SIM_REPLAY_QUEUE].when > when) {
+    r->queue[(r->queueHead + i) % SIM_REPLAY_QUEUE] = r->queue[(r->queueHead + i - 1) % SIM_REPLAY_QUEUE];
+    i--;
+  }
+  SIM_Recorded *e = &r->queue[(r->queueHead + i) % SIM_REPLAY_QUEUE];
+  e->when = when;
+  e->rx = 1;
+  e->byte = byte;
+  SIM_Schedule(&r->deliver, r->queue[r->queueHead].when);
+}
+
+/*
+ * Match a firmware command with the next recorded command of the same kind
+ * and queue its answer, keeping each byte's recorded delay
+ */
+static void SIM_ReplayOnTx(void *ctx, uint32_t uart, uint32_t byte, uint32_t unused) {
+  SIM_Replay *r = (SIM_Replay *)ctx;
+  (void)unused;
+
+  if (uart != SIM_USART3) return;
+  r->commands++;
+  int k = r->next;
+  while (k < r->count && (r->entries[k].rx || r->entries[k].byte != byte)) k++;
+  if (k == r->count) {
+    r->unanswered++;
+    return;
+  }
+  for (int i = r->next; i < k; i++) r->skipped += !r->entries[i].rx;
+  r->next = k + 1;
+
+  for (int i = k + 1; i < r->count; i++) {
+    SIM_Recorded *e = &r->entries[i];
+    if (e->rx && e->answers == k) SIM_ReplayQueue(r, SIM_Now() + (e->when - r->entries[k].when), e->byte);
+  }
+}
+
+/*
+ * Pair every received byte with the command it answers. The sensor answers
+ * in order, two bytes for 0x55 and one for 0x50.
+ */
+static void SIM_ReplayPair(SIM_Replay *r) {
+  int pending[SIM_REPLAY_QUEUE];
+  int head = 0, count = 0, owed = 0;
+
+  for (int i = 0; i < r->count; i++) {
+    SIM_Recorded *e = &r->entries[i];
+    e->answers = -1;
+    if (!e->rx) {
+      if (count < SIM_REPLAY_QUEUE) pending[(head + count++) % SIM_REPLAY_QUEUE] = i;
+      continue;
+    }
+    while (count > 0 && owed == 0) {
+      owed = r->entries[pending[head]].byte == 0x55 ? 2 : r->entries[pending[head]].byte == 0x50 ? 1 : 0;
+      if (owed == 0) {
+        head = (head + 1) % SIM_REPLAY_QUEUE;
+        count--;
+      }
+    }
+    // bytes from before the first command of a capture ring answer nothing
+    if (count == 0) continue;
+    e->answers = pending[head];
+    if (--owed == 0) {
+      head = (head + 1) % SIM_REPLAY_QUEUE;
+      count--;
+    }
+  }
+}
+
+static void SIM_ReplayOnFinish(void *ctx, uint32_t a, uint32_t b, uint32_t c) {
+  SIM_Replay *r = (SIM_Replay *)ctx;
+  (void)a;
+  (void)b;
+  (void)c;
+
+  printf("replay: %u commands, %u recorded commands skipped, %u not in the recording\n",
+         (unsigned)r->commands, (unsigned)r->skipped, (unsigned)r->unanswered);
+  if (!r->hasDigest) return;
+  if (r->digest == digest) printf("replay output matches the recording (digest %016llx)\n", (unsigned long long)digest);
+  else {
+    printf("replay output differs from the recording (digest %016llx, recorded %016llx)\n",
+           (unsigned long long)digest, (unsigned long long)r->digest);
+    SIM_SetExitStatus(1);
+  }
+}
+
+/*
+ * Read a recording, returns 0 on success
+ */
+int SIM_ReplayLoad(const char *path) {
+  char line[128];
+  int lineNo = 0, capacity = 0;
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    double us;
+    char dir[4];
+    unsigned byte;
+    unsigned long long value;
+
+    lineNo++;
+    if (line[0] == '#' || line[0] == '\n') continue;
+    if (sscanf(line, "end %llu", &value) == 1) {
+      replay.end = SIM_US(value);
+      continue;
+    }
+    if (sscanf(line, "digest %llx", &value) == 1) {
+      replay.digest = value;
+      replay.hasDigest = 1;
+      continue;
+    }
+    if (sscanf(line, "%lf %3s %x", &us, dir, &byte) != 3 || byte > 0xFF ||
+        (strcmp(dir, "tx") != 0 && strcmp(dir, "rx") != 0)) {
+      fprintf(stderr, "%s:%d: cannot parse \"%s\"\n", path, lineNo, strtok(line, "\n"));
+      fclose(f);
+      return -1;
+    }
+    if (replay.count == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      replay.entries = realloc(replay.entries, capacity * sizeof(SIM_Recorded));
+    }
+    SIM_Recorded *e = &replay.entries[replay.count++];
+    e->when = (uint64_t)(us * (SIM_CLOCK_HZ / 1000000) + 0.5);
+    e->rx = dir[0] == 'r';
+    e->byte = (uint8_t)byte;
+  }
+  fclose(f);
+  return 0;
+}
+
+/*
+ * Run time of the recording in cycles, 0 if it does not say
+ */
+uint64_t SIM_ReplayEnd(void) {
+  return replay.end;
+}
+
+/*
+ * Feed the recording to USART3 in place of the US-100
+ */
+void SIM_ReplayAttach(void) {
+  replay.deliver.fire = SIM_ReplayDeliver;
+  replay.deliver.ctx = &replay;
+  SIM_ReplayPair(&replay);
+  SIM_Listen(SIM_ON_UART_TX, SIM_ReplayOnTx, &replay);
+  SIM_Listen(SIM_ON_FINISH, SIM_ReplayOnFinish, &replay);
+}
@@ -0,0 +1,283 @@
+/*
+ * File: sim_reset.c
+ * Purpose: Defines the system reset and the faults raised to test it. A
+ *          reset loses RAM and the peripheral state, but not the flash or
+ *          the RAM the firmware keeps out of the startup code's reach
+ *          (crashRetained). The host cannot put the firmware's statics back
+ *          to their initial values in place, so NVIC_SystemReset and the
+ *          IWDG save the clock, the flash, crashRetained and whatever the
+ *          rest of the simulator keeps with SIM_Keep (the world outside the
+ *          MCU, which a reset does not touch) to a memfd, and execute the
+ *          simulator again with the same arguments plus --resume. The new
+ *          process boots the firmware from main() at the time of the reset,
+ *          and reports how long after the fault or the reset the warnings
+ *          came back.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stm32f0xx_hal.h"
+#include "crashLog.h"
+#include "watchdog.h"
+#include "sim.h"
+
+#define SIM_RESET_US 100        // reset pulse, then Reset_Handler filling .data and .bss
+#define SIM_LED_MASK 0x03C0     // PC6-PC9
+#define SIM_MAX_KEPT 16
+#define SIM_MAX_EXTRA_ARGS 4
+#define SIM_RESET_FLAGS (RCC_CSR_OBLRSTF | RCC_CSR_PINRSTF | RCC_CSR_PORRSTF | RCC_CSR_SFTRSTF | \
+                         RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF | RCC_CSR_LPWRRSTF)
+
+// What a reset hands to the next process
+typedef struct {
+  SIM_ResetStats stats;
+  uint16_t leds;            // LED outputs when the fault was raised, or at the reset
+  uint32_t pwm;             // motor duty then
+  uint16_t resetLeds;       // LED outputs the reset turned off
+  uint32_t resetPwm;        // motor duty it stopped, and its period
+  uint32_t resetPeriod;
+  CRASH_RETAINED retained;
+  uint8_t flash[SIM_FLASH_SIZE];
+  size_t keptSize;
+  uint8_t kept[];           // the SIM_Keep regions in the order they were kept
+} SIM_ResetState;
+
+typedef struct {
+  void *data;
+  size_t size;
+} SIM_Kept;
+
+static const char *const stageNames[WATCHDOG_STAGES] = { "acquire", "warn", "display" };
+
+SIM_ResetStats simResetStats;
+
+static int resetArgc;
+static char **resetArgv;
+static const char *extraArgs[2 * SIM_MAX_EXTRA_ARGS];
+static int extraCount;
+static SIM_Kept kept[SIM_MAX_KEPT];
+static int keptCount;
+static size_t keptOffset;
+static const SIM_ResetState *resumed;  // left mapped for SIM_Keep
+static SIM_Event faults[SIM_MAX_FAULTS];
+static uint64_t faultAt;        // the fault raised in this process, 0 for none
+
+// warnings showing now, and when the fault was raised
+static uint16_t leds;
+static uint32_t pwm, period;
+static uint16_t resetLeds;
+static uint32_t resetPwm, resetPeriod;
+static uint16_t faultLeds;
+static uint32_t faultPwm;
+static uint64_t restoredAt;     // the warnings from before the fault are showing again
+static uint64_t resumedAt;      // the firmware asked the US-100 for a reading
+
+/*
+ * Keep the command line to execute again on a reset
+ */
+void SIM_ResetArgs(int argc, char **argv) {
+  resetArgc = argc;
+  resetArgv = argv;
+}
+
+/*
+ * Add an option to the command line executed on a reset, for a process
+ * that was not started with it (a benchmark child)
+ */
+void SIM_ResetAddArg(const char *name, const char *value) {
+  if (extraCount == 2 * SIM_MAX_EXTRA_ARGS) return;
+  extraArgs[extraCount++] = name;
+  extraArgs[extraCount++] = value;
+}
+
+/*
+ * Keep a region over a reset. In the process after one, the same calls in
+ * the same order get back what the last process held there, so call it
+ * once the region is set up, and never for a SIM_Event or a pointer.
+ */
+void SIM_Keep(void *data, size_t size) {
+  if (keptCount == SIM_MAX_KEPT) {
+    fprintf(stderr, "sim: too many kept regions\n");
+    exit(2);
+  }
+  kept[keptCount++] = (SIM_Kept){ data, size };
+  if (resumed != NULL && keptOffset + size <= resumed->keptSize) memcpy(data, resumed->kept + keptOffset, size);
+  keptOffset += size;
+}
+
+/*
+ * Pick up what the process before the reset saved: called after the flash
+ * is attached and before anything is scheduled
+ */
+int SIM_ResetResume(int fd) {
+  struct stat st;
+  SIM_ResetState *state = MAP_FAILED;
+
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SIM_ResetState))
+    state = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (state == MAP_FAILED) {
+    perror("sim: reset state");
+    return -1;
+  }
+  simResetStats = state->stats;
+  faultLeds = state->leds;
+  faultPwm = state->pwm;
+  resetLeds = state->resetLeds;
+  resetPwm = state->resetPwm;
+  resetPeriod = state->resetPeriod;
+  crashRetained = state->retained;
+  SIM_FlashRestore(state->flash);
+  resumed = state;
+
+  SIM_Resume(simResetStats.resetAt + SIM_US(SIM_RESET_US));
+  fprintf(stderr, "sim: booting again at %llu us\n", (unsigned long long)SIM_TO_US(SIM_Now()));
+  return 0;
+}
+
+/*
+ * Save the state a reset keeps and execute the simulator again
+ */
+void SIM_Reboot(uint32_t cause) {
+  int fd = memfd_create("sim-reset", 0);
+  SIM_ResetState *state = MAP_FAILED;
+  size_t keptSize = 0, size, at = 0;
+  char fdArg[16];
+  char **args = calloc(resetArgc + extraCount + 3, sizeof(char *));
+  int n = 0;
+
+  for (int i = 0; i < keptCount; i++) keptSize += kept[i].size;
+  size = sizeof(SIM_ResetState) + keptSize;
+  if (fd >= 0 && ftruncate(fd, size) == 0) state = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (state == MAP_FAILED || args == NULL) {
+    perror("sim: reset state");
+    exit(2);
+  }
+  state->stats.resets = simResetStats.resets + 1;
+  state->stats.faultAt = faultAt;
+  state->stats.resetAt = SIM_Now();
+  state->stats.cause = cause;
+  // an internal reset drives NRST low too
+  state->stats.csr = (((RCC_TypeDef *)SIM_Regs(SIM_RCC))->CSR & SIM_RESET_FLAGS) | cause | RCC_CSR_PINRSTF;
+  state->stats.reason = crashRetained.magic == CRASHLOG_MAGIC ? crashRetained.record.reason : 0;
+  state->leds = faultAt ? faultLeds : leds;
+  state->pwm = faultAt ? faultPwm : pwm;
+  state->resetLeds = leds;
+  state->resetPwm = pwm;
+  state->resetPeriod = period;
+  state->retained = crashRetained;
+  memcpy(state->flash, (const void *)SIM_FLASH_BASE, SIM_FLASH_SIZE);
+  state->keptSize = keptSize;
+  for (int i = 0; i < keptCount; i++) {
+    memcpy(state->kept + at, kept[i].data, kept[i].size);
+    at += kept[i].size;
+  }
+  munmap(state, size);
+
+  // the same arguments, with this reset's state in place of the last one's
+  for (int i = 0; i < resetArgc; i++) {
+    if (strcmp(resetArgv[i], "--resume") == 0 && i + 1 < resetArgc) i++;
+    else args[n++] = resetArgv[i];
+  }
+  for (int i = 0; i < extraCount; i++) args[n++] = (char *)extraArgs[i];
+  snprintf(fdArg, sizeof(fdArg), "%d", fd);
+  args[n++] = "--resume";
+  args[n++] = fdArg;
+  args[n] = NULL;
+
+  fflush(NULL);
+  execv("/proc/self/exe", args);
+  perror("sim: reset");
+  exit(2);
+}
+
+/*
+ * Raise a HardFault in whatever the firmware is running
+ */
+static void SIM_OnFault(void *ctx) {
+  (void)ctx;
+  faultAt = SIM_Now();
+  faultLeds = leds;
+  faultPwm = pwm;
+  fprintf(stderr, "sim: HardFault raised at %llu us\n", (unsigned long long)SIM_TO_US(faultAt));
+  SIM_RaiseHardFault();
+}
+
+/*
+ * After a reset, the first time the LEDs and the motor are back to what
+ * they were when the fault was raised, or at the reset without one
+ */
+static void SIM_CheckRestored(void) {
+  if (restoredAt || !simResetStats.resets) return;
+  if (leds == faultLeds && pwm == faultPwm) restoredAt = SIM_Now();
+}
+
+static void SIM_ResetOnGpio(void *ctx, uint32_t port, uint32_t old, uint32_t new) {
+  (void)ctx;
+  (void)old;
+  if (port != SIM_GPIOC) return;
+  leds = new & SIM_LED_MASK;
+  SIM_CheckRestored();
+}
+
+static void SIM_ResetOnPwm(void *ctx, uint32_t channel, uint32_t ccr, uint32_t arr) {
+  (void)ctx;
+  if (channel != (SIM_TIM3 | (1 << 8))) return;
+  pwm = ccr;
+  period = arr;
+  SIM_CheckRestored();
+}
+
+static void SIM_ResetOnUartTx(void *ctx, uint32_t uart, uint32_t byte, uint32_t unused) {
+  (void)ctx;
+  (void)unused;
+  if (uart == SIM_USART3 && byte == 0x55 && !resumedAt) resumedAt = SIM_Now();
+}
+
+static void SIM_ResetOnFinish(void *ctx, uint32_t a, uint32_t b, uint32_t c) {
+  uint64_t since = simResetStats.faultAt ? simResetStats.faultAt : simResetStats.resetAt;
+  const char *what = simResetStats.faultAt ? "fault" : "reset";
+  uint8_t reason = simResetStats.reason;
+  (void)ctx;
+  (void)a;
+  (void)b;
+  (void)c;
+  if (simResetStats.resets == 0) return;
+
+  printf("resets: %u, the last at %.3f ms", (unsigned)simResetStats.resets, SIM_TO_US(simResetStats.resetAt) / 1000.0);
+  if (simResetStats.faultAt) printf(" after a fault at %.3f ms\n", SIM_TO_US(simResetStats.faultAt) / 1000.0);
+  else if (reason >= CRASHLOG_HANG && reason < CRASHLOG_HANG + WATCHDOG_STAGES)
+    printf(", the %s stage had not checked in for %u ms\n", stageNames[reason - CRASHLOG_HANG],
+           (unsigned)crashRetained.record.frame[reason - CRASHLOG_HANG]);
+  else if (simResetStats.cause == RCC_CSR_IWDGRSTF) printf(" by the IWDG\n");
+  else printf("\n");
+  if (restoredAt) printf("  warnings back %.3f ms after the %s", SIM_TO_US(restoredAt - since) / 1000.0, what);
+  else printf("  warnings not back");
+  if (resumedAt) printf(", readings %.3f ms after\n", SIM_TO_US(resumedAt - since) / 1000.0);
+  else printf(", no reading since\n");
+}
+
+/*
+ * Schedule the faults still ahead and follow the warnings
+ */
+void SIM_ResetAttach(const uint64_t *faultsMs, int count) {
+  for (int i = 0; i < count && i < SIM_MAX_FAULTS; i++) {
+    if (SIM_MS(faultsMs[i]) <= SIM_Now()) continue;
+    faults[i].fire = SIM_OnFault;
+    SIM_Schedule(&faults[i], SIM_MS(faultsMs[i]));
+  }
+  SIM_Listen(SIM_ON_GPIO, SIM_ResetOnGpio, NULL);
+  SIM_Listen(SIM_ON_PWM, SIM_ResetOnPwm, NULL);
+  SIM_Listen(SIM_ON_UART_TX, SIM_ResetOnUartTx, NULL);
+  SIM_Listen(SIM_ON_FINISH, SIM_ResetOnFinish, NULL);
+  // the outputs went off at the reset, which the new process has not seen
+  if (resetLeds) SIM_Emit(SIM_ON_GPIO, SIM_GPIOC, resetLeds, 0);
+  if (resetPwm) SIM_Emit(SIM_ON_PWM, SIM_TIM3 | (1 << 8), 0, resetPeriod);
+  // everything is off out of reset, which may be what was showing
+  SIM_CheckRestored();
+}
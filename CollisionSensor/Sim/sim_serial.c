@@ -0,0 +1,152 @@
+/*
+ * File: sim_serial.c
+ * Purpose: Defines the receiver at the other end of the USART1 telemetry
+ *          link, attached with --serial. It splits the bytes USART1 sends
+ *          at every 0, undoes the COBS encoding and checks the CRC-16 of
+ *          the link, then checks the telemetry frame inside like the USB
+ *          host does. The encoding and the CRC are decoded independently
+ *          of the firmware's code. Frames that are not telemetry are the
+ *          command shell's replies, printed as they come.
+ *
+ *          Command lines queued with SIM_SerialSend are typed into USART1's
+ *          RX line back to back, at the firmware's baud rate.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "stm32f0xx_hal.h"
+#include "serialLink.h"
+#include "commandShell.h"
+#include "sim.h"
+
+#define SIM_SERIAL_MAX 64         // longest encoded frame taken, anything longer is bad
+#define SIM_SERIAL_SENDS 16       // command lines a run can send
+
+static struct {
+  SIM_Telemetry telemetry;
+  uint8_t encoded[SIM_SERIAL_MAX];
+  int length;
+  uint8_t overflow;             // the frame in progress outgrew encoded
+  uint32_t bytes, bad, replies;
+  struct {
+    uint64_t when;
+    const char *text;
+  } sends[SIM_SERIAL_SENDS];
+  int sendCount, sendNext, sendPos;
+  SIM_Event send;
+} serial = { .telemetry = { .lastSequence = -1 } };
+
+/*
+ * Undo COBS: each code byte gives the distance to the next 0, and 0xFF a
+ * block of 254 bytes without one. Returns the decoded length, -1 if a code
+ * runs past the end.
+ */
+static int SIM_SerialDecode(const uint8_t *in, int length, uint8_t *out) {
+  int n = 0;
+
+  for (int i = 0; i < length;) {
+    int code = in[i++];
+    if (code == 0 || i + code - 1 > length) return -1;
+    for (int k = 1; k < code; k++) out[n++] = in[i++];
+    if (code != 0xFF && i < length) out[n++] = 0;
+  }
+  return n;
+}
+
+/*
+ * A frame ended: decode it, check the link's CRC, then the telemetry frame
+ */
+static void SIM_SerialFrame(void) {
+  uint8_t frame[SIM_SERIAL_MAX];
+  int length;
+
+  // a 0 right after another only separates nothing
+  if (serial.length == 0 && !serial.overflow) return;
+  length = serial.overflow ? -1 : SIM_SerialDecode(serial.encoded, serial.length, frame);
+  if (length < 3 || SIM_TelemetryCrc(frame, length - 2) != (frame[length - 2] | frame[length - 1] << 8))
+    serial.bad++;
+  else if (frame[0] != 0xA5) {
+    serial.replies++;
+    printf("%10.3f ms  USART1 reply: %.*s\n", SIM_Now() / 8000.0, length - 2, (const char *)frame);
+  }
+  else if (!SIM_TelemetryFrame(&serial.telemetry, frame, length - 2))
+    serial.bad++;
+  serial.length = 0;
+  serial.overflow = 0;
+}
+
+static void SIM_SerialOnTx(void *ctx, uint32_t uart, uint32_t byte, uint32_t unused) {
+  (void)ctx;
+  (void)unused;
+
+  if (uart != SIM_USART1) return;
+  serial.bytes++;
+  if (byte == 0) SIM_SerialFrame();
+  else if (serial.length < SIM_SERIAL_MAX) serial.encoded[serial.length++] = byte;
+  else serial.overflow = 1;
+}
+
+/*
+ * Type the next byte of the line being sent, its LF after the last one
+ */
+static void SIM_SerialType(void *ctx) {
+  const char *text = serial.sends[serial.sendNext].text;
+  uint64_t next = SIM_Now() + SIM_UartFrameCycles(SIM_USART1);
+  (void)ctx;
+
+  if (text[serial.sendPos]) {
+    SIM_UartInject(SIM_USART1, text[serial.sendPos++]);
+    SIM_Schedule(&serial.send, next);
+    return;
+  }
+  SIM_UartInject(SIM_USART1, '\n');
+  serial.sendPos = 0;
+  if (++serial.sendNext == serial.sendCount) return;
+  SIM_Schedule(&serial.send, serial.sends[serial.sendNext].when > next ? serial.sends[serial.sendNext].when : next);
+}
+
+/*
+ * Queue a command line to type at ms, or after the line before it. Lines
+ * go in the order queued. Returns -1 if there are too many.
+ */
+int SIM_SerialSend(uint64_t ms, const char *text) {
+  if (serial.sendCount == SIM_SERIAL_SENDS) return -1;
+  serial.sends[serial.sendCount].when = SIM_MS(ms);
+  serial.sends[serial.sendCount].text = text;
+  if (serial.sendCount++ == 0) {
+    serial.send.fire = SIM_SerialType;
+    SIM_Schedule(&serial.send, SIM_MS(ms));
+  }
+  return 0;
+}
+
+int SIM_SerialAttach(const char *telemetryPath) {
+  if (telemetryPath != NULL) {
+    serial.telemetry.out = fopen(telemetryPath, "w");
+    if (serial.telemetry.out == NULL) {
+      perror(telemetryPath);
+      return -1;
+    }
+    fprintf(serial.telemetry.out, "# sequence ms flags raw distance zone duty temperature fault faults replies\n");
+  }
+  SIM_Listen(SIM_ON_UART_TX, SIM_SerialOnTx, NULL);
+  return 0;
+}
+
+/*
+ * What came over the link. Returns 1 if a frame was bad or more frames
+ * are missing than the firmware counted as dropped.
+ */
+int SIM_SerialReport(FILE *out) {
+  uint32_t cycles = SIM_UartFrameCycles(SIM_USART1);
+
+  fprintf(out, "USART1: %u bytes at %u baud, %u frames decoded, %u missing, %u bad; the firmware dropped %u\n",
+          (unsigned)serial.bytes, (unsigned)(10ull * SIM_CLOCK_HZ / cycles), (unsigned)serial.telemetry.frames,
+          (unsigned)serial.telemetry.missing, (unsigned)serial.bad, (unsigned)serialStats.dropped);
+  if (serial.sendCount)
+    fprintf(out, "shell: %d lines sent, %u replies, %u commands refused, %u saves\n", serial.sendNext,
+            (unsigned)serial.replies, (unsigned)shellStats.errors, (unsigned)shellStats.saves);
+  if (serial.telemetry.out != NULL) fclose(serial.telemetry.out);
+  serial.telemetry.out = NULL;
+  return serial.bad || serial.telemetry.missing > serialStats.dropped;
+}
@@ -0,0 +1,212 @@
+/*
+ * File: sim_trace.c
+ * Purpose: Defines the timing trace of what the user sees and feels: every
+ *          change of the four warning LEDs on GPIOC and of the vibration
+ *          motor's duty (TIM3 CCR1), stamped with the virtual clock. A trace
+ *          can be written out, and compared with a golden trace written by
+ *          an earlier run of the same scenario. Each signal must go through
+ *          the same values in the same order, every change within the
+ *          tolerance of the golden one; changes meant only to speed up the
+ *          firmware must pass unchanged.
+ *
+ *          Format, one change per line, '#' starts a comment:
+ *            <ms> red|blue|orange|green 0|1
+ *            <ms> motor <ccr>/<period>
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define SIM_TRACE_MAX_REPORTS 10
+#define SIM_TRACE_MAX_EVENTS 4096
+
+typedef enum {
+  SIM_TRACE_RED,
+  SIM_TRACE_BLUE,
+  SIM_TRACE_ORANGE,
+  SIM_TRACE_GREEN,
+  SIM_TRACE_MOTOR,
+  SIM_TRACE_SIGNALS
+} SIM_TraceSignal;
+
+static const char *const signalNames[SIM_TRACE_SIGNALS] = { "red", "blue", "orange", "green", "motor" };
+
+// LED signals in order, bit positions in GPIOC ODR
+static const uint8_t signalPins[] = { 6, 7, 8, 9 };
+
+typedef struct {
+  double ms;
+  uint8_t signal;
+  uint32_t value;
+  uint32_t period;    // motor only
+} SIM_TraceEvent;
+
+// Fixed size, so the run so far can be kept over a reset
+typedef struct {
+  SIM_TraceEvent events[SIM_TRACE_MAX_EVENTS];
+  int count;
+} SIM_Trace;
+
+static SIM_Trace run, golden;
+static const char *outPath;
+static const char *goldenPath;
+static double toleranceMs;
+static int mismatches = -1;
+
+static void SIM_TraceAdd(SIM_Trace *t, SIM_TraceEvent e) {
+  if (t->count == SIM_TRACE_MAX_EVENTS) {
+    fprintf(stderr, "trace: more than %d changes\n", SIM_TRACE_MAX_EVENTS);
+    exit(2);
+  }
+  t->events[t->count++] = e;
+}
+
+static void SIM_TraceOnGpio(void *ctx, uint32_t port, uint32_t old, uint32_t new) {
+  (void)ctx;
+  if (port != SIM_GPIOC) return;
+  for (int s = SIM_TRACE_RED; s <= SIM_TRACE_GREEN; s++) {
+    uint32_t bit = 1u << signalPins[s];
+    if ((old ^ new) & bit)
+      SIM_TraceAdd(&run, (SIM_TraceEvent){ SIM_Now() / 8000.0, s, (new & bit) != 0, 0 });
+  }
+}
+
+static void SIM_TraceOnPwm(void *ctx, uint32_t channel, uint32_t ccr, uint32_t period) {
+  (void)ctx;
+  if (channel != (SIM_TIM3 | (1u << 8))) return;
+  SIM_TraceAdd(&run, (SIM_TraceEvent){ SIM_Now() / 8000.0, SIM_TRACE_MOTOR, ccr, period });
+}
+
+static int SIM_TraceLoad(const char *path, SIM_Trace *t) {
+  char line[128], name[16];
+  int number = 0;
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    SIM_TraceEvent e = { 0 };
+    int s;
+    number++;
+    if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t\r\n")] == '\0') continue;
+    if (sscanf(line, "%lf %15s %u/%u", &e.ms, name, &e.value, &e.period) < 3) s = SIM_TRACE_SIGNALS;
+    else for (s = 0; s < SIM_TRACE_SIGNALS && strcmp(name, signalNames[s]) != 0; s++) {}
+    if (s == SIM_TRACE_SIGNALS) {
+      fprintf(stderr, "%s:%d: not a trace line\n", path, number);
+      fclose(f);
+      return -1;
+    }
+    e.signal = s;
+    SIM_TraceAdd(t, e);
+  }
+  fclose(f);
+  return 0;
+}
+
+static int SIM_TraceWrite(const char *path) {
+  FILE *f = fopen(path, "w");
+
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  fprintf(f, "# LED and motor changes: ms, signal, value\n");
+  for (int i = 0; i < run.count; i++) {
+    const SIM_TraceEvent *e = &run.events[i];
+    if (e->signal == SIM_TRACE_MOTOR)
+      fprintf(f, "%.3f %s %u/%u\n", e->ms, signalNames[e->signal], (unsigned)e->value, (unsigned)e->period);
+    else fprintf(f, "%.3f %s %u\n", e->ms, signalNames[e->signal], (unsigned)e->value);
+  }
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+/*
+ * Index of the next change of a signal at or after i, count if none
+ */
+static int SIM_TraceNext(const SIM_Trace *t, int i, int signal) {
+  while (i < t->count && t->events[i].signal != signal) i++;
+  return i;
+}
+
+/*
+ * Compare the run with the golden trace, signal by signal, and print what
+ * differs to out when it is not NULL. Returns the number of differences.
+ */
+static int SIM_TraceDiff(FILE *out) {
+  int diffs = 0;
+  double shift = 0;
+
+  for (int s = 0; s < SIM_TRACE_SIGNALS; s++) {
+    int i = SIM_TraceNext(&run, 0, s), j = SIM_TraceNext(&golden, 0, s), n = 1;
+    for (; i < run.count || j < golden.count; n++) {
+      const SIM_TraceEvent *a = i < run.count ? &run.events[i] : NULL;
+      const SIM_TraceEvent *b = j < golden.count ? &golden.events[j] : NULL;
+      if (a != NULL && b != NULL && a->value == b->value && a->period == b->period &&
+          fabs(a->ms - b->ms) <= toleranceMs + 5e-4) {
+        if (fabs(a->ms - b->ms) > fabs(shift)) shift = a->ms - b->ms;
+      }
+      else {
+        if (out != NULL && diffs < SIM_TRACE_MAX_REPORTS) {
+          fprintf(out, "trace: %s change %d: ", signalNames[s], n);
+          if (a != NULL) fprintf(out, "%u at %.3f ms", (unsigned)a->value, a->ms);
+          else fprintf(out, "missing");
+          if (b != NULL) fprintf(out, ", golden %u at %.3f ms\n", (unsigned)b->value, b->ms);
+          else fprintf(out, ", not in golden\n");
+        }
+        diffs++;
+      }
+      if (a != NULL) i = SIM_TraceNext(&run, i + 1, s);
+      if (b != NULL) j = SIM_TraceNext(&golden, j + 1, s);
+    }
+  }
+  if (out != NULL && diffs > SIM_TRACE_MAX_REPORTS)
+    fprintf(out, "trace: %d more differences\n", diffs - SIM_TRACE_MAX_REPORTS);
+  if (out != NULL && diffs == 0)
+    fprintf(out, "trace matches %s: %d changes, largest shift %+.3f ms\n", goldenPath, run.count, shift);
+  return diffs;
+}
+
+/*
+ * Differences from the golden trace, -1 without one. Only meaningful once
+ * the run has finished.
+ */
+int SIM_TraceCheck(FILE *out) {
+  if (goldenPath == NULL) return -1;
+  if (mismatches < 0 || out != NULL) mismatches = SIM_TraceDiff(out);
+  return mismatches;
+}
+
+static void SIM_TraceOnFinish(void *ctx, uint32_t a, uint32_t b, uint32_t c) {
+  (void)ctx;
+  (void)a;
+  (void)b;
+  (void)c;
+  if (outPath != NULL && SIM_TraceWrite(outPath) != 0) SIM_SetExitStatus(2);
+  if (goldenPath != NULL && SIM_TraceCheck(stdout) > 0) {
+    printf("trace differs from %s in %d changes (tolerance %.3f ms)\n", goldenPath, mismatches, toleranceMs);
+    SIM_SetExitStatus(1);
+  }
+}
+
+/*
+ * Trace the outputs, write them to tracePath and/or compare them with
+ * goldenFile at the end of the run. Either may be NULL. Call before
+ * SIM_Init, so the benchmark can read the result from its own finish
+ * listener.
+ */
+int SIM_TraceAttach(const char *tracePath, const char *goldenFile, double tolerance) {
+  outPath = tracePath;
+  goldenPath = goldenFile;
+  toleranceMs = tolerance;
+  if (goldenFile != NULL && SIM_TraceLoad(goldenFile, &golden) != 0) return -1;
+  SIM_Keep(&run, sizeof(run));
+  SIM_Listen(SIM_ON_GPIO, SIM_TraceOnGpio, NULL);
+  SIM_Listen(SIM_ON_PWM, SIM_TraceOnPwm, NULL);
+  SIM_Listen(SIM_ON_FINISH, SIM_TraceOnFinish, NULL);
+  return 0;
+}
@@ -0,0 +1,359 @@
+/*
+ * File: sim_us100.c
+ * Purpose: Defines the behavioural model of the US-100 ultrasonic sensor in
+ *          UART mode. It listens for the bytes the firmware sends on USART3
+ *          and answers 0x55 with a two byte distance and 0x50 with a one byte
+ *          temperature, after the time the real sensor would need: the
+ *          trigger delay, the echo flight time 2 * d / c and the UART frames.
+ *
+ *          What the sensor sees is scripted by a scenario file. Each line is
+ *          "<time ms> <setting> <value>":
+ *            distance <mm>   object jumps to this distance
+ *            ramp <mm>       object moves linearly from the previous keyframe
+ *            noise <mm>      standard deviation of the measurement noise
+ *            dropout <%>     chance that a distance request gets no answer
+ *            temp <C>        air temperature
+ *            fault <kind>    none, silent (no answers), stuck (repeats the
+ *                            last distance) or garbage (one random byte)
+ *            bias <mm>       added to every distance the sensor measures,
+ *                            like a sensor mounted behind the brim
+ *            gain <factor>   multiplies every distance the sensor measures
+ *          plus "seed <n>" and "end <ms>" lines without a time. Noise and
+ *          dropouts come from a seeded generator, so a scenario always
+ *          produces the same run.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define SIM_US100_MAX_KEYS 64
+#define SIM_US100_TRIGGER_US 1000      // command decode and burst before the echo starts
+#define SIM_US100_TEMP_US 2000         // temperature conversion
+#define SIM_US100_MAX_RANGE_MM 4500    // no echo beyond this
+#define SIM_US100_TIMEOUT_US 66000     // echo timeout, answered with the out of range value
+#define SIM_US100_OUT_OF_RANGE 0x2AF8  // value sent when no echo came back
+
+typedef enum {
+  SIM_KEY_DISTANCE,
+  SIM_KEY_RAMP,
+  SIM_KEY_NOISE,
+  SIM_KEY_DROPOUT,
+  SIM_KEY_TEMP,
+  SIM_KEY_FAULT,
+  SIM_KEY_BIAS,
+  SIM_KEY_GAIN
+} SIM_KeyType;
+
+typedef enum {
+  SIM_FAULT_NONE,
+  SIM_FAULT_SILENT,
+  SIM_FAULT_STUCK,
+  SIM_FAULT_GARBAGE,
+  SIM_FAULT_COUNT
+} SIM_Fault;
+
+typedef struct {
+  uint64_t when;      // cycles
+  SIM_KeyType type;
+  double value;
+} SIM_Key;
+
+typedef struct {
+  SIM_Key keys[SIM_US100_MAX_KEYS];
+  int keyCount;
+  uint64_t seed;
+  uint64_t endMs;
+  uint64_t rng;
+  uint8_t busy;
+  uint8_t pending;    // command waiting in the sensor's UART while it is busy
+  uint8_t reply[2];
+  uint8_t length;
+  uint8_t next;
+  uint16_t lastDistance;
+  SIM_Event send;
+} SIM_Us100;
+
+static const char *faultNames[SIM_FAULT_COUNT] = { "none", "silent", "stuck", "garbage" };
+
+static SIM_Us100 us100 = { .keyCount = 0, .seed = 1 };
+SIM_Us100Stats simUs100Stats;
+
+/*
+ * xorshift64*, so a scenario replays identically on every host
+ */
+static uint64_t SIM_Us100Random(void) {
+  us100.rng ^= us100.rng >> 12;
+  us100.rng ^= us100.rng << 25;
+  us100.rng ^= us100.rng >> 27;
+  return us100.rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double SIM_Us100Uniform(void) {
+  return (SIM_Us100Random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double SIM_Us100Gaussian(void) {
+  double u1 = SIM_Us100Uniform(), u2 = SIM_Us100Uniform();
+  if (u1 < 1e-12) u1 = 1e-12;
+  return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/*
+ * Value of a step setting (noise, dropout, temperature, fault, bias, gain) at time t
+ */
+static double SIM_Us100Setting(SIM_KeyType type, uint64_t t, double initial) {
+  double value = initial;
+  for (int i = 0; i < us100.keyCount && us100.keys[i].when <= t; i++) {
+    if (us100.keys[i].type == type) value = us100.keys[i].value;
+  }
+  return value;
+}
+
+/*
+ * True distance at time t: the last distance keyframe, or the line towards
+ * the next ramp keyframe
+ */
+static double SIM_Us100Distance(uint64_t t) {
+  const SIM_Key *prev = NULL;
+  for (int i = 0; i < us100.keyCount; i++) {
+    const SIM_Key *k = &us100.keys[i];
+    if (k->type != SIM_KEY_DISTANCE && k->type != SIM_KEY_RAMP) continue;
+    if (k->when <= t) {
+      prev = k;
+      continue;
+    }
+    if (prev != NULL && k->type == SIM_KEY_RAMP) {
+      double f = (double)(t - prev->when) / (double)(k->when - prev->when);
+      return prev->value + f * (k->value - prev->value);
+    }
+    break;
+  }
+  return prev != NULL ? prev->value : SIM_US100_OUT_OF_RANGE;
+}
+
+/*
+ * Send the next byte of the reply, back to back like the sensor's UART does
+ */
+static void SIM_Us100Command(SIM_Us100 *s, uint8_t byte);
+
+static void SIM_Us100Send(void *ctx) {
+  SIM_Us100 *s = (SIM_Us100 *)ctx;
+  SIM_UartInject(SIM_USART3, s->reply[s->next++]);
+  if (s->next < s->length) {
+    SIM_Schedule(&s->send, SIM_Now() + SIM_UartFrameCycles(SIM_USART3));
+    return;
+  }
+  s->busy = 0;
+  if (s->pending) {
+    uint8_t byte = s->pending;
+    s->pending = 0;
+    SIM_Us100Command(s, byte);
+  }
+}
+
+static void SIM_Us100Reply(SIM_Us100 *s, uint64_t delay) {
+  s->next = 0;
+  s->busy = 1;
+  simUs100Stats.replies++;
+  SIM_Schedule(&s->send, SIM_Now() + delay);
+}
+
+/*
+ * The sensor measures when it takes the command and answers once the echo
+ * is back. The speed of sound follows the air temperature; the sensor
+ * compensates for it, so only the timing changes.
+ */
+static void SIM_Us100Command(SIM_Us100 *s, uint8_t byte) {
+  uint64_t t = SIM_Now();
+  double temp = SIM_Us100Setting(SIM_KEY_TEMP, t, 25);
+  SIM_Fault fault = (SIM_Fault)SIM_Us100Setting(SIM_KEY_FAULT, t, SIM_FAULT_NONE);
+
+  if (fault == SIM_FAULT_SILENT) {
+    simUs100Stats.dropouts++;
+    return;
+  }
+  if (fault == SIM_FAULT_GARBAGE) {
+    s->reply[0] = (uint8_t)SIM_Us100Random();
+    s->length = 1;
+    SIM_Us100Reply(s, SIM_US(SIM_US100_TRIGGER_US));
+    return;
+  }
+
+  if (byte == 0x50) {
+    s->reply[0] = (uint8_t)(lround(temp) + 45);
+    s->length = 1;
+    SIM_Us100Reply(s, SIM_US(SIM_US100_TEMP_US));
+    return;
+  }
+
+  if (SIM_Us100Uniform() * 100.0 < SIM_Us100Setting(SIM_KEY_DROPOUT, t, 0)) {
+    simUs100Stats.dropouts++;
+    return;
+  }
+
+  double d = SIM_Us100Distance(t);
+  double c = 331.3 + 0.606 * temp;  // m/s, also mm/ms
+  uint64_t flight;
+  uint16_t mm;
+
+  if (fault == SIM_FAULT_STUCK) {
+    mm = s->lastDistance;
+    flight = SIM_US((uint64_t)(2000.0 * mm / c));
+  }
+  else if (d > SIM_US100_MAX_RANGE_MM) {
+    mm = SIM_US100_OUT_OF_RANGE;
+    flight = SIM_US(SIM_US100_TIMEOUT_US);
+  }
+  else {
+    flight = SIM_US((uint64_t)(2000.0 * d / c));
+    d = d * SIM_Us100Setting(SIM_KEY_GAIN, t, 1) + SIM_Us100Setting(SIM_KEY_BIAS, t, 0);
+    d += SIM_Us100Gaussian() * SIM_Us100Setting(SIM_KEY_NOISE, t, 0);
+    mm = d < 0 ? 0 : (uint16_t)lround(d);
+  }
+  s->lastDistance = mm;
+  s->reply[0] = mm >> 8;
+  s->reply[1] = mm & 0xFF;
+  s->length = 2;
+  SIM_Us100Reply(s, SIM_US(SIM_US100_TRIGGER_US) + flight);
+}
+
+/*
+ * The sensor handles one command at a time. A command sent while it is busy
+ * waits in its UART receive register, and a second one overwrites it.
+ */
+static void SIM_Us100OnTx(void *ctx, uint32_t uart, uint32_t byte, uint32_t unused) {
+  SIM_Us100 *s = (SIM_Us100 *)ctx;
+  (void)unused;
+
+  if (uart != SIM_USART3 || (byte != 0x55 && byte != 0x50)) return;
+  simUs100Stats.requests++;
+  if (!s->busy) {
+    SIM_Us100Command(s, byte);
+    return;
+  }
+  if (s->pending) simUs100Stats.ignored++;
+  else simUs100Stats.queued++;
+  s->pending = byte;
+}
+
+static int SIM_Us100AddKey(uint64_t ms, SIM_KeyType type, double value) {
+  if (us100.keyCount == SIM_US100_MAX_KEYS) return -1;
+  // keep the keys in time order, stable for keys at the same time
+  int i = us100.keyCount++;
+  while (i > 0 && us100.keys[i - 1].when > SIM_MS(ms)) {
+    us100.keys[i] = us100.keys[i - 1];
+    i--;
+  }
+  us100.keys[i].when = SIM_MS(ms);
+  us100.keys[i].type = type;
+  us100.keys[i].value = value;
+  return 0;
+}
+
+/*
+ * A scenario with an object that never moves
+ */
+void SIM_Us100Constant(uint16_t distance, int16_t temperature) {
+  us100.keyCount = 0;
+  SIM_Us100AddKey(0, SIM_KEY_DISTANCE, distance);
+  SIM_Us100AddKey(0, SIM_KEY_TEMP, temperature);
+}
+
+/*
+ * Read a scenario file, returns 0 on success
+ */
+int SIM_Us100Load(const char *path) {
+  static const char *settings[] = { "distance", "ramp", "noise", "dropout", "temp", "fault", "bias", "gain" };
+  char line[256];
+  int lineNo = 0;
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  us100.keyCount = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char word[32], arg[32];
+    unsigned long long ms;
+    int type;
+
+    lineNo++;
+    char *hash = strchr(line, '#');
+    if (hash != NULL) *hash = '\0';
+    if (sscanf(line, " %31s", word) != 1) continue;
+
+    if (sscanf(line, " seed %llu", &ms) == 1) {
+      us100.seed = ms;
+      continue;
+    }
+    if (sscanf(line, " end %llu", &ms) == 1) {
+      us100.endMs = ms;
+      continue;
+    }
+    if (sscanf(line, " %llu %31s %31s", &ms, word, arg) != 3) goto bad;
+    for (type = 0; type <= SIM_KEY_GAIN; type++) {
+      if (strcmp(word, settings[type]) == 0) break;
+    }
+    if (type > SIM_KEY_GAIN) goto bad;
+
+    double value;
+    if (type == SIM_KEY_FAULT) {
+      int fault;
+      for (fault = 0; fault < SIM_FAULT_COUNT; fault++) {
+        if (strcmp(arg, faultNames[fault]) == 0) break;
+      }
+      if (fault == SIM_FAULT_COUNT) goto bad;
+      value = fault;
+    }
+    else {
+      char *end;
+      value = strtod(arg, &end);
+      if (*end != '\0') goto bad;
+    }
+    if (SIM_Us100AddKey(ms, (SIM_KeyType)type, value) != 0) {
+      fprintf(stderr, "%s:%d: too many keyframes (max %d)\n", path, lineNo, SIM_US100_MAX_KEYS);
+      fclose(f);
+      return -1;
+    }
+  }
+  fclose(f);
+  return 0;
+
+bad:
+  fprintf(stderr, "%s:%d: cannot parse \"%s\"\n", path, lineNo, strtok(line, "\n"));
+  fclose(f);
+  return -1;
+}
+
+void SIM_Us100SetSeed(uint64_t seed) {
+  us100.seed = seed;
+}
+
+uint64_t SIM_Us100EndMs(void) {
+  return us100.endMs;
+}
+
+/*
+ * Distance of the object at time t before any noise, used to score runs
+ */
+double SIM_Us100TrueDistance(uint64_t t) {
+  return SIM_Us100Distance(t);
+}
+
+/*
+ * Connect the sensor to USART3
+ */
+void SIM_Us100Attach(void) {
+  us100.rng = us100.seed ? us100.seed : 1;
+  // the sensor does not reset with the MCU; a reply on its way is lost with the USART
+  SIM_Keep(&us100.rng, sizeof(us100.rng));
+  SIM_Keep(&us100.lastDistance, sizeof(us100.lastDistance));
+  SIM_Keep(&simUs100Stats, sizeof(simUs100Stats));
+  us100.send.fire = SIM_Us100Send;
+  us100.send.ctx = &us100;
+  SIM_Listen(SIM_ON_UART_TX, SIM_Us100OnTx, &us100);
+}
@@ -0,0 +1,596 @@
+/*
+ * File: sim_usb.c
+ * Purpose: Defines the model of the USB device peripheral and of the host
+ *          at the other end of the cable. The peripheral model keeps the
+ *          endpoint registers' odd write semantics (CTR flags cleared by
+ *          writing 0, STAT and DTOG bits toggled by writing 1) and the
+ *          packet memory the firmware's buffers live in.
+ *
+ *          The host, attached with --usb, waits for the pull-up on D+,
+ *          resets the bus and enumerates the device the way a PC would:
+ *          descriptors, address, configuration, then the CDC line coding
+ *          and DTR that a terminal sets when it opens the port. It then
+ *          asks the bulk IN endpoint for data once a frame, decodes the
+ *          telemetry frames in it and checks their sync, length, CRC and
+ *          sequence, independently of the firmware's own code. The stream
+ *          can also be written to a pseudo-terminal, for any serial tool on
+ *          the host to read, and the decoded frames to a file.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stm32f0xx_hal.h"
+#include "usbCdc.h"
+#include "sim.h"
+
+// after CMSIS: termios has macros named CR1 and CR2
+#include <termios.h>
+
+#define REG(p, type) ((type *)SIM_Regs(p))
+#define SIM_EPR(ep) (*(&REG(SIM_USB, USB_TypeDef)->EP0R + 2 * (ep)))
+
+#define SIM_USB_ENDPOINTS 8
+#define SIM_USB_FLAGS 0x7F80          // ISTR flags cleared by writing 0, CTR is read-only
+#define SIM_USB_TOGGLE (USB_EP_DTOG_RX | USB_EPRX_STAT | USB_EP_DTOG_TX | USB_EPTX_STAT)
+#define SIM_USB_RW (USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)
+
+#define SIM_USB_ATTACH_MS 100         // the host debounces the pull-up before the reset
+#define SIM_USB_RESET_MS 10           // bus reset, then the first request
+#define SIM_USB_RECOVERY_MS 2         // after SET_ADDRESS, before the new address is used
+#define SIM_USB_RETRY_US 100          // between transactions while enumerating
+#define SIM_USB_POLL_US 1000          // bulk IN is asked once a frame
+#define SIM_USB_TIMEOUT_MS 500        // a control transfer that takes longer fails
+#define SIM_USB_ADDRESS 7
+#define SIM_USB_MAX_PACKET 64
+
+// Telemetry frame layout, see Src/telemetry.h
+#define SIM_USB_FRAME 24
+#define SIM_USB_VERSION 1
+
+// Transaction results
+#define SIM_USB_ACK 1
+#define SIM_USB_NAK 0
+#define SIM_USB_STALL -1
+#define SIM_USB_NONE -2               // no answer: wrong address, or the endpoint is disabled
+
+typedef enum {
+  SIM_HOST_DETACHED,
+  SIM_HOST_ATTACHING,
+  SIM_HOST_RESET,
+  SIM_HOST_SETUP,
+  SIM_HOST_DATA_IN,
+  SIM_HOST_DATA_OUT,
+  SIM_HOST_STATUS_IN,
+  SIM_HOST_STATUS_OUT,
+  SIM_HOST_STREAM,
+  SIM_HOST_FAILED
+} SIM_HostState;
+
+// A control request of enumeration, in the order a PC sends them
+typedef struct {
+  const char *name;
+  uint8_t setup[8];
+  const uint8_t *out;     // OUT data, wLength bytes
+  uint8_t stall;          // the device should refuse it
+} SIM_UsbRequest;
+
+static const uint8_t lineCoding[7] = { 0x00, 0xC2, 0x01, 0x00, 0, 0, 8 };  // 115200 8N1
+
+static const SIM_UsbRequest requests[] = {
+  { .name = "GET_DESCRIPTOR(device)", .setup = { 0x80, 6, 0, 1, 0, 0, 64, 0 } },
+  { .name = "SET_ADDRESS", .setup = { 0x00, 5, SIM_USB_ADDRESS, 0, 0, 0, 0, 0 } },
+  { .name = "GET_DESCRIPTOR(device)", .setup = { 0x80, 6, 0, 1, 0, 0, 18, 0 } },
+  { .name = "GET_DESCRIPTOR(configuration)", .setup = { 0x80, 6, 0, 2, 0, 0, 9, 0 } },
+  { .name = "GET_DESCRIPTOR(configuration)", .setup = { 0x80, 6, 0, 2, 0, 0, 255, 0 } },
+  { .name = "GET_DESCRIPTOR(string 0)", .setup = { 0x80, 6, 0, 3, 0, 0, 255, 0 } },
+  { .name = "GET_DESCRIPTOR(string 1)", .setup = { 0x80, 6, 1, 3, 0x09, 0x04, 255, 0 } },
+  { .name = "GET_DESCRIPTOR(string 2)", .setup = { 0x80, 6, 2, 3, 0x09, 0x04, 255, 0 } },
+  { .name = "GET_DESCRIPTOR(device qualifier)", .setup = { 0x80, 6, 0, 6, 0, 0, 10, 0 }, .stall = 1 },
+  { .name = "SET_CONFIGURATION", .setup = { 0x00, 9, 1, 0, 0, 0, 0, 0 } },
+  { .name = "SET_LINE_CODING", .setup = { 0x21, 0x20, 0, 0, 0, 0, 7, 0 }, .out = lineCoding },
+  { .name = "GET_LINE_CODING", .setup = { 0xA1, 0x21, 0, 0, 0, 0, 7, 0 } },
+  { .name = "SET_CONTROL_LINE_STATE", .setup = { 0x21, 0x22, 3, 0, 0, 0, 0, 0 } },
+};
+
+#define SIM_USB_REQUESTS (int)(sizeof(requests) / sizeof(requests[0]))
+
+// What the endpoint registers and ISTR hold, the register file only has the last write
+static uint16_t epr[SIM_USB_ENDPOINTS];
+static uint16_t istr;
+static uint8_t pulledUp;
+
+static struct {
+  uint8_t attached;
+  SIM_HostState state;
+  SIM_Event tick;
+  uint8_t address;              // the device's address as the host uses it
+  int request;                  // index in requests
+  uint64_t stageStart;
+  uint8_t data[256];            // IN data of the request
+  uint16_t received;
+  uint16_t sent;                // OUT data sent
+  uint16_t configLength;        // wTotalLength of the configuration descriptor
+  char product[32];
+  uint64_t enumeratedAt;
+  uint32_t failures;
+  // the telemetry stream
+  uint8_t buffer[2 * SIM_USB_FRAME + SIM_USB_MAX_PACKET];
+  int buffered;
+  uint8_t inSync;
+  SIM_Telemetry telemetry;
+  uint32_t bytes, bad;
+  int pty, ptySlave;
+  uint32_t ptyLost;             // bytes no one read before the pseudo-terminal filled up
+} host = { .telemetry = { .lastSequence = -1 }, .inSync = 1, .pty = -1, .ptySlave = -1 };
+
+static void SIM_UsbFail(const char *what, const char *request) {
+  fprintf(stderr, "sim: USB host: %s%s%s at %.3f ms\n", request ? request : "", request ? " " : "", what,
+          SIM_Now() / 8000.0);
+  host.failures++;
+  host.state = SIM_HOST_FAILED;
+}
+
+/*
+ * Peripheral: registers
+ */
+static void SIM_UsbSetEpr(int ep, uint16_t value) {
+  epr[ep] = value;
+  SIM_EPR(ep) = value;
+}
+
+/*
+ * CTR, DIR and EP_ID show the lowest endpoint with a transfer done
+ */
+static void SIM_UsbUpdateIstr(void) {
+  istr &= ~(USB_ISTR_CTR | USB_ISTR_DIR | USB_ISTR_EP_ID);
+  for (int ep = 0; ep < SIM_USB_ENDPOINTS; ep++) {
+    if (!(epr[ep] & (USB_EP_CTR_RX | USB_EP_CTR_TX))) continue;
+    istr |= USB_ISTR_CTR | ep | (epr[ep] & USB_EP_CTR_RX ? USB_ISTR_DIR : 0);
+    break;
+  }
+  REG(SIM_USB, USB_TypeDef)->ISTR = istr;
+}
+
+/*
+ * A reset on the bus, or forced by FRES: endpoints and address cleared
+ */
+static void SIM_UsbBusReset(void) {
+  for (int ep = 0; ep < SIM_USB_ENDPOINTS; ep++) SIM_UsbSetEpr(ep, 0);
+  REG(SIM_USB, USB_TypeDef)->DADDR = 0;
+  istr |= USB_ISTR_RESET;
+  SIM_UsbUpdateIstr();
+}
+
+void SIM_UsbReset(void) {
+  REG(SIM_USB, USB_TypeDef)->CNTR = USB_CNTR_FRES | USB_CNTR_PDWN;
+}
+
+void SIM_UsbWrite(uint32_t offset) {
+  USB_TypeDef *usb = REG(SIM_USB, USB_TypeDef);
+
+  if (offset < 4 * SIM_USB_ENDPOINTS) {
+    int ep = offset / 4;
+    uint16_t w = SIM_EPR(ep), s = epr[ep];
+    SIM_UsbSetEpr(ep, (s & w & (USB_EP_CTR_RX | USB_EP_CTR_TX)) | ((s ^ w) & SIM_USB_TOGGLE) |
+                      (s & USB_EP_SETUP) | (w & SIM_USB_RW));
+    SIM_UsbUpdateIstr();
+    return;
+  }
+  switch (offset) {
+    case offsetof(USB_TypeDef, CNTR):
+      if (usb->CNTR & USB_CNTR_FRES) SIM_UsbBusReset();
+      break;
+    case offsetof(USB_TypeDef, ISTR):
+      istr &= usb->ISTR | ~SIM_USB_FLAGS;
+      SIM_UsbUpdateIstr();
+      break;
+    case offsetof(USB_TypeDef, BCDR):
+      if ((usb->BCDR & USB_BCDR_DPPU) && !pulledUp) {
+        pulledUp = 1;
+        if (!host.attached) break;
+        host.state = SIM_HOST_ATTACHING;
+        SIM_Schedule(&host.tick, SIM_Now() + SIM_MS(SIM_USB_ATTACH_MS));
+      }
+      else if (!(usb->BCDR & USB_BCDR_DPPU) && pulledUp) {
+        pulledUp = 0;
+        if (host.state != SIM_HOST_FAILED) host.state = SIM_HOST_DETACHED;
+        SIM_Cancel(&host.tick);
+      }
+      break;
+  }
+}
+
+int SIM_UsbIrqLine(void) {
+  return (istr & REG(SIM_USB, USB_TypeDef)->CNTR & 0xFF80) != 0;
+}
+
+/*
+ * Peripheral: transactions from the host. The endpoint register answering
+ * an address and endpoint number, -1 if none does.
+ */
+static int SIM_UsbFind(uint8_t ep) {
+  uint16_t daddr = REG(SIM_USB, USB_TypeDef)->DADDR;
+
+  if (!(daddr & USB_DADDR_EF) || (daddr & USB_DADDR_ADD) != host.address) return -1;
+  for (int i = 0; i < SIM_USB_ENDPOINTS; i++) {
+    if ((epr[i] & USB_EPADDR_FIELD) == ep) return i;
+  }
+  return -1;
+}
+
+// An entry of the buffer descriptor table: 0 ADDR_TX, 1 COUNT_TX, 2 ADDR_RX, 3 COUNT_RX
+static uint16_t *SIM_UsbBdt(int i, int field) {
+  uint8_t *pma = SIM_Regs(SIM_USBPMA);
+  uint16_t btable = REG(SIM_USB, USB_TypeDef)->BTABLE & 0xFFF8;
+  return (uint16_t *)(pma + ((btable + 8 * i + 2 * field) & 0x3FE));
+}
+
+/*
+ * Data into an endpoint's RX buffer, 0 if it does not fit the size its COUNT_RX gives
+ */
+static int SIM_UsbToPma(int i, const uint8_t *data, int length) {
+  uint8_t *pma = SIM_Regs(SIM_USBPMA);
+  uint16_t addr = *SIM_UsbBdt(i, 2), *count = SIM_UsbBdt(i, 3);
+  int blocks = (*count >> 10) & 0x1F;
+  int size = *count & 0x8000 ? (blocks + 1) * 32 : blocks * 2;
+
+  if (length > size) {
+    char what[64];
+    snprintf(what, sizeof(what), "sent %d bytes to a %d byte buffer", length, size);
+    SIM_UsbFail(what, host.request < SIM_USB_REQUESTS ? requests[host.request].name : NULL);
+    return 0;
+  }
+  for (int k = 0; k < length; k++) pma[(addr + k) & 0x3FF] = data[k];
+  *count = (*count & 0xFC00) | length;
+  return 1;
+}
+
+static int SIM_UsbSetup(const uint8_t *setup) {
+  int i = SIM_UsbFind(0);
+
+  if (i < 0 || (epr[i] & USB_EP_T_FIELD) != USB_EP_CONTROL) return SIM_USB_NONE;
+  // a SETUP is taken whatever STAT_RX says, unless the last one is still there
+  if (epr[i] & USB_EP_CTR_RX) return SIM_USB_NAK;
+  if (!SIM_UsbToPma(i, setup, 8)) return SIM_USB_NONE;
+  SIM_UsbSetEpr(i, (epr[i] & ~USB_EPRX_STAT) | USB_EP_CTR_RX | USB_EP_SETUP | USB_EP_RX_NAK);
+  SIM_UsbUpdateIstr();
+  return SIM_USB_ACK;
+}
+
+static int SIM_UsbOut(uint8_t ep, const uint8_t *data, int length) {
+  int i = SIM_UsbFind(ep);
+
+  if (i < 0) return SIM_USB_NONE;
+  switch (epr[i] & USB_EPRX_STAT) {
+    case USB_EP_RX_DIS: return SIM_USB_NONE;
+    case USB_EP_RX_STALL: return SIM_USB_STALL;
+    case USB_EP_RX_NAK: return SIM_USB_NAK;
+  }
+  if (!SIM_UsbToPma(i, data, length)) return SIM_USB_NONE;
+  SIM_UsbSetEpr(i, ((epr[i] & ~(USB_EPRX_STAT | USB_EP_SETUP)) | USB_EP_CTR_RX | USB_EP_RX_NAK) ^ USB_EP_DTOG_RX);
+  SIM_UsbUpdateIstr();
+  return SIM_USB_ACK;
+}
+
+static int SIM_UsbIn(uint8_t ep, uint8_t *data, int *length) {
+  uint8_t *pma = SIM_Regs(SIM_USBPMA);
+  int i = SIM_UsbFind(ep);
+
+  if (i < 0) return SIM_USB_NONE;
+  switch (epr[i] & USB_EPTX_STAT) {
+    case USB_EP_TX_DIS: return SIM_USB_NONE;
+    case USB_EP_TX_STALL: return SIM_USB_STALL;
+    case USB_EP_TX_NAK: return SIM_USB_NAK;
+  }
+  uint16_t addr = *SIM_UsbBdt(i, 0);
+  *length = *SIM_UsbBdt(i, 1) & 0x3FF;
+  if (*length > SIM_USB_MAX_PACKET) {
+    SIM_UsbFail("got a packet longer than 64 bytes", NULL);
+    return SIM_USB_NONE;
+  }
+  for (int k = 0; k < *length; k++) data[k] = pma[(addr + k) & 0x3FF];
+  SIM_UsbSetEpr(i, ((epr[i] & ~USB_EPTX_STAT) | USB_EP_CTR_TX | USB_EP_TX_NAK) ^ USB_EP_DTOG_TX);
+  SIM_UsbUpdateIstr();
+  return SIM_USB_ACK;
+}
+
+/*
+ * Telemetry frames: CRC-16/CCITT bit by bit, not the firmware's table
+ */
+uint16_t SIM_TelemetryCrc(const uint8_t *p, int length) {
+  uint16_t crc = 0xFFFF;
+
+  while (length--) {
+    crc ^= *p++ << 8;
+    for (int b = 0; b < 8; b++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+/*
+ * Check a frame's sync, length, version and CRC, with offsets of its own
+ * rather than the firmware's struct. A good frame counts the sequence
+ * numbers it skipped and is written out. Returns 0 for a bad one.
+ */
+int SIM_TelemetryFrame(SIM_Telemetry *t, const uint8_t *f, int length) {
+  if (length != SIM_USB_FRAME || f[0] != 0xA5 || f[1] != 0x5A || f[2] != SIM_USB_FRAME || f[3] != SIM_USB_VERSION ||
+      SIM_TelemetryCrc(f, SIM_USB_FRAME - 2) != (f[SIM_USB_FRAME - 2] | f[SIM_USB_FRAME - 1] << 8))
+    return 0;
+  int sequence = f[4] | f[5] << 8;
+  if (t->lastSequence >= 0) t->missing += (sequence - t->lastSequence - 1) & 0xFFFF;
+  t->lastSequence = sequence;
+  t->frames++;
+  if (t->out != NULL)
+    fprintf(t->out, "%u %u %u %u %u %u %u %d %u %u %u\n", (unsigned)sequence,
+            (unsigned)(f[8] | f[9] << 8 | f[10] << 16 | (uint32_t)f[11] << 24), (unsigned)f[6],
+            (unsigned)(f[12] | f[13] << 8), (unsigned)(f[14] | f[15] << 8), (unsigned)f[7], (unsigned)f[16],
+            (int8_t)f[17], (unsigned)f[18], (unsigned)f[19], (unsigned)f[20]);
+  return 1;
+}
+
+/*
+ * Host: the stream on bulk IN has no delimiters, so a bad frame is followed
+ * by a search for the next sync, byte by byte
+ */
+static void SIM_UsbDecode(const uint8_t *data, int length) {
+  host.bytes += length;
+  if (host.pty >= 0 && write(host.pty, data, length) != length) host.ptyLost += length;
+  memcpy(&host.buffer[host.buffered], data, length);
+  host.buffered += length;
+
+  while (host.buffered >= SIM_USB_FRAME) {
+    if (!SIM_TelemetryFrame(&host.telemetry, host.buffer, SIM_USB_FRAME)) {
+      // count a bad frame once
+      if (host.inSync) host.bad++;
+      host.inSync = 0;
+      memmove(host.buffer, host.buffer + 1, --host.buffered);
+      continue;
+    }
+    host.inSync = 1;
+    memmove(host.buffer, host.buffer + SIM_USB_FRAME, host.buffered -= SIM_USB_FRAME);
+  }
+}
+
+/*
+ * Host: enumeration. Check what a request got back.
+ */
+static void SIM_UsbCheck(const SIM_UsbRequest *r) {
+  uint8_t *d = host.data;
+  uint16_t asked = r->setup[6] | r->setup[7] << 8;
+
+  if (r->setup[0] != 0x80 || r->setup[1] != 6) {
+    if (r->setup[1] == 0x21 && (host.received != sizeof(lineCoding) || memcmp(d, lineCoding, sizeof(lineCoding)) != 0))
+      SIM_UsbFail("did not return the line coding that was set", r->name);
+    return;
+  }
+  switch (r->setup[3]) {
+    case 1:
+      if (host.received < 8 || d[0] != 18 || d[1] != 1 || (host.received < asked && host.received != 18))
+        SIM_UsbFail("returned a bad device descriptor", r->name);
+      else if (d[7] != SIM_USB_MAX_PACKET)
+        SIM_UsbFail("has a control endpoint of other than 64 bytes", r->name);
+      break;
+    case 2:
+      if (host.received < 9 || d[1] != 2) SIM_UsbFail("returned a bad configuration descriptor", r->name);
+      else if (asked == 9) host.configLength = d[2] | d[3] << 8;
+      else if (host.received != host.configLength) SIM_UsbFail("returned less than wTotalLength", r->name);
+      break;
+    case 3:
+      if (host.received < 2 || d[0] != host.received || d[1] != 3) SIM_UsbFail("returned a bad string", r->name);
+      else if (r->setup[2] == 2) {
+        int n = 0;
+        for (int k = 2; k + 1 < host.received && n < (int)sizeof(host.product) - 1; k += 2) host.product[n++] = d[k];
+        host.product[n] = '\0';
+      }
+      break;
+  }
+}
+
+static void SIM_UsbStartRequest(void) {
+  host.state = SIM_HOST_SETUP;
+  host.received = 0;
+  host.sent = 0;
+  host.stageStart = SIM_Now();
+}
+
+/*
+ * The request is through, or stalled as it should: on to the next one.
+ * Returns the time to the next transaction.
+ */
+static uint64_t SIM_UsbDone(void) {
+  const SIM_UsbRequest *r = &requests[host.request];
+
+  SIM_UsbCheck(r);
+  if (host.state == SIM_HOST_FAILED) return 0;
+  host.request++;
+  if (host.request == SIM_USB_REQUESTS) {
+    host.state = SIM_HOST_STREAM;
+    host.enumeratedAt = SIM_Now();
+    return SIM_US(SIM_USB_POLL_US);
+  }
+  SIM_UsbStartRequest();
+  if (r->setup[1] == 5) {
+    host.address = r->setup[2];
+    return SIM_MS(SIM_USB_RECOVERY_MS);
+  }
+  return SIM_US(SIM_USB_RETRY_US);
+}
+
+/*
+ * A stall ends a request the device should refuse, and fails any other
+ */
+static uint64_t SIM_UsbStalled(void) {
+  if (!requests[host.request].stall) {
+    SIM_UsbFail("stalled", requests[host.request].name);
+    return 0;
+  }
+  host.request++;
+  SIM_UsbStartRequest();
+  return SIM_US(SIM_USB_RETRY_US);
+}
+
+/*
+ * One transaction of the control transfer in progress
+ */
+static uint64_t SIM_UsbControl(void) {
+  const SIM_UsbRequest *r = &requests[host.request];
+  uint16_t wLength = r->setup[6] | r->setup[7] << 8;
+  uint8_t packet[SIM_USB_MAX_PACKET];
+  int length = 0, result;
+
+  if (SIM_Now() - host.stageStart > SIM_MS(SIM_USB_TIMEOUT_MS)) {
+    SIM_UsbFail("timed out", r->name);
+    return 0;
+  }
+  switch (host.state) {
+    case SIM_HOST_SETUP:
+      result = SIM_UsbSetup(r->setup);
+      if (result == SIM_USB_ACK) {
+        host.stageStart = SIM_Now();
+        if (wLength == 0) host.state = SIM_HOST_STATUS_IN;
+        else host.state = r->setup[0] & 0x80 ? SIM_HOST_DATA_IN : SIM_HOST_DATA_OUT;
+      }
+      break;
+    case SIM_HOST_DATA_IN:
+      result = SIM_UsbIn(0, packet, &length);
+      if (result != SIM_USB_ACK) break;
+      if (host.received + length > wLength) {
+        SIM_UsbFail("returned more than wLength", r->name);
+        return 0;
+      }
+      memcpy(&host.data[host.received], packet, length);
+      host.received += length;
+      // a short packet, or all that was asked, ends the data stage
+      if (length < SIM_USB_MAX_PACKET || host.received == wLength) host.state = SIM_HOST_STATUS_OUT;
+      break;
+    case SIM_HOST_DATA_OUT:
+      length = wLength - host.sent < SIM_USB_MAX_PACKET ? wLength - host.sent : SIM_USB_MAX_PACKET;
+      result = SIM_UsbOut(0, r->out + host.sent, length);
+      if (result != SIM_USB_ACK) break;
+      host.sent += length;
+      if (host.sent == wLength) host.state = SIM_HOST_STATUS_IN;
+      break;
+    case SIM_HOST_STATUS_IN:
+      result = SIM_UsbIn(0, packet, &length);
+      if (result != SIM_USB_ACK) break;
+      if (length != 0) {
+        SIM_UsbFail("sent data in the status stage", r->name);
+        return 0;
+      }
+      return SIM_UsbDone();
+    case SIM_HOST_STATUS_OUT:
+      result = SIM_UsbOut(0, NULL, 0);
+      if (result == SIM_USB_ACK) return SIM_UsbDone();
+      break;
+    default:
+      return 0;
+  }
+  if (host.state == SIM_HOST_FAILED) return 0;
+  if (result == SIM_USB_STALL) return SIM_UsbStalled();
+  if (result == SIM_USB_NONE) {
+    SIM_UsbFail("got no answer", r->name);
+    return 0;
+  }
+  return SIM_US(SIM_USB_RETRY_US);
+}
+
+static void SIM_UsbTick(void *ctx) {
+  uint8_t packet[SIM_USB_MAX_PACKET];
+  uint64_t next = 0;
+  int length = 0;
+  (void)ctx;
+
+  switch (host.state) {
+    case SIM_HOST_ATTACHING:
+      SIM_UsbBusReset();
+      host.state = SIM_HOST_RESET;
+      next = SIM_MS(SIM_USB_RESET_MS);
+      break;
+    case SIM_HOST_RESET:
+      host.address = 0;
+      host.request = 0;
+      SIM_UsbStartRequest();
+      next = SIM_UsbControl();
+      break;
+    case SIM_HOST_STREAM:
+      if (SIM_UsbIn(1, packet, &length) == SIM_USB_ACK) SIM_UsbDecode(packet, length);
+      next = SIM_US(SIM_USB_POLL_US);
+      break;
+    default:
+      next = SIM_UsbControl();
+      break;
+  }
+  if (host.state != SIM_HOST_FAILED && next) SIM_Schedule(&host.tick, SIM_Now() + next);
+}
+
+/*
+ * A pseudo-terminal in raw mode the stream is copied to. Writes never block,
+ * what no one reads is counted as lost once it fills up.
+ */
+static int SIM_UsbOpenPty(void) {
+  struct termios raw;
+
+  host.pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (host.pty < 0 || grantpt(host.pty) != 0 || unlockpt(host.pty) != 0) {
+    perror("sim: pseudo-terminal");
+    return -1;
+  }
+  // held open so the stream waits for a reader instead of failing
+  host.ptySlave = open(ptsname(host.pty), O_RDWR | O_NOCTTY);
+  if (host.ptySlave < 0 || tcgetattr(host.ptySlave, &raw) != 0) {
+    perror(ptsname(host.pty));
+    return -1;
+  }
+  cfmakeraw(&raw);
+  tcsetattr(host.ptySlave, TCSANOW, &raw);
+  fprintf(stderr, "sim: USB telemetry on %s\n", ptsname(host.pty));
+  return 0;
+}
+
+/*
+ * Plug a host in: it enumerates the device once the firmware pulls D+ up
+ */
+int SIM_UsbAttach(int pty, const char *telemetryPath) {
+  host.attached = 1;
+  host.tick.fire = SIM_UsbTick;
+  if (pty && SIM_UsbOpenPty() != 0) return -1;
+  if (telemetryPath != NULL) {
+    host.telemetry.out = fopen(telemetryPath, "w");
+    if (host.telemetry.out == NULL) {
+      perror(telemetryPath);
+      return -1;
+    }
+    fprintf(host.telemetry.out, "# sequence ms flags raw distance zone duty temperature fault faults replies\n");
+  }
+  return 0;
+}
+
+/*
+ * What the host saw. Returns the number of problems: enumeration that did
+ * not finish, bad frames, and frames missing that the firmware did not count
+ * as dropped.
+ */
+int SIM_UsbReport(FILE *out) {
+  int problems = host.failures;
+
+  if (host.state == SIM_HOST_STREAM)
+    fprintf(out, "USB: enumerated as \"%s\" at %.3f ms, %u requests answered and %u stalled\n", host.product,
+            host.enumeratedAt / 8000.0, (unsigned)usbCdcStats.requests, (unsigned)usbCdcStats.stalls);
+  else {
+    fprintf(out, "USB: not enumerated, %d of %d requests through\n", host.request, SIM_USB_REQUESTS);
+    if (!host.failures) problems++;
+  }
+  fprintf(out, "telemetry: %u bytes in %u packets, %u frames decoded, %u missing, %u bad; the firmware dropped %u\n",
+          (unsigned)host.bytes, (unsigned)usbCdcStats.packets, (unsigned)host.telemetry.frames, (unsigned)host.telemetry.missing,
+          (unsigned)host.bad, (unsigned)usbCdcStats.dropped);
+  if (host.pty >= 0 && host.ptyLost) fprintf(out, "  %u bytes not read from the pseudo-terminal\n", (unsigned)host.ptyLost);
+  if (host.bad || host.telemetry.missing > usbCdcStats.dropped) problems++;
+  if (host.telemetry.out != NULL) fclose(host.telemetry.out);
+  host.telemetry.out = NULL;
+  return problems;
+}
@@ -0,0 +1,109 @@
+/*
+ * File: sim_wcet.c
+ * Purpose: Defines the check of the interrupt handlers against the worst-case
+ *          execution time budgets the firmware declares in isrProbe.h. The
+ *          simulator's own timing of each handler, entry to exit on the
+ *          virtual clock, is always checked. When the firmware is built with
+ *          ISR_PROBES, what its probes measured through SysTick is checked
+ *          as well, which exercises the same code that times the board.
+ *
+ *          The alert line's latency is checked with them: the time from the
+ *          entry of the TIM2 update that classifies a reading to the line
+ *          going high, which is when the LEDs change too.
+ *
+ *          The virtual clock charges a handler for the time it waits on the
+ *          peripherals, not for its own instructions; the cycle-count harness
+ *          (Sim/Cycles) measures those.
+ */
+#include <stdio.h>
+
+#include "isrProbe.h"
+#include "sim.h"
+
+#define SIM_ALERT_PIN 12  // PC12, as main() sets it
+
+typedef struct {
+  PROBE_Isr probe;
+  int exc;
+} SIM_WcetHandler;
+
+static const SIM_WcetHandler handlers[] = {
+  { PROBE_TIM2, SIM_EXC_IRQ0 + TIM2_IRQn },
+  { PROBE_USART3, SIM_EXC_IRQ0 + USART3_4_IRQn },
+  { PROBE_SYSTICK, SIM_EXC_SYSTICK },
+  { PROBE_USB, SIM_EXC_IRQ0 + USB_IRQn },
+  { PROBE_SERIAL, SIM_EXC_IRQ0 + DMA1_Channel2_3_IRQn },
+  { PROBE_I2C, SIM_EXC_IRQ0 + I2C1_IRQn },
+};
+
+// Firmware probe results, present when the firmware is built with ISR_PROBES
+extern volatile PROBE_Stats isrProbes[PROBE_COUNT] __attribute__((weak));
+
+// Alert line edges, kept over a reset
+static struct {
+  uint64_t entered;         // when TIM2_IRQHandler last started
+  uint64_t edges, maxCycles;
+} alert;
+
+static void SIM_WcetOnEnter(void *ctx, uint32_t exc, uint32_t depth, uint32_t unused) {
+  (void)ctx;
+  (void)depth;
+  (void)unused;
+  if (exc == SIM_EXC_IRQ0 + TIM2_IRQn) alert.entered = SIM_Now();
+}
+
+static void SIM_WcetOnGpio(void *ctx, uint32_t port, uint32_t old, uint32_t new) {
+  uint32_t bit = 1u << SIM_ALERT_PIN;
+  (void)ctx;
+  if (port != SIM_GPIOC || (old & bit) || !(new & bit)) return;
+  alert.edges++;
+  if (SIM_Now() - alert.entered > alert.maxCycles) alert.maxCycles = SIM_Now() - alert.entered;
+}
+
+void SIM_WcetAttach(void) {
+  SIM_Keep(&alert, sizeof(alert));
+  SIM_Listen(SIM_ON_IRQ_ENTER, SIM_WcetOnEnter, NULL);
+  SIM_Listen(SIM_ON_GPIO, SIM_WcetOnGpio, NULL);
+}
+
+/*
+ * Print every handler's longest run against its budget when out is not
+ * NULL. Returns the number of handlers that went over.
+ */
+int SIM_WcetCheck(FILE *out) {
+  int over = 0;
+
+  if (out != NULL) {
+    fprintf(out, "%-24s %10s %12s %12s %12s\n", "handler", "count", "max us", "probe max us", "budget us");
+  }
+  for (size_t i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++) {
+    const SIM_WcetHandler *h = &handlers[i];
+    uint64_t budget = SIM_US((uint64_t)isrBudgets[h->probe]);
+    uint64_t max = simStats.excMaxCycles[h->exc];
+    int late = max > budget;
+    char probe[24] = "-";
+
+    if (&isrProbes != NULL) {
+      snprintf(probe, sizeof(probe), "%.1f", SIM_TO_US((double)isrProbes[h->probe].max_cycles));
+      if (isrProbes[h->probe].over) late = 1;
+    }
+    over += late;
+    if (out == NULL) continue;
+    fprintf(out, "%-24s %10llu %12.1f %12s %12u%s\n", SIM_ExceptionName(h->exc),
+            (unsigned long long)simStats.excCount[h->exc], SIM_TO_US((double)max), probe,
+            (unsigned)isrBudgets[h->probe], late ? "  OVER BUDGET" : "");
+  }
+
+  int late = alert.maxCycles > SIM_US((uint64_t)isrBudgets[PROBE_ALERT]);
+  char probe[24] = "-";
+  if (&isrProbes != NULL) {
+    snprintf(probe, sizeof(probe), "%.1f", SIM_TO_US((double)isrProbes[PROBE_ALERT].max_cycles));
+    if (isrProbes[PROBE_ALERT].over) late = 1;
+  }
+  over += late;
+  if (out != NULL) {
+    fprintf(out, "%-24s %10llu %12.1f %12s %12u%s\n", "alert line", (unsigned long long)alert.edges,
+            SIM_TO_US((double)alert.maxCycles), probe, (unsigned)isrBudgets[PROBE_ALERT], late ? "  OVER BUDGET" : "");
+  }
+  return over;
+}
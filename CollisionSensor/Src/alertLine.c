@@ -0,0 +1,88 @@
+/*
+ * File: alertLine.c
+ * Purpose: Defines the alert line: the pin, the zone and the time to
+ *          collision of every reading, and the events that assert the line.
+ *
+ *          The velocity is the change of the distance between two readings,
+ *          averaged with the one before, which halves the sensor's noise for
+ *          a period's lag. A reading outside the zones has none. The time to
+ *          collision is the distance over the closing speed, and only counts
+ *          when it is closing faster than min_closing.
+ */
+#include "alertLine.h"
+
+#define ALERT_VELOCITY_MAX 32767
+
+ALERT *thisAlert;
+ALERT_STATUS alertStatus = { .zone = 4, .ttc_ms = ALERT_NO_TTC };
+
+// The last fresh reading, for the velocity
+static uint16_t alertDistance;
+static uint32_t alertMs;
+static uint8_t alertClassified;   // a reading has set the zone, the first is no change
+static uint8_t alarm;             // the time to collision is below the alarm
+static uint8_t high;              // the line as the last store left it
+
+/*
+ * Setup the alert line on GPIOC: push-pull output, low until the first event
+ */
+void ALERT_Setup(ALERT *alert) {
+	uint8_t x = alert->pin;
+	thisAlert = alert;
+
+	RCC->AHBENR |= RCC_AHBENR_GPIOCEN;
+	GPIOC->BRR = 1 << x;
+	GPIOC->MODER = (GPIOC->MODER & ~(3 << (2*x))) | (1 << (2*x));
+	GPIOC->OTYPER &= ~(1 << x);
+	GPIOC->OSPEEDR &= ~(3 << (2*x));
+	GPIOC->PUPDR &= ~(3 << (2*x));
+}
+
+/*
+ * Every period from TIM2, before the LEDs: classify the reading and return
+ * the alert line as a BSRR word, the pin set on an event and reset
+ * otherwise. A period without a fresh reading has no event.
+ */
+uint32_t ALERT_Update(uint8_t fresh, uint16_t distance) {
+	uint32_t now = HAL_GetTick();
+	uint8_t zone = 0, closing;
+	int32_t velocity = 0;
+
+	alertStatus.events = 0;
+	if (fresh) {
+		for (uint8_t i = 0; i < 4; i++) zone += distance >= thisAlert->thresholds[i];
+
+		// only between two readings in the zones, a reading out of range is no speed
+		if (alertClassified && now != alertMs && distance < thisAlert->thresholds[3] && alertDistance < thisAlert->thresholds[3]) {
+			velocity = ((int32_t)distance - alertDistance) * 1000 / (int32_t)(now - alertMs);
+			velocity = (velocity + alertStatus.velocity) / 2;
+			if (velocity > ALERT_VELOCITY_MAX) velocity = ALERT_VELOCITY_MAX;
+			if (velocity < -ALERT_VELOCITY_MAX) velocity = -ALERT_VELOCITY_MAX;
+		}
+		alertStatus.velocity = velocity;
+		alertStatus.ttc_ms = ALERT_NO_TTC;
+		if (velocity < 0 && -velocity >= thisAlert->min_closing) {
+			uint32_t ttc = (uint32_t)distance * 1000 / (uint32_t)-velocity;
+			alertStatus.ttc_ms = ttc < ALERT_NO_TTC ? ttc : ALERT_NO_TTC;
+		}
+
+		closing = alertStatus.ttc_ms < thisAlert->ttc_ms;
+		if (alertClassified && zone != alertStatus.zone) {
+			alertStatus.events |= ALERT_ZONE;
+			alertStatus.zone_changes++;
+		}
+		if (closing && !alarm) {
+			alertStatus.events |= ALERT_TTC;
+			alertStatus.ttc_alarms++;
+		}
+		alarm = closing;
+		alertStatus.zone = zone;
+		alertDistance = distance;
+		alertMs = now;
+		alertClassified = 1;
+	}
+
+	if (alertStatus.events && !high) alertStatus.asserted++;
+	high = alertStatus.events != 0;
+	return high ? 1u << thisAlert->pin : 1u << (thisAlert->pin + 16);
+}
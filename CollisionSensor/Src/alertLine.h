@@ -0,0 +1,51 @@
+/*
+ * File: alertLine.h
+ * Purpose: Declares the alert line, a GPIOC output a host can take on an
+ *          edge interrupt instead of polling the links. The line goes high
+ *          when a reading moves to another zone or first gives a time to
+ *          collision below the alarm, and low again at the next reading
+ *          without one, so an event holds it for a period. Events in
+ *          consecutive periods keep it high; the status register of the I2C
+ *          map tells what they were.
+ *
+ *          The classification returns the line as a BSRR word, and setLEDs
+ *          writes it in the same store as the LEDs, so the line never lags
+ *          the warnings the user sees. Its latency from TIM2's update has a
+ *          budget with the interrupt handlers', in isrProbe.h.
+ */
+#ifndef __ALERT_LINE_H
+#define __ALERT_LINE_H
+
+#include "stm32f0xx_hal.h"
+
+// Events of a classification
+#define ALERT_ZONE 0x01           // the reading is in another zone than the last one
+#define ALERT_TTC 0x02            // the time to collision went below the alarm
+
+#define ALERT_NO_TTC 0xFFFF       // not closing, or too slowly to tell
+
+// Holds the alert line information, pin on GPIOC
+typedef struct alert {
+  uint8_t pin;
+  uint16_t ttc_ms;          // time to collision below which the line is asserted
+  uint16_t min_closing;     // in mm/s, slower is the sensor's noise and never an alarm
+  const uint16_t *thresholds; // zone boundaries in mm, closest first, those of CONFIG
+} ALERT;
+
+// The last classification and the events so far, for the I2C map, the simulator and the debugger
+typedef struct alert_status {
+  uint8_t events;           // ALERT_ZONE, ALERT_TTC of the last reading
+  uint8_t zone;             // of the last reading: red 0, orange, blue, green, none 4
+  int16_t velocity;         // change of the distance in mm/s, smoothed, negative closing, 0 outside the zones
+  uint16_t ttc_ms;          // distance over the closing speed, ALERT_NO_TTC when there is none
+  uint32_t zone_changes;
+  uint32_t ttc_alarms;
+  uint32_t asserted;        // rising edges of the line
+} ALERT_STATUS;
+
+extern ALERT_STATUS alertStatus;
+
+void ALERT_Setup(ALERT *alert);
+uint32_t ALERT_Update(uint8_t fresh, uint16_t distance);
+
+#endif /* __ALERT_LINE_H */
@@ -0,0 +1,62 @@
+/*
+ * File: clutterModel.c
+ * Purpose: Defines the background model: a score per range bin learned from
+ *          the readings that hold still, and the motor distance for each
+ *          reading. Every reading costs the same, one bin and a short sweep.
+ */
+#include "clutterModel.h"
+
+CLUTTER *thisClutter;
+CLUTTER_STATS clutterStats;
+
+static uint8_t scores[CLUTTER_BINS];  // still readings in each bin, less the sweep, up to twice learn
+static uint16_t last = 0xFFFF;        // the reading before, none yet
+static uint8_t sweep;                 // next bin the sweep takes one off
+
+void CLUTTER_Setup(CLUTTER *clutter) {
+	thisClutter = clutter;
+}
+
+/*
+ * Whether a distance is on the background: its bin or one next to it, so
+ * noise across a bin edge does not matter, has been learned
+ */
+uint8_t CLUTTER_Background(uint16_t distance) {
+	uint8_t learn = thisClutter->learn, bin;
+
+	if (learn == 0 || distance >= CLUTTER_BINS * CLUTTER_BIN_MM) return 0;
+	bin = distance / CLUTTER_BIN_MM;
+	return scores[bin] >= learn || (bin > 0 && scores[bin - 1] >= learn) ||
+	       (bin < CLUTTER_BINS - 1 && scores[bin + 1] >= learn);
+}
+
+/*
+ * Learn from a filtered reading and return the distance the motor should
+ * warn for: the reading itself, or a quieter one if it is on the background
+ * and does not come closer
+ */
+uint16_t CLUTTER_Update(uint16_t distance) {
+	uint16_t previous = last;
+	uint8_t bin;
+
+	last = distance;
+	if (thisClutter->learn == 0) return distance;
+
+	// forget what is not seen any more, also while nothing is in range
+	for (uint8_t i = 0; i < CLUTTER_SWEEP; i++) {
+		if (scores[sweep]) scores[sweep]--;
+		sweep = (sweep + 1) & (CLUTTER_BINS - 1);
+	}
+	if (distance >= CLUTTER_BINS * CLUTTER_BIN_MM) return distance;
+	bin = distance / CLUTTER_BIN_MM;
+	if (distance + CLUTTER_STILL_MM >= previous && distance <= previous + CLUTTER_STILL_MM && scores[bin] < 2 * thisClutter->learn)
+		scores[bin]++;
+
+	if (!CLUTTER_Background(distance)) return distance;
+	clutterStats.quiet++;
+	if (previous != 0xFFFF && distance + CLUTTER_APPROACH_MM < previous) {
+		clutterStats.lifted++;
+		return distance;
+	}
+	return distance < thisClutter->thresholds[0] ? thisClutter->thresholds[0] : thisClutter->thresholds[3];
+}
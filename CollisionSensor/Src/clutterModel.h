@@ -0,0 +1,44 @@
+/*
+ * File: clutterModel.h
+ * Purpose: Declares the background model that keeps the motor quiet in
+ *          front of things that are always there, like the monitor of a
+ *          wearer seated at a desk. Ranges are kept in CLUTTER_BINS bins with
+ *          a score each. A reading that holds still adds to the score of its
+ *          bin, and a sweep takes a little off a few bins every reading, so
+ *          a range becomes background after about learn still readings and
+ *          stops being background a few minutes after it is gone. A reading
+ *          on background leaves the motor off, or at the orange zone's
+ *          strength in the red zone. A reading off the background, or one
+ *          that comes closer, gets the full warning at once. The LEDs always
+ *          show the real zone.
+ */
+#ifndef __CLUTTER_MODEL_H
+#define __CLUTTER_MODEL_H
+
+#include "stm32f0xx_hal.h"
+
+#define CLUTTER_BINS 128
+#define CLUTTER_BIN_MM 32         // the bins cover 0 to 4096 mm, farther is never background
+#define CLUTTER_STILL_MM 40       // a reading this close to the last one holds still
+#define CLUTTER_APPROACH_MM 40    // a reading this much closer than the last one comes closer
+#define CLUTTER_SWEEP 8           // bins the decay sweep takes one off every reading
+
+// Zone boundaries and how fast ranges are learned
+typedef struct clutter {
+  const uint16_t *thresholds; // in mm, closest first, those of CONFIG
+  uint8_t learn;            // still readings in a range before it is background, up to 127 (0 is off)
+} CLUTTER;
+
+// Readings the model quietened, for the simulator and the debugger
+typedef struct clutter_stats {
+  uint32_t quiet;           // readings on background
+  uint32_t lifted;          // readings on background that came closer
+} CLUTTER_STATS;
+
+extern CLUTTER_STATS clutterStats;
+
+void CLUTTER_Setup(CLUTTER *clutter);
+uint16_t CLUTTER_Update(uint16_t distance);
+uint8_t CLUTTER_Background(uint16_t distance);
+
+#endif /* __CLUTTER_MODEL_H */
@@ -0,0 +1,299 @@
+/*
+ * File: commandShell.c
+ * Purpose: Defines the command shell on the USART1 telemetry link: the
+ *          line reader, the table of settings with their bounds, and the
+ *          replies. Replies go out as frames like the telemetry, text that
+ *          never starts with its sync bytes.
+ */
+#include <string.h>
+
+#include "commandShell.h"
+#include "serialLink.h"
+#include "flashRing.h"
+#include "rangeFilter.h"
+#include "sessionStats.h"
+
+#define SHELL_MAX_VALUES 4
+#define SHELL_MAX_WORDS (2 + SHELL_MAX_VALUES)
+
+SHELL *thisShell;
+SHELL_STATS shellStats;
+
+// A setting: how many values it takes and the bounds of each
+typedef struct {
+  const char *name;
+  uint8_t count;
+  uint16_t min[SHELL_MAX_VALUES];
+  uint16_t max[SHELL_MAX_VALUES];
+} SHELL_SETTING;
+
+// In the order of the SHELL_ bits, with the bounds CONFIG_Load holds a record to
+static const SHELL_SETTING settings[] = {
+  { "thresholds", 4, { 1, 1, 1, 1 }, { CONFIG_MAX_MM, CONFIG_MAX_MM, CONFIG_MAX_MM, CONFIG_MAX_MM } },
+  { "sample", 1, { CONFIG_MIN_SAMPLE_MS }, { CONFIG_MAX_SAMPLE_MS } },
+  { "filter", 3, { 1, 0, 0 }, { FILTER_MAX_WINDOW, CONFIG_MAX_SMOOTHING, CONFIG_MAX_HYSTERESIS } },  // window, smoothing, hysteresis in mm
+  { "haptic", 4, { 0, 0, 0, 0 }, { CONFIG_MAX_DUTY, CONFIG_MAX_DUTY, CONFIG_MAX_DUTY, CONFIG_MAX_DUTY } },
+  { "display", 1, { 0 }, { 1 } },
+};
+#define SHELL_SETTINGS (sizeof(settings) / sizeof(settings[0]))
+
+// The values of display, main's SCREEN_DISTANCE and SCREEN_STATS
+static const char *const pages[] = { "distance", "stats" };
+
+static char line[SHELL_LINE];
+static uint8_t length;
+static uint8_t overlong;    // the line outgrew line, refuse it when it ends
+static uint8_t saving;      // a save waits for time before the next reading
+
+/*
+ * Use the given configuration
+ */
+void SHELL_Setup(SHELL *shell) {
+	thisShell = shell;
+}
+
+/*
+ * Append text to a reply, returns its new size
+ */
+static uint8_t SHELL_Append(char *reply, uint8_t size, const char *text) {
+	while (*text) reply[size++] = *text++;
+	return size;
+}
+
+/*
+ * Append a number in decimal to a reply, returns its new size
+ */
+static uint8_t SHELL_Number(char *reply, uint8_t size, uint32_t value) {
+	char digits[10];
+	uint8_t n = 0;
+
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	while (n) reply[size++] = digits[--n];
+	return size;
+}
+
+/*
+ * The values of a setting in a configuration
+ */
+static void SHELL_Get(int8_t setting, const CONFIG *config, uint16_t *values) {
+	switch (1 << setting) {
+		case SHELL_THRESHOLDS:
+			for (uint8_t i = 0; i < 4; i++) values[i] = config->thresholds[i];
+			break;
+		case SHELL_SAMPLE:
+			values[0] = config->sample_ms;
+			break;
+		case SHELL_FILTER:
+			values[0] = config->filter_window;
+			values[1] = config->filter_smoothing;
+			values[2] = config->filter_hysteresis;
+			break;
+		case SHELL_HAPTIC:
+			for (uint8_t i = 0; i < 4; i++) values[i] = config->haptic[i];
+			break;
+		case SHELL_DISPLAY:
+			values[0] = config->display != 0;
+			break;
+	}
+}
+
+/*
+ * Send a reply: the text, then a setting and its values if there is one.
+ * The longest, thresholds at their farthest, fits a frame.
+ */
+static void SHELL_Reply(const char *text, int8_t setting, const CONFIG *config) {
+	char reply[SERIAL_MAX_FRAME];
+	uint16_t values[SHELL_MAX_VALUES];
+	uint8_t size = SHELL_Append(reply, 0, text);
+
+	if (setting >= 0) {
+		size = SHELL_Append(reply, size, " ");
+		size = SHELL_Append(reply, size, settings[setting].name);
+		SHELL_Get(setting, config, values);
+		for (uint8_t i = 0; i < settings[setting].count; i++) {
+			size = SHELL_Append(reply, size, " ");
+			if ((1 << setting) == SHELL_DISPLAY) size = SHELL_Append(reply, size, pages[values[i]]);
+			else size = SHELL_Number(reply, size, values[i]);
+		}
+	}
+	SERIAL_Write((const uint8_t *)reply, size);
+}
+
+/*
+ * Send the session statistics: the readings in range, the closest, the
+ * farthest and their mean in mm, and their variance in mm^2. The longest
+ * reply fits a frame.
+ */
+static void SHELL_Stats(void) {
+	char reply[SERIAL_MAX_FRAME];
+	uint32_t values[5];
+	uint8_t size = SHELL_Append(reply, 0, "ok stats");
+
+	values[0] = sessionStats.count;
+	values[1] = sessionStats.count ? sessionStats.min : 0;
+	values[2] = sessionStats.max;
+	values[3] = SESSION_Mean();
+	values[4] = SESSION_Variance();
+	for (uint8_t i = 0; i < 5; i++) {
+		size = SHELL_Append(reply, size, " ");
+		size = SHELL_Number(reply, size, values[i]);
+	}
+	SERIAL_Write((const uint8_t *)reply, size);
+}
+
+/*
+ * Parse a value: a number, or a page for display. Returns 0 if it is neither.
+ */
+static uint8_t SHELL_Value(const char *word, int8_t setting, uint16_t *value) {
+	uint32_t n = 0;
+
+	if ((1 << setting) == SHELL_DISPLAY) {
+		for (uint8_t i = 0; i < 2; i++) {
+			if (strcmp(word, pages[i]) == 0) {
+				*value = i;
+				return 1;
+			}
+		}
+		return 0;
+	}
+	if (*word == 0) return 0;
+	for (; *word; word++) {
+		if (*word < '0' || *word > '9' || n > 0xFFFF) return 0;
+		n = n * 10 + (*word - '0');
+	}
+	if (n > 0xFFFF) return 0;
+	*value = n;
+	return 1;
+}
+
+/*
+ * Stage a set: check every value, then put them all in a copy of the
+ * configuration in use. Returns the error to reply with, or NULL.
+ */
+static const char *SHELL_Set(int8_t setting, char **words, uint8_t count, CONFIG *staged) {
+	const SHELL_SETTING *s = &settings[setting];
+	uint16_t values[SHELL_MAX_VALUES];
+
+	if (count != s->count) return "error values";
+	for (uint8_t i = 0; i < count; i++) {
+		if (!SHELL_Value(words[i], setting, &values[i]) || values[i] < s->min[i] || values[i] > s->max[i])
+			return "error values";
+	}
+
+	*staged = *thisShell->config;
+	switch (1 << setting) {
+		case SHELL_THRESHOLDS:
+			// the zones are in order, closest first
+			for (uint8_t i = 1; i < 4; i++) {
+				if (values[i] <= values[i - 1]) return "error order";
+			}
+			for (uint8_t i = 0; i < 4; i++) staged->thresholds[i] = values[i];
+			break;
+		case SHELL_SAMPLE:
+			staged->sample_ms = values[0];
+			break;
+		case SHELL_FILTER:
+			staged->filter_window = values[0];
+			staged->filter_smoothing = values[1];
+			staged->filter_hysteresis = values[2];
+			break;
+		case SHELL_HAPTIC:
+			for (uint8_t i = 0; i < 4; i++) staged->haptic[i] = values[i];
+			break;
+		case SHELL_DISPLAY:
+			staged->display = values[0];
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * Run a line. Returns the setting a set staged, 0 for anything else.
+ */
+static uint8_t SHELL_Run(CONFIG *staged) {
+	char *words[SHELL_MAX_WORDS];
+	uint8_t count = 0;
+	int8_t setting = -1;
+	const char *error;
+
+	// split at the spaces in place, counting the words past the last one kept
+	line[length] = 0;
+	for (uint8_t i = 0; i < length; i++) {
+		if (line[i] == ' ' || line[i] == '\t') line[i] = 0;
+		else if (i == 0 || line[i - 1] == 0) {
+			if (count < SHELL_MAX_WORDS) words[count] = &line[i];
+			count++;
+		}
+	}
+	if (count == 0) return 0;
+	shellStats.lines++;
+
+	if (strcmp(words[0], "save") == 0 && count == 1) {
+		saving = 1;
+		return 0;
+	}
+	if (strcmp(words[0], "get") == 0 && count == 2 && strcmp(words[1], "stats") == 0) {
+		SHELL_Stats();
+		return 0;
+	}
+	for (uint8_t i = 0; count >= 2 && i < SHELL_SETTINGS; i++) {
+		if (strcmp(words[1], settings[i].name) == 0) setting = i;
+	}
+	if (strcmp(words[0], "get") != 0 && strcmp(words[0], "set") != 0) error = "error command";
+	else if (setting < 0) error = "error setting";
+	else if (words[0][0] == 'g') error = count == 2 ? NULL : "error values";
+	else error = SHELL_Set(setting, words + 2, count - 2, staged);
+
+	if (error) {
+		shellStats.errors++;
+		SHELL_Reply(error, -1, NULL);
+		return 0;
+	}
+	if (words[0][0] == 'g') {
+		SHELL_Reply("ok", setting, thisShell->config);
+		return 0;
+	}
+	SHELL_Reply("ok", setting, staged);
+	return 1 << setting;
+}
+
+/*
+ * From main's idle loop with the time left before the next reading: save
+ * if a save waits, then read what came in and run the next whole line.
+ * Returns the setting a set staged in staged for main to apply, 0 if none.
+ */
+uint8_t SHELL_Idle(uint32_t msLeft, CONFIG *staged) {
+	uint8_t byte;
+
+	// the save erases a page, which stalls the CPU
+	if (saving && msLeft >= FLASHRING_ERASE_MS) {
+		saving = 0;
+		if (CONFIG_Save(thisShell->config) == HAL_OK) {
+			shellStats.saves++;
+			SHELL_Reply("ok save", -1, NULL);
+		}
+		else SHELL_Reply("error flash", -1, NULL);
+	}
+
+	while (SERIAL_Read(&byte, 1)) {
+		if (byte == '\r' || byte == '\n') {
+			uint8_t changed = 0;
+			if (overlong) {
+				shellStats.lines++;
+				shellStats.errors++;
+				SHELL_Reply("error long", -1, NULL);
+			}
+			else changed = SHELL_Run(staged);
+			length = 0;
+			overlong = 0;
+			if (changed) return changed;
+			continue;
+		}
+		if (length < SHELL_LINE - 1) line[length++] = byte;
+		else overlong = 1;
+	}
+	return 0;
+}
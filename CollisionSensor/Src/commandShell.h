@@ -0,0 +1,54 @@
+/*
+ * File: commandShell.h
+ * Purpose: Declares the command shell on the USART1 telemetry link, for
+ *          tuning a unit without reflashing it. A command is a line of
+ *          text ended by CR or LF, and every line gets one reply frame on
+ *          the link:
+ *
+ *            get <setting>             ok <setting> <values>
+ *            set <setting> <values>    ok <setting> <values>, or error <why>
+ *            get stats                 ok stats <count> <min> <max> <mean> <variance>
+ *            save                      ok save, once the flash holds it
+ *
+ *          The settings are thresholds (4 mm, closest first), sample (ms),
+ *          filter (window, smoothing, hysteresis), haptic (4 duties in
+ *          percent, closest first) and display (distance or stats).
+ *          get stats reads the session statistics, the readings in range
+ *          since boot with their distances in mm and variance in mm^2.
+ *
+ *          Lines are read from the receive ring in main's idle loop, never
+ *          in an interrupt. A set only stages its values: main applies them
+ *          between two readings, so no reading sees half of a change.
+ */
+#ifndef __COMMAND_SHELL_H
+#define __COMMAND_SHELL_H
+
+#include "configStore.h"
+
+#define SHELL_LINE 48             // longest line, a longer one is refused whole
+
+// The settings a set changes, as SHELL_Idle returns them
+#define SHELL_THRESHOLDS 0x01
+#define SHELL_SAMPLE 0x02
+#define SHELL_FILTER 0x04
+#define SHELL_HAPTIC 0x08
+#define SHELL_DISPLAY 0x10
+
+// The configuration in use, what get reads and save writes to flash
+typedef struct shell {
+  CONFIG *config;           // main copies a set into it when it applies one
+} SHELL;
+
+// What came in, for the simulator and the debugger
+typedef struct shell_stats {
+  uint32_t lines;           // commands run, blank lines not counted
+  uint32_t errors;          // of them refused
+  uint32_t saves;           // saved to flash
+} SHELL_STATS;
+
+extern SHELL_STATS shellStats;
+
+void SHELL_Setup(SHELL *shell);
+uint8_t SHELL_Idle(uint32_t msLeft, CONFIG *staged);
+
+#endif /* __COMMAND_SHELL_H */
@@ -0,0 +1,133 @@
+/*
+ * File: configStore.c
+ * Purpose: Defines the configuration store in the last two pages of flash.
+ *          Loading checks the record in each page and points at the newer
+ *          valid one whose settings are within the bounds the shell sets
+ *          them in. Saving erases the other page and programs the new
+ *          record there, its CRC last.
+ */
+#include <string.h>
+
+#include "configStore.h"
+#include "rangeFilter.h"
+#include "rangeCalibration.h"
+
+#define CONFIG_HEADER_SIZE (sizeof(CONFIG_RECORD) - sizeof(CONFIG))
+
+static const CONFIG_RECORD *current;	// record a save leaves alone, NULL until a valid record is found or saved
+static CONFIG migrated;
+
+/*
+ * CRC-32 of a record from the version to the end of its configuration,
+ * with the hardware CRC unit in its reset configuration
+ */
+static uint32_t CONFIG_Crc(const CONFIG_RECORD *record) {
+	const uint32_t *word = (const uint32_t *)&record->version;
+	uint32_t words = (CONFIG_HEADER_SIZE - sizeof(record->crc) + record->length) / 4;
+
+	CRC->CR = CRC_CR_RESET;
+	for (uint32_t i = 0; i < words; i++) CRC->DR = word[i];
+	return CRC->DR;
+}
+
+/*
+ * A record is valid once it has been programmed completely, CRC included
+ */
+static uint8_t CONFIG_Valid(const CONFIG_RECORD *record) {
+	if (record->version == 0xFFFF || record->length == 0 || (record->length & 3) ||
+	    record->length > FLASH_PAGE_SIZE - CONFIG_HEADER_SIZE) return 0;
+	return CONFIG_Crc(record) == record->crc;
+}
+
+/*
+ * The settings are within the bounds of the shell and the calibration, so
+ * a record that passed its CRC but was written by other firmware cannot
+ * stall TIM2 or unorder the zones
+ */
+static uint8_t CONFIG_InBounds(const CONFIG *config) {
+	for (uint8_t i = 0; i < 4; i++) {
+		if (config->thresholds[i] < 1 || config->thresholds[i] > CONFIG_MAX_MM) return 0;
+		if (i > 0 && config->thresholds[i] <= config->thresholds[i - 1]) return 0;
+		if (config->haptic[i] > CONFIG_MAX_DUTY) return 0;
+	}
+	if (config->sample_ms < CONFIG_MIN_SAMPLE_MS || config->sample_ms > CONFIG_MAX_SAMPLE_MS) return 0;
+	if (config->filter_window < 1 || config->filter_window > FILTER_MAX_WINDOW) return 0;
+	if (config->filter_smoothing > CONFIG_MAX_SMOOTHING || config->filter_hysteresis > CONFIG_MAX_HYSTERESIS) return 0;
+	if (config->pwm_arr == 0) return 0;
+	if (config->range_scale < CALIBRATION_MIN_SCALE || config->range_scale > CALIBRATION_MAX_SCALE) return 0;
+	return config->range_offset >= -CALIBRATION_MAX_OFFSET && config->range_offset <= CALIBRATION_MAX_OFFSET;
+}
+
+/*
+ * A valid record's configuration, or NULL if its settings are out of
+ * bounds. A record written with another layout is laid over the defaults,
+ * which works because fields are only ever appended.
+ */
+static const CONFIG *CONFIG_Read(const CONFIG_RECORD *record, const CONFIG *defaults) {
+	if (record->version == CONFIG_VERSION && record->length == sizeof(CONFIG))
+		return CONFIG_InBounds(&record->config) ? &record->config : NULL;
+	migrated = *defaults;
+	memcpy(&migrated, &record->config, record->length < sizeof(CONFIG) ? record->length : sizeof(CONFIG));
+	return CONFIG_InBounds(&migrated) ? &migrated : NULL;
+}
+
+/*
+ * Find the newest valid record and return its configuration. Settings out
+ * of bounds fall back to the older valid record, the one saved before, and
+ * give the defaults, whole, if there is none.
+ */
+const CONFIG *CONFIG_Load(const CONFIG *defaults) {
+	const CONFIG_RECORD *a = (const CONFIG_RECORD *)CONFIG_PAGE_A;
+	const CONFIG_RECORD *b = (const CONFIG_RECORD *)CONFIG_PAGE_B;
+	const CONFIG_RECORD *older;
+	const CONFIG *config;
+
+	RCC->AHBENR |= RCC_AHBENR_CRCEN;  // Enable CRC clock
+
+	if (!CONFIG_Valid(a)) a = NULL;
+	if (!CONFIG_Valid(b)) b = NULL;
+	if (b != NULL && (a == NULL || (int32_t)(a->sequence - b->sequence) <= 0)) {
+		current = b;
+		older = a;
+	}
+	else {
+		current = a;
+		older = b;
+	}
+
+	if (current == NULL) return defaults;
+	config = CONFIG_Read(current, defaults);
+	if (config != NULL) return config;
+	if (older == NULL || (config = CONFIG_Read(older, defaults)) == NULL) return defaults;
+	// the next save replaces the record out of bounds and keeps this one
+	current = older;
+	return config;
+}
+
+/*
+ * Save a configuration for the next boot. The page that held the record
+ * CONFIG_Load used is left alone, so what it returned stays readable until
+ * the save after this one. Call CONFIG_Load first.
+ */
+HAL_StatusTypeDef CONFIG_Save(const CONFIG *config) {
+	uintptr_t target = current == (const CONFIG_RECORD *)CONFIG_PAGE_A ? CONFIG_PAGE_B : CONFIG_PAGE_A;
+	FLASH_EraseInitTypeDef erase = { .TypeErase = FLASH_TYPEERASE_PAGES, .PageAddress = target, .NbPages = 1 };
+	CONFIG_RECORD record = { 0, CONFIG_VERSION, sizeof(CONFIG), current != NULL ? current->sequence + 1 : 1, *config };
+	const uint32_t *word = (const uint32_t *)&record;
+	uint32_t pageError;
+	HAL_StatusTypeDef status;
+
+	record.crc = CONFIG_Crc(&record);
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASHEx_Erase(&erase, &pageError);
+	// the CRC goes last, until it is there the record does not count
+	for (uint32_t i = 1; i < sizeof(record) / 4 && status == HAL_OK; i++)
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, target + 4 * i, word[i]);
+	if (status == HAL_OK) status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, target, record.crc);
+	HAL_FLASH_Lock();
+
+	if (status != HAL_OK || !CONFIG_Valid((const CONFIG_RECORD *)target)) return HAL_ERROR;
+	current = (const CONFIG_RECORD *)target;
+	return HAL_OK;
+}
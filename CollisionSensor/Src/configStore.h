@@ -0,0 +1,61 @@
+/*
+ * File: configStore.h
+ * Purpose: Declares the configuration kept in the last two pages of flash:
+ *          the warning thresholds, the motor PWM and its strength in each
+ *          zone, the sample period, the filter, the LCD page shown at boot
+ *          and the range calibration, so they can be tuned without
+ *          reflashing the firmware. Each page holds one record checked with the hardware
+ *          CRC unit. A save always goes to the page that does not hold the
+ *          newest record, and that record only becomes valid once its CRC is
+ *          programmed, so losing power while saving leaves the previous
+ *          configuration in place.
+ */
+#ifndef __CONFIG_STORE_H
+#define __CONFIG_STORE_H
+
+#include "stm32f0xx_hal.h"
+
+// Layout of CONFIG, incremented when fields are added (only at the end)
+#define CONFIG_VERSION 3
+
+// The two pages at the end of flash, kept out of the image in the linker settings
+#define CONFIG_PAGE_A (FLASH_BANK1_END + 1 - 2 * FLASH_PAGE_SIZE)
+#define CONFIG_PAGE_B (FLASH_BANK1_END + 1 - FLASH_PAGE_SIZE)
+
+// Bounds of the settings, for the shell and for a record loaded from flash
+#define CONFIG_MIN_SAMPLE_MS 100    // TIM2 takes up to 90 ms when it waits out both replies
+#define CONFIG_MAX_SAMPLE_MS 1000   // a reading a second, the watchdog deadlines follow the period
+#define CONFIG_MAX_MM 10000         // farthest threshold, well past the sensor's range
+#define CONFIG_MAX_SMOOTHING 8
+#define CONFIG_MAX_HYSTERESIS 1000  // mm
+#define CONFIG_MAX_DUTY 100         // percent
+
+// Settings that can be tuned on the board, a multiple of 4 bytes
+typedef struct config {
+  uint16_t thresholds[4];     // zone boundaries in mm, closest first: orange, blue, green, no LED
+  uint16_t pwm_prescalar;     // TIM3 prescalar of the motor PWM
+  uint16_t pwm_arr;           // TIM3 auto-reload, the motor PWM period
+  uint16_t sample_ms;         // TIM2 period, time between readings
+  uint8_t filter_window;      // see FILTER
+  uint8_t filter_smoothing;
+  uint16_t filter_hysteresis;
+  uint8_t display;            // LCD page at boot, 0 is the distance (was reserved, always 0)
+  uint8_t reserved;
+  int16_t range_offset;       // see CALIBRATION, mm added to every reading after the scale
+  uint16_t range_scale;       // 1/2^14, multiplies every reading
+  uint8_t haptic[4];          // motor duty in percent in each zone, closest first (version 3)
+} CONFIG;
+
+// How a configuration is stored in a flash page
+typedef struct config_record {
+  uint32_t crc;               // CRC-32 of the words after it, programmed last
+  uint16_t version;           // CONFIG_VERSION the record was written with
+  uint16_t length;            // bytes of CONFIG stored
+  uint32_t sequence;          // incremented by every save, the higher one is newer
+  CONFIG config;
+} CONFIG_RECORD;
+
+const CONFIG *CONFIG_Load(const CONFIG *defaults);
+HAL_StatusTypeDef CONFIG_Save(const CONFIG *config);
+
+#endif /* __CONFIG_STORE_H */
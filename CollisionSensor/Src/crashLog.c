@@ -0,0 +1,184 @@
+/*
+ * File: crashLog.c
+ * Purpose: Defines the crash log: the capture taken by the fault handler
+ *          or the watchdog supervisor, which only writes RAM and resets, and
+ *          the boot side that picks the capture up, times the recovery and
+ *          programs it to flash from main's idle loop once readings run
+ *          again.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "crashLog.h"
+#include "eventLog.h"
+#include "ultrasonicSensorUart.h"
+
+
+CRASH_RETAINED crashRetained CRASHLOG_NOINIT;
+CRASH_RECORD lastCrash;           // the crash before this boot, if CRASHLOG_Setup found one
+
+static FLASHRING ring = { .start = CRASHLOG_START, .pages = CRASHLOG_PAGES, .size = sizeof(CRASH_RECORD) };
+
+static uint16_t trace[CRASHLOG_TRACE];
+static uint32_t traced;           // readings since boot
+static uint8_t recovering;        // lastCrash waits for the first new reading
+static volatile uint8_t staged;   // lastCrash waits to be programmed
+
+/*
+ * Time since HAL_Init in us, from the HAL tick and the SysTick counter
+ */
+static uint32_t CRASHLOG_Micros(void) {
+	uint32_t load = SysTick->LOAD + 1;
+	return HAL_GetTick() * 1000 + (load - 1 - SysTick->VAL) * 1000 / load;
+}
+
+/*
+ * Pick up a capture left by the fault handler or the supervisor, or note a
+ * reset by the IWDG, and find where the flash ring ends. Returns 1 if this
+ * boot follows a crash.
+ */
+uint8_t CRASHLOG_Setup(void) {
+	uint8_t watchdogReset = (RCC->CSR & RCC_CSR_IWDGRSTF) != 0;
+
+	// the reset flags add up until they are removed
+	RCC->CSR |= RCC_CSR_RMVF;
+	FLASHRING_Setup(&ring);
+	if (crashRetained.magic == CRASHLOG_MAGIC) lastCrash = crashRetained.record;
+	else if (watchdogReset) {
+		// SysTick stopped with the rest: only the reset itself is known
+		memset(&lastCrash, 0, sizeof(lastCrash));
+		lastCrash.timestamp = 0xFFFFFFFF;
+		lastCrash.restored_us = 0xFFFFFFFF;
+		lastCrash.resumed_ms = 0xFFFF;
+		lastCrash.session = 0xFFFF;
+		lastCrash.reason = CRASHLOG_WATCHDOG;
+	}
+	else return 0;
+	crashRetained.magic = 0;
+	recovering = 1;
+	return 1;
+}
+
+/*
+ * Last reading before the crash, or nothing in range if there was none
+ */
+uint16_t CRASHLOG_LastDistance(void) {
+	return lastCrash.traced ? lastCrash.trace[lastCrash.traced - 1] : SENSOR_NOTHING;
+}
+
+/*
+ * The warning from before the crash is showing again
+ */
+void CRASHLOG_Restored(void) {
+	lastCrash.restored_us = CRASHLOG_Micros();
+}
+
+/*
+ * Keep a filtered reading from TIM2 for the next capture. The first one
+ * after a crash ends the recovery and hands the crash to the idle loop.
+ */
+void CRASHLOG_Update(uint16_t distance) {
+	trace[traced++ % CRASHLOG_TRACE] = distance;
+	if (!recovering) return;
+
+	uint32_t now = HAL_GetTick();
+	lastCrash.resumed_ms = now > 0xFFFF ? 0xFFFF : now;
+	recovering = 0;
+	staged = 1;
+}
+
+/*
+ * Whether a crash waits for CRASHLOG_Idle
+ */
+uint8_t CRASHLOG_Pending(void) {
+	return staged;
+}
+
+/*
+ * One step of flash work, from main's idle loop with the time left before
+ * the next reading: start a new page, or program the crash
+ */
+void CRASHLOG_Idle(uint32_t msLeft) {
+	if (!staged) return;
+
+	if (FLASHRING_Full(&ring)) {
+		// an erase stalls the CPU, so it waits for time before the next reading
+		if (msLeft < FLASHRING_ERASE_MS) return;
+		FLASHRING_StartPage(&ring);
+		return;
+	}
+
+	if (FLASHRING_Append(&ring, &lastCrash) != HAL_OK) return;
+	staged = 0;
+}
+
+/*
+ * Number of crashes in flash
+ */
+uint16_t CRASHLOG_Count(void) {
+	return FLASHRING_Count(&ring);
+}
+
+/*
+ * The index-th crash in flash, oldest first, NULL past the end
+ */
+const CRASH_RECORD *CRASHLOG_Get(uint16_t index) {
+	return FLASHRING_Get(&ring, index);
+}
+
+/*
+ * Capture into the retained RAM and reset. Flash is left alone, it may be
+ * what failed, and a boot loop that never reads the sensor never wears it.
+ * A crash before the first reading since the last one keeps that one's
+ * readings, so the warning shown through a boot loop stays the last real
+ * one.
+ */
+static void CRASHLOG_Capture(uint8_t reason, const uint32_t *words, uint8_t count) {
+	CRASH_RECORD *record = &crashRetained.record;
+	uint8_t kept = traced < CRASHLOG_TRACE ? traced : CRASHLOG_TRACE;
+	uint8_t i;
+
+	for (i = 0; i < 8; i++) record->frame[i] = i < count ? words[i] : 0;
+	record->icsr = SCB->ICSR;
+	record->timestamp = HAL_GetTick();
+	record->restored_us = 0xFFFFFFFF;
+	record->resumed_ms = 0xFFFF;
+	if (recovering) {
+		memcpy(record->trace, lastCrash.trace, sizeof(record->trace));
+		record->traced = lastCrash.traced;
+		record->session = lastCrash.session;
+	}
+	else {
+		for (i = 0; i < CRASHLOG_TRACE; i++) record->trace[i] = i < kept ? trace[(traced - kept + i) % CRASHLOG_TRACE] : 0xFFFF;
+		record->traced = kept;
+		record->session = EVENTLOG_Session();
+	}
+	record->reason = reason;
+	crashRetained.magic = CRASHLOG_MAGIC;
+
+	__DSB();
+	NVIC_SystemReset();
+}
+
+/*
+ * From HardFault_Handler with the frame the fault stacked, or NULL from
+ * Error_Handler
+ */
+void CRASHLOG_Fault(uint32_t *frame) {
+	CRASHLOG_Capture(frame != NULL ? CRASHLOG_HARDFAULT : CRASHLOG_ERROR, frame, frame != NULL ? 8 : 0);
+}
+
+/*
+ * From Error_Handler, a HAL call that failed
+ */
+void CRASHLOG_Error(void) {
+	CRASHLOG_Fault(NULL);
+}
+
+/*
+ * From the watchdog supervisor, a stage that missed its deadline, with the
+ * ms since each stage checked in
+ */
+void CRASHLOG_Hang(uint8_t stage, const uint32_t *ages, uint8_t stages) {
+	CRASHLOG_Capture(CRASHLOG_HANG + stage, ages, stages);
+}
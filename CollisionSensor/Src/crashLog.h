@@ -0,0 +1,73 @@
+/*
+ * File: crashLog.h
+ * Purpose: Declares the crash log. A HardFault, an Error_Handler call or
+ *          a pipeline stage the watchdog supervisor found stalled captures
+ *          the stacked registers, the pending exceptions and the last
+ *          readings into RAM that the reset does not clear, and resets the
+ *          board at once. The next boot shows the last warning again before
+ *          anything slow is set up, and appends the capture with the time
+ *          the recovery took to a ring of flash pages below the sample log.
+ *          A reset by the IWDG itself leaves no capture and is logged with
+ *          what the boot can still tell.
+ */
+#ifndef __CRASH_LOG_H
+#define __CRASH_LOG_H
+
+#include "stm32f0xx_hal.h"
+#include "sampleLog.h"
+#include "flashRing.h"
+
+#define CRASHLOG_PAGES 2
+#define CRASHLOG_START (SAMPLELOG_START - CRASHLOG_PAGES * FLASH_PAGE_SIZE)
+#define CRASHLOG_TRACE 16           // readings kept for the capture, a power of 2
+#define CRASHLOG_MAGIC 0x48535243   // a capture waits for the next boot
+
+#define CRASHLOG_HARDFAULT 1
+#define CRASHLOG_ERROR 2
+#define CRASHLOG_WATCHDOG 3         // the IWDG reset the board, nothing was captured
+#define CRASHLOG_HANG 4             // plus the stage that missed its deadline, see watchdog.h
+
+// Keeps a variable out of the startup code's zero fill, in the RAM the scatter file leaves uninitialised
+#if defined(__CC_ARM)
+#define CRASHLOG_NOINIT __attribute__((section(".noinit"), zero_init))
+#else
+#define CRASHLOG_NOINIT __attribute__((section(".noinit")))
+#endif
+
+// One crash as stored in flash, 84 bytes
+typedef struct crash_record {
+  uint32_t frame[8];        // r0, r1, r2, r3, r12, lr, pc and xpsr as stacked by the fault, 0 from Error_Handler;
+                            // for a hang, the ms since each stage checked in
+  uint32_t icsr;            // SCB->ICSR at the fault, the exceptions pending
+  uint32_t timestamp;       // ms since boot at the fault, 0xFFFFFFFF if unknown
+  uint32_t restored_us;     // us from the reset to the last warning shown again
+  uint16_t resumed_ms;      // ms from the reset to the first new reading
+  uint16_t session;         // boot that crashed, as in NEAR_MISS, 0xFFFF if unknown
+  uint16_t trace[CRASHLOG_TRACE]; // last filtered readings in mm, oldest first
+  uint8_t traced;           // readings in trace, fewer right after boot
+  uint8_t reason;           // CRASHLOG_HARDFAULT, _ERROR, _WATCHDOG or _HANG plus the stage
+  uint16_t check;           // see FLASHRING
+} CRASH_RECORD;
+
+// What survives the reset
+typedef struct crash_retained {
+  uint32_t magic;           // CRASHLOG_MAGIC while record waits for the next boot
+  CRASH_RECORD record;
+} CRASH_RETAINED;
+
+extern CRASH_RETAINED crashRetained;
+extern CRASH_RECORD lastCrash;
+
+uint8_t CRASHLOG_Setup(void);
+uint16_t CRASHLOG_LastDistance(void);
+void CRASHLOG_Restored(void);
+void CRASHLOG_Update(uint16_t distance);
+uint8_t CRASHLOG_Pending(void);
+void CRASHLOG_Idle(uint32_t msLeft);
+uint16_t CRASHLOG_Count(void);
+const CRASH_RECORD *CRASHLOG_Get(uint16_t index);
+void CRASHLOG_Fault(uint32_t *frame);
+void CRASHLOG_Error(void);
+void CRASHLOG_Hang(uint8_t stage, const uint32_t *ages, uint8_t stages);
+
+#endif /* __CRASH_LOG_H */
@@ -0,0 +1,135 @@
+/*
+ * File: eventLog.c
+ * Purpose: Defines the near-miss log: the TIM2 side that follows readings
+ *          and finishes events, and the idle side that moves them into the
+ *          flash ring.
+ */
+#include "eventLog.h"
+#include "ultrasonicSensorUart.h"
+
+
+EVENTLOG *thisEventLog;
+EVENTLOG_STATS eventLogStats;
+
+static FLASHRING ring = { .start = EVENTLOG_START, .pages = EVENTLOG_PAGES, .size = sizeof(NEAR_MISS) };
+
+// Events finished by TIM2 and not yet programmed, the idle loop empties it
+static NEAR_MISS staged[EVENTLOG_STAGED];
+static volatile uint8_t stagedHead;
+static volatile uint8_t stagedTail;
+
+static uint16_t session;
+
+static NEAR_MISS current;     // near miss in progress
+static uint8_t active;
+static volatile uint8_t quiet = 1;  // the last reading was no near miss
+static uint16_t lastDistance;
+static uint32_t lastTime;
+
+/*
+ * Find where the log ends and which session this boot is
+ */
+void EVENTLOG_Setup(EVENTLOG *log) {
+	uint16_t count;
+
+	thisEventLog = log;
+	FLASHRING_Setup(&ring);
+	count = EVENTLOG_Count();
+	session = count ? EVENTLOG_Get(count - 1)->session + 1 : 0;
+}
+
+/*
+ * One more than the session of the newest event in the log, so a boot that
+ * logged no near miss shares its number with the next one. Other records
+ * carry it to match them to the near misses of the same boot
+ */
+uint16_t EVENTLOG_Session(void) {
+	return session;
+}
+
+/*
+ * Follow a reading from TIM2: start, grow or finish the near miss in progress
+ */
+void EVENTLOG_Update(uint16_t distance) {
+	uint32_t now = HAL_GetTick();
+	uint8_t zone = 0;
+	uint16_t speed = 0;
+
+	for (uint8_t i = 0; i < 4; i++) zone += distance >= thisEventLog->thresholds[i];
+	if (distance < lastDistance && lastDistance < SENSOR_MAX_RANGE && now != lastTime) {
+		uint32_t mmPerS = (uint32_t)(lastDistance - distance) * 1000 / (now - lastTime);
+		speed = mmPerS > 0xFFFF ? 0xFFFF : mmPerS;
+	}
+	lastDistance = distance;
+	lastTime = now;
+
+	if (zone <= thisEventLog->near_zone) {
+		if (!active) {
+			current.timestamp = now;
+			current.session = session;
+			current.min_distance = distance;
+			current.closing_speed = speed;
+			current.zone = zone;
+			active = 1;
+		}
+		if (distance < current.min_distance) current.min_distance = distance;
+		if (speed > current.closing_speed) current.closing_speed = speed;
+		if (zone < current.zone) current.zone = zone;
+		quiet = 0;
+		return;
+	}
+
+	quiet = 1;
+	if (!active) return;
+	active = 0;
+	current.duration = now - current.timestamp > 0xFFFF ? 0xFFFF : now - current.timestamp;
+	if ((uint8_t)(stagedHead - stagedTail) == EVENTLOG_STAGED) {
+		eventLogStats.dropped++;
+		return;
+	}
+	staged[stagedHead % EVENTLOG_STAGED] = current;
+	stagedHead++;
+}
+
+/*
+ * Whether staged events wait for EVENTLOG_Idle
+ */
+uint8_t EVENTLOG_Pending(void) {
+	return stagedHead != stagedTail;
+}
+
+/*
+ * One step of flash work, from main's idle loop with the time left before
+ * the next reading: start a new page, or program one staged event
+ */
+void EVENTLOG_Idle(uint32_t msLeft) {
+	if (stagedHead == stagedTail) return;
+
+	if (FLASHRING_Full(&ring)) {
+		// an erase stalls the CPU, so it always waits for time before the next
+		// reading, and for nothing near unless the staging buffer is full
+		if (msLeft < FLASHRING_ERASE_MS) return;
+		if (!quiet && (uint8_t)(stagedHead - stagedTail) < EVENTLOG_STAGED) return;
+		FLASHRING_StartPage(&ring);
+		eventLogStats.erases++;
+		return;
+	}
+
+	if (FLASHRING_Append(&ring, &staged[stagedTail % EVENTLOG_STAGED]) != HAL_OK) return;
+	stagedTail++;
+	eventLogStats.logged++;
+}
+
+/*
+ * Number of events in the log
+ */
+uint16_t EVENTLOG_Count(void) {
+	return FLASHRING_Count(&ring);
+}
+
+/*
+ * The index-th event in the log, oldest first, NULL past the end
+ */
+const NEAR_MISS *EVENTLOG_Get(uint16_t index) {
+	return FLASHRING_Get(&ring, index);
+}
@@ -0,0 +1,56 @@
+/*
+ * File: eventLog.h
+ * Purpose: Declares the near-miss log: every time something comes within
+ *          the near-miss zones, one event with its closest distance, zone,
+ *          fastest approach and duration is appended to a ring of flash
+ *          pages below the configuration. The TIM2 path only finishes events
+ *          into a RAM staging buffer; main's idle loop programs them and
+ *          erases the next page, so flash never stalls a reading in progress.
+ */
+#ifndef __EVENT_LOG_H
+#define __EVENT_LOG_H
+
+#include "stm32f0xx_hal.h"
+#include "configStore.h"
+#include "flashRing.h"
+
+#define EVENTLOG_PAGES 8
+#define EVENTLOG_START (CONFIG_PAGE_A - EVENTLOG_PAGES * FLASH_PAGE_SIZE)
+#define EVENTLOG_STAGED 8     // events waiting for idle time, a power of 2
+
+// Which readings make a near miss, and the zone boundaries to grade it with
+typedef struct eventlog {
+  uint8_t near_zone;        // zones this close or closer count, 0 is red and 1 orange
+  const uint16_t *thresholds; // in mm, closest first, those of CONFIG
+} EVENTLOG;
+
+// One near miss as stored in flash, 16 bytes
+typedef struct near_miss {
+  uint32_t timestamp;       // ms since boot when it started
+  uint16_t session;         // boot number, the newest logged event's plus one at boot
+  uint16_t min_distance;    // closest reading in mm
+  uint16_t closing_speed;   // fastest approach between two readings in mm/s
+  uint16_t duration;        // ms until the object left the near-miss zones, at most 65535
+  uint8_t zone;             // closest zone reached
+  uint8_t reserved;
+  uint16_t check;           // see FLASHRING
+} NEAR_MISS;
+
+// Counts since boot
+typedef struct eventlog_stats {
+  uint32_t logged;          // events programmed to flash
+  uint32_t dropped;         // events lost because the staging buffer was full
+  uint32_t erases;          // pages erased
+} EVENTLOG_STATS;
+
+extern EVENTLOG_STATS eventLogStats;
+
+void EVENTLOG_Setup(EVENTLOG *log);
+uint16_t EVENTLOG_Session(void);
+void EVENTLOG_Update(uint16_t distance);
+uint8_t EVENTLOG_Pending(void);
+void EVENTLOG_Idle(uint32_t msLeft);
+uint16_t EVENTLOG_Count(void);
+const NEAR_MISS *EVENTLOG_Get(uint16_t index);
+
+#endif /* __EVENT_LOG_H */
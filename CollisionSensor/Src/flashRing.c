@@ -0,0 +1,189 @@
+/*
+ * File: flashRing.c
+ * Purpose: Defines the ring of flash pages behind the logs kept in flash.
+ *          Each page starts with a header and holds records in order. A page
+ *          header or a record only counts once its last half-word is
+ *          programmed.
+ */
+#include <stddef.h>
+
+#include "flashRing.h"
+
+#define FLASHRING_MAGIC 0x474C4D4E   // "NMLG", kept from when the ring was only the near-miss log
+
+// Start of every page in a ring
+typedef struct flashring_page {
+  uint32_t sequence;        // order the pages were started in
+  uint32_t erases;          // times the page has been erased
+  uint32_t reserved;
+  uint32_t magic;           // programmed last, without it the page holds nothing
+} FLASHRING_PAGE;
+
+static const FLASHRING_PAGE *FLASHRING_Page(const FLASHRING *ring, uint8_t p) {
+	return (const FLASHRING_PAGE *)(ring->start + (uintptr_t)p * FLASH_PAGE_SIZE);
+}
+
+static uint16_t FLASHRING_Slots(const FLASHRING *ring) {
+	return (FLASH_PAGE_SIZE - sizeof(FLASHRING_PAGE)) / ring->size;
+}
+
+static const uint16_t *FLASHRING_Slot(const FLASHRING *ring, uint8_t p, uint16_t s) {
+	return (const uint16_t *)((const uint8_t *)(FLASHRING_Page(ring, p) + 1) + (uintptr_t)s * ring->size);
+}
+
+/*
+ * Checksum of all half-words of a record but the last, never 0xFFFF so a
+ * record whose check was not programmed does not count
+ */
+static uint16_t FLASHRING_Check(const FLASHRING *ring, const uint16_t *half) {
+	uint16_t sum = 0xA55A;
+
+	for (uint16_t i = 0; i < ring->size / 2 - 1; i++) sum = (uint16_t)((sum << 1) | (sum >> 15)) ^ half[i];
+	return sum == 0xFFFF ? 0 : sum;
+}
+
+static uint8_t FLASHRING_Started(const FLASHRING *ring, uint8_t p) {
+	return FLASHRING_Page(ring, p)->magic == FLASHRING_MAGIC;
+}
+
+static uint8_t FLASHRING_Free(const FLASHRING *ring, uint8_t p, uint16_t s) {
+	const uint32_t *word = (const uint32_t *)FLASHRING_Slot(ring, p, s);
+	for (uint16_t i = 0; i < ring->size / 4; i++) {
+		if (word[i] != 0xFFFFFFFF) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Program half-words in order, so the last one goes last
+ */
+static HAL_StatusTypeDef FLASHRING_Program(uintptr_t address, const void *data, uint16_t bytes) {
+	const uint16_t *half = data;
+	HAL_StatusTypeDef status = HAL_OK;
+
+	HAL_FLASH_Unlock();
+	for (uint16_t i = 0; i < bytes / 2 && status == HAL_OK; i++)
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + 2 * i, half[i]);
+	HAL_FLASH_Lock();
+	return status;
+}
+
+/*
+ * Find where the ring ends: the newest started page and its first free slot
+ */
+void FLASHRING_Setup(FLASHRING *ring) {
+	uint8_t found = 0;
+
+	for (uint8_t p = 0; p < ring->pages; p++) {
+		if (!FLASHRING_Started(ring, p)) continue;
+		if (!found || (int32_t)(FLASHRING_Page(ring, p)->sequence - ring->sequence) > 0) {
+			ring->page = p;
+			ring->sequence = FLASHRING_Page(ring, p)->sequence;
+			found = 1;
+		}
+	}
+	ring->slot = FLASHRING_Slots(ring);
+	ring->erases = 0;
+	if (found) {
+		for (ring->slot = 0; ring->slot < FLASHRING_Slots(ring) && !FLASHRING_Free(ring, ring->page, ring->slot); ring->slot++) {}
+	}
+	else {
+		// the first page started is page 0, sequence 0
+		ring->page = ring->pages - 1;
+		ring->sequence = 0xFFFFFFFF;
+	}
+}
+
+/*
+ * Whether the next record needs a new page, so FLASHRING_StartPage first
+ */
+uint8_t FLASHRING_Full(const FLASHRING *ring) {
+	return ring->slot >= FLASHRING_Slots(ring);
+}
+
+/*
+ * Erase the next page in the ring and write its header. This stalls the CPU
+ * for up to FLASHRING_ERASE_MS. A page that fails FLASHRING_TRIES times is
+ * marked bad and the one after it is tried next; with every page bad,
+ * nothing is erased and it fails at once.
+ */
+HAL_StatusTypeDef FLASHRING_StartPage(FLASHRING *ring) {
+	uint8_t next = ring->page;
+	FLASHRING_PAGE header = { ring->sequence + 1, 1, 0xFFFFFFFF, FLASHRING_MAGIC };
+	FLASH_EraseInitTypeDef erase = { .TypeErase = FLASH_TYPEERASE_PAGES, .NbPages = 1 };
+	uint32_t pageError;
+	HAL_StatusTypeDef status;
+
+	for (uint8_t i = 0; i < ring->pages; i++) {
+		next = (next + 1) % ring->pages;
+		if (!(ring->bad & (1u << next))) break;
+	}
+	if (ring->bad & (1u << next)) return HAL_ERROR;
+
+	if (FLASHRING_Started(ring, next)) header.erases = FLASHRING_Page(ring, next)->erases + 1;
+	erase.PageAddress = (uintptr_t)FLASHRING_Page(ring, next);
+	HAL_FLASH_Unlock();
+	status = HAL_FLASHEx_Erase(&erase, &pageError);
+	HAL_FLASH_Lock();
+	ring->erases++;
+	if (status == HAL_OK) status = FLASHRING_Program((uintptr_t)FLASHRING_Page(ring, next), &header, sizeof(header));
+	if (status != HAL_OK) {
+		if (++ring->tries >= FLASHRING_TRIES) {
+			ring->bad |= 1u << next;
+			ring->tries = 0;
+		}
+		return status;
+	}
+
+	ring->page = next;
+	ring->slot = 0;
+	ring->sequence = header.sequence;
+	ring->tries = 0;
+	return HAL_OK;
+}
+
+/*
+ * Fill in the record's check half-word and program it to the next free
+ * slot. A failed record uses up its slot, so try again with the next one.
+ */
+HAL_StatusTypeDef FLASHRING_Append(FLASHRING *ring, void *record) {
+	uint16_t *half = record;
+
+	if (FLASHRING_Full(ring)) return HAL_ERROR;
+	half[ring->size / 2 - 1] = FLASHRING_Check(ring, half);
+	return FLASHRING_Program((uintptr_t)FLASHRING_Slot(ring, ring->page, ring->slot++), record, ring->size);
+}
+
+/*
+ * Walk the valid records, oldest first, until the index-th one
+ */
+static const void *FLASHRING_Walk(const FLASHRING *ring, uint16_t index, uint16_t *count) {
+	*count = 0;
+	for (uint8_t i = 1; i <= ring->pages; i++) {
+		uint8_t p = (ring->page + i) % ring->pages;
+		if (!FLASHRING_Started(ring, p)) continue;
+		for (uint16_t s = 0; s < FLASHRING_Slots(ring) && !FLASHRING_Free(ring, p, s); s++) {
+			const uint16_t *record = FLASHRING_Slot(ring, p, s);
+			if (record[ring->size / 2 - 1] != FLASHRING_Check(ring, record)) continue;
+			if ((*count)++ == index) return record;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Number of records in the ring
+ */
+uint16_t FLASHRING_Count(const FLASHRING *ring) {
+	uint16_t count;
+	FLASHRING_Walk(ring, 0xFFFF, &count);
+	return count;
+}
+
+/*
+ * The index-th record in the ring, oldest first, NULL past the end
+ */
+const void *FLASHRING_Get(const FLASHRING *ring, uint16_t index) {
+	uint16_t count;
+	return FLASHRING_Walk(ring, index, &count);
+}
@@ -0,0 +1,40 @@
+/*
+ * File: flashRing.h
+ * Purpose: Declares a ring of flash pages holding fixed size records, shared
+ *          by the logs kept in flash. Pages are started in turn with a
+ *          sequence number and an erase count in their header, so every
+ *          page wears at the same rate. Every record ends in a check
+ *          half-word that is programmed last, so a record cut short by a
+ *          power loss is skipped. A page that fails to start
+ *          FLASHRING_TRIES times is left out of the ring until the next
+ *          boot.
+ */
+#ifndef __FLASH_RING_H
+#define __FLASH_RING_H
+
+#include "stm32f0xx_hal.h"
+
+#define FLASHRING_ERASE_MS 40   // longest page erase, the CPU stalls for all of it
+#define FLASHRING_TRIES 3       // failed starts of a page before it is left out of the ring
+
+// Where a ring lives and, once set up, where it ends
+typedef struct flash_ring {
+  uintptr_t start;          // first page
+  uint8_t pages;
+  uint16_t size;            // bytes per record, a multiple of 4 ending with the check half-word
+  uint8_t page;             // page records are programmed to
+  uint16_t slot;            // next free slot on it, the slots per page when a new page must be started
+  uint32_t sequence;        // sequence of that page
+  uint32_t erases;          // pages erased since boot
+  uint8_t tries;            // failed starts of the next page in a row
+  uint32_t bad;             // pages left out until the next boot, a bit each
+} FLASHRING;
+
+void FLASHRING_Setup(FLASHRING *ring);
+uint8_t FLASHRING_Full(const FLASHRING *ring);
+HAL_StatusTypeDef FLASHRING_StartPage(FLASHRING *ring);
+HAL_StatusTypeDef FLASHRING_Append(FLASHRING *ring, void *record);
+uint16_t FLASHRING_Count(const FLASHRING *ring);
+const void *FLASHRING_Get(const FLASHRING *ring, uint16_t index);
+
+#endif /* __FLASH_RING_H */
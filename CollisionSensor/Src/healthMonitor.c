@@ -0,0 +1,118 @@
+/*
+ * File: healthMonitor.c
+ * Purpose: Defines the health monitor: the checks on every period's reading,
+ *          the faults they raise and clear, and the pace of the requests to
+ *          a faulted sensor.
+ */
+#include "healthMonitor.h"
+#include "ultrasonicSensorUart.h"
+
+HEALTH *thisHealth;
+HEALTH_STATUS healthStatus;
+
+static uint8_t replies;   // replies completed at the last update
+static uint8_t asked;     // a request went out this period
+static uint8_t due;       // one went out last period, its reply is due by now
+static uint8_t wait;      // periods until the next request while faulted
+
+/*
+ * Start with no fault and no readings
+ */
+void HEALTH_Setup(HEALTH *health) {
+	thisHealth = health;
+	healthStatus.last = 0xFFFF;
+	healthStatus.before = 0xFFFF;
+}
+
+/*
+ * At the start of every period: whether to ask the sensor for a reading. A
+ * faulted sensor is asked every retry periods, and every period again once
+ * it gives a good reading.
+ */
+uint8_t HEALTH_Request(void) {
+	uint8_t ask = healthStatus.fault == HEALTH_OK || healthStatus.fault == HEALTH_STUCK || healthStatus.good > 0 || wait == 0;
+
+	wait = ask ? thisHealth->retry - 1 : wait - 1;
+	due = asked;
+	asked = ask;
+	return ask;
+}
+
+/*
+ * Raise a fault, or keep the one raised
+ */
+static void HEALTH_Fault(uint8_t fault) {
+	if (healthStatus.fault == HEALTH_OK) {
+		healthStatus.faults++;
+		healthStatus.periods = 0;
+	}
+	healthStatus.fault = fault;
+	healthStatus.good = 0;
+}
+
+/*
+ * The fault a new reading shows, if any
+ */
+static uint8_t HEALTH_Check(uint16_t reading, uint8_t temperature) {
+	uint16_t last = healthStatus.last, before = healthStatus.before, spike = thisHealth->spike_mm;
+	uint8_t warmed = temperature != healthStatus.temperature;
+
+	healthStatus.before = last;
+	healthStatus.last = reading;
+	healthStatus.temperature = temperature;
+	if (reading > SENSOR_MAX_RANGE) {
+		healthStatus.stuck = 0;
+		if (healthStatus.flood < thisHealth->flood) healthStatus.flood++;
+		return healthStatus.flood == thisHealth->flood ? HEALTH_NO_ECHO : HEALTH_OK;
+	}
+	healthStatus.flood = 0;
+
+	if (reading != last || warmed) healthStatus.stuck = 1;
+	else if (healthStatus.stuck < thisHealth->stuck) healthStatus.stuck++;
+
+	// the last reading is far from this one and the one before, which agree
+	if (last <= SENSOR_MAX_RANGE && before <= SENSOR_MAX_RANGE &&
+	    (last > reading ? last - reading : reading - last) > spike &&
+	    (last > before ? last - before : before - last) > spike &&
+	    (reading > before ? reading - before : before - reading) <= spike) {
+		healthStatus.spikes += HEALTH_SPIKE_WEIGHT;
+		if (healthStatus.spikes > thisHealth->spikes * HEALTH_SPIKE_WEIGHT) healthStatus.spikes = thisHealth->spikes * HEALTH_SPIKE_WEIGHT;
+	}
+	else if (healthStatus.spikes) healthStatus.spikes--;
+
+	if (healthStatus.stuck == thisHealth->stuck) return HEALTH_STUCK;
+	if (healthStatus.spikes == thisHealth->spikes * HEALTH_SPIKE_WEIGHT) return HEALTH_ERRATIC;
+	return HEALTH_OK;
+}
+
+/*
+ * Every period, after the wait for the reading: check it if it is new, and
+ * count a period without one if a reply was due. Returns whether the reading
+ * is new and good with no fault left, or stuck, so the warnings can use it.
+ */
+uint8_t HEALTH_Update(uint8_t count, uint16_t reading, uint8_t temperature) {
+	uint8_t fault;
+
+	healthStatus.periods++;
+	if (count == replies) {
+		if (!due) return 0;
+		healthStatus.good = 0;
+		if (healthStatus.missed < thisHealth->missed) healthStatus.missed++;
+		if (healthStatus.missed == thisHealth->missed) HEALTH_Fault(HEALTH_NO_REPLY);
+		return 0;
+	}
+	replies = count;
+	healthStatus.missed = 0;
+
+	fault = HEALTH_Check(reading, temperature);
+	if (fault != HEALTH_OK) {
+		HEALTH_Fault(fault);
+		// a stuck reading may be a still object, so it is never dropped
+		return fault == HEALTH_STUCK;
+	}
+	if (healthStatus.fault == HEALTH_OK) return 1;
+	if (++healthStatus.good < thisHealth->recover) return healthStatus.fault == HEALTH_STUCK;
+	healthStatus.fault = HEALTH_OK;
+	healthStatus.good = 0;
+	return 1;
+}
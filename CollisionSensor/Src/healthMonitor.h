@@ -0,0 +1,63 @@
+/*
+ * File: healthMonitor.h
+ * Purpose: Declares the health monitor on the readings from the sensor. It
+ *          notices a sensor that stops answering, one that sends the same
+ *          reading over and over, one that sees nothing in range for a
+ *          minute, and one whose readings spike: a single reading far from
+ *          the two either side of it, which agree. On a fault main shows the
+ *          fault pattern instead of the warnings, and the sensor is asked
+ *          only every few periods until it gives a good reading again.
+ *
+ *          A still object in front of a still sensor gives the same reading
+ *          for as long as it stays, so a stuck sensor also has to keep the
+ *          same temperature, and for much longer. Even then the readings
+ *          may be real: a stuck sensor is flagged but its readings still
+ *          drive the warnings.
+ */
+#ifndef __HEALTH_MONITOR_H
+#define __HEALTH_MONITOR_H
+
+#include "stm32f0xx_hal.h"
+
+#define HEALTH_SPIKE_WEIGHT 8     // readings without a spike that make up for one
+
+// Faults, HEALTH_OK when there is none
+#define HEALTH_OK 0
+#define HEALTH_NO_REPLY 1         // no reply for missed periods in a row
+#define HEALTH_STUCK 2            // the same reading and temperature stuck times in a row, still warned on
+#define HEALTH_NO_ECHO 3          // nothing in range flood times in a row
+#define HEALTH_ERRATIC 4          // spikes too close together
+
+// Limits of each fault and how the sensor is retried
+typedef struct health {
+  uint8_t missed;           // periods in a row without a reply
+  uint16_t stuck;           // readings in range in a row with the same value and temperature
+  uint16_t flood;           // readings in a row with nothing in range
+  uint16_t spike_mm;        // how far a spike is from the readings either side, which are this close
+  uint8_t spikes;           // spikes, less one for every HEALTH_SPIKE_WEIGHT readings without, up to 31
+  uint8_t retry;            // periods between requests while faulted
+  uint8_t recover;          // good readings in a row that clear a fault
+} HEALTH;
+
+// State of the monitor, for main, the simulator and the debugger
+typedef struct health_status {
+  uint8_t fault;            // HEALTH_OK to HEALTH_ERRATIC
+  uint8_t periods;          // since the fault, wraps, paces the fault pattern
+  uint8_t good;             // good readings in a row while faulted
+  uint8_t missed;           // periods in a row without a reply
+  uint8_t spikes;           // spike score, HEALTH_SPIKE_WEIGHT a spike
+  uint16_t stuck;           // readings in a row with the last one's value and temperature
+  uint16_t flood;           // readings in a row with nothing in range
+  uint16_t last;            // last reading
+  uint16_t before;          // the one before it
+  uint8_t temperature;      // the sensor's, when the last reading was checked
+  uint32_t faults;          // since boot
+} HEALTH_STATUS;
+
+extern HEALTH_STATUS healthStatus;
+
+void HEALTH_Setup(HEALTH *health);
+uint8_t HEALTH_Request(void);
+uint8_t HEALTH_Update(uint8_t count, uint16_t reading, uint8_t temperature);
+
+#endif /* __HEALTH_MONITOR_H */
@@ -0,0 +1,166 @@
+/*
+ * File: i2cTarget.c
+ * Purpose: Defines the I2C target on I2C1: the pins, the own address, the
+ *          interrupt handler that answers the host a byte at a time, and
+ *          the three buffers the register map is built in.
+ *
+ *          One buffer is the published map, one may be latched by a read
+ *          in progress, and TIM2 builds the next map in one that is
+ *          neither. Only the handler changes the latched one, and only to
+ *          the published one or to none, so TIM2 needs no critical section
+ *          to pick its buffer. The bytes go to TXDR straight from the
+ *          buffer, nothing is copied on the way.
+ */
+#include <stddef.h>
+
+#include "i2cTarget.h"
+#include "telemetry.h"
+#include "ultrasonicSensorUart.h"
+#include "healthMonitor.h"
+#include "alertLine.h"
+#include "isrProbe.h"
+
+#define TARGET_NONE 3             // no read in progress
+
+TARGET *thisTarget;
+TARGET_STATS targetStats;
+
+static TARGET_MAP maps[3];
+static volatile uint8_t published;            // the map a read takes
+static volatile uint8_t latched = TARGET_NONE; // the map the read in progress sends from
+static uint8_t start;                         // register address the host wrote last
+static uint8_t address;                       // next register to send
+static uint8_t addressing;                    // the next byte written is a register address
+
+// The last fresh reading, for the periods without one
+static uint16_t lastRaw, lastDistance;
+static uint32_t sequence, readings;
+
+/*
+ * GPIOB pin configuration: alternate function 1 (I2C1), open-drain with
+ * the pull-up on, high speed
+ */
+static void TARGET_ConfigPin(uint8_t x) {
+	GPIOB->MODER = (GPIOB->MODER & ~(3 << (2*x))) | (2 << (2*x));
+	GPIOB->OTYPER |= 1 << x;
+	GPIOB->OSPEEDR |= 3 << (2*x);
+	GPIOB->PUPDR = (GPIOB->PUPDR & ~(3 << (2*x))) | (1 << (2*x));
+	GPIOB->AFR[x >> 3] = (GPIOB->AFR[x >> 3] & ~(0xF << (4*(x & 7)))) | (0x1 << (4*(x & 7)));
+}
+
+/*
+ * Setup I2C1 as a target at the given address, clocked from the HSI
+ */
+void TARGET_Setup(TARGET *target) {
+	thisTarget = target;
+	for (uint8_t i = 0; i < 3; i++) {
+		maps[i].id = TARGET_ID;
+		maps[i].version = TARGET_VERSION;
+		maps[i].zone = 4;  // no reading yet
+	}
+	maps[0].crc = TELEMETRY_Crc((const uint8_t *)&maps[0], offsetof(TARGET_MAP, crc));
+
+	RCC->APB1ENR |= RCC_APB1ENR_I2C1EN;
+	RCC->AHBENR |= RCC_AHBENR_GPIOBEN;
+	TARGET_ConfigPin(target->i2c_scl);
+	TARGET_ConfigPin(target->i2c_sda);
+
+	// data setup and hold times of the fast mode from 8 MHz, the standard mode takes them too
+	I2C1->CR1 &= ~I2C_CR1_PE;
+	I2C1->TIMINGR = 0x00310309;
+	I2C1->OAR1 = target->address << 1;
+	I2C1->OAR1 |= I2C_OAR1_OA1EN;
+	// the clock is stretched while a byte waits for the handler, so none is late
+	I2C1->CR1 = I2C_CR1_ADDRIE | I2C_CR1_RXIE | I2C_CR1_TXIE | I2C_CR1_STOPIE | I2C_CR1_NACKIE | I2C_CR1_ERRIE | I2C_CR1_PE;
+
+	// below the sensor's USART3 and SysTick, above TIM2, with the links
+	NVIC_EnableIRQ(I2C1_IRQn);
+	NVIC_SetPriority(I2C1_IRQn, 1);
+}
+
+/*
+ * Every period from TIM2, after the warnings: build the map in a buffer no
+ * read is using, then publish it. A period without a fresh reading keeps
+ * the last distances. The velocity and the events are the alert line's.
+ */
+void TARGET_Update(uint8_t fresh, uint16_t raw, uint16_t distance) {
+	uint8_t busy = latched;
+	uint8_t next = 0;
+	TARGET_MAP *map;
+	uint32_t now = HAL_GetTick();
+
+	while (next == published || next == busy) next++;
+	map = &maps[next];
+
+	if (fresh) {
+		lastRaw = raw;
+		lastDistance = distance;
+		readings++;
+	}
+
+	map->status = (fresh ? TARGET_FRESH : 0) | (healthStatus.fault != HEALTH_OK ? TARGET_FAULT : 0) |
+	              (alertStatus.events & ALERT_ZONE ? TARGET_ZONE : 0) | (alertStatus.events & ALERT_TTC ? TARGET_TTC : 0);
+	map->zone = 0;
+	for (uint8_t i = 0; i < 4; i++) map->zone += lastDistance >= thisTarget->thresholds[i];
+	if (readings == 0) map->zone = 4;
+	map->distance = lastDistance;
+	map->velocity = fresh ? alertStatus.velocity : 0;
+	map->raw = lastRaw;
+	map->fault = healthStatus.fault;
+	map->temperature = sensorValues.temperature - 45;
+	map->time_ms = now;
+	map->sequence = ++sequence;
+	map->readings = readings;
+	map->faults = healthStatus.faults;
+	map->replies = sensorValues.replies;
+	map->crc = TELEMETRY_Crc((const uint8_t *)map, offsetof(TARGET_MAP, crc));
+
+	published = next;
+	targetStats.published++;
+}
+
+/*
+ * I2C1 interrupt request handler: the host addressed the board, wrote a
+ * byte, wants the next byte or is done
+ */
+void I2C1_IRQHandler(void) {
+	uint32_t probe = PROBE_Enter();
+	uint32_t isr = I2C1->ISR;
+
+	if (isr & I2C_ISR_ADDR) {
+		if (isr & I2C_ISR_DIR) {
+			// a read takes the map published last and keeps it to the stop
+			latched = published;
+			address = start;
+			I2C1->ISR |= I2C_ISR_TXE;  // drop the byte a read before this one left in TXDR
+			targetStats.reads++;
+		}
+		else addressing = 1;
+		I2C1->ICR = I2C_ICR_ADDRCF;
+	}
+	if (isr & I2C_ISR_RXNE) {
+		uint8_t byte = I2C1->RXDR;
+		// the map is read-only, a byte after the register address is ignored
+		if (addressing) start = address = byte;
+		addressing = 0;
+	}
+	if (isr & I2C_ISR_TXIS) {
+		// past the end of the map reads as 0
+		uint8_t map = latched;
+		I2C1->TXDR = map != TARGET_NONE && address < sizeof(TARGET_MAP) ? ((const uint8_t *)&maps[map])[address] : 0;
+		address++;
+		targetStats.bytes++;
+	}
+	if (isr & I2C_ISR_NACKF) I2C1->ICR = I2C_ICR_NACKCF;
+	if (isr & (I2C_ISR_BERR | I2C_ISR_ARLO | I2C_ISR_OVR)) {
+		I2C1->ICR = I2C_ICR_BERRCF | I2C_ICR_ARLOCF | I2C_ICR_OVRCF;
+		targetStats.errors++;
+	}
+	if (isr & I2C_ISR_STOPF) {
+		I2C1->ICR = I2C_ICR_STOPCF;
+		latched = TARGET_NONE;
+		addressing = 0;
+	}
+
+	PROBE_Exit(PROBE_I2C, probe);
+}
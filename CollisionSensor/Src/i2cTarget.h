@@ -0,0 +1,70 @@
+/*
+ * File: i2cTarget.h
+ * Purpose: Declares the I2C target on I2C1, for a host that uses the board
+ *          as a ranging co-processor. The host reads a map of registers
+ *          with the latest reading in it: it writes a register address,
+ *          then reads from there after a repeated start, and the address
+ *          moves on with every byte, so one read can take the whole map.
+ *          A read on its own starts again from the last address written.
+ *
+ *          TIM2 builds each period's map in place, in one of three buffers,
+ *          then publishes it. A read sends every byte from the map that was
+ *          published when the host addressed the board, and TIM2 never
+ *          builds into that one, so all the values of a read come from the
+ *          same period however long the host takes over it.
+ */
+#ifndef __I2C_TARGET_H
+#define __I2C_TARGET_H
+
+#include "stm32f0xx_hal.h"
+
+#define TARGET_ID 0xC5            // first register, what a host checks it is talking to
+#define TARGET_VERSION 1          // layout of TARGET_MAP, incremented when it changes
+
+// Status register
+#define TARGET_FRESH 0x01         // the distances are this period's reading, not the last one
+#define TARGET_FAULT 0x02         // the sensor is faulted, see the fault register
+#define TARGET_ZONE 0x04          // the reading moved to another zone, the alert line is high
+#define TARGET_TTC 0x08           // the time to collision went below the alarm, the alert line is high
+
+// Holds the I2C information, pins on GPIOB
+typedef struct target {
+  uint8_t i2c_scl;
+  uint8_t i2c_sda;
+  uint8_t address;          // 7 bit
+  const uint16_t *thresholds; // zone boundaries in mm, closest first, those of CONFIG, for the zone register
+} TARGET;
+
+// The registers, little-endian, at their offsets in the map
+typedef struct target_map {
+  uint8_t id;               // 0x00 TARGET_ID
+  uint8_t version;          // 0x01 TARGET_VERSION
+  uint8_t status;           // 0x02 TARGET_FRESH, TARGET_FAULT, TARGET_ZONE, TARGET_TTC
+  uint8_t zone;             // 0x03 of the distance: red 0, orange, blue, green, none 4
+  uint16_t distance;        // 0x04 calibrated and filtered, in mm
+  int16_t velocity;         // 0x06 change of the distance in mm/s, smoothed, negative closing, 0 outside the zones
+  uint16_t raw;             // 0x08 reading from the sensor in mm
+  uint8_t fault;            // 0x0A HEALTH_OK to HEALTH_ERRATIC
+  int8_t temperature;       // 0x0B degrees C, the last the sensor sent
+  uint32_t time_ms;         // 0x0C HAL tick when the map was built
+  uint32_t sequence;        // 0x10 maps built since boot, one a period
+  uint32_t readings;        // 0x14 of them with a fresh reading
+  uint32_t faults;          // 0x18 sensor faults since boot
+  uint16_t replies;         // 0x1C sensor replies since boot, wraps
+  uint16_t crc;             // 0x1E CRC-16/CCITT of the bytes before it, as in the telemetry
+} TARGET_MAP;
+
+// What the host did, for the simulator and the debugger
+typedef struct target_stats {
+  uint32_t published;       // maps built
+  uint32_t reads;           // read transfers started
+  uint32_t bytes;           // put in TXDR, one more than the host takes as the next is always ready
+  uint32_t errors;          // bus errors and overruns
+} TARGET_STATS;
+
+extern TARGET_STATS targetStats;
+
+void TARGET_Setup(TARGET *target);
+void TARGET_Update(uint8_t fresh, uint16_t raw, uint16_t distance);
+
+#endif /* __I2C_TARGET_H */
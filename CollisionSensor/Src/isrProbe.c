@@ -0,0 +1,54 @@
+/*
+ * File: isrProbe.c
+ * Purpose: Defines the interrupt handler budgets and, with ISR_PROBES set,
+ *          the probes that time each handler with the HAL tick and the
+ *          SysTick counter.
+ */
+#include "isrProbe.h"
+
+const uint32_t isrBudgets[PROBE_COUNT] = {
+	PROBE_BUDGET_TIM2_US,
+	PROBE_BUDGET_USART3_US,
+	PROBE_BUDGET_SYSTICK_US,
+	PROBE_BUDGET_USB_US,
+	PROBE_BUDGET_SERIAL_US,
+	PROBE_BUDGET_I2C_US,
+	PROBE_BUDGET_ALERT_US
+};
+
+#if ISR_PROBES
+volatile PROBE_Stats isrProbes[PROBE_COUNT];
+
+/*
+ * Core clock cycles since reset, wraps after 2^32 cycles
+ */
+uint32_t PROBE_Now(void) {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uint32_t ms = HAL_GetTick();
+	uint32_t val = SysTick->VAL;
+	// SysTick has wrapped but its interrupt has not counted the tick yet
+	if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+		ms++;
+		val = SysTick->VAL;
+	}
+	uint32_t now = ms * (SysTick->LOAD + 1) + (SysTick->LOAD - val);
+
+	__set_PRIMASK(primask);
+	return now;
+}
+
+/*
+ * Record a handler run that started at start, a PROBE_Enter timestamp
+ */
+void PROBE_Exit(PROBE_Isr isr, uint32_t start) {
+	uint32_t spent = PROBE_Now() - start;
+	volatile PROBE_Stats *s = &isrProbes[isr];
+
+	s->count++;
+	s->last_cycles = spent;
+	if (spent > s->max_cycles) s->max_cycles = spent;
+	if (spent > isrBudgets[isr] * (SystemCoreClock / 1000000)) s->over++;
+}
+#endif
@@ -0,0 +1,65 @@
+/*
+ * File: isrProbe.h
+ * Purpose: Declares the worst-case execution time budget of every interrupt
+ *          handler and the timestamp probes that measure them on the board.
+ *          The budgets are always built in, so the simulator can check its
+ *          own measurements against them.
+ */
+#ifndef __ISR_PROBE_H
+#define __ISR_PROBE_H
+
+#include "stm32f0xx_hal.h"
+
+// Set ISR_PROBES to 1 to time every handler in RAM. The results can be read
+// out with the debugger or the simulator.
+#ifndef ISR_PROBES
+#define ISR_PROBES 0
+#endif
+
+// Handlers with a budget, and the alert line from TIM2's entry to its edge
+typedef enum {
+	PROBE_TIM2,
+	PROBE_USART3,
+	PROBE_SYSTICK,
+	PROBE_USB,
+	PROBE_SERIAL,
+	PROBE_I2C,
+	PROBE_ALERT,
+	PROBE_COUNT
+} PROBE_Isr;
+
+// Budgets in microseconds, from entry to exit including time preempted
+#define PROBE_BUDGET_TIM2_US 100000		// must finish within its own 100 ms period
+#define PROBE_BUDGET_USART3_US 50			// a byte arrives every 1042 us at 9600 baud
+#define PROBE_BUDGET_SYSTICK_US 10		// delays USART3, which shares its priority
+#define PROBE_BUDGET_USB_US 200			// well inside the 1 ms frame the host polls in
+#define PROBE_BUDGET_SERIAL_US 50		// the USART1 line idles about a byte between frames at 230400 baud
+#define PROBE_BUDGET_I2C_US 100			// holds the host's clock, four bytes' time at 400 kHz
+#define PROBE_BUDGET_ALERT_US 500		// the handlers above TIM2 at their budgets, then the classification
+
+extern const uint32_t isrBudgets[PROBE_COUNT];
+
+// What the probes saw of one handler
+typedef struct {
+	uint32_t count;
+	uint32_t max_cycles;
+	uint32_t last_cycles;
+	uint32_t over;				// runs above the budget
+} PROBE_Stats;
+
+#if ISR_PROBES
+extern volatile PROBE_Stats isrProbes[PROBE_COUNT];
+
+uint32_t PROBE_Now(void);
+void PROBE_Exit(PROBE_Isr isr, uint32_t start);
+
+#define PROBE_Enter() PROBE_Now()
+// SysTick_Handler enters after the tick it counts has passed, but before HAL_IncTick
+#define PROBE_EnterTick() (PROBE_Now() + SysTick->LOAD + 1)
+#else
+#define PROBE_Enter() 0
+#define PROBE_EnterTick() 0
+#define PROBE_Exit(isr, start) ((void)(start))
+#endif
+
+#endif /* __ISR_PROBE_H */
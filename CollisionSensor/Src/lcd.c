@@ -27,7 +27,7 @@ void LCD_Setup(LCD *screen) {
 	
 	// send a reset pulse to reset LCD screen 
 	GPIOB->BRR = (1 << thisScreen->reset);
-	HAL_Delay(100);
+	HAL_Delay(thisScreen->reset_ms);
 	GPIOB->BSRR = (1 << thisScreen->chip_select) | (1 << thisScreen->reset);
   
 	// Configure SPI
@@ -311,6 +311,53 @@ void LCD_PrintTempMeasurement(uint16_t temp, char* units, uint8_t units_sz, uint
 	LCD_PrintStringCentered(fullTempStr, i);
 }
 
+/*
+ * Print "label value units" from the left of row y, clearing the rest
+ */
+void LCD_PrintStat(uint8_t y, char* label, uint8_t label_sz, uint16_t value, char* units, uint8_t units_sz) {
+	LCD_ClearRow(y, 0);
+	LCD_SetY(y);
+	LCD_SetX(0);
+	LCD_PrintString(label, label_sz);
+	LCD_AppendStat(value, units, units_sz);
+}
+
+/*
+ * Continue a row started by LCD_PrintStat with " value units"
+ */
+void LCD_AppendStat(uint16_t value, char* units, uint8_t units_sz) {
+	char valueStr[8];
+	uint8_t sz = uintToStr(valueStr, value);
+	
+	LCD_PrintCharacter(' ');
+	LCD_PrintString(valueStr, sz);
+	LCD_PrintString(units, units_sz);
+}
+
+/*
+ * Draw a bar for each bin on row y, 4 columns wide and up to 8 pixels
+ * high, scaled to the fullest bin
+ */
+void LCD_PrintHistogram(uint8_t y, const uint32_t* bins, uint8_t count) {
+	uint32_t most = 1;
+	
+	for (int i = 0; i < count; i++) {
+		if (bins[i] > most) most = bins[i];
+	}
+	LCD_ClearRow(y, 0);
+	LCD_SetY(y);
+	LCD_SetX((84 - count*5)/2);
+	for (int i = 0; i < count; i++) {
+		// any reading at all shows at least one pixel
+		uint8_t height = bins[i] ? (bins[i]*8 + most - 1) / most : 0;
+		uint8_t column = (uint8_t)(0xFF00 >> height); // the top pixel is the lowest bit
+		for (int j = 0; j < 4; j++) {
+			LCD_SendData(column);
+		}
+		LCD_SendData(0x00);
+	}
+}
+
 /*
  * convert an unsigned int to a string and return the number of characters
  */ 
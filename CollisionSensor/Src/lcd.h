@@ -127,6 +127,7 @@ typedef struct {						// Pin Numbers on LCD
 	uint8_t chip_select;			// Pin 3, SCE - active low
 	uint8_t mode_select;			// Pin 5, D/C - command low, data high
 	uint8_t reset;						// Pin 4, RST - active low
+	uint8_t reset_ms;					// length of the reset pulse
 } LCD;
 
 void LCD_Setup(LCD *screen);
@@ -158,6 +159,9 @@ void LCD_PrintStringCentered(char* str, uint8_t sz);
 void LCD_DistanceSetup(void);
 void LCD_PrintMeasurement(uint16_t dist, char* units, uint8_t units_sz);
 void LCD_PrintTempMeasurement(uint16_t temp, char* units, uint8_t units_sz, uint16_t temp2, char* units2, uint8_t units_sz2);
+void LCD_PrintStat(uint8_t y, char* label, uint8_t label_sz, uint16_t value, char* units, uint8_t units_sz);
+void LCD_AppendStat(uint16_t value, char* units, uint8_t units_sz);
+void LCD_PrintHistogram(uint8_t y, const uint32_t* bins, uint8_t count);
 uint8_t uintToStr(char* buf, uint16_t dist);
 
 // Pin configuration
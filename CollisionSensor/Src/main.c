@@ -23,6 +23,24 @@
 #include "motor.h"
 #include "ultrasonicSensorUart.h"
 #include "lcd.h"
+#include "isrProbe.h"
+#include "rangeFilter.h"
+#include "rangeCalibration.h"
+#include "clutterModel.h"
+#include "healthMonitor.h"
+#include "configStore.h"
+#include "eventLog.h"
+#include "scopeCapture.h"
+#include "sampleLog.h"
+#include "sessionStats.h"
+#include "crashLog.h"
+#include "watchdog.h"
+#include "telemetry.h"
+#include "usbCdc.h"
+#include "serialLink.h"
+#include "commandShell.h"
+#include "i2cTarget.h"
+#include "alertLine.h"
 
 /*
  * USART3 Pins:
@@ -34,6 +52,26 @@
 #define TX_B 10
 #define RX_B 11
 
+/*
+ * USART1 Pins, the telemetry link:
+ *  CHOSEN: TX PA9, RX PA10
+ *          AF1     AF1
+ */
+#define TX_A 9
+#define RX_A 10
+#define SERIAL_BAUD 230400	// fastest standard rate within 1% at the 8 MHz core clock
+
+/*
+ * I2C1 Pins, the register map for a host:
+ *  SCL: PB6, PB8
+ *  SDA: PB7, PB9
+ *  CHOSEN: SCL PB8, SDA PB9 (PB6 and PB7 drive the LCD)
+ *          AF1      AF1
+ */
+#define SCL_B 8
+#define SDA_B 9
+#define TARGET_ADDRESS 0x2A	// 7 bit
+
 // SPI Pins for LCD
 #define SCK_B 13	// system clock
 #define MOSI_B 15 // send data
@@ -51,20 +89,108 @@
 #define GREEN_LED_THRESHOLD 1900 // 6 feet
 #define NO_LED_THRESHOLD 3500 // 12 feet
 
+// Motor PWM: 8MHz timer clock, 1250 us period
+#define MOTOR_PWM_PRESCALAR 0
+#define MOTOR_PWM_ARR 10000
+
+// Motor duty in percent in the red, orange, blue and green zones, the haptic curve
+#define HAPTIC_RED 100
+#define HAPTIC_ORANGE 66
+#define HAPTIC_BLUE 33
+#define HAPTIC_GREEN 0
+
+// TIM2 auto-reload at 1 ms per count, the time between readings
+#define SAMPLE_MS 100
+
+// User button on the Discovery board, PA0, high while pressed
+#define USER_BUTTON_A 0
+
+// Readings between redraws of the stats page, about a second
+#define STATS_REFRESH 10
+
+// Range calibration: targets at known distances from the front of the hat,
+// the readings averaged at each, and the readings the user button is held
+// to start it (2 s)
+#define CALIBRATION_NEAR_MM 500
+#define CALIBRATION_FAR_MM 1000
+#define CALIBRATION_BURST 16
+#define CALIBRATION_HOLD 20
+
+// Still readings at one range before the motor treats it as background, 10 s
+#define CLUTTER_LEARN_READINGS 100
+
+// Sensor health: periods without a reply (0.3 s), identical readings at an
+// unchanged temperature (1 min) and readings with nothing in range (1 min)
+// before a fault, how far a spike is and how many close together are a
+// fault, the periods between requests to a faulted sensor and the good
+// readings that clear the fault. The fault pattern flashes red and green,
+// then blue and orange, a pair no zone lights, and buzzes the motor one
+// period in HEALTH_BUZZ. A stuck sensor is only flagged, a still object
+// reads the same, so its readings keep driving the warnings.
+#define HEALTH_MISSED_PERIODS 3
+#define HEALTH_STUCK_READINGS 600
+#define HEALTH_FLOOD_READINGS 600
+#define HEALTH_SPIKE_MM 1000
+#define HEALTH_SPIKES 4
+#define HEALTH_RETRY_PERIODS 5
+#define HEALTH_RECOVER_READINGS 3
+#define HEALTH_BUZZ 10
+
+// What the LCD shows
+#define SCREEN_DISTANCE 0
+#define SCREEN_STATS 1
+#define SCREEN_CALIBRATION 2
+
+// LCD reset pulse: long enough for its supply to come up at power-on, the
+// shortest HAL_Delay when the board resets after a crash with the LCD powered
+#define LCD_RESET_MS 100
+#define LCD_RESET_CRASH_MS 1
+
+// Readings a pipeline stage may miss before the watchdog supervisor resets the board
+#define WATCHDOG_MISSED_READINGS 3
+
 // LED Pins on GPIOC
 #define RED_LED 6
 #define BLUE_LED 7
 #define ORANGE_LED 8
 #define GREEN_LED 9
 
+// Alert line for a host, on GPIOC with the LEDs so one store drives them all.
+// High for a period on a zone change, or when the object would reach the
+// hat within ALERT_TTC_MS closing faster than ALERT_MIN_CLOSING mm/s
+#define ALERT_C 12
+#define ALERT_TTC_MS 1500
+#define ALERT_MIN_CLOSING 200
+
+// Settings used until a configuration is saved to flash, the filter is off (tune with Sim/Filters)
+static const CONFIG defaults = {
+  {ORANGE_LED_THRESHOLD, BLUE_LED_THRESHOLD, GREEN_LED_THRESHOLD, NO_LED_THRESHOLD},
+  MOTOR_PWM_PRESCALAR, MOTOR_PWM_ARR, SAMPLE_MS,
+  1, 0, 0, // filter window, smoothing, hysteresis
+  SCREEN_DISTANCE, 0, // LCD page at boot, reserved
+  0, CALIBRATION_UNITY, // range offset and scale, readings as they are until calibrated
+  {HAPTIC_RED, HAPTIC_ORANGE, HAPTIC_BLUE, HAPTIC_GREEN}
+};
+static CONFIG settings; // a copy, a save erases the page the loaded one is in
+const CONFIG *config;
+
 void SystemClock_Config(void);
 
 void configGPIOC_output(uint8_t pin);
 void timerSetup(void);
+uint32_t msLeft(void);
 
 void setWarnings(void);
-void setLEDs(uint16_t distance);
+void setLEDs(uint16_t distance, uint32_t alert);
+void showFault(void);
 void displayTemperature(void);
+void updateScreen(void);
+void displayStats(void);
+void displayCalibration(void);
+
+static uint8_t screen; // SCREEN_DISTANCE, SCREEN_STATS or SCREEN_CALIBRATION
+static uint8_t page;   // the display setting updateScreen last followed
+static uint32_t period; // PROBE_Enter of this period's TIM2, for the alert line's latency
 
 /*
  * Setup the motr, sensor, LEDs, LCD screen, and the 100ms timer interrupt
@@ -75,7 +201,18 @@ int main(void)
   HAL_Init();
   SystemClock_Config();
   
+  // A crash captured before this boot: recover first, then log it
+  uint8_t recovering = CRASHLOG_Setup();
+  
+  // Settings saved in flash, or the defaults
+  settings = *CONFIG_Load(&defaults);
+  config = &settings;
+  page = config->display == SCREEN_STATS ? SCREEN_STATS : SCREEN_DISTANCE;
+  screen = page;
+  
   RCC->AHBENR |= RCC_AHBENR_GPIOCEN;  // Enable GPIOC clock
+  RCC->AHBENR |= RCC_AHBENR_GPIOAEN;  // Enable GPIOA clock, for the user button
+  GPIOA->MODER &= ~(3 << (2*USER_BUTTON_A)); // input, the board pulls it down
 	RCC->APB1ENR |= RCC_APB1ENR_TIM2EN; // Enable TIM2 clock
   
   // initialize LEDs
@@ -84,26 +221,126 @@ int main(void)
   configGPIOC_output(BLUE_LED);
   configGPIOC_output(ORANGE_LED);
   
+  // Tell a host about zone changes and collision alarms on an edge
+  ALERT alert = { ALERT_C, ALERT_TTC_MS, ALERT_MIN_CLOSING, config->thresholds }; // pin, ttc_ms, min_closing, thresholds (closest first)
+  ALERT_Setup(&alert);
+  
   // Set up motor on GPIOB and TIM3
-  MOTOR motor = { MOTOR1_B, 0, 10000, {ORANGE_LED_THRESHOLD, BLUE_LED_THRESHOLD, GREEN_LED_THRESHOLD, NO_LED_THRESHOLD} }; // pin_number, pwm_prescalar, pwm_arr, thresholds (high to low)
+  MOTOR motor = { MOTOR1_B, config->pwm_prescalar, config->pwm_arr, config->thresholds, {config->haptic[0], config->haptic[1], config->haptic[2], config->haptic[3]} }; // pin_number, pwm_prescalar, pwm_arr, thresholds (high to low), duty in each zone
   MOTOR_Setup(&motor);
   MOTOR_Start();
   
+  // After a crash, show the warning from before it until the first new reading
+  if (recovering) {
+    setLEDs(CRASHLOG_LastDistance(), 0);
+    MOTOR_SetVibrationIntensity(CRASHLOG_LastDistance());
+    CRASHLOG_Restored();
+  }
+  
+  // Set up the filter between the sensor and the warnings
+  FILTER filter = { config->filter_window, config->filter_smoothing, config->filter_hysteresis, config->thresholds }; // window, smoothing, hysteresis, thresholds (closest first)
+  FILTER_Setup(&filter);
+  
+  // Correct the readings for the mount, and calibrate again when the button is held
+  CALIBRATION calibration = { 2, CALIBRATION_BURST, {CALIBRATION_NEAR_MM, CALIBRATION_FAR_MM}, &settings }; // targets, burst, distances, configuration
+  CALIBRATION_Setup(&calibration);
+  
+  // Learn the ranges that are always there and keep the motor quiet for them
+  CLUTTER clutter = { config->thresholds, CLUTTER_LEARN_READINGS }; // thresholds (closest first), learn
+  CLUTTER_Setup(&clutter);
+  
+  // Watch the readings for a sensor that fails, and show it when it does
+  HEALTH health = { HEALTH_MISSED_PERIODS, HEALTH_STUCK_READINGS, HEALTH_FLOOD_READINGS, HEALTH_SPIKE_MM, HEALTH_SPIKES, HEALTH_RETRY_PERIODS, HEALTH_RECOVER_READINGS }; // missed, stuck, flood, spike_mm, spikes, retry, recover
+  HEALTH_Setup(&health);
+  
+  // Log near misses (orange and red zones) to flash
+  EVENTLOG eventLog = { 1, config->thresholds }; // near_zone, thresholds (closest first)
+  EVENTLOG_Setup(&eventLog);
+  
+  // Capture the readings around every close call (red zone) to flash
+  SCOPE scope = { config->thresholds[0], 32, 15 }; // trigger (red zone), readings before and after it
+  SCOPE_Setup(&scope);
+  
+  // Keep statistics of this session
+  SESSION session = { config->thresholds }; // thresholds (closest first)
+  SESSION_Setup(&session);
+  
+  // Log every reading to flash, compressed
+  SAMPLELOG_Setup();
+  
 	// Set up UART Ultrasonic Distance sensor
   SENSOR sensor = { TX_B, RX_B, 9600 }; // uart_tx, uart_rx, uart_baud_rate
   SENSOR_Setup(&sensor);
 	
 	// Set up LCD screen
-	LCD screen = { SCK_B, MOSI_B, SCE_B, DC_B, RST_B };
+	LCD screen = { SCK_B, MOSI_B, SCE_B, DC_B, RST_B, recovering ? LCD_RESET_CRASH_MS : LCD_RESET_MS }; // pins, reset pulse
 	LCD_Setup(&screen);
 	LCD_DistanceSetup();
 	
+	// Feed the watchdog only while every stage of the readings keeps up
+	WATCHDOG watchdog = { {WATCHDOG_MISSED_READINGS * config->sample_ms, WATCHDOG_MISSED_READINGS * config->sample_ms, WATCHDOG_MISSED_READINGS * config->sample_ms} }; // deadlines: acquire, warn, display
+	WATCHDOG_Setup(&watchdog);
+	
+	// Stream every period to a host on the USB virtual COM port and on USART1
+	USBCDC_Setup();
+	SERIAL serial = { TX_A, RX_A, SERIAL_BAUD }; // uart_tx, uart_rx, baud_rate
+	SERIAL_Setup(&serial);
+	TELEMETRY telemetry = { config->thresholds }; // thresholds (closest first)
+	TELEMETRY_Setup(&telemetry);
+	
+	// Take commands on USART1 to tune the settings and save them
+	SHELL shell = { &settings }; // configuration
+	SHELL_Setup(&shell);
+	CONFIG tuned;
+	
+	// Answer a host reading the latest results over I2C
+	TARGET target = { SCL_B, SDA_B, TARGET_ADDRESS, config->thresholds }; // i2c_scl, i2c_sda, address, thresholds (closest first)
+	TARGET_Setup(&target);
+	
 	// setup and start the 100ms timer
 	timerSetup();
 	
   while (1)
   {
+		// a command that changed a setting: apply it with TIM2 held off, so it
+		// lands between two readings and no reading sees half of it
+		uint8_t changed = SHELL_Idle(msLeft(), &tuned);
+		if (changed) {
+			NVIC_DisableIRQ(TIM2_IRQn);
+			if (changed & SHELL_THRESHOLDS) {
+				// the modules read them from config
+				for (uint8_t i = 0; i < 4; i++) settings.thresholds[i] = tuned.thresholds[i];
+				scope.trigger = tuned.thresholds[0];
+			}
+			if (changed & SHELL_SAMPLE) {
+				settings.sample_ms = tuned.sample_ms;
+				TIM2->ARR = tuned.sample_ms;   // preloaded, from the next reading on
+				for (uint8_t i = 0; i < WATCHDOG_STAGES; i++) WATCHDOG_SetDeadline(i, WATCHDOG_MISSED_READINGS * tuned.sample_ms);
+			}
+			if (changed & SHELL_FILTER) {
+				settings.filter_window = filter.window = tuned.filter_window;
+				settings.filter_smoothing = filter.smoothing = tuned.filter_smoothing;
+				settings.filter_hysteresis = filter.hysteresis = tuned.filter_hysteresis;
+				FILTER_Setup(&filter);
+			}
+			if (changed & SHELL_HAPTIC) {
+				for (uint8_t i = 0; i < 4; i++) settings.haptic[i] = motor.duty[i] = tuned.haptic[i];
+			}
+			if (changed & SHELL_DISPLAY) settings.display = tuned.display;
+			NVIC_EnableIRQ(TIM2_IRQn);
+			continue;
+		}
 		
+		// flash work for the logs, one step at a time in the time left before the next reading
+		if (EVENTLOG_Pending() || SCOPE_Pending() || SAMPLELOG_Pending() || CRASHLOG_Pending() || CALIBRATION_Pending()) {
+			EVENTLOG_Idle(msLeft());
+			SCOPE_Idle(msLeft());
+			SAMPLELOG_Idle(msLeft());
+			CRASHLOG_Idle(msLeft());
+			CALIBRATION_Idle(msLeft());
+		}
+		// until SysTick, at the latest, brings more bytes to read
+		__WFI();
   }
 }
 
@@ -113,10 +350,11 @@ int main(void)
 void timerSetup() {
 	// Configure TIM2 to trigger UEV at 10 Hz, every 100 ms
 	TIM2->PSC = (8000-1);	// 1kHz timer clock -> 1ms counter
-	TIM2->ARR = 100;
+	TIM2->ARR = config->sample_ms;
 	
 	// Configure TIM2 to interrupt on UEV
 	TIM2->CR1 &= ~(1 << 1);	// UDIS bit to 0 means UEV enabled
+	TIM2->CR1 |= TIM_CR1_ARPE;	// a new period only counts from the next UEV, never below CNT
 	TIM2->DIER |= 1;	// Update interrupt enabled
 	
 	// Enable/start TIM2
@@ -129,54 +367,233 @@ void timerSetup() {
 	NVIC_SetPriority(TIM2_IRQn, 3);
 }
 
+/*
+ * The ms left before TIM2's next reading, 0 when the counter is past a
+ * period just shortened
+ */
+uint32_t msLeft(void) {
+	uint32_t arr = TIM2->ARR, cnt = TIM2->CNT;
+	return cnt < arr ? arr - cnt : 0;
+}
+
 /*
  * TIM2 Interrupt Handler: Get Ultrasonic distance readings and set the warnings
  */
 void TIM2_IRQHandler(void) {
-	SENSOR_GetReading();
+	uint32_t probe = PROBE_Enter();
+	
+	period = probe;
+	if (HEALTH_Request()) SENSOR_GetReading();
 	setWarnings();
-	HAL_Delay(10);
-	SENSOR_GetTempReading();
-	displayTemperature();
+	// a faulted sensor is left alone between the requests for distance, a
+	// stuck one is still asked for the temperature that tells it from a still object
+	if (healthStatus.fault == HEALTH_OK || healthStatus.fault == HEALTH_STUCK) {
+		HAL_Delay(10);
+		SENSOR_GetTempReading();
+		displayTemperature();
+	}
+	updateScreen();
+	WATCHDOG_CheckIn(WATCHDOG_DISPLAY);
 	
 	TIM2->SR &= ~(1);	// clear update interrupt flag
+	PROBE_Exit(PROBE_TIM2, probe);
 }
 
 /*
  * Wait for new temperature value, then display it
  */
 void displayTemperature() {
-  while (sensorValues.new_temp_value == 0);
+	uint32_t start = HAL_GetTick();
+  while (sensorValues.new_temp_value == 0 && HAL_GetTick() - start < SENSOR_REPLY_MS);
+  if (sensorValues.new_temp_value == 0) return;
 	uint8_t temp = sensorValues.temperature - 45;
 	uint16_t far = ((temp * 9)/5) + 32;
-	LCD_PrintTempMeasurement(far, "F", 1, temp, "C", 1);
+	if (screen == SCREEN_DISTANCE) LCD_PrintTempMeasurement(far, "F", 1, temp, "C", 1);
+}
+
+/*
+ * Follow the user button: a press switches between the distance and the
+ * stats page, or moves the calibration on, and holding it for
+ * CALIBRATION_HOLD readings starts the calibration. Presses count when the
+ * button is let go, so a hold is never a press too. A command that changes
+ * the display setting switches to its page like a press. Redraw the stats
+ * page every STATS_REFRESH readings and the calibration page every reading.
+ */
+void updateScreen() {
+	static uint8_t held;  // readings the button has been down, up to CALIBRATION_HOLD
+	static uint8_t refresh;
+	uint8_t pressed = (GPIOA->IDR >> USER_BUTTON_A) & 1;
+	uint8_t press = !pressed && held > 0 && held < CALIBRATION_HOLD;
+	uint8_t chosen = config->display == SCREEN_STATS ? SCREEN_STATS : SCREEN_DISTANCE;
+	
+	if (chosen != page) {
+		page = chosen;
+		press = screen != SCREEN_CALIBRATION && screen != chosen;
+	}
+	
+	held = pressed ? (held < CALIBRATION_HOLD ? held + 1 : held) : 0;
+	if (screen != SCREEN_CALIBRATION && held == CALIBRATION_HOLD) {
+		CALIBRATION_Start();
+		screen = SCREEN_CALIBRATION;
+		LCD_ClearDisplay();
+	}
+	else if (screen == SCREEN_CALIBRATION && press) {
+		CALIBRATION_Button();
+	}
+	else if (press) {
+		screen = screen == SCREEN_STATS ? SCREEN_DISTANCE : SCREEN_STATS;
+		refresh = 0;
+		if (screen == SCREEN_DISTANCE) LCD_DistanceSetup();
+	}
+	
+	if (screen == SCREEN_CALIBRATION) {
+		if (calibrationStatus.state != CALIBRATION_OFF) {
+			displayCalibration();
+			return;
+		}
+		screen = SCREEN_DISTANCE;
+		LCD_DistanceSetup();
+	}
+	if (screen != SCREEN_STATS) return;
+	if (refresh) {
+		refresh--;
+		return;
+	}
+	refresh = STATS_REFRESH - 1;
+	displayStats();
+}
+
+/*
+ * Stats page: mean, standard deviation and closest reading, entries into and
+ * seconds in the red and orange zones, and the distance histogram
+ */
+void displayStats() {
+	uint32_t redS = sessionStats.zone_ms[0] / 1000, orangeS = sessionStats.zone_ms[1] / 1000;
+	
+	LCD_PrintStat(0, "AVG", 3, SESSION_Mean(), "mm", 2);
+	LCD_PrintStat(1, "SD", 2, SESSION_StdDev(), "mm", 2);
+	LCD_PrintStat(2, "MIN", 3, sessionStats.count ? sessionStats.min : 0, "mm", 2);
+	LCD_PrintStat(3, "RED", 3, sessionStats.zone_entries[0] > 0xFFFF ? 0xFFFF : sessionStats.zone_entries[0], "x", 1);
+	LCD_AppendStat(redS > 0xFFFF ? 0xFFFF : redS, "s", 1);
+	LCD_PrintStat(4, "ORG", 3, sessionStats.zone_entries[1] > 0xFFFF ? 0xFFFF : sessionStats.zone_entries[1], "x", 1);
+	LCD_AppendStat(orangeS > 0xFFFF ? 0xFFFF : orangeS, "s", 1);
+	LCD_PrintHistogram(5, sessionStats.histogram, SESSION_BINS);
+}
+
+/*
+ * Calibration page: the target to point the sensor at and the reading it
+ * gives, then the offset and the scale (in thousandths) that were fitted
+ */
+void displayCalibration() {
+	uint8_t state = calibrationStatus.state;
+	int16_t offset = calibrationStatus.offset;
+	
+	LCD_SetY(0);
+	LCD_PrintStringCentered("CALIBRATION", 11);
+	for (uint8_t y = 1; y < 6; y++) LCD_ClearRow(y, 0);
+	
+	if (state == CALIBRATION_WAITING || state == CALIBRATION_MEASURING) {
+		LCD_PrintStat(1, "TARGET", 6, calibrationStatus.target + 1, "", 0);
+		LCD_AppendStat(calibrationStatus.target ? CALIBRATION_FAR_MM : CALIBRATION_NEAR_MM, "mm", 2);
+		LCD_PrintStat(2, "READS", 5, calibrationStatus.last, "mm", 2);
+		if (state == CALIBRATION_MEASURING) {
+			LCD_PrintStat(3, "AVERAGING", 9, calibrationStatus.readings, "", 0);
+			return;
+		}
+		LCD_SetY(4);
+		LCD_PrintStringCentered("PRESS TO READ", 13);
+		return;
+	}
+	
+	if (state == CALIBRATION_DONE) {
+		LCD_PrintStat(1, offset < 0 ? "OFFSET -" : "OFFSET", offset < 0 ? 8 : 6, offset < 0 ? -offset : offset, "mm", 2);
+		LCD_PrintStat(2, "SCALE", 5, (calibrationStatus.scale * 1000 + CALIBRATION_UNITY / 2) >> CALIBRATION_SHIFT, "", 0);
+		LCD_SetY(3);
+		LCD_PrintStringCentered(calibrationStatus.saved ? "SAVED" : "SAVING", calibrationStatus.saved ? 5 : 6);
+	}
+	else {
+		LCD_SetY(2);
+		LCD_PrintStringCentered("FAILED", 6);
+	}
+	LCD_SetY(5);
+	LCD_PrintStringCentered("PRESS TO EXIT", 13);
 }
 
 /*
- * Wait for a new distance value, then set the warnings
+ * Wait for a new distance value, then set the warnings. A period without a
+ * new one leaves them as they are, and a faulted sensor shows the fault
+ * pattern instead. The alert line is classified with the LEDs and set in the
+ * same store. Every period sends a telemetry frame and publishes the I2C
+ * register map.
  */
 void setWarnings() {
-  while (sensorValues.new_value == 0);
-  uint16_t distance = sensorValues.distance; // in millimeters  
-  setLEDs(distance);
-  MOTOR_SetVibrationIntensity(distance);
-  LCD_PrintMeasurement(distance, "mm", 2);
+	uint32_t start = HAL_GetTick();
+  // a stuck sensor still drives the warnings, so its reply is waited for like a
+  // good one's; other faults show the fault pattern, their replies are checked next period
+  while ((healthStatus.fault == HEALTH_OK || healthStatus.fault == HEALTH_STUCK) &&
+         sensorValues.new_value == 0 && HAL_GetTick() - start < SENSOR_REPLY_MS);
+  WATCHDOG_CheckIn(WATCHDOG_ACQUIRE);
+  if (!HEALTH_Update(sensorValues.replies, sensorValues.distance, sensorValues.temperature)) {
+    if (healthStatus.fault != HEALTH_OK) showFault();
+    GPIOC->BSRR = ALERT_Update(0, 0);
+    WATCHDOG_CheckIn(WATCHDOG_WARN);
+    TELEMETRY_Update(0, 0, 0);
+    TARGET_Update(0, 0, 0);
+    return;
+  }
+  CALIBRATION_Update(sensorValues.distance);
+  uint16_t reading = CALIBRATION_Apply(sensorValues.distance); // in millimeters from the front of the hat
+  uint16_t distance = FILTER_Update(reading);
+  uint32_t asserted = alertStatus.asserted;
+  setLEDs(distance, ALERT_Update(1, distance));
+  if (alertStatus.asserted != asserted) PROBE_Exit(PROBE_ALERT, period);
+  MOTOR_SetVibrationIntensity(CLUTTER_Update(distance));
+  WATCHDOG_CheckIn(WATCHDOG_WARN);
+  EVENTLOG_Update(distance);
+  SCOPE_Update(reading, distance);
+  SAMPLELOG_Update(reading);
+  SESSION_Update(distance);
+  CRASHLOG_Update(distance);
+  TELEMETRY_Update(1, sensorValues.distance, distance);
+  TARGET_Update(1, sensorValues.distance, distance);
+  if (screen == SCREEN_DISTANCE) LCD_PrintMeasurement(distance, "mm", 2);
 }
 
 /*
- * Turn on and off the LEDs based on the distance thresholds
+ * Turn on and off the LEDs based on the distance thresholds, and set or
+ * reset the alert line with them, alert being its BSRR word (0 leaves it)
  */
-void setLEDs(uint16_t distance) {
+void setLEDs(uint16_t distance, uint32_t alert) {
+  const uint16_t *threshold = config->thresholds; // orange, blue, green, no LED
+  
   // turn on LEDs
-  GPIOC->BSRR = (((distance >= GREEN_LED_THRESHOLD) & (distance < NO_LED_THRESHOLD)) << GREEN_LED) |
-                  (((distance >= BLUE_LED_THRESHOLD) & (distance < GREEN_LED_THRESHOLD)) << BLUE_LED) |
-                  (((distance >= ORANGE_LED_THRESHOLD) & (distance < BLUE_LED_THRESHOLD)) << ORANGE_LED) |
-                  (((distance >= RED_LED_THRESHOLD) & (distance < ORANGE_LED_THRESHOLD)) << RED_LED);
+  GPIOC->BSRR = (((distance >= threshold[2]) & (distance < threshold[3])) << GREEN_LED) |
+                  (((distance >= threshold[1]) & (distance < threshold[2])) << BLUE_LED) |
+                  (((distance >= threshold[0]) & (distance < threshold[1])) << ORANGE_LED) |
+                  (((distance >= RED_LED_THRESHOLD) & (distance < threshold[0])) << RED_LED) | alert;
     // turn off LEDs
-  GPIOC->BRR = (((distance < GREEN_LED_THRESHOLD) | (distance >= NO_LED_THRESHOLD)) << GREEN_LED) |
-                 (((distance < BLUE_LED_THRESHOLD) | (distance >= GREEN_LED_THRESHOLD)) << BLUE_LED) |
-                 (((distance < ORANGE_LED_THRESHOLD) | (distance >= BLUE_LED_THRESHOLD)) << ORANGE_LED) |
-                 ((distance >= ORANGE_LED_THRESHOLD) << RED_LED);
+  GPIOC->BRR = (((distance < threshold[2]) | (distance >= threshold[3])) << GREEN_LED) |
+                 (((distance < threshold[1]) | (distance >= threshold[2])) << BLUE_LED) |
+                 (((distance < threshold[0]) | (distance >= threshold[1])) << ORANGE_LED) |
+                 ((distance >= threshold[0]) << RED_LED);
+}
+
+/*
+ * Fault pattern: red and green, then blue and orange, the motor at the blue
+ * zone's strength one period in HEALTH_BUZZ, and the fault on the distance row
+ */
+void showFault() {
+  uint8_t phase = healthStatus.periods & 1;
+  static const char *faults[] = { "", "NO REPLY", "SENSOR STUCK", "NO ECHO", "ERRATIC" };
+  static const uint8_t sizes[] = { 0, 8, 12, 7, 7 };
+  
+  GPIOC->BSRR = (phase << RED_LED) | (phase << GREEN_LED) | (!phase << BLUE_LED) | (!phase << ORANGE_LED);
+  GPIOC->BRR = (!phase << RED_LED) | (!phase << GREEN_LED) | (phase << BLUE_LED) | (phase << ORANGE_LED);
+  MOTOR_SetVibrationIntensity(healthStatus.periods % HEALTH_BUZZ == 0 ? config->thresholds[1] : config->thresholds[3]);
+  if (screen != SCREEN_DISTANCE) return;
+  LCD_ClearRow(2, 0);
+  LCD_SetY(2);
+  LCD_PrintStringCentered((char *)faults[healthStatus.fault], sizes[healthStatus.fault]);
 }
 
 /*
@@ -246,8 +663,8 @@ void SystemClock_Config(void)
 void Error_Handler(void)
 {
   /* USER CODE BEGIN Error_Handler_Debug */
-  /* User can add his own implementation to report the HAL error return state */
-
+  // capture it like a fault and reset, rather than carry on without warnings
+  CRASHLOG_Error();
   /* USER CODE END Error_Handler_Debug */
 }
 
@@ -56,6 +56,14 @@ void MOTOR_SetDutyCycle(float prcnt) {
   TIM3->CCR1 = thisMotor->pwm_arr * prcnt;
 }
 
+/*
+ * Set the duty cycle in percent, in whole counts of the period
+ */
+static void MOTOR_SetDuty(uint8_t percent) {
+	if (percent > 100) return;
+  TIM3->CCR1 = thisMotor->pwm_arr * percent / 100;
+}
+
 /*
  * Set the vibration intensity by changing the duty cycle based on the thresholds
  */
@@ -67,14 +75,15 @@ void MOTOR_SetVibrationIntensity(uint16_t distance) {
   
   switch (motorSpeed) {
     case 0xF:
-      MOTOR_SetDutyCycle(1); break;
+      MOTOR_SetDuty(thisMotor->duty[0]); break;
     case 0x7:
-      MOTOR_SetDutyCycle(0.66); break;
+      MOTOR_SetDuty(thisMotor->duty[1]); break;
     case 0x3:
-      MOTOR_SetDutyCycle(0.33); break;
+      MOTOR_SetDuty(thisMotor->duty[2]); break;
     case 0x1:
+      MOTOR_SetDuty(thisMotor->duty[3]); break;
     default:
-      MOTOR_SetDutyCycle(0);
+      MOTOR_SetDuty(0);
   }
 }
 
@@ -9,12 +9,13 @@
 
 #include "stm32f0xx_hal.h"
 
-// PWM pin, prescalar, auto-reload value, and the four warning thresholds
+// PWM pin, prescalar, auto-reload value, the four warning thresholds and the duty in each zone
 typedef struct motor {
   uint8_t pin_number;
   uint16_t pwm_prescalar;
   uint16_t pwm_arr;
-	uint32_t thresholds[4];   // thresholds vibration changes at high vibration intensity to lowest (off)
+  const uint16_t *thresholds; // 4 thresholds vibration changes at high vibration intensity to lowest (off), those of CONFIG
+  uint8_t duty[4];          // percent below each threshold, the haptic curve (0 past the last)
 } MOTOR;
 
 // Motor setup and startup functions
@@ -0,0 +1,152 @@
+/*
+ * File: rangeCalibration.c
+ * Purpose: Defines the range calibration: the correction applied to every
+ *          reading, and the routine that fits it from bursts of readings of
+ *          targets at known distances and saves it with the configuration.
+ */
+#include "rangeCalibration.h"
+#include "flashRing.h"
+#include "ultrasonicSensorUart.h"
+
+CALIBRATION *thisCalibration;
+CALIBRATION_STATUS calibrationStatus;
+
+static int32_t scale = CALIBRATION_UNITY;                // of the readings
+static int32_t bias = 1 << (CALIBRATION_SHIFT - 1);      // offset in 1/2^CALIBRATION_SHIFT mm, plus a half to round
+static uint32_t sums[CALIBRATION_MAX_TARGETS];           // of the burst at each target
+static uint8_t pending;                                  // a fit waits for CALIBRATION_Idle
+
+/*
+ * Correct readings with a new offset and scale
+ */
+static void CALIBRATION_Use(int16_t offset, uint16_t newScale) {
+	scale = newScale;
+	bias = ((int32_t)offset << CALIBRATION_SHIFT) + (1 << (CALIBRATION_SHIFT - 1));
+}
+
+/*
+ * Take the offset and scale from the configuration. A configuration saved
+ * before they existed gets them from the defaults, and one out of bounds
+ * leaves the readings as they are.
+ */
+void CALIBRATION_Setup(CALIBRATION *calibration) {
+	const CONFIG *config = calibration->config;
+
+	thisCalibration = calibration;
+	if (config->range_scale < CALIBRATION_MIN_SCALE || config->range_scale > CALIBRATION_MAX_SCALE ||
+	    config->range_offset < -CALIBRATION_MAX_OFFSET || config->range_offset > CALIBRATION_MAX_OFFSET)
+		CALIBRATION_Use(0, CALIBRATION_UNITY);
+	else CALIBRATION_Use(config->range_offset, config->range_scale);
+}
+
+/*
+ * A reading from the sensor corrected for the mount and the unit, kept
+ * within the sensor's range so it is never taken for one past it
+ */
+uint16_t CALIBRATION_Apply(uint16_t reading) {
+	int32_t mm;
+
+	if (reading > SENSOR_MAX_RANGE) return reading;
+	mm = (reading * scale + bias) >> CALIBRATION_SHIFT;
+	if (mm > SENSOR_MAX_RANGE) return SENSOR_MAX_RANGE;
+	return mm < 0 ? 0 : mm;
+}
+
+/*
+ * Start the routine at the first target
+ */
+void CALIBRATION_Start(void) {
+	for (uint8_t i = 0; i < CALIBRATION_MAX_TARGETS; i++) sums[i] = 0;
+	calibrationStatus.target = 0;
+	calibrationStatus.readings = 0;
+	calibrationStatus.saved = 0;
+	calibrationStatus.state = CALIBRATION_WAITING;
+}
+
+/*
+ * The user pressed the button: measure the target the sensor points at, or
+ * leave the routine. A press while measuring cancels it.
+ */
+void CALIBRATION_Button(void) {
+	if (calibrationStatus.state != CALIBRATION_WAITING) {
+		calibrationStatus.state = CALIBRATION_OFF;
+		return;
+	}
+	sums[calibrationStatus.target] = 0;
+	calibrationStatus.readings = 0;
+	calibrationStatus.state = CALIBRATION_MEASURING;
+}
+
+/*
+ * Least squares line from the mean reading at each target to its distance,
+ * with sums of whole bursts so the means keep their fractions. Used for the
+ * readings and staged for flash if it is in bounds.
+ */
+static void CALIBRATION_Fit(void) {
+	int64_t n = thisCalibration->targets, sx = 0, sy = 0, sxx = 0, sxy = 0, num, den;
+	int32_t fitScale, fitOffset;
+
+	for (uint8_t i = 0; i < n; i++) {
+		int64_t x = sums[i], y = (int64_t)thisCalibration->distances[i] * thisCalibration->burst;
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+	num = n * sxy - sx * sy;
+	den = n * sxx - sx * sx;
+	calibrationStatus.state = CALIBRATION_FAILED;
+	// every target read the same, there is no line, or the readings fall as
+	// the targets move away; either way num is left positive for the shift
+	if (den <= 0 || num <= 0) return;
+
+	fitScale = ((num << CALIBRATION_SHIFT) + den / 2) / den;
+	if (fitScale < CALIBRATION_MIN_SCALE || fitScale > CALIBRATION_MAX_SCALE) return;
+	fitOffset = (((sy << CALIBRATION_SHIFT) - fitScale * sx) / (n * thisCalibration->burst) + (1 << (CALIBRATION_SHIFT - 1))) >> CALIBRATION_SHIFT;
+	if (fitOffset < -CALIBRATION_MAX_OFFSET || fitOffset > CALIBRATION_MAX_OFFSET) return;
+
+	calibrationStatus.offset = fitOffset;
+	calibrationStatus.scale = fitScale;
+	calibrationStatus.state = CALIBRATION_DONE;
+	CALIBRATION_Use(fitOffset, fitScale);
+	thisCalibration->config->range_offset = fitOffset;
+	thisCalibration->config->range_scale = fitScale;
+	pending = 1;
+}
+
+/*
+ * Every reading, before it is corrected: add it to the burst being measured
+ * and fit once the last target has been measured. Readings with nothing in
+ * range do not count.
+ */
+void CALIBRATION_Update(uint16_t reading) {
+	if (calibrationStatus.state == CALIBRATION_OFF) return;
+	calibrationStatus.last = reading;
+	if (calibrationStatus.state != CALIBRATION_MEASURING || reading > SENSOR_MAX_RANGE) return;
+
+	sums[calibrationStatus.target] += reading;
+	if (++calibrationStatus.readings < thisCalibration->burst) return;
+
+	calibrationStatus.readings = 0;
+	if (++calibrationStatus.target < thisCalibration->targets) calibrationStatus.state = CALIBRATION_WAITING;
+	else CALIBRATION_Fit();
+}
+
+/*
+ * Whether a fit waits for CALIBRATION_Idle
+ */
+uint8_t CALIBRATION_Pending(void) {
+	return pending;
+}
+
+/*
+ * From main's idle loop with the time left before the next reading: save
+ * the configuration with the new fit
+ */
+void CALIBRATION_Idle(uint32_t msLeft) {
+	// the save erases a page, which stalls the CPU
+	if (!pending || msLeft < FLASHRING_ERASE_MS) return;
+	if (CONFIG_Save(thisCalibration->config) != HAL_OK) return;
+	pending = 0;
+	calibrationStatus.saved = 1;
+}
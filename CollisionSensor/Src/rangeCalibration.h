@@ -0,0 +1,63 @@
+/*
+ * File: rangeCalibration.h
+ * Purpose: Declares the range calibration. The mount puts the sensor a few
+ *          centimetres behind the brim and units differ slightly in scale,
+ *          so every reading is corrected to reading * scale / 2^14 + offset
+ *          before the filter, one multiply and a shift. The calibration
+ *          routine finds the offset and scale: the user points the sensor at
+ *          a target at each known distance in turn and presses the button,
+ *          a burst of readings is averaged at each, and the least squares
+ *          line through the averages is saved with the configuration.
+ */
+#ifndef __RANGE_CALIBRATION_H
+#define __RANGE_CALIBRATION_H
+
+#include "stm32f0xx_hal.h"
+#include "configStore.h"
+
+#define CALIBRATION_MAX_TARGETS 4
+#define CALIBRATION_SHIFT 14                        // fraction bits of the scale
+#define CALIBRATION_UNITY (1 << CALIBRATION_SHIFT)  // scale of a reading left as it is
+
+// A fit outside these is a target at the wrong distance, not the mount
+#define CALIBRATION_MIN_SCALE (CALIBRATION_UNITY * 4 / 5)
+#define CALIBRATION_MAX_SCALE (CALIBRATION_UNITY * 5 / 4)
+#define CALIBRATION_MAX_OFFSET 300                  // mm
+
+// Steps of the calibration routine
+#define CALIBRATION_OFF 0
+#define CALIBRATION_WAITING 1     // for the button, with the sensor on the next target
+#define CALIBRATION_MEASURING 2   // averaging a burst of readings of the target
+#define CALIBRATION_DONE 3        // fitted, saved from the idle loop
+#define CALIBRATION_FAILED 4      // the fit was out of bounds, nothing changed
+
+// Targets of the routine and the configuration it is saved with
+typedef struct calibration {
+  uint8_t targets;                              // 2 to CALIBRATION_MAX_TARGETS
+  uint8_t burst;                                // readings averaged at each target
+  uint16_t distances[CALIBRATION_MAX_TARGETS];  // mm from the front of the hat to each target
+  CONFIG *config;                               // holds the offset and scale in use, saved to flash with a new fit
+} CALIBRATION;
+
+// Progress of the routine, for the LCD
+typedef struct calibration_status {
+  uint8_t state;                                // CALIBRATION_OFF to CALIBRATION_FAILED
+  uint8_t target;                               // the target waited for or measured
+  uint8_t readings;                             // taken of it so far
+  uint8_t saved;                                // the fit is in flash
+  uint16_t last;                                // last reading, uncorrected
+  int16_t offset;                               // the fit
+  uint16_t scale;
+} CALIBRATION_STATUS;
+
+extern CALIBRATION_STATUS calibrationStatus;
+
+void CALIBRATION_Setup(CALIBRATION *calibration);
+uint16_t CALIBRATION_Apply(uint16_t reading);
+void CALIBRATION_Start(void);
+void CALIBRATION_Button(void);
+void CALIBRATION_Update(uint16_t reading);
+uint8_t CALIBRATION_Pending(void);
+void CALIBRATION_Idle(uint32_t msLeft);
+
+#endif /* __RANGE_CALIBRATION_H */
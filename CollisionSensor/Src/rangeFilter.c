@@ -0,0 +1,83 @@
+/*
+ * File: rangeFilter.c
+ * Purpose: Defines the filter between the US-100 readings and the warnings:
+ *          median, exponential smoothing and zone hysteresis, in that order.
+ */
+#include "rangeFilter.h"
+
+FILTER *thisFilter;
+
+static uint16_t history[FILTER_MAX_WINDOW];
+static uint8_t historyCount;
+static uint8_t historyNext;
+static uint32_t smoothed;	// output of the smoothing stage in 1/16 mm
+static uint16_t output;
+static uint8_t primed;
+
+/*
+ * Use the given configuration and forget every earlier reading
+ */
+void FILTER_Setup(FILTER *filter) {
+	thisFilter = filter;
+	historyCount = 0;
+	historyNext = 0;
+	primed = 0;
+}
+
+/*
+ * Median of the last window readings, the lower middle one while the window fills
+ */
+static uint16_t FILTER_Median(uint16_t distance) {
+	uint16_t sorted[FILTER_MAX_WINDOW];
+	uint8_t window = thisFilter->window;
+
+	if (window <= 1) return distance;
+	if (window > FILTER_MAX_WINDOW) window = FILTER_MAX_WINDOW;
+
+	history[historyNext] = distance;
+	if (++historyNext >= window) historyNext = 0;
+	if (historyCount < window) historyCount++;
+
+	// insertion sort, at most FILTER_MAX_WINDOW values
+	for (uint8_t i = 0; i < historyCount; i++) {
+		uint16_t value = history[i];
+		uint8_t j = i;
+		while (j > 0 && sorted[j - 1] > value) {
+			sorted[j] = sorted[j - 1];
+			j--;
+		}
+		sorted[j] = value;
+	}
+	return sorted[(historyCount - 1) / 2];
+}
+
+/*
+ * Zone of a distance, 0 for the closest (red) to 4 for no warning
+ */
+static uint8_t FILTER_Zone(uint16_t distance) {
+	uint8_t zone = 0;
+	for (uint8_t i = 0; i < 4; i++) zone += distance >= thisFilter->thresholds[i];
+	return zone;
+}
+
+/*
+ * Filter a new reading and return the distance to warn about
+ */
+uint16_t FILTER_Update(uint16_t distance) {
+	uint16_t value = FILTER_Median(distance);
+
+	if (!primed || thisFilter->smoothing == 0) smoothed = (uint32_t)value << 4;
+	else smoothed += ((int32_t)((uint32_t)value << 4) - (int32_t)smoothed) >> thisFilter->smoothing;
+	value = (smoothed + 8) >> 4;
+
+	// a closer zone is taken at once, a farther one only well past its boundary
+	if (primed && thisFilter->hysteresis) {
+		uint8_t zone = FILTER_Zone(output);
+		if (zone < 4 && FILTER_Zone(value) > zone && value < thisFilter->thresholds[zone] + thisFilter->hysteresis)
+			value = output;
+	}
+
+	output = value;
+	primed = 1;
+	return output;
+}
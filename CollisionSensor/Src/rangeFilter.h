@@ -0,0 +1,28 @@
+/*
+ * File: rangeFilter.h
+ * Purpose: Declares the filter between the US-100 readings and the warnings.
+ *          A median over the last few readings rejects spikes, exponential
+ *          smoothing reduces noise, and hysteresis keeps a warning from
+ *          flickering when the object sits on a zone boundary. Every stage
+ *          can be turned off; with all three off the reading passes through
+ *          unchanged.
+ */
+#ifndef __RANGE_FILTER_H
+#define __RANGE_FILTER_H
+
+#include <stdint.h>
+
+#define FILTER_MAX_WINDOW 7
+
+// Filter configuration and the zone boundaries the hysteresis applies to
+typedef struct filter {
+  uint8_t window;           // median of the last window readings, 1 to FILTER_MAX_WINDOW (1 is off)
+  uint8_t smoothing;        // each reading moves the output by 1/2^smoothing of the difference (0 is off)
+  uint16_t hysteresis;      // mm past a boundary before a warning relaxes to a farther zone (0 is off)
+  const uint16_t *thresholds; // in mm, closest first, those of CONFIG
+} FILTER;
+
+void FILTER_Setup(FILTER *filter);
+uint16_t FILTER_Update(uint16_t distance);
+
+#endif /* __RANGE_FILTER_H */
@@ -0,0 +1,256 @@
+/*
+ * File: sampleLog.c
+ * Purpose: Defines the sample log. TIM2 codes each reading into the block
+ *          it fills in RAM, a bounded amount of work: at most a run and one
+ *          entry, a few bytes each. A full block is handed to main's idle
+ *          loop, which programs it to the flash ring while TIM2 fills the
+ *          other one.
+ */
+#include <string.h>
+
+#include "sampleLog.h"
+
+#define SAMPLELOG_ENTRY_MAX 10    // longest entry, two 5 byte varints
+#define SAMPLELOG_RUN_MAX 4       // longest run, its kind byte and a 3 byte count
+
+SAMPLELOG_STATS sampleLogStats;
+
+static FLASHRING ring = { .start = SAMPLELOG_START, .pages = SAMPLELOG_PAGES, .size = sizeof(SAMPLE_BLOCK) };
+
+static SAMPLE_BLOCK blocks[2];    // one filled by TIM2, the other waiting for the idle loop
+static uint8_t filling;           // block TIM2 fills
+static volatile uint8_t staged;   // the other block waits to be programmed
+static uint16_t used;             // data bytes used in the block being filled
+static uint16_t run;              // readings that repeat the last one and are not coded yet
+
+static uint8_t started;           // a block was started since boot
+static uint32_t lastTime;
+static uint16_t lastDistance;
+static uint32_t interval;         // ms between the last reading and the one before
+
+/*
+ * Code a value as a varint at out, returns its length in bytes
+ */
+uint8_t SAMPLELOG_Varint(uint8_t *out, uint32_t value) {
+	uint8_t n = 0;
+
+	while (value >= 0x80) {
+		out[n++] = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	out[n++] = (uint8_t)value;
+	return n;
+}
+
+/*
+ * A change as a value small for small changes either way, for a varint
+ */
+uint32_t SAMPLELOG_ZigZag(int32_t value) {
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/*
+ * The change SAMPLELOG_ZigZag made a value of
+ */
+int32_t SAMPLELOG_UnZigZag(uint32_t value) {
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+/*
+ * Find where the flash ring ends
+ */
+void SAMPLELOG_Setup(void) {
+	FLASHRING_Setup(&ring);
+}
+
+/*
+ * Code the readings that repeat the last one, there is always room for them
+ */
+static void SAMPLELOG_FlushRun(SAMPLE_BLOCK *block) {
+	if (run == 0) return;
+	if (run == 1) block->data[used++] = SAMPLELOG_SAME;
+	else {
+		block->data[used++] = SAMPLELOG_RUN;
+		used += SAMPLELOG_Varint(&block->data[used], run);
+	}
+	run = 0;
+}
+
+/*
+ * Start a block with a full reading
+ */
+static void SAMPLELOG_Start(uint32_t now, uint16_t distance, uint32_t dt) {
+	SAMPLE_BLOCK *block = &blocks[filling];
+
+	interval = dt > 0xFFFF ? 0xFFFF : dt;
+	block->timestamp = now;
+	block->distance = distance;
+	block->interval = interval;
+	block->session = EVENTLOG_Session();
+	block->count = 1;
+	used = 0;
+	started = 1;
+	sampleLogStats.bytes += sizeof(SAMPLE_BLOCK) - SAMPLELOG_DATA;
+}
+
+/*
+ * Hand the block being filled to the idle loop and fill the other one
+ */
+static void SAMPLELOG_Close(void) {
+	SAMPLE_BLOCK *block = &blocks[filling];
+
+	SAMPLELOG_FlushRun(block);
+	sampleLogStats.bytes += SAMPLELOG_DATA - used;
+	memset(&block->data[used], 0xFF, SAMPLELOG_DATA - used);
+	staged = 1;
+	filling ^= 1;
+}
+
+/*
+ * Log a reading from TIM2
+ */
+void SAMPLELOG_Update(uint16_t distance) {
+	SAMPLE_BLOCK *block = &blocks[filling];
+	uint32_t now = HAL_GetTick();
+	uint32_t dt = now - lastTime;
+	int32_t change = (int32_t)distance - lastDistance;
+	int32_t drift = (int32_t)(dt - interval);
+	uint8_t entry[SAMPLELOG_ENTRY_MAX];
+	uint8_t n;
+
+	if (!started) {
+		SAMPLELOG_Start(now, distance, 0);
+	}
+	else if (change == 0 && drift == 0 && run < 0xFFFF && block->count < 0xFFFF) {
+		run++;
+		block->count++;
+	}
+	else {
+		n = SAMPLELOG_Varint(entry, SAMPLELOG_ZigZag(change) << 2 | (drift ? SAMPLELOG_TIMED : SAMPLELOG_SAME));
+		if (drift) n += SAMPLELOG_Varint(&entry[n], SAMPLELOG_ZigZag(drift));
+
+		// the run is coded before the entry, and room for one more run is always kept
+		if (used + (run == 1 ? 1 : run ? SAMPLELOG_RUN_MAX : 0) + n + SAMPLELOG_RUN_MAX <= SAMPLELOG_DATA && block->count < 0xFFFF) {
+			SAMPLELOG_FlushRun(block);
+			memcpy(&block->data[used], entry, n);
+			used += n;
+			sampleLogStats.bytes += n;
+			block->count++;
+			interval = dt;
+		}
+		else if (staged) {
+			// the other block is not programmed yet, nothing to start a new one in
+			sampleLogStats.dropped++;
+			return;
+		}
+		else {
+			SAMPLELOG_Close();
+			SAMPLELOG_Start(now, distance, dt);
+		}
+	}
+
+	lastTime = now;
+	lastDistance = distance;
+	sampleLogStats.readings++;
+}
+
+/*
+ * Whether a full block waits for SAMPLELOG_Idle
+ */
+uint8_t SAMPLELOG_Pending(void) {
+	return staged;
+}
+
+/*
+ * One step of flash work, from main's idle loop with the time left before
+ * the next reading: start a new page, or program the full block
+ */
+void SAMPLELOG_Idle(uint32_t msLeft) {
+	if (!staged) return;
+
+	if (FLASHRING_Full(&ring)) {
+		// an erase stalls the CPU, so it waits for time before the next reading
+		if (msLeft < FLASHRING_ERASE_MS) return;
+		FLASHRING_StartPage(&ring);
+		sampleLogStats.erases++;
+		return;
+	}
+
+	if (FLASHRING_Append(&ring, &blocks[filling ^ 1]) != HAL_OK) return;
+	staged = 0;
+	sampleLogStats.blocks++;
+}
+
+/*
+ * Number of blocks in flash
+ */
+uint16_t SAMPLELOG_Count(void) {
+	return FLASHRING_Count(&ring);
+}
+
+/*
+ * The index-th block in flash, oldest first, NULL past the end
+ */
+const SAMPLE_BLOCK *SAMPLELOG_Get(uint16_t index) {
+	return FLASHRING_Get(&ring, index);
+}
+
+/*
+ * Read a block's readings with SAMPLELOG_Next
+ */
+void SAMPLELOG_Open(SAMPLE_CURSOR *cursor, const SAMPLE_BLOCK *block) {
+	cursor->block = block;
+	cursor->offset = 0;
+	cursor->left = block->count;
+	cursor->run = 0;
+	cursor->interval = block->interval;
+	cursor->last.timestamp = block->timestamp;
+	cursor->last.distance = block->distance;
+}
+
+/*
+ * Read the varint at offset in size bytes of data and move offset past it,
+ * 0 past the end of the data
+ */
+uint8_t SAMPLELOG_ReadVarint(const uint8_t *data, uint16_t size, uint16_t *offset, uint32_t *value) {
+	*value = 0;
+	for (uint8_t shift = 0; shift < 35 && *offset < size; shift += 7) {
+		uint8_t byte = data[(*offset)++];
+		*value |= (uint32_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return 1;
+	}
+	return 0;
+}
+
+/*
+ * The next reading of the block, 0 once there are none left or the block
+ * does not decode
+ */
+uint8_t SAMPLELOG_Next(SAMPLE_CURSOR *cursor, SAMPLE *sample) {
+	uint32_t header, value;
+
+	if (cursor->left == 0) return 0;
+	if (cursor->left == cursor->block->count) {
+		// the first reading is the block's own
+	}
+	else if (cursor->run) {
+		cursor->run--;
+		cursor->last.timestamp += cursor->interval;
+	}
+	else {
+		if (!SAMPLELOG_ReadVarint(cursor->block->data, SAMPLELOG_DATA, &cursor->offset, &header)) return 0;
+		if ((header & 3) == SAMPLELOG_RUN) {
+			if (!SAMPLELOG_ReadVarint(cursor->block->data, SAMPLELOG_DATA, &cursor->offset, &value) || value == 0) return 0;
+			cursor->run = value - 1;
+		}
+		else if ((header & 3) == SAMPLELOG_TIMED) {
+			if (!SAMPLELOG_ReadVarint(cursor->block->data, SAMPLELOG_DATA, &cursor->offset, &value)) return 0;
+			cursor->interval += SAMPLELOG_UnZigZag(value);
+		}
+		cursor->last.timestamp += cursor->interval;
+		cursor->last.distance += SAMPLELOG_UnZigZag(header >> 2);
+	}
+	cursor->left--;
+	*sample = cursor->last;
+	return 1;
+}
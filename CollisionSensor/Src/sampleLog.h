@@ -0,0 +1,91 @@
+/*
+ * File: sampleLog.h
+ * Purpose: Declares the sample log: every raw reading and its time, kept
+ *          in flash for as long as the ring holds them. Stored as they are,
+ *          6 bytes per reading, they would fill the ring's 48 KB in under a
+ *          quarter of an hour at 10 readings per second, so TIM2 compresses
+ *          them as they come into blocks: each block starts with one full
+ *          reading, and every other reading is coded against the one before
+ *          it.
+ *
+ *          An entry starts with a varint holding the zig-zag coded change in
+ *          distance and two kind bits:
+ *            - SAMPLELOG_SAME: the time since the last reading is the same as
+ *              the time between the two before it
+ *            - SAMPLELOG_TIMED: a second zig-zag varint follows with how much
+ *              that time changed
+ *            - SAMPLELOG_RUN: the distance change is 0 and a varint follows
+ *              with a count of readings that repeat the last one exactly,
+ *              same distance and same time since the reading before
+ *          Varints hold 7 bits per byte, lowest first, the top bit set on
+ *          every byte but the last.
+ */
+#ifndef __SAMPLE_LOG_H
+#define __SAMPLE_LOG_H
+
+#include "stm32f0xx_hal.h"
+#include "scopeCapture.h"
+#include "flashRing.h"
+
+#define SAMPLELOG_PAGES 24
+#define SAMPLELOG_START (SCOPE_START - SAMPLELOG_PAGES * FLASH_PAGE_SIZE)
+#define SAMPLELOG_BLOCK 508   // bytes per block, 4 fill a page exactly
+#define SAMPLELOG_DATA (SAMPLELOG_BLOCK - 14)
+#define SAMPLELOG_RAW 6       // bytes per reading stored as they are, a tick and a distance
+
+#define SAMPLELOG_SAME 0
+#define SAMPLELOG_TIMED 1
+#define SAMPLELOG_RUN 2
+
+// One block as stored in flash
+typedef struct sample_block {
+  uint32_t timestamp;       // ms since boot of the first reading
+  uint16_t distance;        // first reading in mm
+  uint16_t interval;        // ms between the reading before the first one and the first one
+  uint16_t session;         // boot it was logged in, as in NEAR_MISS
+  uint16_t count;           // readings in the block, the first one included
+  uint8_t data[SAMPLELOG_DATA];  // entries for the readings after the first one
+  uint16_t check;           // see FLASHRING
+} SAMPLE_BLOCK;
+
+// A reading as it was logged
+typedef struct sample {
+  uint32_t timestamp;       // ms since boot
+  uint16_t distance;        // raw reading in mm
+} SAMPLE;
+
+// Where SAMPLELOG_Next is in a block
+typedef struct sample_cursor {
+  const SAMPLE_BLOCK *block;
+  uint16_t offset;          // next byte of data
+  uint16_t left;            // readings not read yet
+  uint16_t run;             // readings left in a run
+  uint32_t interval;        // ms between the last two readings
+  SAMPLE last;
+} SAMPLE_CURSOR;
+
+// Counts since boot
+typedef struct samplelog_stats {
+  uint32_t readings;        // readings coded into blocks
+  uint32_t bytes;           // bytes of the blocks they went into, headers and unused bytes included
+  uint32_t blocks;          // blocks programmed to flash
+  uint32_t dropped;         // readings lost because the last block was not programmed yet
+  uint32_t erases;          // pages erased
+} SAMPLELOG_STATS;
+
+extern SAMPLELOG_STATS sampleLogStats;
+
+void SAMPLELOG_Setup(void);
+void SAMPLELOG_Update(uint16_t distance);
+uint8_t SAMPLELOG_Pending(void);
+void SAMPLELOG_Idle(uint32_t msLeft);
+uint16_t SAMPLELOG_Count(void);
+const SAMPLE_BLOCK *SAMPLELOG_Get(uint16_t index);
+void SAMPLELOG_Open(SAMPLE_CURSOR *cursor, const SAMPLE_BLOCK *block);
+uint8_t SAMPLELOG_Next(SAMPLE_CURSOR *cursor, SAMPLE *sample);
+uint8_t SAMPLELOG_Varint(uint8_t *out, uint32_t value);
+uint8_t SAMPLELOG_ReadVarint(const uint8_t *data, uint16_t size, uint16_t *offset, uint32_t *value);
+uint32_t SAMPLELOG_ZigZag(int32_t value);
+int32_t SAMPLELOG_UnZigZag(uint32_t value);
+
+#endif /* __SAMPLE_LOG_H */
@@ -0,0 +1,178 @@
+/*
+ * File: scopeCapture.c
+ * Purpose: Defines the close-call capture. While armed, TIM2 only stores
+ *          each reading in the RAM ring and checks for the trigger; the
+ *          window is copied out and programmed to flash from main's idle
+ *          loop.
+ */
+#include <string.h>
+
+#include "scopeCapture.h"
+#include "sampleLog.h"
+
+SCOPE *thisScope;
+SCOPE_STATS scopeStats;
+
+static FLASHRING ring = { .start = SCOPE_START, .pages = SCOPE_PAGES, .size = sizeof(SCOPE_CAPTURE) };
+
+static uint16_t readings[SCOPE_RING];
+static uint32_t head;                 // readings stored since boot
+static uint32_t resumed;              // first reading after the last gap, older ones do not belong
+static uint32_t triggerAt;            // head of the trigger reading
+static uint32_t triggerTime;
+static uint32_t stop;                 // head once the window after the trigger is complete
+static volatile uint8_t triggered;
+static uint8_t wasRed;
+static uint8_t gap;                   // readings were skipped while frozen
+static volatile uint8_t frozen;       // the window is complete and TIM2 leaves the ring alone
+
+static SCOPE_CAPTURE capture;         // copied out of the ring, waiting to be programmed
+static uint8_t staged;
+
+/*
+ * Find where the flash ring ends and fit the window in a capture
+ */
+void SCOPE_Setup(SCOPE *scope) {
+	thisScope = scope;
+	if (thisScope->post > SCOPE_SAMPLES - 1) thisScope->post = SCOPE_SAMPLES - 1;
+	if (thisScope->pre > SCOPE_SAMPLES - 1 - thisScope->post) thisScope->pre = SCOPE_SAMPLES - 1 - thisScope->post;
+	FLASHRING_Setup(&ring);
+}
+
+/*
+ * Keep a reading from TIM2, the raw one, and trigger on the filtered one
+ * entering the red zone. Armed, this is a store and a few compares.
+ */
+void SCOPE_Update(uint16_t reading, uint16_t distance) {
+	uint8_t red = distance < thisScope->trigger;
+
+	if (frozen) {
+		scopeStats.skipped++;
+		gap = 1;
+		wasRed = red;
+		return;
+	}
+
+	readings[head++ % SCOPE_RING] = reading;
+	if (red && !wasRed && !triggered) {
+		triggered = 1;
+		triggerAt = head - 1;
+		triggerTime = HAL_GetTick();
+		stop = head + thisScope->post;
+	}
+	wasRed = red;
+	if (triggered && head == stop) frozen = 1;
+}
+
+/*
+ * Whether a frozen window or a capture waits for SCOPE_Idle
+ */
+uint8_t SCOPE_Pending(void) {
+	return frozen || staged;
+}
+
+/*
+ * The change of the i-th reading of the window starting at first from the
+ * one before it, ready for a varint
+ */
+static uint32_t SCOPE_Change(uint32_t first, uint8_t i) {
+	return SAMPLELOG_ZigZag((int32_t)readings[(first + i) % SCOPE_RING] - readings[(first + i - 1) % SCOPE_RING]);
+}
+
+/*
+ * Code the frozen window out of the ring and arm again
+ */
+static void SCOPE_Copy(void) {
+	uint8_t pre = triggerAt - resumed < thisScope->pre ? triggerAt - resumed : thisScope->pre;
+	uint32_t first = triggerAt - pre;
+	uint8_t count = pre + 1 + thisScope->post;
+	uint8_t sizes[SCOPE_SAMPLES];
+	uint8_t entry[5];
+	uint8_t from = 0;
+	uint16_t used = 0;
+
+	for (uint8_t i = 1; i < count; i++) {
+		sizes[i] = SAMPLELOG_Varint(entry, SCOPE_Change(first, i));
+		used += sizes[i];
+	}
+	// what does not fit goes from the oldest readings first, then from the last ones
+	while (used > SCOPE_DATA) {
+		if (from < pre) used -= sizes[++from];
+		else used -= sizes[--count];
+	}
+
+	capture.timestamp = triggerTime;
+	capture.session = EVENTLOG_Session();
+	capture.pre = pre - from;
+	capture.post = count - 1 - pre;
+	capture.first = readings[(first + from) % SCOPE_RING];
+	used = 0;
+	for (uint8_t i = from + 1; i < count; i++) used += SAMPLELOG_Varint(&capture.data[used], SCOPE_Change(first, i));
+	memset(&capture.data[used], 0xFF, SCOPE_DATA - used);
+	staged = 1;
+
+	// TIM2 leaves everything alone until frozen is cleared
+	if (gap) resumed = head;
+	gap = 0;
+	triggered = 0;
+	frozen = 0;
+}
+
+/*
+ * One step of flash work, from main's idle loop with the time left before
+ * the next reading: copy out a frozen window, start a new page, or program
+ * the capture
+ */
+void SCOPE_Idle(uint32_t msLeft) {
+	if (!staged) {
+		if (frozen) SCOPE_Copy();
+		return;
+	}
+
+	if (FLASHRING_Full(&ring)) {
+		// an erase stalls the CPU, so it always waits for time before the next
+		// reading, and for the window after a trigger to be complete unless
+		// readings are skipped
+		if (msLeft < FLASHRING_ERASE_MS) return;
+		if (!frozen && triggered) return;
+		FLASHRING_StartPage(&ring);
+		scopeStats.erases++;
+		return;
+	}
+
+	if (FLASHRING_Append(&ring, &capture) != HAL_OK) return;
+	staged = 0;
+	scopeStats.saved++;
+}
+
+/*
+ * Number of captures in flash
+ */
+uint16_t SCOPE_Count(void) {
+	return FLASHRING_Count(&ring);
+}
+
+/*
+ * The index-th capture in flash, oldest first, NULL past the end
+ */
+const SCOPE_CAPTURE *SCOPE_Get(uint16_t index) {
+	return FLASHRING_Get(&ring, index);
+}
+
+/*
+ * Decode a capture's readings into samples, oldest first, the trigger at
+ * samples[pre]. Returns how many, 0 if the capture does not decode
+ */
+uint8_t SCOPE_Samples(const SCOPE_CAPTURE *capture, uint16_t *samples) {
+	uint8_t count = capture->pre + 1 + capture->post;
+	uint16_t offset = 0;
+	uint32_t value;
+
+	if (count > SCOPE_SAMPLES) return 0;
+	samples[0] = capture->first;
+	for (uint8_t i = 1; i < count; i++) {
+		if (!SAMPLELOG_ReadVarint(capture->data, SCOPE_DATA, &offset, &value)) return 0;
+		samples[i] = samples[i - 1] + SAMPLELOG_UnZigZag(value);
+	}
+	return count;
+}
@@ -0,0 +1,65 @@
+/*
+ * File: scopeCapture.h
+ * Purpose: Declares the close-call capture. Like an oscilloscope on single
+ *          trigger, it keeps the last readings in a RAM ring, and when the
+ *          filtered distance enters the red zone it goes on for a few more
+ *          readings, then freezes the window around the trigger. Main's
+ *          idle loop copies the window out and appends it to a ring of
+ *          flash pages below the near-miss log, so a close call can be
+ *          replayed reading by reading next to its near-miss event.
+ *
+ *          A capture keeps its first reading as it is and every other one
+ *          as its change from the one before, coded like the sample log's
+ *          distances: a zig-zag varint each, no kind bits. A window whose
+ *          readings change too much to fit loses its oldest readings, then
+ *          its last ones.
+ */
+#ifndef __SCOPE_CAPTURE_H
+#define __SCOPE_CAPTURE_H
+
+#include "stm32f0xx_hal.h"
+#include "eventLog.h"
+#include "flashRing.h"
+
+#define SCOPE_PAGES 4
+#define SCOPE_START (EVENTLOG_START - SCOPE_PAGES * FLASH_PAGE_SIZE)
+#define SCOPE_SAMPLES 48    // readings a capture holds, SCOPE pre + 1 + post at most
+#define SCOPE_RING 64       // readings kept in RAM, a power of 2 of at least SCOPE_SAMPLES
+#define SCOPE_DATA 84       // bytes of changes a capture holds, a full window even with dropouts
+
+// Trigger and window
+typedef struct scope {
+  uint16_t trigger;         // capture when the distance first falls below this, the red zone boundary
+  uint8_t pre;              // readings kept from before the trigger
+  uint8_t post;             // readings taken after it
+} SCOPE;
+
+// One capture as stored in flash, 96 bytes
+typedef struct scope_capture {
+  uint32_t timestamp;       // ms since boot of the trigger reading
+  uint16_t session;         // boot it was taken in, as in NEAR_MISS
+  uint8_t pre;              // readings before the trigger one, fewer if there were none yet or they did not fit
+  uint8_t post;             // readings after it, fewer if they did not fit
+  uint16_t first;           // oldest raw sensor reading in mm
+  uint8_t data[SCOPE_DATA]; // changes of the readings after it, see SCOPE_Samples
+  uint16_t check;           // see FLASHRING
+} SCOPE_CAPTURE;
+
+// Counts since boot
+typedef struct scope_stats {
+  uint32_t saved;           // captures programmed to flash
+  uint32_t skipped;         // readings not kept because the last capture was still frozen
+  uint32_t erases;          // pages erased
+} SCOPE_STATS;
+
+extern SCOPE_STATS scopeStats;
+
+void SCOPE_Setup(SCOPE *scope);
+void SCOPE_Update(uint16_t reading, uint16_t distance);
+uint8_t SCOPE_Pending(void);
+void SCOPE_Idle(uint32_t msLeft);
+uint16_t SCOPE_Count(void);
+const SCOPE_CAPTURE *SCOPE_Get(uint16_t index);
+uint8_t SCOPE_Samples(const SCOPE_CAPTURE *capture, uint16_t *samples);
+
+#endif /* __SCOPE_CAPTURE_H */
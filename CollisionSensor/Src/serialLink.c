@@ -0,0 +1,203 @@
+/*
+ * File: serialLink.c
+ * Purpose: Defines the telemetry link on USART1: the pins, the baud rate,
+ *          the DMA channel that feeds TDR, and the ring of encoded frames
+ *          it sends from.
+ *
+ *          A slot is a frame's encoded bytes. The queue holds slot numbers
+ *          in the order they were written, and the DMA sends one slot at a
+ *          time from DMA1 channel 2. A writer takes a free slot, or the
+ *          oldest queued one when there is none, encodes into it and puts it
+ *          on the queue. Only taking and queueing a slot is done with the
+ *          interrupts off, a handful of instructions, so TIM2 and the idle
+ *          loop can both write.
+ *
+ *          DMA1 channel 3 copies every byte received into a ring and goes
+ *          round it for ever. Its count of bytes left to the end of the
+ *          ring gives where it writes next, so a reader needs no interrupt.
+ */
+#include "serialLink.h"
+#include "telemetry.h"
+#include "isrProbe.h"
+
+#define SERIAL_ALL_SLOTS ((1 << SERIAL_SLOTS) - 1)
+
+SERIAL_STATS serialStats;
+
+static uint8_t slots[SERIAL_SLOTS][SERIAL_SLOT_SIZE];
+static uint8_t lengths[SERIAL_SLOTS];
+static uint8_t queue[SERIAL_SLOTS];   // slot numbers, oldest at queueTail
+static uint8_t queueTail, queueCount;
+static uint8_t used;                  // slots being written, queued or sent, one bit each
+static int8_t sending = -1;           // slot the DMA reads, -1 when it is idle
+static uint8_t rxRing[SERIAL_RX_SIZE];
+static uint8_t rxNext;                // next byte to read
+
+/*
+ * GPIOA pin configuration: alternate function 1 (USART1), push-pull,
+ * high speed for the fast baud rates, no pull-up/down
+ */
+static void SERIAL_ConfigPin(uint8_t x) {
+	GPIOA->MODER = (GPIOA->MODER & ~(3 << (2*x))) | (2 << (2*x));
+	GPIOA->OTYPER &= ~(1 << x);
+	GPIOA->OSPEEDR |= 3 << (2*x);
+	GPIOA->PUPDR &= ~(3 << (2*x));
+	GPIOA->AFR[x >> 3] = (GPIOA->AFR[x >> 3] & ~(0xF << (4*(x & 7)))) | (0x1 << (4*(x & 7)));
+}
+
+/*
+ * COBS-encode a frame and its CRC-16 into out, ended by a 0. Each code byte
+ * gives the distance to the next 0 of the frame, which it replaces. Returns
+ * the bytes written.
+ */
+uint8_t SERIAL_Encode(uint8_t *out, const uint8_t *data, uint8_t length) {
+	uint16_t crc = TELEMETRY_Crc(data, length);
+	uint8_t code = 0, n = 1;
+
+	for (uint8_t i = 0; i < length + 2; i++) {
+		uint8_t byte = i < length ? data[i] : i == length ? crc & 0xFF : crc >> 8;
+		if (byte == 0) {
+			out[code] = n - code;
+			code = n++;
+			continue;
+		}
+		out[n++] = byte;
+		// 254 bytes without a 0 end a block that implies none
+		if (n - code == 0xFF) {
+			out[code] = 0xFF;
+			code = n++;
+		}
+	}
+	out[code] = n - code;
+	out[n++] = 0;
+	return n;
+}
+
+/*
+ * Hand the oldest queued slot to the DMA if it is idle. Called with the
+ * interrupts off or from the DMA interrupt.
+ */
+static void SERIAL_Start(void) {
+	if (sending >= 0 || queueCount == 0) return;
+	sending = queue[queueTail];
+	queueTail = (queueTail + 1) & (SERIAL_SLOTS - 1);
+	queueCount--;
+
+	DMA1_Channel2->CCR &= ~DMA_CCR_EN;
+	DMA1_Channel2->CMAR = (uint32_t)(uintptr_t)slots[sending];
+	DMA1_Channel2->CNDTR = lengths[sending];
+	DMA1_Channel2->CCR |= DMA_CCR_EN;
+	serialStats.sent++;
+	serialStats.bytes += lengths[sending];
+}
+
+/*
+ * Setup USART1 for transmission from DMA1 channel 2 and reception into the
+ * ring by DMA1 channel 3
+ */
+void SERIAL_Setup(SERIAL *serial) {
+	uint32_t fclk = HAL_RCC_GetHCLKFreq();
+
+	RCC->APB2ENR |= RCC_APB2ENR_USART1EN;
+	RCC->AHBENR |= RCC_AHBENR_GPIOAEN | RCC_AHBENR_DMA1EN;
+	SERIAL_ConfigPin(serial->uart_tx);
+	SERIAL_ConfigPin(serial->uart_rx);
+
+	// 16 times oversampling tops out at fclk / 16, 8 times at fclk / 8
+	if (serial->baud_rate > fclk / 16) {
+		uint32_t usartdiv = (2 * fclk + serial->baud_rate / 2) / serial->baud_rate;
+		USART1->CR1 |= USART_CR1_OVER8;
+		USART1->BRR = (usartdiv & ~0xF) | ((usartdiv & 0xF) >> 1);
+	}
+	else USART1->BRR = (fclk + serial->baud_rate / 2) / serial->baud_rate;
+	// a byte the DMA is late for is overwritten rather than stopping reception
+	USART1->CR3 |= USART_CR3_DMAT | USART_CR3_DMAR | USART_CR3_OVRDIS;
+
+	// byte at a time from memory to TDR, an interrupt when the slot is through
+	DMA1_Channel2->CPAR = (uint32_t)(uintptr_t)&USART1->TDR;
+	DMA1_Channel2->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_TCIE;
+
+	// byte at a time from RDR round the ring, no interrupts
+	DMA1_Channel3->CPAR = (uint32_t)(uintptr_t)&USART1->RDR;
+	DMA1_Channel3->CMAR = (uint32_t)(uintptr_t)rxRing;
+	DMA1_Channel3->CNDTR = SERIAL_RX_SIZE;
+	DMA1_Channel3->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_EN;
+	USART1->CR1 |= USART_CR1_TE | USART_CR1_RE | USART_CR1_UE;
+
+	// below the sensor's USART3 and SysTick, above TIM2, with the USB
+	NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
+	NVIC_SetPriority(DMA1_Channel2_3_IRQn, 1);
+}
+
+/*
+ * Queue a frame, from TIM2 or the idle loop. Never waits: with no slot free
+ * the oldest queued frame makes room. Returns 0 if the frame was too long or
+ * every slot was busy being written or sent.
+ */
+uint8_t SERIAL_Write(const uint8_t *data, uint8_t length) {
+	uint32_t primask;
+	int8_t slot = -1;
+
+	if (length > SERIAL_MAX_FRAME) return 0;
+	primask = __get_PRIMASK();
+	__disable_irq();
+	if (used != SERIAL_ALL_SLOTS) {
+		for (slot = 0; used & (1 << slot); slot++) {}
+		used |= 1 << slot;
+	}
+	else if (queueCount) {
+		slot = queue[queueTail];
+		queueTail = (queueTail + 1) & (SERIAL_SLOTS - 1);
+		queueCount--;
+		serialStats.dropped++;
+	}
+	__set_PRIMASK(primask);
+	if (slot < 0) {
+		serialStats.dropped++;
+		return 0;
+	}
+
+	lengths[slot] = SERIAL_Encode(slots[slot], data, length);
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	queue[(queueTail + queueCount) & (SERIAL_SLOTS - 1)] = slot;
+	queueCount++;
+	serialStats.frames++;
+	SERIAL_Start();
+	__set_PRIMASK(primask);
+	return 1;
+}
+
+/*
+ * Take up to max bytes received since the last read. Never waits. Bytes
+ * are lost if the host sends more than the ring holds between two reads.
+ */
+uint8_t SERIAL_Read(uint8_t *data, uint8_t max) {
+	// CNDTR counts down to the end of the ring and starts again at its size
+	uint8_t head = SERIAL_RX_SIZE - DMA1_Channel3->CNDTR;
+	uint8_t n = 0;
+
+	while (rxNext != head && n < max) {
+		data[n++] = rxRing[rxNext];
+		rxNext = (rxNext + 1) & (SERIAL_RX_SIZE - 1);
+	}
+	return n;
+}
+
+/*
+ * DMA1 channel 2 and 3 interrupt request handler: the slot on the way is
+ * through, so free it and send the next
+ */
+void DMA1_Channel2_3_IRQHandler(void) {
+	uint32_t probe = PROBE_Enter();
+
+	if (DMA1->ISR & DMA_ISR_TCIF2) {
+		DMA1->IFCR = DMA_IFCR_CGIF2;
+		used &= ~(1 << sending);
+		sending = -1;
+		SERIAL_Start();
+	}
+
+	PROBE_Exit(PROBE_SERIAL, probe);
+}
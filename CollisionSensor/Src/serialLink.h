@@ -0,0 +1,45 @@
+/*
+ * File: serialLink.h
+ * Purpose: Declares the telemetry link on USART1, for units without USB.
+ *          Every frame gets a CRC and is COBS-encoded, so a 0 byte only
+ *          ever ends a frame and a receiver that starts anywhere is in step
+ *          after the next one. Frames queue in a ring of slots that the DMA
+ *          sends from. A writer queues a frame and returns; when the link
+ *          falls behind, the oldest frame still waiting is dropped and
+ *          counted, so the link never holds up the readings. What the host
+ *          sends back lands in a receive ring by DMA and is read by polling.
+ */
+#ifndef __SERIAL_LINK_H
+#define __SERIAL_LINK_H
+
+#include "stm32f0xx_hal.h"
+
+#define SERIAL_MAX_FRAME 48       // longest frame a writer hands over, the shell's stats reply
+#define SERIAL_SLOTS 8            // frames queued or on the way, a power of 2
+// On the wire: the frame, its CRC-16, one COBS code byte per 254 and the 0 that ends it
+#define SERIAL_SLOT_SIZE (SERIAL_MAX_FRAME + 2 + 1 + 1)
+#define SERIAL_RX_SIZE 64         // receive ring, a power of 2: what the host may send between two reads
+
+// Holds the UART information, pins on GPIOA
+typedef struct {
+  uint8_t uart_tx;
+  uint8_t uart_rx;
+  uint32_t baud_rate;       // up to 1/8 of the core clock
+} SERIAL;
+
+// What happened to the frames, for the simulator and the debugger
+typedef struct serial_stats {
+  uint32_t frames;          // queued
+  uint32_t sent;            // handed to the DMA
+  uint32_t bytes;           // in them, encoded
+  uint32_t dropped;         // overwritten while waiting, or with every slot busy
+} SERIAL_STATS;
+
+extern SERIAL_STATS serialStats;
+
+void SERIAL_Setup(SERIAL *serial);
+uint8_t SERIAL_Write(const uint8_t *data, uint8_t length);
+uint8_t SERIAL_Read(uint8_t *data, uint8_t max);
+uint8_t SERIAL_Encode(uint8_t *out, const uint8_t *data, uint8_t length);
+
+#endif /* __SERIAL_LINK_H */
@@ -0,0 +1,108 @@
+/*
+ * File: sessionStats.c
+ * Purpose: Defines the session statistics. A reading only adds to the
+ *          sums of the readings and of their squares, 64 bit counters that
+ *          take thousands of years to overflow. The mean and the variance
+ *          are worked out from them when they are read, so the 64 bit
+ *          divides stay out of TIM2 and no rounding builds up.
+ */
+#include "sessionStats.h"
+#include "ultrasonicSensorUart.h"
+
+SESSION *thisSession;
+SESSION_STATS sessionStats = { .min = 0xFFFF };
+
+static uint8_t lastZone = SESSION_ZONES;  // none yet
+static uint32_t lastTime;
+
+void SESSION_Setup(SESSION *session) {
+	thisSession = session;
+}
+
+/*
+ * Add a reading from TIM2: a bin, the time since the last reading to the
+ * zone it was in, and the sums
+ */
+void SESSION_Update(uint16_t distance) {
+	uint32_t now = HAL_GetTick();
+	uint8_t zone = 0;
+
+	for (uint8_t i = 0; i < 4; i++) zone += distance >= thisSession->thresholds[i];
+	if (lastZone < SESSION_ZONES) sessionStats.zone_ms[lastZone] += now - lastTime;
+	if (zone != lastZone) sessionStats.zone_entries[zone]++;
+	lastZone = zone;
+	lastTime = now;
+
+	if (distance > SENSOR_MAX_RANGE) {
+		sessionStats.out_of_range++;
+		return;
+	}
+	sessionStats.histogram[distance / SESSION_BIN_MM]++;
+	if (distance < sessionStats.min) sessionStats.min = distance;
+	if (distance > sessionStats.max) sessionStats.max = distance;
+
+	sessionStats.count++;
+	sessionStats.sum += distance;
+	sessionStats.squares += (uint32_t)distance * distance;
+}
+
+/*
+ * The count and the sums in one piece, as TIM2 may add a reading between
+ * two of them when called from main's idle loop
+ */
+static uint32_t SESSION_Sums(uint64_t *sum, uint64_t *squares) {
+	uint32_t primask = __get_PRIMASK();
+	uint32_t count;
+
+	__disable_irq();
+	count = sessionStats.count;
+	*sum = sessionStats.sum;
+	*squares = sessionStats.squares;
+	__set_PRIMASK(primask);
+	return count;
+}
+
+/*
+ * Mean of the readings in range in mm, rounded
+ */
+uint16_t SESSION_Mean(void) {
+	uint64_t sum, squares;
+	uint32_t count = SESSION_Sums(&sum, &squares);
+
+	if (count == 0) return 0;
+	return (sum + count / 2) / count;
+}
+
+/*
+ * Variance of the readings in range in mm^2: the mean of the squares less
+ * the square of the mean, both in 1/256
+ */
+uint32_t SESSION_Variance(void) {
+	uint64_t sum, squares, mean, meanSquares;
+	uint32_t count = SESSION_Sums(&sum, &squares);
+
+	if (count == 0) return 0;
+	mean = (sum << SESSION_SHIFT) / count;
+	// squares would outgrow 64 bits shifted first, after about 11 years of readings
+	meanSquares = squares / count;
+	meanSquares = (meanSquares << SESSION_SHIFT) + ((squares - meanSquares * count) << SESSION_SHIFT) / count;
+	mean = (mean * mean) >> SESSION_SHIFT;
+	return meanSquares > mean ? (meanSquares - mean) >> SESSION_SHIFT : 0;
+}
+
+/*
+ * Standard deviation of the readings in range in mm, the integer square
+ * root of the variance
+ */
+uint16_t SESSION_StdDev(void) {
+	uint32_t variance = SESSION_Variance(), root = 0;
+
+	for (uint32_t bit = 1u << 30; bit != 0; bit >>= 2) {
+		if (variance >= root + bit) {
+			variance -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else root >>= 1;
+	}
+	return root;
+}
@@ -0,0 +1,46 @@
+/*
+ * File: sessionStats.h
+ * Purpose: Declares the statistics kept for the current session (boot):
+ *          a histogram of the distances, the time spent in each warning
+ *          zone and how often it was entered, and the closest, farthest,
+ *          mean and variance of the readings in range. Each reading updates
+ *          them in constant time and nothing is kept of the readings
+ *          themselves, so they cost the same after a minute or a month.
+ */
+#ifndef __SESSION_STATS_H
+#define __SESSION_STATS_H
+
+#include "stm32f0xx_hal.h"
+
+#define SESSION_BINS 16
+#define SESSION_BIN_MM 300      // histogram bin width, the bins cover 0 to 4800 mm
+#define SESSION_ZONES 5         // red, orange, blue, green, none
+#define SESSION_SHIFT 8         // fraction bits of the mean and variance while they are worked out
+
+// Zone boundaries the time in each zone is kept for
+typedef struct session {
+  const uint16_t *thresholds; // in mm, closest first, those of CONFIG
+} SESSION;
+
+// The statistics
+typedef struct session_stats {
+  uint32_t histogram[SESSION_BINS];     // readings in range per SESSION_BIN_MM
+  uint32_t out_of_range;                // readings with nothing in range
+  uint32_t zone_ms[SESSION_ZONES];      // time spent in each zone, closest first
+  uint32_t zone_entries[SESSION_ZONES]; // times each zone was entered from another one
+  uint32_t count;                       // readings in range
+  uint16_t min;                         // closest reading in range in mm
+  uint16_t max;                         // farthest
+  uint64_t sum;                         // of the readings in range in mm
+  uint64_t squares;                     // sum of their squares in mm^2
+} SESSION_STATS;
+
+extern SESSION_STATS sessionStats;
+
+void SESSION_Setup(SESSION *session);
+void SESSION_Update(uint16_t distance);
+uint16_t SESSION_Mean(void);
+uint32_t SESSION_Variance(void);
+uint16_t SESSION_StdDev(void);
+
+#endif /* __SESSION_STATS_H */
@@ -23,6 +23,9 @@
 #include "stm32f0xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "isrProbe.h"
+#include "crashLog.h"
+#include "watchdog.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -52,6 +55,39 @@
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
+/**
+  * @brief This function handles Hard fault interrupt.
+  *        Hands the frame the fault stacked to the crash log, which captures
+  *        it and resets. Only MSP is used, so the frame is always there.
+  *        It must read MSP before any prologue, so it is naked and lives in
+  *        this user section, with its generation turned off in the .ioc.
+  */
+#if defined(__CC_ARM)
+__asm void HardFault_Handler(void)
+{
+  IMPORT CRASHLOG_Fault
+  MRS r0, MSP
+  LDR r1, =CRASHLOG_Fault
+  BX r1
+  ALIGN
+}
+#elif defined(__GNUC__) && defined(__arm__)
+__attribute__((naked)) void HardFault_Handler(void)
+{
+  __asm volatile (
+    "mrs r0, msp\n"
+    "ldr r1, =CRASHLOG_Fault\n"
+    "bx r1\n"
+    ".ltorg\n"
+  );
+}
+#else
+void HardFault_Handler(void)
+{
+  // host build: the simulator stacks a frame for the fault it raises
+  CRASHLOG_Fault((uint32_t *)__get_MSP());
+}
+#endif
 
 /* USER CODE END 0 */
 
@@ -77,21 +113,6 @@ void NMI_Handler(void)
   /* USER CODE END NonMaskableInt_IRQn 1 */
 }
 
-/**
-  * @brief This function handles Hard fault interrupt.
-  */
-void HardFault_Handler(void)
-{
-  /* USER CODE BEGIN HardFault_IRQn 0 */
-
-  /* USER CODE END HardFault_IRQn 0 */
-  while (1)
-  {
-    /* USER CODE BEGIN W1_HardFault_IRQn 0 */
-    /* USER CODE END W1_HardFault_IRQn 0 */
-  }
-}
-
 /**
   * @brief This function handles System service call via SWI instruction.
   */
@@ -124,11 +145,12 @@ void PendSV_Handler(void)
 void SysTick_Handler(void)
 {
   /* USER CODE BEGIN SysTick_IRQn 0 */
-
+  uint32_t probe = PROBE_EnterTick();
   /* USER CODE END SysTick_IRQn 0 */
   HAL_IncTick();
   /* USER CODE BEGIN SysTick_IRQn 1 */
-
+  WATCHDOG_Tick();
+  PROBE_Exit(PROBE_SYSTICK, probe);
   /* USER CODE END SysTick_IRQn 1 */
 }
 
@@ -0,0 +1,74 @@
+/*
+ * File: telemetry.c
+ * Purpose: Defines the telemetry frames: what goes in them, their CRC and
+ *          the hand-over to the USB and USART1 links. The CRC is computed
+ *          in software, four bits at a time, as the CRC unit belongs to the
+ *          flash code that TIM2 preempts.
+ */
+#include <stddef.h>
+
+#include "telemetry.h"
+#include "ultrasonicSensorUart.h"
+#include "healthMonitor.h"
+#include "usbCdc.h"
+#include "serialLink.h"
+
+TELEMETRY *thisTelemetry;
+TELEMETRY_STATS telemetryStats;
+
+static TELEMETRY_FRAME frame;
+
+// CRC-16/CCITT of every value of a nibble
+static const uint16_t crcNibbles[16] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+void TELEMETRY_Setup(TELEMETRY *telemetry) {
+	thisTelemetry = telemetry;
+	frame.sync = TELEMETRY_SYNC;
+	frame.length = sizeof(TELEMETRY_FRAME);
+	frame.version = TELEMETRY_VERSION;
+	frame.zone = 4;  // no reading yet
+}
+
+/*
+ * CRC-16/CCITT from 0xFFFF, the check the host does on every frame
+ */
+uint16_t TELEMETRY_Crc(const uint8_t *data, uint16_t length) {
+	uint16_t crc = 0xFFFF;
+
+	while (length--) {
+		crc = (crc << 4) ^ crcNibbles[(crc >> 12) ^ (*data >> 4)];
+		crc = (crc << 4) ^ crcNibbles[(crc >> 12) ^ (*data++ & 0xF)];
+	}
+	return crc;
+}
+
+/*
+ * Every period from TIM2, after the warnings: build the frame and hand it to
+ * the link. A period without a fresh reading sends the last distances again.
+ */
+void TELEMETRY_Update(uint8_t fresh, uint16_t raw, uint16_t distance) {
+	uint16_t arr = TIM3->ARR;
+
+	frame.sequence++;
+	frame.flags = fresh ? TELEMETRY_NEW : 0;
+	if (fresh) {
+		frame.raw = raw;
+		frame.distance = distance;
+		frame.zone = 0;
+		for (uint8_t i = 0; i < 4; i++) frame.zone += distance >= thisTelemetry->thresholds[i];
+	}
+	frame.time_ms = HAL_GetTick();
+	frame.duty = arr ? TIM3->CCR1 * 100 / arr : 0;
+	frame.temperature = sensorValues.temperature - 45;
+	frame.fault = healthStatus.fault;
+	frame.faults = healthStatus.faults;
+	frame.replies = sensorValues.replies;
+	frame.crc = TELEMETRY_Crc((const uint8_t *)&frame, offsetof(TELEMETRY_FRAME, crc));
+
+	telemetryStats.frames++;
+	if (USBCDC_Write((const uint8_t *)&frame, sizeof(frame))) telemetryStats.sent++;
+	if (SERIAL_Write((const uint8_t *)&frame, sizeof(frame))) telemetryStats.serialSent++;
+}
@@ -0,0 +1,60 @@
+/*
+ * File: telemetry.h
+ * Purpose: Declares the telemetry stream: one binary frame per period with
+ *          the raw and the filtered distance, the zone, the motor's duty,
+ *          the temperature and the sensor's health, sent over USB to a
+ *          host that has the port open and out of USART1. Frames are built
+ *          in TIM2 and handed to the links, which send them when they can;
+ *          a link that cannot keep up drops frames and never holds up the
+ *          readings.
+ */
+#ifndef __TELEMETRY_H
+#define __TELEMETRY_H
+
+#include "stm32f0xx_hal.h"
+
+#define TELEMETRY_SYNC 0x5AA5     // first two bytes of every frame, A5 5A on the wire
+#define TELEMETRY_VERSION 1       // layout of TELEMETRY_FRAME, incremented when it changes
+
+// Flags of a frame
+#define TELEMETRY_NEW 0x01        // the distances are this period's reading, not the last one
+
+// Zone boundaries the frame's zone is graded with
+typedef struct telemetry {
+  const uint16_t *thresholds; // in mm, closest first, those of CONFIG
+} TELEMETRY;
+
+// One frame, little-endian and laid out to be sent as it is
+typedef struct telemetry_frame {
+  uint16_t sync;            // TELEMETRY_SYNC
+  uint8_t length;           // bytes in the frame, the CRC included
+  uint8_t version;          // TELEMETRY_VERSION
+  uint16_t sequence;        // frames built since boot, a gap is a frame the link dropped
+  uint8_t flags;            // TELEMETRY_NEW
+  uint8_t zone;             // of the filtered distance: red 0, orange, blue, green, none 4
+  uint32_t time_ms;         // HAL tick when the frame was built
+  uint16_t raw;             // reading from the sensor in mm, SENSOR_NOTHING for nothing in range
+  uint16_t distance;        // the warnings' distance: calibrated and filtered
+  uint8_t duty;             // motor PWM duty in percent
+  int8_t temperature;       // degrees C, the last the sensor sent
+  uint8_t fault;            // HEALTH_OK to HEALTH_ERRATIC
+  uint8_t faults;           // sensor faults since boot, wraps
+  uint8_t replies;          // sensor replies since boot, wraps
+  uint8_t reserved;
+  uint16_t crc;             // CRC-16/CCITT (0x1021, from 0xFFFF) of the bytes before it
+} TELEMETRY_FRAME;
+
+// What happened to the frames, for the simulator and the debugger
+typedef struct telemetry_stats {
+  uint32_t frames;          // built
+  uint32_t sent;            // taken by the USB link
+  uint32_t serialSent;      // taken by the USART1 link
+} TELEMETRY_STATS;
+
+extern TELEMETRY_STATS telemetryStats;
+
+void TELEMETRY_Setup(TELEMETRY *telemetry);
+void TELEMETRY_Update(uint8_t fresh, uint16_t raw, uint16_t distance);
+uint16_t TELEMETRY_Crc(const uint8_t *data, uint16_t length);
+
+#endif /* __TELEMETRY_H */
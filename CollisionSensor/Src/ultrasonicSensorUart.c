@@ -5,11 +5,19 @@
  *          is via USART3 using GPIOB pins.
  */
 #include "ultrasonicSensorUart.h"
+#include "isrProbe.h"
 
 // initialize the data recieved to 0
-volatile SENSOR_Values sensorValues = { 0, 0, 0, 0, 0 };
+volatile SENSOR_Values sensorValues = { 0, 0, 0, 0, 0, 0, 0 };
 volatile uint8_t rangeMeasurement = 1;
 
+static uint8_t requestedReplies;				// replies completed when the last distance request went out
+static volatile uint8_t tempPending;		// the temperature request waits for the distance reply
+
+#if SENSOR_CAPTURE
+volatile SENSOR_Capture sensorCapture;
+#endif
+
 /*
  * Setups the USART3 subsystem and GPIO pins
  */
@@ -49,21 +57,44 @@ void SENSOR_GetReading() {
   // wait until transmit data register is empty. bit 7 will be set when empty
   while ((USART3->ISR & (1 << 7)) == 0) {}
   
+	// a byte left over from a reply cut short would pair with the first byte
+	// of this one, so the next byte always starts a new reply
+	sensorValues.recieved = 2;
+	requestedReplies = sensorValues.replies;
+	tempPending = 0;
 	rangeMeasurement = 1;
   // Transmit data register is now empty, write new char to send
   USART3->TDR = 0x55;
+	SENSOR_CaptureByte(SENSOR_CAPTURE_TX, 0x55);
 }
 
 /*
  * Send a request for a temperature reading to the sensor
  */
-void SENSOR_GetTempReading(void) {
+static void SENSOR_SendTempRequest(void) {
 	// wait until transmit data register is empty. bit 7 will be set when empty
   while ((USART3->ISR & (1 << 7)) == 0) {}
   
 	rangeMeasurement = 0;
   // Transmit data register is now empty, write new char to send
   USART3->TDR = 0x50;
+	SENSOR_CaptureByte(SENSOR_CAPTURE_TX, 0x50);
+}
+
+/*
+ * Ask for a temperature reading once the reply to the distance request is
+ * in, from the USART3 interrupt if it is still coming. Its bytes would be
+ * taken for the temperature otherwise, which happens with anything farther
+ * than about 1.3 m. A sensor that never replies gets no request.
+ */
+void SENSOR_GetTempReading(void) {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	
+	if (sensorValues.replies == requestedReplies) tempPending = 1;
+	else SENSOR_SendTempRequest();
+	
+	__set_PRIMASK(primask);
 }
 
 /*
@@ -71,11 +102,19 @@ void SENSOR_GetTempReading(void) {
  * Wait for data to be received, then process it
  */
 void USART3_4_IRQHandler(void) {
+	uint32_t probe = PROBE_Enter();
+	uint32_t isr = USART3->ISR;
+	
 	// wait for distance data to be received
-  if (((USART3->ISR & USART_ISR_RXNE_Msk) >> USART_ISR_RXNE_Pos) != 1) return;
+  if (((isr & USART_ISR_RXNE_Msk) >> USART_ISR_RXNE_Pos) == 1) {
+		if (rangeMeasurement) SENSOR_RecvDistance();
+		else SENSOR_RecvTemperature();
+	}
+	// a byte lost while a flash erase stalled the CPU: the overrun flag keeps
+	// the interrupt raised until it is cleared, the next request resyncs
+	if (isr & USART_ISR_ORE) USART3->ICR = USART_ICR_ORECF;
 	
-	if (rangeMeasurement) SENSOR_RecvDistance();
-	else SENSOR_RecvTemperature();
+	PROBE_Exit(PROBE_USART3, probe);
 }
 
 /*
@@ -90,6 +129,7 @@ void SENSOR_RecvDistance() {
   }
 	// read the value and parse it out
   uint8_t val = USART3->RDR;
+	SENSOR_CaptureByte(SENSOR_CAPTURE_RX, val);
   switch (sensorValues.recieved++) {
     case 0:
       sensorValues.distance |= val << 8; break;
@@ -98,7 +138,14 @@ void SENSOR_RecvDistance() {
   };
   
 	// if two 8 bit values were received, the 16 bit number is ready
-  if (sensorValues.recieved == 2) sensorValues.new_value = 1;
+  if (sensorValues.recieved == 2) {
+		sensorValues.new_value = 1;
+		sensorValues.replies++;
+		if (tempPending) {
+			tempPending = 0;
+			SENSOR_SendTempRequest();
+		}
+	}
 }
 
 /*
@@ -112,10 +159,38 @@ void SENSOR_RecvTemperature() {
   }
 	
 	sensorValues.temperature = USART3->RDR;
+	SENSOR_CaptureByte(SENSOR_CAPTURE_RX, sensorValues.temperature);
 	sensorValues.temp_recieved++;
 	sensorValues.new_temp_value = 1;
 }
 
+#if SENSOR_CAPTURE
+/*
+ * Log a byte sent to or received from the sensor with a microsecond timestamp
+ * from the HAL tick and the SysTick counter
+ */
+void SENSOR_CaptureByte(uint8_t dir, uint8_t byte) {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	
+	uint32_t ms = HAL_GetTick();
+	uint32_t val = SysTick->VAL;
+	// SysTick has wrapped but its interrupt has not counted the tick yet
+	if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+		ms++;
+		val = SysTick->VAL;
+	}
+	
+	volatile SENSOR_CaptureEntry *e = &sensorCapture.entries[sensorCapture.head & (SENSOR_CAPTURE_SIZE - 1)];
+	e->time_us = ms * 1000 + (SysTick->LOAD - val) / (SystemCoreClock / 1000000);
+	e->dir = dir;
+	e->byte = byte;
+	sensorCapture.head++;
+	
+	__set_PRIMASK(primask);
+}
+#endif
+
 /*
  * GPIOB Pin configuration function
  * Pass in the pin number, x
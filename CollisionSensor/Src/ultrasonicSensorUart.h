@@ -9,6 +9,12 @@
 
 #include "stm32f0xx_hal.h"
 
+#define SENSOR_MAX_RANGE 4500    // farthest real reading in mm
+#define SENSOR_NOTHING 11000     // what the sensor reports with nothing in range
+
+// Longest the sensor takes to answer: its 66 ms echo timeout, the trigger and two frames
+#define SENSOR_REPLY_MS 70
+
 // Holds the UART information
 typedef struct {
   uint8_t uart_tx;
@@ -24,11 +30,38 @@ typedef struct {
 	uint8_t temperature;
 	uint8_t new_value;
 	uint8_t new_temp_value;
+	uint8_t replies;	// distance replies completed, wraps
 } SENSOR_Values;
 
 // Define a volatile extern so SENSOR_GetReading can change the values and main can see them
 extern volatile SENSOR_Values sensorValues;
 
+// Set SENSOR_CAPTURE to 1 to log every byte exchanged with the US-100 in RAM.
+// The log can be read out with the debugger or the simulator and replayed.
+#ifndef SENSOR_CAPTURE
+#define SENSOR_CAPTURE 0
+#endif
+#define SENSOR_CAPTURE_SIZE 256	// entries, must be a power of 2
+#define SENSOR_CAPTURE_TX 0
+#define SENSOR_CAPTURE_RX 1
+
+// One logged byte
+typedef struct {
+	uint32_t time_us;	// microseconds since reset
+	uint8_t dir;			// SENSOR_CAPTURE_TX or SENSOR_CAPTURE_RX
+	uint8_t byte;
+} SENSOR_CaptureEntry;
+
+// Ring of the last SENSOR_CAPTURE_SIZE bytes, head counts every byte logged
+typedef struct {
+	uint32_t head;
+	SENSOR_CaptureEntry entries[SENSOR_CAPTURE_SIZE];
+} SENSOR_Capture;
+
+#if SENSOR_CAPTURE
+extern volatile SENSOR_Capture sensorCapture;
+#endif
+
 void SENSOR_Setup(SENSOR *sensor);
 
 void SENSOR_SetBaudRate(uint32_t x);
@@ -38,6 +71,12 @@ void SENSOR_GetTempReading(void);
 void SENSOR_RecvDistance(void);
 void SENSOR_RecvTemperature(void);
 
+#if SENSOR_CAPTURE
+void SENSOR_CaptureByte(uint8_t dir, uint8_t byte);
+#else
+#define SENSOR_CaptureByte(dir, byte) ((void)0)
+#endif
+
 void configPinB_AF4(uint8_t x);
 
 #endif /* __ULTRASONIC_UARTUART_H */
@@ -0,0 +1,425 @@
+/*
+ * File: usbCdc.c
+ * Purpose: Defines the USB virtual COM port: the clock and the transceiver,
+ *          the endpoints and their buffers in the packet memory, the
+ *          control requests of enumeration and of the CDC class, and the
+ *          telemetry stream on the bulk IN endpoint.
+ *
+ *          Endpoint 0 is control, endpoint 1 bulk IN (telemetry) and OUT
+ *          (taken and ignored), endpoint 2 the interrupt IN that CDC ACM
+ *          asks for and never uses. The USB interrupt runs below the
+ *          sensor's USART3 and above TIM2, so enumeration goes on while TIM2
+ *          waits for a reading.
+ */
+#include <string.h>
+
+#include "usbCdc.h"
+#include "isrProbe.h"
+
+// Endpoint register and packet memory access, 16 bits wide
+#define USBCDC_EPR(ep) (*(&USB->EP0R + 2 * (ep)))
+#define USBCDC_PMA(offset) (*(volatile uint16_t *)(USB_PMAADDR + (offset)))
+
+// Buffer descriptor table at the start of the packet memory, one entry per endpoint
+#define USBCDC_ADDR_TX(ep) USBCDC_PMA(8 * (ep))
+#define USBCDC_COUNT_TX(ep) USBCDC_PMA(8 * (ep) + 2)
+#define USBCDC_ADDR_RX(ep) USBCDC_PMA(8 * (ep) + 4)
+#define USBCDC_COUNT_RX(ep) USBCDC_PMA(8 * (ep) + 6)
+#define USBCDC_RX_64 0x8400       // COUNT_RX for a 64 byte buffer: two blocks of 32
+
+// Buffers in the packet memory
+#define USBCDC_EP0_RX 0x040
+#define USBCDC_EP0_TX 0x080
+#define USBCDC_EP1_RX 0x0C0
+#define USBCDC_EP1_TX 0x100
+#define USBCDC_EP2_TX 0x140
+
+// Standard and CDC requests, bmRequestType << 8 | bRequest
+#define USBCDC_GET_STATUS_DEVICE 0x8000
+#define USBCDC_GET_STATUS_INTERFACE 0x8100
+#define USBCDC_GET_STATUS_ENDPOINT 0x8200
+#define USBCDC_SET_ADDRESS 0x0005
+#define USBCDC_GET_DESCRIPTOR 0x8006
+#define USBCDC_GET_CONFIGURATION 0x8008
+#define USBCDC_SET_CONFIGURATION 0x0009
+#define USBCDC_SET_LINE_CODING 0x2120
+#define USBCDC_GET_LINE_CODING 0xA121
+#define USBCDC_SET_CONTROL_LINE_STATE 0x2122
+
+// Descriptor types
+#define USBCDC_DEVICE 1
+#define USBCDC_CONFIGURATION 2
+#define USBCDC_STRING 3
+
+#define USBCDC_MAX_STRING 31      // characters in a string descriptor built in ctrlBuffer
+
+USBCDC_STATS usbCdcStats;
+
+static const uint8_t deviceDescriptor[18] = {
+	18, USBCDC_DEVICE, 0x00, 0x02,   // USB 2.0
+	0x02, 0x00, 0x00, USBCDC_PACKET, // communications device class, 64 byte control packets
+	USBCDC_VID & 0xFF, USBCDC_VID >> 8, USBCDC_PID & 0xFF, USBCDC_PID >> 8,
+	0x00, 0x01,                      // release 1.00
+	1, 2, 0,                         // manufacturer and product strings, no serial number
+	1                                // configurations
+};
+
+static const uint8_t configDescriptor[67] = {
+	9, USBCDC_CONFIGURATION, 67, 0, 2, 1, 0, 0x80, 50,  // 2 interfaces, bus powered, 100 mA
+	// communications interface: abstract control model
+	9, 4, 0, 0, 1, 0x02, 0x02, 0x01, 0,
+	5, 0x24, 0x00, 0x10, 0x01,       // header, CDC 1.10
+	5, 0x24, 0x01, 0x00, 1,          // call management, no calls, data on interface 1
+	4, 0x24, 0x02, 0x02,             // ACM: line coding and control line state
+	5, 0x24, 0x06, 0, 1,             // union of interfaces 0 and 1
+	7, 5, 0x82, 0x03, 8, 0, 255,     // notifications, interrupt IN 2, never sent
+	// data interface
+	9, 4, 1, 0, 2, 0x0A, 0x00, 0x00, 0,
+	7, 5, 0x01, 0x02, USBCDC_PACKET, 0, 0,  // bulk OUT 1
+	7, 5, 0x81, 0x02, USBCDC_PACKET, 0, 0   // bulk IN 1, the telemetry
+};
+
+static const char *const strings[] = { "CollisionSensingHat", "Collision Sensor Telemetry" };
+
+// 115200 baud, 1 stop bit, no parity, 8 data bits; the port has no baud rate, it is kept for the host
+static uint8_t lineCoding[7] = { 0x00, 0xC2, 0x01, 0x00, 0, 0, 8 };
+
+// Control transfer in progress
+static uint8_t ctrlBuffer[2 + 2 * USBCDC_MAX_STRING];  // answers that are not constant
+static const uint8_t *ctrlData;   // IN data still to send
+static uint16_t ctrlLeft;
+static uint8_t ctrlZlp;           // the IN data ends on a packet boundary short of what was asked
+static uint16_t ctrlOut;          // request waiting for its OUT data, 0 for none
+static uint8_t address;           // to take once the SET_ADDRESS status stage is through
+
+static volatile uint8_t configured;
+static volatile uint8_t dtr;      // a terminal has the port open
+
+// Telemetry waiting for the next packet, and the packet on the way
+static uint8_t stream[USBCDC_PACKET];
+static uint8_t streamLength;
+static uint8_t inFlight;
+
+/*
+ * Copy bytes into the packet memory, a half-word at a time
+ */
+static void USBCDC_ToPma(uint16_t offset, const uint8_t *data, uint16_t length) {
+	for (uint16_t i = 0; i < length; i += 2) {
+		USBCDC_PMA(offset + i) = data[i] | (i + 1 < length ? data[i + 1] << 8 : 0);
+	}
+}
+
+static void USBCDC_FromPma(uint16_t offset, uint8_t *data, uint16_t length) {
+	for (uint16_t i = 0; i < length; i += 2) {
+		uint16_t word = USBCDC_PMA(offset + i);
+		data[i] = word & 0xFF;
+		if (i + 1 < length) data[i + 1] = word >> 8;
+	}
+}
+
+/*
+ * Endpoint registers: the CTR flags clear on a 0 and keep on a 1, the STAT
+ * and DTOG bits toggle on a 1. These write 1 to both flags and toggle the
+ * STAT bits to stat, or clear the one flag.
+ */
+static void USBCDC_SetTx(uint8_t ep, uint16_t stat) {
+	uint16_t r = USBCDC_EPR(ep);
+	USBCDC_EPR(ep) = (r & USB_EPREG_MASK) | USB_EP_CTR_RX | USB_EP_CTR_TX | ((r & USB_EPTX_STAT) ^ stat);
+}
+
+static void USBCDC_SetRx(uint8_t ep, uint16_t stat) {
+	uint16_t r = USBCDC_EPR(ep);
+	USBCDC_EPR(ep) = (r & USB_EPREG_MASK) | USB_EP_CTR_RX | USB_EP_CTR_TX | ((r & USB_EPRX_STAT) ^ stat);
+}
+
+static void USBCDC_ClearCtr(uint8_t ep, uint16_t ctr) {
+	uint16_t r = USBCDC_EPR(ep);
+	USBCDC_EPR(ep) = ((r & USB_EPREG_MASK) | USB_EP_CTR_RX | USB_EP_CTR_TX) & ~ctr;
+}
+
+/*
+ * Bus reset: the endpoint registers and the address are cleared, so set
+ * the endpoints up again and forget the configuration
+ */
+static void USBCDC_Reset(void) {
+	USB->BTABLE = 0;
+	USBCDC_ADDR_RX(0) = USBCDC_EP0_RX;
+	USBCDC_COUNT_RX(0) = USBCDC_RX_64;
+	USBCDC_ADDR_TX(0) = USBCDC_EP0_TX;
+	USBCDC_ADDR_RX(1) = USBCDC_EP1_RX;
+	USBCDC_COUNT_RX(1) = USBCDC_RX_64;
+	USBCDC_ADDR_TX(1) = USBCDC_EP1_TX;
+	USBCDC_ADDR_TX(2) = USBCDC_EP2_TX;
+	USBCDC_COUNT_TX(2) = 0;
+
+	// the STAT bits are 0 after a reset, so writing a state toggles them to it
+	USBCDC_EPR(0) = USB_EP_CONTROL | USB_EP_RX_VALID | USB_EP_TX_NAK;
+	USBCDC_EPR(1) = USB_EP_BULK | 1 | USB_EP_RX_VALID | USB_EP_TX_NAK;
+	USBCDC_EPR(2) = USB_EP_INTERRUPT | 2 | USB_EP_TX_NAK;
+	USB->DADDR = USB_DADDR_EF;
+
+	configured = 0;
+	dtr = 0;
+	address = 0;
+	ctrlLeft = 0;
+	ctrlZlp = 0;
+	ctrlOut = 0;
+	streamLength = 0;
+	inFlight = 0;
+	usbCdcStats.resets++;
+}
+
+/*
+ * Next packet of the IN data stage, or the empty one that ends it
+ */
+static void USBCDC_ControlIn(void) {
+	uint16_t length = ctrlLeft < USBCDC_PACKET ? ctrlLeft : USBCDC_PACKET;
+
+	USBCDC_ToPma(USBCDC_EP0_TX, ctrlData, length);
+	USBCDC_COUNT_TX(0) = length;
+	ctrlData += length;
+	ctrlLeft -= length;
+	USBCDC_SetTx(0, USB_EP_TX_VALID);
+}
+
+/*
+ * Answer a request with data, no more than the host asked for. A request
+ * without data is answered with the empty status packet.
+ */
+static void USBCDC_Answer(const uint8_t *data, uint16_t size, uint16_t asked) {
+	ctrlData = data;
+	ctrlLeft = size < asked ? size : asked;
+	ctrlZlp = ctrlLeft < asked && ctrlLeft % USBCDC_PACKET == 0;
+	USBCDC_ControlIn();
+}
+
+/*
+ * A string descriptor in UTF-16, built from ASCII in ctrlBuffer
+ */
+static uint16_t USBCDC_String(uint8_t index) {
+	if (index == 0) {
+		// language IDs: US English only
+		ctrlBuffer[0] = 4;
+		ctrlBuffer[1] = USBCDC_STRING;
+		ctrlBuffer[2] = 0x09;
+		ctrlBuffer[3] = 0x04;
+		return 4;
+	}
+	const char *s = strings[index - 1];
+	uint8_t length = 0;
+	while (s[length] && length < USBCDC_MAX_STRING) {
+		ctrlBuffer[2 + 2 * length] = s[length];
+		ctrlBuffer[3 + 2 * length] = 0;
+		length++;
+	}
+	ctrlBuffer[0] = 2 + 2 * length;
+	ctrlBuffer[1] = USBCDC_STRING;
+	return ctrlBuffer[0];
+}
+
+/*
+ * A SETUP packet came in on endpoint 0: answer it, wait for its data, or
+ * stall both directions if the device does not know it. Returns 1 if it
+ * stalled.
+ */
+static uint8_t USBCDC_Request(void) {
+	uint16_t request = USBCDC_PMA(USBCDC_EP0_RX);
+	uint16_t value = USBCDC_PMA(USBCDC_EP0_RX + 2);
+	uint16_t length = USBCDC_PMA(USBCDC_EP0_RX + 6);
+	uint8_t type = value >> 8, index = value & 0xFF;
+
+	// bmRequestType is the low byte, bRequest the high one
+	request = (request << 8) | (request >> 8);
+	ctrlLeft = 0;
+	ctrlZlp = 0;
+	ctrlOut = 0;
+	usbCdcStats.requests++;
+
+	switch (request) {
+		case USBCDC_GET_DESCRIPTOR:
+			if (type == USBCDC_DEVICE) USBCDC_Answer(deviceDescriptor, sizeof(deviceDescriptor), length);
+			else if (type == USBCDC_CONFIGURATION) USBCDC_Answer(configDescriptor, sizeof(configDescriptor), length);
+			else if (type == USBCDC_STRING && index <= sizeof(strings) / sizeof(strings[0]))
+				USBCDC_Answer(ctrlBuffer, USBCDC_String(index), length);
+			else break;
+			return 0;
+		case USBCDC_SET_ADDRESS:
+			// the old address answers the status stage, the new one everything after it
+			address = value & USB_DADDR_ADD;
+			USBCDC_Answer(NULL, 0, 0);
+			return 0;
+		case USBCDC_SET_CONFIGURATION:
+			if (value > 1) break;
+			configured = value;
+			dtr = 0;
+			USBCDC_Answer(NULL, 0, 0);
+			return 0;
+		case USBCDC_GET_CONFIGURATION:
+			ctrlBuffer[0] = configured;
+			USBCDC_Answer(ctrlBuffer, 1, length);
+			return 0;
+		case USBCDC_GET_STATUS_DEVICE:
+		case USBCDC_GET_STATUS_INTERFACE:
+		case USBCDC_GET_STATUS_ENDPOINT:
+			// bus powered, no remote wakeup, nothing halted
+			ctrlBuffer[0] = 0;
+			ctrlBuffer[1] = 0;
+			USBCDC_Answer(ctrlBuffer, 2, length);
+			return 0;
+		case USBCDC_SET_LINE_CODING:
+			if (length != sizeof(lineCoding)) break;
+			ctrlOut = request;
+			return 0;
+		case USBCDC_GET_LINE_CODING:
+			USBCDC_Answer(lineCoding, sizeof(lineCoding), length);
+			return 0;
+		case USBCDC_SET_CONTROL_LINE_STATE:
+			dtr = value & 1;
+			USBCDC_Answer(NULL, 0, 0);
+			return 0;
+	}
+	usbCdcStats.stalls++;
+	USBCDC_SetTx(0, USB_EP_TX_STALL);
+	USBCDC_SetRx(0, USB_EP_RX_STALL);
+	return 1;
+}
+
+/*
+ * Endpoint 0 transfers: a SETUP or OUT packet came in, or an IN packet went out
+ */
+static void USBCDC_Control(uint16_t epr) {
+	if (epr & USB_EP_CTR_RX) {
+		uint8_t stalled = 0;
+		USBCDC_ClearCtr(0, USB_EP_CTR_RX);
+		if (epr & USB_EP_SETUP) {
+			stalled = USBCDC_Request();
+		}
+		else if (ctrlOut == USBCDC_SET_LINE_CODING) {
+			// the data stage of SET_LINE_CODING, answered with the status stage
+			ctrlOut = 0;
+			USBCDC_FromPma(USBCDC_EP0_RX, lineCoding, sizeof(lineCoding));
+			USBCDC_Answer(NULL, 0, 0);
+		}
+		// an empty OUT packet ends an IN transfer, there is nothing to do for it
+		if (!stalled) USBCDC_SetRx(0, USB_EP_RX_VALID);
+	}
+	if (epr & USB_EP_CTR_TX) {
+		USBCDC_ClearCtr(0, USB_EP_CTR_TX);
+		if (address) {
+			USB->DADDR = USB_DADDR_EF | address;
+			address = 0;
+		}
+		else if (ctrlLeft) {
+			USBCDC_ControlIn();
+		}
+		else if (ctrlZlp) {
+			ctrlZlp = 0;
+			USBCDC_ControlIn();
+		}
+	}
+}
+
+/*
+ * Put the telemetry that came in since the last packet on the way, unless
+ * the host has not taken that one yet
+ */
+static void USBCDC_Flush(void) {
+	if (inFlight || streamLength == 0) return;
+	USBCDC_ToPma(USBCDC_EP1_TX, stream, streamLength);
+	USBCDC_COUNT_TX(1) = streamLength;
+	usbCdcStats.packets++;
+	usbCdcStats.bytes += streamLength;
+	streamLength = 0;
+	inFlight = 1;
+	USBCDC_SetTx(1, USB_EP_TX_VALID);
+}
+
+/*
+ * Clock the USB from the HSI48, power up the transceiver and connect to
+ * the host with the pull-up on D+
+ */
+void USBCDC_Setup() {
+	RCC->CR2 |= RCC_CR2_HSI48ON;
+	while ((RCC->CR2 & RCC_CR2_HSI48RDY) == 0) {}
+	RCC->CFGR3 &= ~RCC_CFGR3_USBSW;  // HSI48 is the USB clock
+	RCC->APB1ENR |= RCC_APB1ENR_USBEN | RCC_APB1ENR_CRSEN;
+	// the CRS trims the HSI48 to the start of frames the host sends every ms
+	CRS->CR |= CRS_CR_AUTOTRIMEN | CRS_CR_CEN;
+
+	// leave power down, then reset once the transceiver is up (1 us, less than these writes take)
+	USB->CNTR = USB_CNTR_FRES;
+	USB->CNTR = 0;
+	USB->ISTR = 0;
+	USB->CNTR = USB_CNTR_CTRM | USB_CNTR_RESETM;
+
+	// below the sensor's USART3 and SysTick, above TIM2
+	NVIC_EnableIRQ(USB_IRQn);
+	NVIC_SetPriority(USB_IRQn, 1);
+
+	USB->BCDR |= USB_BCDR_DPPU;
+}
+
+/*
+ * Whether a terminal on the host has the port open
+ */
+uint8_t USBCDC_Connected() {
+	return configured && dtr;
+}
+
+/*
+ * Queue bytes for the host from TIM2. Only the USB interrupt is held off
+ * while they are copied, never the sensor. Returns 0 if the port is not
+ * open or the bytes do not fit, which the host will see as a gap.
+ */
+uint8_t USBCDC_Write(const uint8_t *data, uint8_t length) {
+	uint8_t fits;
+
+	if (!USBCDC_Connected()) return 0;
+	NVIC_DisableIRQ(USB_IRQn);
+	fits = streamLength + length <= USBCDC_PACKET;
+	if (fits) {
+		memcpy(&stream[streamLength], data, length);
+		streamLength += length;
+	}
+	else usbCdcStats.dropped++;
+	NVIC_EnableIRQ(USB_IRQn);
+
+	// the interrupt puts it on the way, so the packet memory is only touched there
+	if (fits) NVIC_SetPendingIRQ(USB_IRQn);
+	return fits;
+}
+
+/*
+ * USB interrupt request handler: a bus reset, transfers on the endpoints,
+ * or telemetry written since the last run
+ */
+void USB_IRQHandler(void) {
+	uint32_t probe = PROBE_Enter();
+	uint16_t istr;
+
+	if (USB->ISTR & USB_ISTR_RESET) {
+		USB->ISTR = (uint16_t)~USB_ISTR_RESET;
+		USBCDC_Reset();
+	}
+	while ((istr = USB->ISTR) & USB_ISTR_CTR) {
+		uint8_t ep = istr & USB_ISTR_EP_ID;
+		uint16_t epr = USBCDC_EPR(ep);
+
+		if (ep == 0) {
+			USBCDC_Control(epr);
+			continue;
+		}
+		if (epr & USB_EP_CTR_RX) {
+			// nothing is read from the host, the packet is let go
+			USBCDC_ClearCtr(ep, USB_EP_CTR_RX);
+			USBCDC_SetRx(ep, USB_EP_RX_VALID);
+		}
+		if (epr & USB_EP_CTR_TX) {
+			USBCDC_ClearCtr(ep, USB_EP_CTR_TX);
+			if (ep == 1) inFlight = 0;
+		}
+	}
+	if (configured) USBCDC_Flush();
+
+	PROBE_Exit(PROBE_USB, probe);
+}
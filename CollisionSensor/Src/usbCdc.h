@@ -0,0 +1,37 @@
+/*
+ * File: usbCdc.h
+ * Purpose: Declares the USB virtual COM port (CDC ACM) the telemetry goes
+ *          out on. It drives the USB peripheral's registers directly: the
+ *          device enumerates on its own, clocked from the HSI48 that the
+ *          CRS trims to the host's start of frames, and streams once a
+ *          terminal opens the port (sets DTR). Frames collect in a RAM
+ *          buffer while the last packet waits in the packet memory for the
+ *          host to take it, so a write from TIM2 is a copy and never waits
+ *          for the bus.
+ */
+#ifndef __USB_CDC_H
+#define __USB_CDC_H
+
+#include "stm32f0xx_hal.h"
+
+#define USBCDC_VID 0x0483         // ST's vendor ID and the PID of its virtual COM port
+#define USBCDC_PID 0x5740
+#define USBCDC_PACKET 64          // most bytes in a full-speed bulk packet
+
+// What went over the port, for the simulator and the debugger
+typedef struct usbcdc_stats {
+  uint32_t resets;          // bus resets from the host
+  uint32_t requests;        // control requests answered
+  uint32_t stalls;          // control requests refused
+  uint32_t packets;         // bulk packets of telemetry sent
+  uint32_t bytes;           // in them
+  uint32_t dropped;         // writes that did not fit while the host was not taking packets
+} USBCDC_STATS;
+
+extern USBCDC_STATS usbCdcStats;
+
+void USBCDC_Setup(void);
+uint8_t USBCDC_Connected(void);
+uint8_t USBCDC_Write(const uint8_t *data, uint8_t length);
+
+#endif /* __USB_CDC_H */
@@ -0,0 +1,89 @@
+/*
+ * File: watchdog.c
+ * Purpose: Defines the watchdog supervisor: the stage check-ins from TIM2
+ *          and the look at them from SysTick that feeds the IWDG or hands a
+ *          stalled stage to the crash log.
+ */
+#include "watchdog.h"
+#include "crashLog.h"
+
+// IWDG keys, prescaler and reload
+#define WATCHDOG_KEY_RELOAD 0xAAAA
+#define WATCHDOG_KEY_ACCESS 0x5555   // unlocks PR and RLR
+#define WATCHDOG_KEY_START 0xCCCC    // also starts the LSI
+#define WATCHDOG_LSI_KHZ 40
+#define WATCHDOG_PRESCALAR 3         // LSI / 32
+#define WATCHDOG_RELOAD (WATCHDOG_TIMEOUT_MS * WATCHDOG_LSI_KHZ / 32)
+
+WATCHDOG *thisWatchdog;
+
+static volatile uint32_t checkIns[WATCHDOG_STAGES]; // HAL tick of each stage's last check-in
+static uint8_t watchdogTicks;                       // SysTicks since the last look
+static uint32_t lowered[WATCHDOG_STAGES];           // a shorter deadline for after the next check-in, 0 none
+
+/*
+ * Start the IWDG, which cannot be stopped again until the next reset. Every
+ * stage counts as checked in now, so call it just before the first reading.
+ */
+void WATCHDOG_Setup(WATCHDOG *watchdog) {
+	uint32_t now = HAL_GetTick();
+
+	for (uint8_t i = 0; i < WATCHDOG_STAGES; i++) checkIns[i] = now;
+
+	IWDG->KR = WATCHDOG_KEY_START;
+	IWDG->KR = WATCHDOG_KEY_ACCESS;
+	IWDG->PR = WATCHDOG_PRESCALAR;
+	IWDG->RLR = WATCHDOG_RELOAD;
+	// the new values cross into the LSI domain before they count
+	while (IWDG->SR != 0) {}
+	IWDG->KR = WATCHDOG_KEY_RELOAD;
+
+	thisWatchdog = watchdog;
+}
+
+/*
+ * Change a stage's deadline, with TIM2 held off. A longer one counts at
+ * once; a shorter one only from the stage's next check-in, since the last
+ * one may already be older than it.
+ */
+void WATCHDOG_SetDeadline(uint8_t stage, uint32_t ms) {
+	if (ms >= thisWatchdog->deadlines[stage]) {
+		thisWatchdog->deadlines[stage] = ms;
+		lowered[stage] = 0;
+	}
+	else lowered[stage] = ms;
+}
+
+/*
+ * A stage got through, from TIM2
+ */
+void WATCHDOG_CheckIn(uint8_t stage) {
+	checkIns[stage] = HAL_GetTick();
+	if (lowered[stage]) {
+		thisWatchdog->deadlines[stage] = lowered[stage];
+		lowered[stage] = 0;
+	}
+}
+
+/*
+ * From SysTick after the tick is counted: every WATCHDOG_PERIOD_MS, feed
+ * the IWDG if every stage checked in within its deadline, or capture the
+ * one that has been stalled the longest and reset
+ */
+void WATCHDOG_Tick(void) {
+	uint32_t ages[WATCHDOG_STAGES];
+	uint32_t now;
+	uint8_t stalled = WATCHDOG_STAGES;
+
+	if (thisWatchdog == NULL || ++watchdogTicks < WATCHDOG_PERIOD_MS) return;
+	watchdogTicks = 0;
+
+	now = HAL_GetTick();
+	for (uint8_t i = 0; i < WATCHDOG_STAGES; i++) {
+		ages[i] = now - checkIns[i];
+		if (ages[i] > thisWatchdog->deadlines[i] && (stalled == WATCHDOG_STAGES || ages[i] > ages[stalled])) stalled = i;
+	}
+	if (stalled < WATCHDOG_STAGES) CRASHLOG_Hang(stalled, ages, WATCHDOG_STAGES);
+
+	IWDG->KR = WATCHDOG_KEY_RELOAD;
+}
@@ -0,0 +1,38 @@
+/*
+ * File: watchdog.h
+ * Purpose: Declares the watchdog supervisor. Each stage of the reading
+ *          pipeline checks in when it gets through: the wait for a reading
+ *          from the sensor ended, the LEDs and the motor show it or the
+ *          fault pattern, the LCD shows it.
+ *          SysTick, which preempts TIM2, looks at the check-ins every
+ *          WATCHDOG_PERIOD_MS and feeds the independent watchdog (IWDG) only
+ *          while every stage has checked in within its deadline. A stage
+ *          that misses it is handed to the crash log, which captures it and
+ *          resets the board at once, so a hang ends within its deadline plus
+ *          WATCHDOG_PERIOD_MS. The IWDG resets the board within
+ *          WATCHDOG_TIMEOUT_MS if SysTick itself stops.
+ */
+#ifndef __WATCHDOG_H
+#define __WATCHDOG_H
+
+#include "stm32f0xx_hal.h"
+
+#define WATCHDOG_STAGES 3
+#define WATCHDOG_ACQUIRE 0      // the wait for a reading ended, with one or without
+#define WATCHDOG_WARN 1         // the LEDs and the motor show it, or the sensor's fault
+#define WATCHDOG_DISPLAY 2      // the LCD shows it
+
+#define WATCHDOG_PERIOD_MS 10   // between looks at the check-ins
+#define WATCHDOG_TIMEOUT_MS 250 // IWDG at the typical 40 kHz LSI, 200 ms at the fastest (50 kHz)
+
+// Deadlines of the stages
+typedef struct watchdog {
+  uint32_t deadlines[WATCHDOG_STAGES]; // most ms each stage may go without checking in
+} WATCHDOG;
+
+void WATCHDOG_Setup(WATCHDOG *watchdog);
+void WATCHDOG_SetDeadline(uint8_t stage, uint32_t ms);
+void WATCHDOG_CheckIn(uint8_t stage);
+void WATCHDOG_Tick(void);
+
+#endif /* __WATCHDOG_H */